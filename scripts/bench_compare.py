@@ -0,0 +1,124 @@
+#!/usr/bin/env python3
+"""Compares two db_bench result files and fails on regressions.
+
+Usage: scripts/bench_compare.py [--threshold PCT] [--confidence 0.95]
+                                baseline.json current.json
+
+Both files come from `db_bench -R <reps> -O <file>`. For every configuration
+present in both, the throughput and p50/p99 latency of the repetitions are
+compared. A metric regresses when it is worse by more than the threshold
+(5% by default) and, when both sides have at least two repetitions, the
+confidence interval of the difference in means (Welch's t) lies entirely on
+the worse side, so run-to-run noise is not reported as a regression.
+
+Exits 1 if anything regressed, 2 on bad input, 0 otherwise.
+"""
+
+import argparse
+import json
+import math
+import sys
+
+# Two-sided Student's t critical values by degrees of freedom
+T_95 = [12.706, 4.303, 3.182, 2.776, 2.571, 2.447, 2.365, 2.306, 2.262,
+        2.228, 2.201, 2.179, 2.160, 2.145, 2.131, 2.120, 2.110, 2.101,
+        2.093, 2.086, 2.080, 2.074, 2.069, 2.064, 2.060, 2.056, 2.052,
+        2.048, 2.045, 2.042]
+T_99 = [63.657, 9.925, 5.841, 4.604, 4.032, 3.707, 3.499, 3.355, 3.250,
+        3.169, 3.106, 3.055, 3.012, 2.977, 2.947, 2.921, 2.898, 2.878,
+        2.861, 2.845, 2.831, 2.819, 2.807, 2.797, 2.787, 2.779, 2.771,
+        2.763, 2.756, 2.750]
+
+# Metric, and whether higher values are better
+METRICS = [("ops_per_sec", True), ("p50_ns", False), ("p99_ns", False)]
+
+
+def t_critical(df, confidence):
+    table, limit = (T_99, 2.576) if confidence >= 0.99 else (T_95, 1.960)
+    df = int(math.floor(df))
+    return table[df - 1] if 1 <= df <= len(table) else limit
+
+
+def mean_var(xs):
+    m = sum(xs) / len(xs)
+    v = sum((x - m) ** 2 for x in xs) / (len(xs) - 1) if len(xs) > 1 else 0.0
+    return m, v
+
+
+def diff_interval(base, cur, confidence):
+    """Returns (difference of means, half-width of its interval or None)."""
+    mb, vb = mean_var(base)
+    mc, vc = mean_var(cur)
+    if len(base) < 2 or len(cur) < 2:
+        return mc - mb, None
+    sb, sc = vb / len(base), vc / len(cur)
+    se = math.sqrt(sb + sc)
+    if se == 0:
+        return mc - mb, 0.0
+    df = (sb + sc) ** 2 / ((sb ** 2) / (len(base) - 1) +
+                           (sc ** 2) / (len(cur) - 1))
+    return mc - mb, t_critical(df, confidence) * se
+
+
+def load(path):
+    try:
+        with open(path) as f:
+            return json.load(f)["results"]
+    except (OSError, ValueError, KeyError) as e:
+        sys.stderr.write("%s: %s\n" % (path, e))
+        sys.exit(2)
+
+
+def main():
+    parser = argparse.ArgumentParser(
+        description="Diff two db_bench -O result files.")
+    parser.add_argument("baseline")
+    parser.add_argument("current")
+    parser.add_argument("--threshold", type=float, default=5.0,
+                        help="smallest change in percent that counts")
+    parser.add_argument("--confidence", type=float, default=0.95,
+                        help="0.95 or 0.99")
+    args = parser.parse_args()
+
+    base, cur = load(args.baseline), load(args.current)
+    regressions = 0
+    print("%-48s %-11s %12s %12s %8s %10s  %s" %
+          ("configuration", "metric", "baseline", "current", "change",
+           "+/-", "verdict"))
+    for key in sorted(set(base) & set(cur)):
+        for metric, higher_better in METRICS:
+            b, c = base[key][metric], cur[key][metric]
+            diff, half = diff_interval(b, c, args.confidence)
+            mb = sum(b) / len(b)
+            pct = 100.0 * diff / mb if mb else 0.0
+            worse = -pct if higher_better else pct
+            if half is None:
+                significant = True  # no spread to judge noise by
+            else:
+                lo, hi = diff - half, diff + half
+                significant = hi < 0 if higher_better else lo > 0
+            if worse > args.threshold and significant:
+                verdict = "REGRESSION"
+                regressions += 1
+            elif -worse > args.threshold and significant:
+                verdict = "improved"
+            else:
+                verdict = "ok"
+            print("%-48s %-11s %12.0f %12.0f %+7.1f%% %10s  %s" %
+                  (key, metric, mb, mb + diff, pct,
+                   "-" if half is None else "%.0f" % half, verdict))
+    for key in sorted(set(base) - set(cur)):
+        print("%-48s missing from %s" % (key, args.current))
+    for key in sorted(set(cur) - set(base)):
+        print("%-48s not in baseline" % key)
+
+    if regressions:
+        print("\n%d regression(s) beyond %.1f%% at %.0f%% confidence" %
+              (regressions, args.threshold, 100 * args.confidence))
+        return 1
+    print("\nno regressions")
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
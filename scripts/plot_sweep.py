@@ -0,0 +1,80 @@
+#!/usr/bin/env python3
+"""Plots a db_bench thread sweep.
+
+Usage: ./db_bench -T 16 -m both > sweep.csv
+       scripts/plot_sweep.py sweep.csv [out.png]
+
+Draws throughput, p50/p99 latency and CPU use against the thread count, one
+line per mode (inproc, net). Without matplotlib it prints the same numbers as
+a table instead.
+"""
+
+import csv
+import sys
+from collections import defaultdict
+
+
+def load(path):
+    series = defaultdict(list)  # mode -> rows of the "all" op, by threads
+    with open(path) as f:
+        for row in csv.DictReader(f):
+            if row["op"] == "all":
+                series[row["mode"]].append(row)
+    for rows in series.values():
+        rows.sort(key=lambda r: int(r["threads"]))
+    return series
+
+
+def print_table(series):
+    print("%-7s %7s %12s %10s %10s %9s" %
+          ("mode", "threads", "ops/sec", "p50 us", "p99 us", "cpu"))
+    for mode, rows in sorted(series.items()):
+        for r in rows:
+            print("%-7s %7s %12.0f %10.1f %10.1f %9.2f" %
+                  (mode, r["threads"], float(r["ops_per_sec"]),
+                   int(r["p50_ns"]) / 1e3, int(r["p99_ns"]) / 1e3,
+                   float(r["cpu_cores"])))
+
+
+def plot(series, out):
+    import matplotlib
+    matplotlib.use("Agg")
+    import matplotlib.pyplot as plt
+
+    fig, axes = plt.subplots(1, 3, figsize=(15, 4.5))
+    for mode, rows in sorted(series.items()):
+        threads = [int(r["threads"]) for r in rows]
+        axes[0].plot(threads, [float(r["ops_per_sec"]) for r in rows],
+                     marker="o", label=mode)
+        axes[1].plot(threads, [int(r["p50_ns"]) / 1e3 for r in rows],
+                     marker="o", label=mode + " p50")
+        axes[1].plot(threads, [int(r["p99_ns"]) / 1e3 for r in rows],
+                     marker="x", linestyle="--", label=mode + " p99")
+        axes[2].plot(threads, [float(r["cpu_cores"]) for r in rows],
+                     marker="o", label=mode)
+    titles = ["Throughput (ops/sec)", "Latency (us)", "CPU (cores busy)"]
+    for ax, title in zip(axes, titles):
+        ax.set_title(title)
+        ax.set_xlabel("threads")
+        ax.set_xscale("log", base=2)
+        ax.grid(True, alpha=0.3)
+        ax.legend()
+    axes[1].set_yscale("log")
+    fig.tight_layout()
+    fig.savefig(out)
+    print("wrote " + out)
+
+
+def main():
+    if len(sys.argv) < 2:
+        sys.exit(__doc__)
+    series = load(sys.argv[1])
+    out = sys.argv[2] if len(sys.argv) > 2 else "sweep.png"
+    try:
+        plot(series, out)
+    except ImportError:
+        print_table(series)
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,186 @@
+#include "./admin.h"
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include "./comm.h"
+
+#define ADMIN_MAX_PAGES 16
+#define REQLEN 1024
+
+typedef struct admin_page {
+    const char *path;
+    void (*write_page)(FILE *);
+} admin_page_t;
+
+static admin_page_t pages[ADMIN_MAX_PAGES];
+static int num_pages = 0;
+
+static int admin_port;
+
+static void *admin_listener(void *arg);
+
+void admin_register(const char *path, void (*write_page)(FILE *)) {
+    if (num_pages == ADMIN_MAX_PAGES) {
+        fprintf(stderr, "too many admin pages\n");
+        exit(1);
+    }
+    pages[num_pages].path = path;
+    pages[num_pages].write_page = write_page;
+    num_pages++;
+}
+
+pthread_t start_admin(int port) {
+    admin_port = port;
+    pthread_t tid;
+    int err;
+
+    if ((err = pthread_create(&tid, 0, admin_listener, NULL)))
+        handle_error_en(err, "pthread_create");
+
+    return tid;
+}
+
+/* Writes the whole buffer to the socket, giving up on the first error. */
+static void send_all(int sock, const char *buf, size_t len) {
+    while (len > 0) {
+        ssize_t n = send(sock, buf, len, MSG_NOSIGNAL);
+        if (n <= 0)
+            return;
+        buf += n;
+        len -= n;
+    }
+}
+
+static void respond(int sock, const char *status, const char *body,
+                    size_t body_len) {
+    char header[256];
+    int n = snprintf(header, sizeof(header),
+                     "HTTP/1.0 %s\r\n"
+                     "Content-Type: text/plain; version=0.0.4\r\n"
+                     "Content-Length: %zu\r\n"
+                     "Connection: close\r\n\r\n",
+                     status, body_len);
+    send_all(sock, header, n);
+    send_all(sock, body, body_len);
+}
+
+/* Reads one request and answers it. */
+static void serve_request(int sock) {
+    char req[REQLEN];
+    size_t len = 0;
+
+    // Read until the end of the request line; headers are ignored
+    while (len < sizeof(req) - 1) {
+        ssize_t n = recv(sock, req + len, sizeof(req) - 1 - len, 0);
+        if (n <= 0)
+            return;
+        len += n;
+        req[len] = '\0';
+        if (strchr(req, '\n') != NULL)
+            break;
+    }
+    req[len] = '\0';
+
+    char method[16], path[256];
+    if (sscanf(req, "%15s %255s", method, path) != 2) {
+        const char *msg = "bad request\n";
+        respond(sock, "400 Bad Request", msg, strlen(msg));
+        return;
+    }
+    if (strcmp(method, "GET") != 0) {
+        const char *msg = "only GET is supported\n";
+        respond(sock, "405 Method Not Allowed", msg, strlen(msg));
+        return;
+    }
+
+    // Drop any query string
+    char *query = strchr(path, '?');
+    if (query != NULL)
+        *query = '\0';
+
+    for (int i = 0; i < num_pages; i++) {
+        if (strcmp(path, pages[i].path) != 0)
+            continue;
+
+        char *body = NULL;
+        size_t body_len = 0;
+        FILE *out;
+        if ((out = open_memstream(&body, &body_len)) == NULL) {
+            perror("open_memstream");
+            return;
+        }
+        pages[i].write_page(out);
+        fclose(out);
+        respond(sock, "200 OK", body, body_len);
+        free(body);
+        return;
+    }
+
+    const char *msg = "not found\n";
+    respond(sock, "404 Not Found", msg, strlen(msg));
+}
+
+static void *admin_listener(void *arg) {
+    (void)arg;
+    int asock;
+    if ((asock = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
+        perror("admin socket");
+        exit(1);
+    }
+
+    int on = 1;
+    setsockopt(asock, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(admin_port);
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+
+    if (bind(asock, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        perror("admin bind");
+        if (close(asock) < 0)
+            perror("close");
+        exit(1);
+    }
+
+    if (listen(asock, 16) < 0) {
+        perror("admin listen");
+        if (close(asock) < 0)
+            perror("close");
+        exit(1);
+    }
+
+    fprintf(stderr, "admin listening on port %d\n", admin_port);
+
+    while (1) {
+        int csock;
+        if ((csock = accept(asock, NULL, NULL)) < 0) {
+            perror("admin accept");
+            continue;
+        }
+
+        // A stalled scraper must not wedge the admin thread
+        struct timeval tv = {1, 0};
+        setsockopt(csock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+        setsockopt(csock, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+
+        // Pages take locks, so only allow cancellation in accept
+        int oldstate;
+        pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &oldstate);
+        serve_request(csock);
+        if (close(csock) < 0)
+            perror("close");
+        pthread_setcancelstate(oldstate, NULL);
+    }
+
+    return NULL;
+}
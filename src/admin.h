@@ -0,0 +1,19 @@
+#ifndef ADMIN_H_
+#define ADMIN_H_
+
+#include <pthread.h>
+#include <stdio.h>
+
+/*
+ * A minimal HTTP/1.0 listener for monitoring, served by a single thread on its
+ * own port so that scrapes never compete with client traffic. Each page is a
+ * function that writes a plain-text body; only GET is supported.
+ */
+
+/* Registers a page. Must be called before start_admin. */
+void admin_register(const char *path, void (*write_page)(FILE *));
+
+/* Starts the admin thread listening on the given port. */
+pthread_t start_admin(int port);
+
+#endif  // ADMIN_H_
@@ -0,0 +1,86 @@
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "./capture.h"
+#include "./metrics.h"
+
+#define CAPTURE_BUFSIZE (1 << 20)
+
+// Read without the lock on every command; only changed under it
+static int capture_active = 0;
+
+static pthread_mutex_t capture_mutex = PTHREAD_MUTEX_INITIALIZER;
+static FILE *capture_file = NULL;
+static uint64_t capture_start_ns;
+static int capture_sample_every;
+static uint64_t capture_records;
+
+int capture_start(const char *path, int sample_every) {
+    pthread_mutex_lock(&capture_mutex);
+    if (capture_file != NULL) {
+        pthread_mutex_unlock(&capture_mutex);
+        errno = EBUSY;
+        return -1;
+    }
+    if ((capture_file = fopen(path, "wb")) == NULL) {
+        pthread_mutex_unlock(&capture_mutex);
+        return -1;
+    }
+    // A large buffer keeps writes to the disk rare while clients hold the lock
+    setvbuf(capture_file, NULL, _IOFBF, CAPTURE_BUFSIZE);
+
+    capture_header_t header;
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, CAPTURE_MAGIC, sizeof(CAPTURE_MAGIC));
+    header.start_realtime_ns =
+        (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+    fwrite(&header, sizeof(header), 1, capture_file);
+
+    capture_start_ns = metrics_now_ns();
+    capture_sample_every = sample_every > 0 ? sample_every : 1;
+    capture_records = 0;
+    __atomic_store_n(&capture_active, 1, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&capture_mutex);
+    return 0;
+}
+
+uint64_t capture_stop(void) {
+    uint64_t records;
+
+    pthread_mutex_lock(&capture_mutex);
+    __atomic_store_n(&capture_active, 0, __ATOMIC_RELEASE);
+    if (capture_file != NULL) {
+        if (fclose(capture_file) != 0)
+            perror("fclose");
+        capture_file = NULL;
+    }
+    records = capture_records;
+    pthread_mutex_unlock(&capture_mutex);
+    return records;
+}
+
+void capture_write(uint64_t conn_id, const char *command, size_t len) {
+    if (!__atomic_load_n(&capture_active, __ATOMIC_ACQUIRE))
+        return;
+
+    // fwrite can be a cancellation point; don't leave the lock held
+    int oldstate;
+    pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &oldstate);
+    pthread_mutex_lock(&capture_mutex);
+    if (capture_file != NULL && conn_id % capture_sample_every == 0) {
+        capture_record_t rec;
+        rec.ts_ns = metrics_now_ns() - capture_start_ns;
+        rec.conn_id = conn_id;
+        rec.len = (uint32_t)len;
+        fwrite(&rec, sizeof(rec), 1, capture_file);
+        fwrite(command, 1, len, capture_file);
+        capture_records++;
+    }
+    pthread_mutex_unlock(&capture_mutex);
+    pthread_setcancelstate(oldstate, NULL);
+}
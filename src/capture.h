@@ -0,0 +1,49 @@
+#ifndef CAPTURE_H_
+#define CAPTURE_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Traffic capture. While a capture is running, client threads append every
+ * command they receive to a binary file, before interpreting it, so that
+ * loadgen can replay the same traffic later. A capture file is a header
+ * followed by one record per command, all in host byte order:
+ *
+ *   header  char magic[8] = "CDBCAP1"; uint64_t start_realtime_ns
+ *   record  uint64_t ts_ns;    // since the capture started
+ *           uint64_t conn_id;  // the client's id, as in `clients`
+ *           uint32_t len;      // bytes of command that follow
+ *           char command[len]; // as received, newline included
+ *
+ * Sampling is per connection: with `sample N`, one connection in N is
+ * recorded in full, so replayed connections keep their own order and timing.
+ */
+
+#define CAPTURE_MAGIC "CDBCAP1"
+
+typedef struct capture_header {
+    char magic[8];
+    uint64_t start_realtime_ns;
+} capture_header_t;
+
+typedef struct capture_record {
+    uint64_t ts_ns;
+    uint64_t conn_id;
+    uint32_t len;
+} __attribute__((packed)) capture_record_t;
+
+/*
+ * Starts writing a capture to path, recording one connection in sample_every.
+ * Returns 0, or -1 with errno set if the file cannot be created or a capture
+ * is already running.
+ */
+int capture_start(const char *path, int sample_every);
+
+/* Stops the capture and closes its file; returns the number of records. */
+uint64_t capture_stop(void);
+
+/* Records command from connection conn_id, if a capture is running. */
+void capture_write(uint64_t conn_id, const char *command, size_t len);
+
+#endif  // CAPTURE_H_
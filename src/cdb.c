@@ -0,0 +1,96 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "./cdb.h"
+#include "./db.h"
+
+#define CDB_PUT_TRIES 16  // add/update rounds lost to concurrent deletes
+
+struct cdb {
+    db_t *db;
+};
+
+const char *cdb_strerror(int status) {
+    switch (status) {
+        case CDB_OK:
+            return "ok";
+        case CDB_NOT_FOUND:
+            return "not found";
+        case CDB_EXISTS:
+            return "already in database";
+        case CDB_ERR_ARG:
+            return "invalid argument";
+        default:
+            return "unknown status";
+    }
+}
+
+/* Whether s can be stored as a key or value. */
+static int valid_string(const char *s) {
+    return s != NULL && s[0] != '\0' && strlen(s) <= CDB_MAX_KEY;
+}
+
+cdb_t *cdb_open(void) {
+    cdb_t *cdb = malloc(sizeof(cdb_t));
+    if (cdb == NULL)
+        return NULL;
+    if ((cdb->db = db_create()) == NULL) {
+        free(cdb);
+        return NULL;
+    }
+    return cdb;
+}
+
+void cdb_close(cdb_t *cdb) {
+    if (cdb == NULL)
+        return;
+    db_destroy(cdb->db);
+    free(cdb);
+}
+
+int cdb_get(cdb_t *cdb, const char *key, char *value, size_t cap) {
+    if (!valid_string(key) || cap == 0)
+        return CDB_ERR_ARG;
+    // Values are short, so a larger buffer only needs to hold the longest
+    int len = db_query(cdb->db, key, value,
+                       cap > CDB_MAX_KEY + 1 ? CDB_MAX_KEY + 1 : (int)cap);
+    if (len < 0)
+        return CDB_NOT_FOUND;
+    return (size_t)len < cap ? CDB_OK : CDB_ERR_ARG;
+}
+
+int cdb_add(cdb_t *cdb, const char *key, const char *value) {
+    if (!valid_string(key) || !valid_string(value))
+        return CDB_ERR_ARG;
+    return db_add(cdb->db, key, value) ? CDB_OK : CDB_EXISTS;
+}
+
+int cdb_update(cdb_t *cdb, const char *key, const char *value) {
+    if (!valid_string(key) || !valid_string(value))
+        return CDB_ERR_ARG;
+    return db_update(cdb->db, key, value) ? CDB_OK : CDB_NOT_FOUND;
+}
+
+int cdb_put(cdb_t *cdb, const char *key, const char *value) {
+    int err = CDB_NOT_FOUND;
+    // The key can be deleted between the two, so go round again if it is
+    for (int i = 0; i < CDB_PUT_TRIES && err == CDB_NOT_FOUND; i++) {
+        if ((err = cdb_add(cdb, key, value)) == CDB_EXISTS)
+            err = cdb_update(cdb, key, value);
+    }
+    return err;
+}
+
+int cdb_delete(cdb_t *cdb, const char *key) {
+    if (!valid_string(key))
+        return CDB_ERR_ARG;
+    return db_remove(cdb->db, key) ? CDB_OK : CDB_NOT_FOUND;
+}
+
+int cdb_scan(cdb_t *cdb, const char *start, int count, cdb_scan_fn fn,
+             void *arg) {
+    if ((start != NULL && strlen(start) > CDB_MAX_KEY) || count < 0 ||
+        fn == NULL)
+        return CDB_ERR_ARG;
+    return db_scan(cdb->db, start != NULL ? start : "", 1, count, fn, arg);
+}
@@ -0,0 +1,67 @@
+#ifndef CDB_H_
+#define CDB_H_
+
+#include <stddef.h>
+
+/*
+ * libconcurrentdb: the database engine, embedded in the calling process.
+ *
+ * A cdb_t is one database, with no server and no line protocol in between:
+ * calls go straight to the engine, so they cost a tree walk rather than a
+ * round trip. A process may open any number of databases, and any number of
+ * threads may use one at once; only cdb_close needs it to themselves. Calls
+ * return CDB_OK or one of the other non-negative outcomes below, or a
+ * negative error.
+ *
+ * Keys and values are strings of 1 to CDB_MAX_KEY bytes. Unlike over the
+ * network they may contain spaces, but then a server could not serve them.
+ */
+
+#define CDB_MAX_KEY 255  // as db.c's MAXLEN, less the terminator
+
+enum cdb_status {
+    CDB_OK = 0,
+    CDB_NOT_FOUND = 1,  // get, update, delete of a missing key
+    CDB_EXISTS = 2,     // add of a key that is already there
+    CDB_ERR_ARG = -1,   // key or value empty or too long, or a value too
+                        // long for the buffer given
+};
+
+typedef struct cdb cdb_t;
+
+/* Called for each pair a scan visits; a non-zero return stops the scan. */
+typedef int (*cdb_scan_fn)(const char *key, const char *value, void *arg);
+
+/* Describes a status or error. */
+const char *cdb_strerror(int status);
+
+/* Opens an empty database. Returns NULL if out of memory. */
+cdb_t *cdb_open(void);
+
+/* Frees the database and everything in it. */
+void cdb_close(cdb_t *db);
+
+/* Looks up key, copying its value into value (cap bytes). */
+int cdb_get(cdb_t *db, const char *key, char *value, size_t cap);
+
+/* Adds key, failing with CDB_EXISTS if it is already there. */
+int cdb_add(cdb_t *db, const char *key, const char *value);
+
+/* Replaces the value of key, failing with CDB_NOT_FOUND if it is missing. */
+int cdb_update(cdb_t *db, const char *key, const char *value);
+
+/* Adds key, or replaces its value if it is already there. */
+int cdb_put(cdb_t *db, const char *key, const char *value);
+
+int cdb_delete(cdb_t *db, const char *key);
+
+/*
+ * Calls fn on up to count pairs in key order, from start onwards; start may
+ * be NULL for the first key. Pairs are passed while their locks are held, so
+ * fn must copy what it keeps and must not call back into the database.
+ * Returns the number of pairs visited.
+ */
+int cdb_scan(cdb_t *db, const char *start, int count, cdb_scan_fn fn,
+             void *arg);
+
+#endif  // CDB_H_
@@ -0,0 +1,1135 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "./cdbc.h"
+#include "./cdbc_internal.h"
+
+#define CDBC_WBUF 16384                      // queued commands
+#define CDBC_RBUF (2 * CDBC_MAX_RESPONSE)    // unread responses
+#define CDBC_BATCH_WINDOW 64  // batch operations in flight at once
+#define CDBC_PUT_TRIES 16     // add/update rounds lost to concurrent deletes
+#define CDBC_BUCKETS 65536    // as tracking.h's TRACKING_BUCKETS
+#define CDBC_CACHE_SLOTS 4096 // near-cache chains, each a few buckets
+#define CDBC_PUSH "!inv "     // starts an invalidation pushed by the server
+
+/* A thread waiting for its response on an auto-pipelined connection. */
+typedef struct waiter {
+    char *response;
+    size_t cap;
+    int status;
+    int done;
+    struct waiter *next;
+} waiter_t;
+
+/* A cached value, in its bucket's chain and in the eviction order. */
+typedef struct cache_entry {
+    struct cache_entry *next;  // in the chain
+    struct cache_entry *newer;
+    struct cache_entry *older;
+    unsigned bucket;
+    char *value;  // after the key
+    char key[];
+} cache_entry_t;
+
+/*
+ * A near cache. Entries are chained by the server's tracking buckets, so
+ * that an invalidation, which names a bucket, finds all of them at once.
+ */
+typedef struct near_cache {
+    cache_entry_t *slots[CDBC_CACHE_SLOTS];
+    cache_entry_t *newest;
+    cache_entry_t *oldest;
+    int count;
+    unsigned fetch_bucket;  // of the get being answered by the server
+    int fetch_stale;        // the bucket was invalidated meanwhile
+    cdbc_cache_stats_t stats;
+} near_cache_t;
+
+struct cdbc_conn {
+    char *host;
+    char *port;
+    cdbc_options_t opts;
+    int fd;  // -1 while disconnected
+    int pending;
+    size_t wlen;
+    size_t rstart, rend;
+    char wbuf[CDBC_WBUF];
+    char rbuf[CDBC_RBUF];
+    cdbc_conn_t *next;  // in the pool's idle list
+    near_cache_t *cache;  // NULL without near_cache
+
+    // Auto-pipelining; pending then counts the waiters
+    pthread_mutex_t mutex;
+    pthread_cond_t changed;
+    waiter_t *oldest;  // in the order their commands were queued
+    waiter_t *newest;
+    int unsent;   // the newest waiters, whose commands are still in wbuf
+    int writing;  // a waiter is sending sbuf
+    int reading;  // a waiter is receiving into rbuf
+    int broken;   // failed; closed once nobody is sending or receiving
+    char sbuf[CDBC_WBUF];
+};
+
+enum batch_type { b_get, b_add, b_update, b_delete };
+
+typedef struct batch_op {
+    enum batch_type type;
+    int status;
+    char key[CDBC_MAX_KEY + 1];
+    char value[CDBC_MAX_KEY + 1];  // the value to write, or the one got
+} batch_op_t;
+
+struct cdbc_batch {
+    batch_op_t *ops;
+    int count;
+    int capacity;
+};
+
+struct cdbc_pool {
+    char *host;
+    char *port;
+    cdbc_options_t opts;
+    int size;
+    int created;
+    cdbc_conn_t *idle;
+    pthread_mutex_t mutex;
+    pthread_cond_t returned;
+};
+
+void cdbc_options_default(cdbc_options_t *opts) {
+    opts->connect_timeout_ms = 1000;
+    opts->io_timeout_ms = 5000;
+    opts->max_retries = 3;
+    opts->retry_delay_ms = 100;
+    opts->auto_pipeline = 0;
+    opts->pipeline_delay_us = 0;
+    opts->near_cache = 0;
+}
+
+const char *cdbc_strerror(int status) {
+    switch (status) {
+        case CDBC_OK:
+            return "ok";
+        case CDBC_NOT_FOUND:
+            return "not found";
+        case CDBC_EXISTS:
+            return "already in database";
+        case CDBC_ERR_ARG:
+            return "invalid argument";
+        case CDBC_ERR_IO:
+            return "connection failed";
+        case CDBC_ERR_TIMEOUT:
+            return "timed out";
+        case CDBC_ERR_PROTOCOL:
+            return "unexpected response";
+        case CDBC_ERR_STATE:
+            return "pipelined responses unread";
+        default:
+            return "unknown status";
+    }
+}
+
+//------------------------------------------------------------------------------------------------
+// Near cache
+
+/* The server's tracking bucket of key: FNV-1a, as tracking.c has it. */
+static unsigned cache_bucket(const char *key) {
+    uint32_t h = 2166136261u;
+    for (; *key != '\0'; key++) {
+        h ^= (unsigned char)*key;
+        h *= 16777619u;
+    }
+    return h & (CDBC_BUCKETS - 1);
+}
+
+static void cache_unlink(near_cache_t *cache, cache_entry_t *e) {
+    cache_entry_t **p = &cache->slots[e->bucket % CDBC_CACHE_SLOTS];
+    while (*p != e)
+        p = &(*p)->next;
+    *p = e->next;
+    if (e->newer != NULL)
+        e->newer->older = e->older;
+    else
+        cache->newest = e->older;
+    if (e->older != NULL)
+        e->older->newer = e->newer;
+    else
+        cache->oldest = e->newer;
+    cache->count--;
+    free(e);
+}
+
+static void cache_clear(near_cache_t *cache) {
+    while (cache->oldest != NULL)
+        cache_unlink(cache, cache->oldest);
+    cache->fetch_stale = 1;
+}
+
+/* Drops every entry in a bucket the server says may have changed. */
+static void cache_invalidate(near_cache_t *cache, unsigned bucket) {
+    cache_entry_t *e = cache->slots[bucket % CDBC_CACHE_SLOTS];
+    while (e != NULL) {
+        cache_entry_t *next = e->next;
+        if (e->bucket == bucket)
+            cache_unlink(cache, e);
+        e = next;
+    }
+    if (cache->fetch_bucket == bucket)
+        cache->fetch_stale = 1;
+    cache->stats.invalidations++;
+}
+
+static cache_entry_t *cache_find(near_cache_t *cache, const char *key,
+                                 unsigned bucket) {
+    cache_entry_t *e = cache->slots[bucket % CDBC_CACHE_SLOTS];
+    while (e != NULL && (e->bucket != bucket || strcmp(e->key, key) != 0))
+        e = e->next;
+    if (e == NULL || e == cache->newest)
+        return e;
+    // Move it to the front of the eviction order
+    e->newer->older = e->older;
+    if (e->older != NULL)
+        e->older->newer = e->newer;
+    else
+        cache->oldest = e->newer;
+    e->newer = NULL;
+    e->older = cache->newest;
+    cache->newest->newer = e;
+    cache->newest = e;
+    return e;
+}
+
+static void cache_store(near_cache_t *cache, int capacity, const char *key,
+                        const char *value, unsigned bucket) {
+    cache_entry_t *e = cache_find(cache, key, bucket);
+    if (e != NULL)
+        cache_unlink(cache, e);
+    if (cache->count >= capacity)
+        cache_unlink(cache, cache->oldest);
+    size_t klen = strlen(key), vlen = strlen(value);
+    if ((e = malloc(sizeof(cache_entry_t) + klen + vlen + 2)) == NULL)
+        return;
+    memcpy(e->key, key, klen + 1);
+    e->value = e->key + klen + 1;
+    memcpy(e->value, value, vlen + 1);
+    e->bucket = bucket;
+    e->next = cache->slots[bucket % CDBC_CACHE_SLOTS];
+    cache->slots[bucket % CDBC_CACHE_SLOTS] = e;
+    e->newer = NULL;
+    if ((e->older = cache->newest) != NULL)
+        e->older->newer = e;
+    else
+        cache->oldest = e;
+    cache->newest = e;
+    cache->count++;
+}
+
+/*
+ * Takes in a line if it is a push rather than a response. Pushes reach
+ * connections that turned tracking on, with or without a cache.
+ */
+static int conn_push(cdbc_conn_t *conn, const char *line, size_t len) {
+    size_t plen = sizeof(CDBC_PUSH) - 1;
+    if (len <= plen || memcmp(line, CDBC_PUSH, plen) != 0)
+        return 0;
+    unsigned bucket = 0;
+    for (size_t i = plen; i < len && line[i] >= '0' && line[i] <= '9'; i++)
+        bucket = bucket * 10 + (line[i] - '0');
+    if (conn->cache != NULL)
+        cache_invalidate(conn->cache, bucket & (CDBC_BUCKETS - 1));
+    return 1;
+}
+
+void cdbc_cache_stats(const cdbc_conn_t *conn, cdbc_cache_stats_t *stats) {
+    if (conn->cache != NULL)
+        *stats = conn->cache->stats;
+    else
+        memset(stats, 0, sizeof(*stats));
+}
+
+//------------------------------------------------------------------------------------------------
+// Sockets
+
+/* Waits until fd is ready for events, for at most timeout_ms (0: forever). */
+static int wait_fd(int fd, short events, int timeout_ms) {
+    struct pollfd pfd = {fd, events, 0};
+    int n;
+    do {
+        n = poll(&pfd, 1, timeout_ms > 0 ? timeout_ms : -1);
+    } while (n < 0 && errno == EINTR);
+    if (n < 0)
+        return CDBC_ERR_IO;
+    return n == 0 ? CDBC_ERR_TIMEOUT : CDBC_OK;
+}
+
+/* Drops the connection, and with it any queued or unread requests. */
+static void conn_fail(cdbc_conn_t *conn) {
+    if (conn->fd >= 0) {
+        close(conn->fd);
+        conn->fd = -1;
+    }
+    conn->pending = 0;
+    conn->wlen = 0;
+    conn->rstart = conn->rend = 0;
+    // Invalidations for the cache no longer arrive
+    if (conn->cache != NULL)
+        cache_clear(conn->cache);
+}
+
+/* Connects to one address, within the connect timeout. */
+static int open_addr(const struct addrinfo *ai, int timeout_ms) {
+    int fd;
+    if ((fd = socket(ai->ai_family, ai->ai_socktype | SOCK_NONBLOCK,
+                     ai->ai_protocol)) < 0) {
+        return -1;
+    }
+    if (connect(fd, ai->ai_addr, ai->ai_addrlen) < 0) {
+        int err = 0;
+        socklen_t len = sizeof(err);
+        if (errno != EINPROGRESS || wait_fd(fd, POLLOUT, timeout_ms) != 0 ||
+            getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &len) < 0 || err != 0) {
+            close(fd);
+            return -1;
+        }
+    }
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    return fd;
+}
+
+int cdbc_dial(const char *host, const char *port, int timeout_ms) {
+    struct addrinfo hints, *result, *ai;
+    int fd = -1;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+
+    if (getaddrinfo(host, port, &hints, &result) != 0) {
+        return -1;
+    }
+    for (ai = result; ai != NULL && fd < 0; ai = ai->ai_next) {
+        fd = open_addr(ai, timeout_ms);
+    }
+    freeaddrinfo(result);
+    return fd;
+}
+
+/* Sends len bytes of buf on fd. */
+static int send_all(int fd, const char *buf, size_t len, int timeout_ms) {
+    size_t off = 0;
+    int err;
+    while (off < len) {
+        ssize_t n = send(fd, buf + off, len - off, MSG_NOSIGNAL);
+        if (n >= 0) {
+            off += n;
+        } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            if ((err = wait_fd(fd, POLLOUT, timeout_ms)))
+                return err;
+        } else if (errno != EINTR) {
+            return CDBC_ERR_IO;
+        }
+    }
+    return CDBC_OK;
+}
+
+/* Moves unread data to the start of rbuf. */
+static void rbuf_compact(cdbc_conn_t *conn) {
+    if (conn->rstart > 0) {
+        memmove(conn->rbuf, conn->rbuf + conn->rstart,
+                conn->rend - conn->rstart);
+        conn->rend -= conn->rstart;
+        conn->rstart = 0;
+    }
+}
+
+/* Receives what has arrived, or waits for something to, into rbuf. */
+static int recv_some(cdbc_conn_t *conn) {
+    int err;
+    rbuf_compact(conn);
+    if (conn->rend == CDBC_RBUF)
+        return CDBC_ERR_PROTOCOL;
+    while (1) {
+        ssize_t n = recv(conn->fd, conn->rbuf + conn->rend,
+                         CDBC_RBUF - conn->rend, 0);
+        if (n > 0) {
+            conn->rend += n;
+            return CDBC_OK;
+        } else if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            if ((err = wait_fd(conn->fd, POLLIN, conn->opts.io_timeout_ms)))
+                return err;
+        } else if (n == 0 || errno != EINTR) {
+            return CDBC_ERR_IO;
+        }
+    }
+}
+
+int cdbc_flush(cdbc_conn_t *conn) {
+    int err;
+    if (conn->opts.auto_pipeline)
+        return CDBC_ERR_STATE;
+    if (conn->fd < 0)
+        return conn->wlen > 0 ? CDBC_ERR_IO : CDBC_OK;
+    if ((err = send_all(conn->fd, conn->wbuf, conn->wlen,
+                        conn->opts.io_timeout_ms))) {
+        conn_fail(conn);
+        return err;
+    }
+    conn->wlen = 0;
+    return CDBC_OK;
+}
+
+/*
+ * Reads one response line and copies as much of it as fits into line (cap
+ * bytes, which may be 0), without its newline. Returns its full length.
+ * Pushes on the way are taken in.
+ */
+static int recv_line(cdbc_conn_t *conn, char *line, size_t cap) {
+    int err;
+    while (1) {
+        char *start = conn->rbuf + conn->rstart;
+        char *nl = memchr(start, '\n', conn->rend - conn->rstart);
+        if (nl != NULL) {
+            size_t len = nl - start;
+            if (conn_push(conn, start, len)) {
+                conn->rstart += len + 1;
+                continue;
+            }
+            if (cap > 0) {
+                size_t copy = len < cap - 1 ? len : cap - 1;
+                memcpy(line, start, copy);
+                line[copy] = '\0';
+            }
+            conn->rstart += len + 1;
+            return (int)len;
+        }
+        if ((err = recv_some(conn))) {
+            conn_fail(conn);
+            return err;
+        }
+    }
+}
+
+/*
+ * Takes in what an idle connection has been sent. Only pushes are expected,
+ * so anything else, or the server closing the connection, fails it.
+ */
+static int conn_drain(cdbc_conn_t *conn) {
+    char *nl;
+    while (1) {
+        while ((nl = memchr(conn->rbuf + conn->rstart, '\n',
+                            conn->rend - conn->rstart)) != NULL) {
+            size_t len = nl - (conn->rbuf + conn->rstart);
+            if (!conn_push(conn, conn->rbuf + conn->rstart, len))
+                return CDBC_ERR_PROTOCOL;
+            conn->rstart += len + 1;
+        }
+        rbuf_compact(conn);
+        if (conn->rend == CDBC_RBUF)
+            return CDBC_ERR_PROTOCOL;
+        ssize_t n = recv(conn->fd, conn->rbuf + conn->rend,
+                         CDBC_RBUF - conn->rend, MSG_DONTWAIT);
+        if (n > 0)
+            conn->rend += n;
+        else if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            return CDBC_OK;
+        else if (n == 0 || errno != EINTR)
+            return CDBC_ERR_IO;
+    }
+}
+
+/*
+ * Connects, and turns tracking on for a near cache. A server that does not
+ * track leaves the connection without one.
+ */
+static int conn_open(cdbc_conn_t *conn) {
+    char response[64];
+    int err;
+    conn_fail(conn);
+    conn->fd = cdbc_dial(conn->host, conn->port,
+                         conn->opts.connect_timeout_ms);
+    if (conn->fd < 0)
+        return CDBC_ERR_IO;
+    if (conn->cache == NULL)
+        return CDBC_OK;
+    if ((err = send_all(conn->fd, "t on\n", 5, conn->opts.io_timeout_ms))) {
+        conn_fail(conn);
+        return err;
+    }
+    if ((err = recv_line(conn, response, sizeof(response))) < 0)
+        return err;
+    if (strcmp(response, "tracking on") != 0) {
+        free(conn->cache);
+        conn->cache = NULL;
+    }
+    return CDBC_OK;
+}
+
+/*
+ * Makes sure an idle connection is up: a server that went away since the
+ * last request shows up as a readable socket, so that is checked first
+ * rather than found out after sending, along with taking in any pushes.
+ * Reconnects up to max_retries times.
+ */
+static int conn_ready(cdbc_conn_t *conn) {
+    if (conn->fd >= 0 && conn->pending == 0 && conn_drain(conn) != CDBC_OK)
+        conn_fail(conn);
+    int err = CDBC_OK;
+    for (int attempt = 0; conn->fd < 0; attempt++) {
+        if (attempt > 0 && attempt > conn->opts.max_retries)
+            return err;
+        if (attempt > 0)
+            usleep(conn->opts.retry_delay_ms * 1000);
+        err = conn_open(conn);
+    }
+    return CDBC_OK;
+}
+
+//------------------------------------------------------------------------------------------------
+// Connections
+
+cdbc_conn_t *cdbc_connect(const char *host, const char *port,
+                          const cdbc_options_t *opts) {
+    cdbc_conn_t *conn = malloc(sizeof(cdbc_conn_t));
+    if (conn == NULL)
+        return NULL;
+    if ((conn->host = strdup(host)) == NULL ||
+        (conn->port = strdup(port)) == NULL) {
+        free(conn->host);
+        free(conn);
+        return NULL;
+    }
+    if (opts != NULL)
+        conn->opts = *opts;
+    else
+        cdbc_options_default(&conn->opts);
+    conn->fd = -1;
+    conn->next = NULL;
+    conn->cache = NULL;
+    if (conn->opts.near_cache > 0 && !conn->opts.auto_pipeline &&
+        (conn->cache = calloc(1, sizeof(near_cache_t))) == NULL) {
+        free(conn->host);
+        free(conn->port);
+        free(conn);
+        return NULL;
+    }
+    conn->oldest = conn->newest = NULL;
+    conn->unsent = conn->writing = conn->reading = conn->broken = 0;
+    pthread_mutex_init(&conn->mutex, NULL);
+    pthread_cond_init(&conn->changed, NULL);
+    conn_open(conn);
+    return conn;
+}
+
+int cdbc_connected(const cdbc_conn_t *conn) { return conn->fd >= 0; }
+
+void cdbc_close(cdbc_conn_t *conn) {
+    if (conn == NULL)
+        return;
+    conn_fail(conn);
+    free(conn->cache);
+    pthread_mutex_destroy(&conn->mutex);
+    pthread_cond_destroy(&conn->changed);
+    free(conn->host);
+    free(conn->port);
+    free(conn);
+}
+
+int cdbc_send(cdbc_conn_t *conn, const char *command) {
+    size_t len = strlen(command);
+    int err;
+    if (len + 1 > CDBC_MAX_LINE - 1 || memchr(command, '\n', len) != NULL)
+        return CDBC_ERR_ARG;
+    if (conn->opts.auto_pipeline)
+        return CDBC_ERR_STATE;
+    if (conn->pending == 0 && (err = conn_ready(conn)))
+        return err;
+    if (conn->fd < 0)
+        return CDBC_ERR_IO;
+    if (conn->wlen + len + 1 > CDBC_WBUF && (err = cdbc_flush(conn)))
+        return err;
+    memcpy(conn->wbuf + conn->wlen, command, len);
+    conn->wbuf[conn->wlen + len] = '\n';
+    conn->wlen += len + 1;
+    conn->pending++;
+    return CDBC_OK;
+}
+
+int cdbc_recv(cdbc_conn_t *conn, char *response, size_t cap) {
+    int err;
+    if (conn->pending == 0 || conn->opts.auto_pipeline)
+        return CDBC_ERR_STATE;
+    if ((err = cdbc_flush(conn)))
+        return err;
+    if ((err = recv_line(conn, response, cap)) < 0)
+        return err;
+    conn->pending--;
+    return CDBC_OK;
+}
+
+int cdbc_pending(const cdbc_conn_t *conn) { return conn->pending; }
+
+//------------------------------------------------------------------------------------------------
+// Auto-pipelining
+//
+// Threads sharing a connection queue their commands in wbuf. Whichever of
+// them finds nobody sending takes everything queued so far and sends it in
+// one write, while later commands queue up behind it; whichever finds
+// nobody receiving reads responses and hands them to the waiters in order.
+
+/*
+ * Completes every waiter with err and shuts the socket down, so that a
+ * thread sending or receiving on it gives up too. Called with the lock held.
+ */
+static void shared_fail(cdbc_conn_t *conn, int err) {
+    for (waiter_t *w = conn->oldest; w != NULL; w = w->next) {
+        w->status = err;
+        w->done = 1;
+    }
+    conn->oldest = conn->newest = NULL;
+    conn->pending = conn->unsent = 0;
+    conn->wlen = 0;
+    conn->broken = 1;
+    if (conn->fd >= 0)
+        shutdown(conn->fd, SHUT_RDWR);
+}
+
+/*
+ * Ends a turn at sending or receiving; the last one out of a failed socket
+ * closes it. Called with the lock held.
+ */
+static void shared_end_turn(cdbc_conn_t *conn, int err) {
+    if (err != CDBC_OK && !conn->broken)
+        shared_fail(conn, err);
+    if (conn->broken && !conn->writing && !conn->reading) {
+        conn_fail(conn);
+        conn->broken = 0;
+    }
+    pthread_cond_broadcast(&conn->changed);
+}
+
+/* Hands the complete lines in rbuf to the oldest waiters. */
+static int shared_dispatch(cdbc_conn_t *conn) {
+    char *nl;
+    while ((nl = memchr(conn->rbuf + conn->rstart, '\n',
+                        conn->rend - conn->rstart)) != NULL) {
+        size_t len = nl - (conn->rbuf + conn->rstart);
+        if (conn_push(conn, conn->rbuf + conn->rstart, len)) {
+            conn->rstart += len + 1;
+            continue;
+        }
+        waiter_t *w = conn->oldest;
+        if (w == NULL || conn->pending == conn->unsent)
+            return CDBC_ERR_PROTOCOL;  // a response nobody asked for
+        size_t copy = len < w->cap - 1 ? len : w->cap - 1;
+        memcpy(w->response, conn->rbuf + conn->rstart, copy);
+        w->response[copy] = '\0';
+        w->done = 1;
+        conn->rstart += len + 1;
+        if ((conn->oldest = w->next) == NULL)
+            conn->newest = NULL;
+        conn->pending--;
+    }
+    return CDBC_OK;
+}
+
+static int shared_request(cdbc_conn_t *conn, const char *command,
+                          char *response, size_t cap) {
+    size_t len = strlen(command);
+    waiter_t me = {response, cap, CDBC_OK, 0, NULL};
+    int delayed = conn->opts.pipeline_delay_us <= 0;
+    int err;
+    if (len + 1 > CDBC_MAX_LINE - 1 || memchr(command, '\n', len) != NULL)
+        return CDBC_ERR_ARG;
+
+    pthread_mutex_lock(&conn->mutex);
+    // Wait for room, and for the socket to be idle before checking it
+    while (conn->broken || conn->wlen + len + 1 > CDBC_WBUF ||
+           (conn->pending == 0 && (conn->writing || conn->reading))) {
+        pthread_cond_wait(&conn->changed, &conn->mutex);
+    }
+    if (conn->pending == 0 && (err = conn_ready(conn))) {
+        pthread_mutex_unlock(&conn->mutex);
+        return err;
+    }
+    memcpy(conn->wbuf + conn->wlen, command, len);
+    conn->wbuf[conn->wlen + len] = '\n';
+    conn->wlen += len + 1;
+    if (conn->newest != NULL)
+        conn->newest->next = &me;
+    else
+        conn->oldest = &me;
+    conn->newest = &me;
+    conn->pending++;
+    conn->unsent++;
+
+    while (!me.done) {
+        if (!conn->writing && conn->unsent > 0 && !conn->broken) {
+            if (!delayed) {
+                // Give other threads a moment to add to this write
+                struct timespec until;
+                clock_gettime(CLOCK_REALTIME, &until);
+                until.tv_nsec += conn->opts.pipeline_delay_us * 1000L;
+                until.tv_sec += until.tv_nsec / 1000000000L;
+                until.tv_nsec %= 1000000000L;
+                pthread_cond_timedwait(&conn->changed, &conn->mutex, &until);
+                delayed = 1;
+                continue;
+            }
+            size_t slen = conn->wlen;
+            memcpy(conn->sbuf, conn->wbuf, slen);
+            conn->wlen = 0;
+            conn->unsent = 0;
+            conn->writing = 1;
+            pthread_cond_broadcast(&conn->changed);  // wbuf has room again
+            pthread_mutex_unlock(&conn->mutex);
+            err = send_all(conn->fd, conn->sbuf, slen,
+                           conn->opts.io_timeout_ms);
+            pthread_mutex_lock(&conn->mutex);
+            conn->writing = 0;
+            shared_end_turn(conn, err);
+        } else if (!conn->reading && conn->pending > conn->unsent &&
+                   !conn->broken) {
+            conn->reading = 1;
+            pthread_mutex_unlock(&conn->mutex);
+            err = recv_some(conn);
+            pthread_mutex_lock(&conn->mutex);
+            conn->reading = 0;
+            if (err == CDBC_OK && !conn->broken)
+                err = shared_dispatch(conn);
+            shared_end_turn(conn, err);
+        } else {
+            pthread_cond_wait(&conn->changed, &conn->mutex);
+        }
+    }
+    pthread_mutex_unlock(&conn->mutex);
+    return me.status;
+}
+
+//------------------------------------------------------------------------------------------------
+// Requests
+
+/*
+ * Sends one command and reads its response. cdbc_send reconnects as need be
+ * before anything is sent; requests that may be repeated are also retried
+ * if the connection fails while waiting for their response.
+ */
+static int request(cdbc_conn_t *conn, const char *command, char *response,
+                   size_t cap, int idempotent) {
+    int err;
+    if (conn->pending > 0 && !conn->opts.auto_pipeline)
+        return CDBC_ERR_STATE;
+    for (int attempt = 0;; attempt++) {
+        if (conn->opts.auto_pipeline) {
+            if ((err = shared_request(conn, command, response, cap)) ==
+                CDBC_OK)
+                return CDBC_OK;
+        } else {
+            if ((err = cdbc_send(conn, command)))
+                return err;
+            if ((err = cdbc_recv(conn, response, cap)) == CDBC_OK)
+                return CDBC_OK;
+        }
+        if (err == CDBC_ERR_ARG || !idempotent ||
+            attempt >= conn->opts.max_retries)
+            return err;
+        usleep(conn->opts.retry_delay_ms * 1000);
+    }
+}
+
+int cdbc_command(cdbc_conn_t *conn, const char *command, char *response,
+                 size_t cap) {
+    return request(conn, command, response, cap, 0);
+}
+
+int cdbc_valid_word(const char *s) {
+    size_t len = strlen(s);
+    if (len == 0 || len > CDBC_MAX_KEY)
+        return 0;
+    for (size_t i = 0; i < len; i++) {
+        if (s[i] == ' ' || s[i] == '\t' || s[i] == '\n' || s[i] == '\r')
+            return 0;
+    }
+    return 1;
+}
+
+int cdbc_write_status(const char *response, const char *ok) {
+    if (strcmp(response, ok) == 0)
+        return CDBC_OK;
+    if (strcmp(response, "already in database") == 0)
+        return CDBC_EXISTS;
+    if (strcmp(response, "not in database") == 0)
+        return CDBC_NOT_FOUND;
+    return CDBC_ERR_PROTOCOL;
+}
+
+int cdbc_read_status(const char *response) {
+    // A value is one word, so it cannot be mistaken for these
+    if (strcmp(response, "not found") == 0)
+        return CDBC_NOT_FOUND;
+    if (strcmp(response, "ill-formed command") == 0)
+        return CDBC_ERR_PROTOCOL;
+    if (strchr(response, ' ') != NULL)
+        return CDBC_ERR_PROTOCOL;  // a refusal, such as "replica syncing"
+    return CDBC_OK;
+}
+
+/*
+ * Answers a get from the near cache if it can. Pushes are taken in first,
+ * so that the cache is as fresh as what the server has sent.
+ */
+static int cache_get(cdbc_conn_t *conn, const char *key, unsigned bucket,
+                     char *value, size_t cap) {
+    int err;
+    if ((err = conn_ready(conn)))
+        return err;
+    near_cache_t *cache = conn->cache;
+    if (cache == NULL)
+        return CDBC_NOT_FOUND;  // the server it reconnected to cannot track
+    cache_entry_t *e = cache_find(cache, key, bucket);
+    if (e == NULL) {
+        cache->stats.misses++;
+        cache->fetch_bucket = bucket;
+        cache->fetch_stale = 0;
+        return CDBC_NOT_FOUND;
+    }
+    cache->stats.hits++;
+    if (strlen(e->value) >= cap)
+        return CDBC_ERR_ARG;
+    strcpy(value, e->value);
+    return CDBC_OK;
+}
+
+int cdbc_get(cdbc_conn_t *conn, const char *key, char *value, size_t cap) {
+    char command[CDBC_MAX_LINE], response[CDBC_MAX_KEY + 1];
+    unsigned bucket = 0;
+    int err;
+    if (!cdbc_valid_word(key))
+        return CDBC_ERR_ARG;
+    if (conn->cache != NULL && conn->pending == 0) {
+        bucket = cache_bucket(key);
+        if ((err = cache_get(conn, key, bucket, value, cap)) !=
+            CDBC_NOT_FOUND)
+            return err;
+    }
+    snprintf(command, sizeof(command), "q %s", key);
+    if ((err = request(conn, command, response, sizeof(response), 1)))
+        return err;
+    if ((err = cdbc_read_status(response)) != CDBC_OK)
+        return err;
+    if (strlen(response) >= cap)
+        return CDBC_ERR_ARG;
+    strcpy(value, response);
+    // Unless the server has since said the value may have changed
+    if (conn->cache != NULL && !conn->cache->fetch_stale) {
+        cache_store(conn->cache, conn->opts.near_cache, key, response,
+                    bucket);
+        conn->cache->fetch_stale = 1;
+    }
+    return CDBC_OK;
+}
+
+static int write_request(cdbc_conn_t *conn, char cmd, const char *key,
+                         const char *value, const char *ok) {
+    char command[CDBC_MAX_LINE], response[64];
+    int err;
+    if (!cdbc_valid_word(key) || (value != NULL && !cdbc_valid_word(value)))
+        return CDBC_ERR_ARG;
+    if (value != NULL)
+        snprintf(command, sizeof(command), "%c %s %s", cmd, key, value);
+    else
+        snprintf(command, sizeof(command), "%c %s", cmd, key);
+    if ((err = request(conn, command, response, sizeof(response), 0)))
+        return err;
+    return cdbc_write_status(response, ok);
+}
+
+int cdbc_add(cdbc_conn_t *conn, const char *key, const char *value) {
+    return write_request(conn, 'a', key, value, "added");
+}
+
+int cdbc_update(cdbc_conn_t *conn, const char *key, const char *value) {
+    return write_request(conn, 'u', key, value, "updated");
+}
+
+int cdbc_put(cdbc_conn_t *conn, const char *key, const char *value) {
+    int err = CDBC_NOT_FOUND;
+    // The key can be deleted between the two, so go round again if it is
+    for (int i = 0; i < CDBC_PUT_TRIES && err == CDBC_NOT_FOUND; i++) {
+        if ((err = cdbc_add(conn, key, value)) == CDBC_EXISTS)
+            err = cdbc_update(conn, key, value);
+    }
+    return err;
+}
+
+int cdbc_delete(cdbc_conn_t *conn, const char *key) {
+    return write_request(conn, 'd', key, NULL, "removed");
+}
+
+int cdbc_scan(cdbc_conn_t *conn, const char *start, int count,
+              cdbc_scan_fn fn, void *arg) {
+    char command[CDBC_MAX_LINE];
+    char *response, *save, *key, *value;
+    int err;
+    if (!cdbc_valid_word(start) || count < 0)
+        return CDBC_ERR_ARG;
+    if ((response = malloc(CDBC_MAX_RESPONSE)) == NULL)
+        return CDBC_ERR_IO;
+    snprintf(command, sizeof(command), "s %s %d", start, count);
+    if ((err = request(conn, command, response, CDBC_MAX_RESPONSE, 1))) {
+        free(response);
+        return err;
+    }
+
+    // "<n> k1 v1 k2 v2 ..."
+    char *n = strtok_r(response, " ", &save);
+    char *end;
+    long pairs = n != NULL ? strtol(n, &end, 10) : -1;
+    if (n == NULL || *end != '\0' || pairs < 0) {
+        free(response);
+        return CDBC_ERR_PROTOCOL;
+    }
+    for (long i = 0; i < pairs; i++) {
+        key = strtok_r(NULL, " ", &save);
+        value = strtok_r(NULL, " ", &save);
+        if (key == NULL || value == NULL) {
+            free(response);
+            return CDBC_ERR_PROTOCOL;
+        }
+        if (fn != NULL && fn(key, value, arg))
+            break;
+    }
+    free(response);
+    return (int)pairs;
+}
+
+//------------------------------------------------------------------------------------------------
+// Batches
+
+cdbc_batch_t *cdbc_batch_create(void) {
+    return calloc(1, sizeof(cdbc_batch_t));
+}
+
+void cdbc_batch_free(cdbc_batch_t *batch) {
+    if (batch == NULL)
+        return;
+    free(batch->ops);
+    free(batch);
+}
+
+void cdbc_batch_clear(cdbc_batch_t *batch) { batch->count = 0; }
+
+static int batch_push(cdbc_batch_t *batch, enum batch_type type,
+                      const char *key, const char *value) {
+    if (!cdbc_valid_word(key) || (value != NULL && !cdbc_valid_word(value)))
+        return CDBC_ERR_ARG;
+    if (batch->count == batch->capacity) {
+        int capacity = batch->capacity > 0 ? 2 * batch->capacity : 16;
+        batch_op_t *ops = realloc(batch->ops, capacity * sizeof(batch_op_t));
+        if (ops == NULL)
+            return CDBC_ERR_IO;
+        batch->ops = ops;
+        batch->capacity = capacity;
+    }
+    batch_op_t *op = &batch->ops[batch->count];
+    op->type = type;
+    op->status = CDBC_ERR_STATE;  // until it runs
+    strcpy(op->key, key);
+    if (value != NULL)
+        strcpy(op->value, value);
+    else
+        op->value[0] = '\0';
+    return batch->count++;
+}
+
+int cdbc_batch_get(cdbc_batch_t *batch, const char *key) {
+    return batch_push(batch, b_get, key, NULL);
+}
+
+int cdbc_batch_add(cdbc_batch_t *batch, const char *key, const char *value) {
+    return batch_push(batch, b_add, key, value);
+}
+
+int cdbc_batch_update(cdbc_batch_t *batch, const char *key,
+                      const char *value) {
+    return batch_push(batch, b_update, key, value);
+}
+
+int cdbc_batch_delete(cdbc_batch_t *batch, const char *key) {
+    return batch_push(batch, b_delete, key, NULL);
+}
+
+/* Sets an operation's status from its response. */
+static void batch_result(batch_op_t *op, const char *response) {
+    switch (op->type) {
+        case b_get:
+            if ((op->status = cdbc_read_status(response)) == CDBC_OK)
+                strcpy(op->value, response);
+            break;
+        case b_add:
+            op->status = cdbc_write_status(response, "added");
+            break;
+        case b_update:
+            op->status = cdbc_write_status(response, "updated");
+            break;
+        default:
+            op->status = cdbc_write_status(response, "removed");
+            break;
+    }
+}
+
+int cdbc_batch_exec(cdbc_conn_t *conn, cdbc_batch_t *batch) {
+    static const char cmds[] = {'q', 'a', 'u', 'd'};
+    char command[CDBC_MAX_LINE], response[CDBC_MAX_KEY + 1];
+    int err;
+    if (conn->pending > 0 || conn->opts.auto_pipeline)
+        return CDBC_ERR_STATE;
+
+    // A window at a time, so neither side's socket buffers fill up with
+    // responses that nobody is reading yet
+    for (int base = 0; base < batch->count; base += CDBC_BATCH_WINDOW) {
+        int end = base + CDBC_BATCH_WINDOW < batch->count
+                      ? base + CDBC_BATCH_WINDOW
+                      : batch->count;
+        for (int i = base; i < end; i++) {
+            batch_op_t *op = &batch->ops[i];
+            if (op->type == b_add || op->type == b_update)
+                snprintf(command, sizeof(command), "%c %s %s",
+                         cmds[op->type], op->key, op->value);
+            else
+                snprintf(command, sizeof(command), "%c %s", cmds[op->type],
+                         op->key);
+            if ((err = cdbc_send(conn, command)))
+                return err;
+        }
+        for (int i = base; i < end; i++) {
+            if ((err = cdbc_recv(conn, response, sizeof(response))))
+                return err;
+            batch_result(&batch->ops[i], response);
+        }
+    }
+    return CDBC_OK;
+}
+
+int cdbc_batch_status(const cdbc_batch_t *batch, int i) {
+    return i >= 0 && i < batch->count ? batch->ops[i].status : CDBC_ERR_ARG;
+}
+
+const char *cdbc_batch_value(const cdbc_batch_t *batch, int i) {
+    if (i < 0 || i >= batch->count || batch->ops[i].type != b_get ||
+        batch->ops[i].status != CDBC_OK) {
+        return NULL;
+    }
+    return batch->ops[i].value;
+}
+
+int cdbc_batch_size(const cdbc_batch_t *batch) { return batch->count; }
+
+const char *cdbc_batch_key(const cdbc_batch_t *batch, int i) {
+    return batch->ops[i].key;
+}
+
+int cdbc_batch_take(cdbc_batch_t *dst, const cdbc_batch_t *src, int i) {
+    const batch_op_t *op = &src->ops[i];
+    return batch_push(dst, op->type, op->key,
+                      op->type == b_add || op->type == b_update ? op->value
+                                                                : NULL);
+}
+
+void cdbc_batch_settle(cdbc_batch_t *dst, int i, const cdbc_batch_t *src,
+                       int j, int status) {
+    batch_op_t *op = &dst->ops[i];
+    if (src != NULL) {
+        op->status = src->ops[j].status;
+        if (op->type == b_get && op->status == CDBC_OK)
+            strcpy(op->value, src->ops[j].value);
+    } else {
+        op->status = status;
+    }
+}
+
+//------------------------------------------------------------------------------------------------
+// Pools
+
+cdbc_pool_t *cdbc_pool_create(const char *host, const char *port, int size,
+                              const cdbc_options_t *opts) {
+    cdbc_pool_t *pool;
+    if (size < 1 || (pool = calloc(1, sizeof(cdbc_pool_t))) == NULL)
+        return NULL;
+    if ((pool->host = strdup(host)) == NULL ||
+        (pool->port = strdup(port)) == NULL) {
+        free(pool->host);
+        free(pool);
+        return NULL;
+    }
+    if (opts != NULL)
+        pool->opts = *opts;
+    else
+        cdbc_options_default(&pool->opts);
+    pool->size = size;
+    pthread_mutex_init(&pool->mutex, NULL);
+    pthread_cond_init(&pool->returned, NULL);
+    return pool;
+}
+
+void cdbc_pool_destroy(cdbc_pool_t *pool) {
+    if (pool == NULL)
+        return;
+    while (pool->idle != NULL) {
+        cdbc_conn_t *conn = pool->idle;
+        pool->idle = conn->next;
+        cdbc_close(conn);
+    }
+    pthread_mutex_destroy(&pool->mutex);
+    pthread_cond_destroy(&pool->returned);
+    free(pool->host);
+    free(pool->port);
+    free(pool);
+}
+
+cdbc_conn_t *cdbc_pool_acquire(cdbc_pool_t *pool) {
+    cdbc_conn_t *conn;
+    pthread_mutex_lock(&pool->mutex);
+    while (pool->idle == NULL && pool->created == pool->size) {
+        pthread_cond_wait(&pool->returned, &pool->mutex);
+    }
+    if ((conn = pool->idle) != NULL) {
+        pool->idle = conn->next;
+        pthread_mutex_unlock(&pool->mutex);
+        return conn;
+    }
+    pool->created++;
+    pthread_mutex_unlock(&pool->mutex);
+
+    // Connect outside the lock, so other threads can take idle connections
+    if ((conn = cdbc_connect(pool->host, pool->port, &pool->opts)) == NULL) {
+        pthread_mutex_lock(&pool->mutex);
+        pool->created--;
+        pthread_cond_signal(&pool->returned);
+        pthread_mutex_unlock(&pool->mutex);
+    }
+    return conn;
+}
+
+void cdbc_pool_release(cdbc_pool_t *pool, cdbc_conn_t *conn) {
+    // Nobody will read those responses; a fresh connection starts in step
+    if (conn->pending > 0)
+        conn_fail(conn);
+    pthread_mutex_lock(&pool->mutex);
+    conn->next = pool->idle;
+    pool->idle = conn;
+    pthread_cond_signal(&pool->returned);
+    pthread_mutex_unlock(&pool->mutex);
+}
@@ -0,0 +1,319 @@
+#ifndef CDBC_H_
+#define CDBC_H_
+
+#include <stddef.h>
+
+/*
+ * libconcurrentdb-client: a client library for the server's line protocol.
+ *
+ * A cdbc_conn_t is one connection. It is not thread-safe; threads share
+ * connections through a cdbc_pool_t, which hands each one to a single
+ * thread at a time. Calls return CDBC_OK or one of the other non-negative
+ * outcomes below, or a negative error. Connections that fail are
+ * reconnected on their next use, and reads (get, scan) are retried
+ * on a fresh connection up to max_retries times; writes are only retried if
+ * they failed before being sent, since the server may have applied them.
+ *
+ * Requests can be pipelined: cdbc_send queues commands, which go out
+ * together, and cdbc_recv reads their responses in order. A cdbc_batch_t
+ * does the same for typed operations.
+ *
+ * With auto_pipeline set, a connection may instead be shared by any number
+ * of threads making the typed calls or cdbc_command: requests that threads
+ * make while a write is under way are coalesced into the next write, and
+ * the responses handed back to each thread in order. cdbc_send, cdbc_recv
+ * and batches are then unavailable.
+ *
+ * With near_cache set, a connection keeps up to that many of the values it
+ * got, and answers gets from them. The server pushes an invalidation to the
+ * connection whenever a key it read may have changed, and the connection
+ * takes in pushes before every get it answers, so a cached value is never
+ * staler than the invalidation on its way to it. A connection empties its
+ * cache when it breaks. Near-caching needs a connection of its own, so it is
+ * unavailable with auto_pipeline.
+ */
+
+#define CDBC_MAX_KEY 255    // as db.c's MAXLEN, less the terminator
+#define CDBC_MAX_LINE 1024  // longest command line, as comm.h's BUFLEN
+#define CDBC_MAX_RESPONSE 16384  // longest response line, as server.c's RESLEN
+
+enum cdbc_status {
+    CDBC_OK = 0,
+    CDBC_NOT_FOUND = 1,    // get, update, delete of a missing key
+    CDBC_EXISTS = 2,       // add of a key that is already there
+    CDBC_ERR_ARG = -1,     // key or value empty, too long or with spaces
+    CDBC_ERR_IO = -2,      // could not connect, or the connection broke
+    CDBC_ERR_TIMEOUT = -3,
+    CDBC_ERR_PROTOCOL = -4,  // unexpected or truncated response
+    CDBC_ERR_STATE = -5,     // pipelined responses are still unread
+};
+
+typedef struct cdbc_options {
+    int connect_timeout_ms;  // 0 waits for as long as connect does
+    int io_timeout_ms;       // per send or receive; 0 waits forever
+    int max_retries;         // reconnects per call
+    int retry_delay_ms;      // between reconnects
+    int auto_pipeline;       // share the connection between threads
+    int pipeline_delay_us;   // how long a write waits for more to join it
+    int near_cache;          // values to cache per connection; 0: none
+} cdbc_options_t;
+
+typedef struct cdbc_cache_stats {
+    unsigned long hits;
+    unsigned long misses;
+    unsigned long invalidations;  // pushes taken in
+} cdbc_cache_stats_t;
+
+typedef struct cdbc_conn cdbc_conn_t;
+typedef struct cdbc_pool cdbc_pool_t;
+typedef struct cdbc_batch cdbc_batch_t;
+
+/* Called for each pair a scan returns; a non-zero return stops the scan. */
+typedef int (*cdbc_scan_fn)(const char *key, const char *value, void *arg);
+
+/*
+ * Fills opts with the defaults: 1s connect, 5s I/O, 3 retries 100ms apart,
+ * no auto-pipelining and no near cache.
+ */
+void cdbc_options_default(cdbc_options_t *opts);
+
+/* Describes a status or error. */
+const char *cdbc_strerror(int status);
+
+//------------------------------------------------------------------------------------------------
+// Connections
+
+/*
+ * Connects to host:port; opts may be NULL for the defaults. Returns NULL
+ * only if out of memory: a connection that cannot be made yet is made again
+ * on first use, and the calls on it fail with CDBC_ERR_IO until it is.
+ */
+cdbc_conn_t *cdbc_connect(const char *host, const char *port,
+                          const cdbc_options_t *opts);
+
+/* Whether the connection is currently up. */
+int cdbc_connected(const cdbc_conn_t *conn);
+
+void cdbc_close(cdbc_conn_t *conn);
+
+/* The near cache's counters, all 0 if the connection has none. */
+void cdbc_cache_stats(const cdbc_conn_t *conn, cdbc_cache_stats_t *stats);
+
+/*
+ * Looks up key, copying its value into value (cap bytes). With a near cache,
+ * the value may come from it.
+ */
+int cdbc_get(cdbc_conn_t *conn, const char *key, char *value, size_t cap);
+
+/* Adds key, failing with CDBC_EXISTS if it is already there. */
+int cdbc_add(cdbc_conn_t *conn, const char *key, const char *value);
+
+/* Replaces the value of key, failing with CDBC_NOT_FOUND if it is missing. */
+int cdbc_update(cdbc_conn_t *conn, const char *key, const char *value);
+
+/* Adds key, or replaces its value if it is already there. */
+int cdbc_put(cdbc_conn_t *conn, const char *key, const char *value);
+
+int cdbc_delete(cdbc_conn_t *conn, const char *key);
+
+/*
+ * Calls fn on up to count pairs in key order, from start onwards. Returns the
+ * number of pairs the server sent, or an error.
+ */
+int cdbc_scan(cdbc_conn_t *conn, const char *start, int count,
+              cdbc_scan_fn fn, void *arg);
+
+/*
+ * Sends one raw command line, without its newline, and copies the response
+ * line, without its newline, into response (cap bytes).
+ */
+int cdbc_command(cdbc_conn_t *conn, const char *command, char *response,
+                 size_t cap);
+
+//------------------------------------------------------------------------------------------------
+// Pipelining
+
+/* Queues a raw command line; it is sent by cdbc_flush or cdbc_recv. */
+int cdbc_send(cdbc_conn_t *conn, const char *command);
+
+/* Sends all queued commands. */
+int cdbc_flush(cdbc_conn_t *conn);
+
+/* Reads the response to the oldest command still unanswered. */
+int cdbc_recv(cdbc_conn_t *conn, char *response, size_t cap);
+
+/* Number of commands sent or queued whose responses are unread. */
+int cdbc_pending(const cdbc_conn_t *conn);
+
+//------------------------------------------------------------------------------------------------
+// Batches
+
+cdbc_batch_t *cdbc_batch_create(void);
+void cdbc_batch_free(cdbc_batch_t *batch);
+
+/* Empties the batch for reuse. */
+void cdbc_batch_clear(cdbc_batch_t *batch);
+
+/* Number of operations in the batch. */
+int cdbc_batch_size(const cdbc_batch_t *batch);
+
+/* Queue operations; they return the operation's index, or an error. */
+int cdbc_batch_get(cdbc_batch_t *batch, const char *key);
+int cdbc_batch_add(cdbc_batch_t *batch, const char *key, const char *value);
+int cdbc_batch_update(cdbc_batch_t *batch, const char *key,
+                      const char *value);
+int cdbc_batch_delete(cdbc_batch_t *batch, const char *key);
+
+/*
+ * Runs the batch over conn, pipelined, and returns CDBC_OK once every
+ * operation has a result, or the error that stopped it. Operations are not
+ * retried, as some may have been applied.
+ */
+int cdbc_batch_exec(cdbc_conn_t *conn, cdbc_batch_t *batch);
+
+/* The outcome of operation i, and the value it got if it was a get. */
+int cdbc_batch_status(const cdbc_batch_t *batch, int i);
+const char *cdbc_batch_value(const cdbc_batch_t *batch, int i);
+
+//------------------------------------------------------------------------------------------------
+// Pools
+
+/* A pool of up to size connections to host:port, made as they are needed. */
+cdbc_pool_t *cdbc_pool_create(const char *host, const char *port, int size,
+                              const cdbc_options_t *opts);
+
+/* Closes the pool's connections; none may still be checked out. */
+void cdbc_pool_destroy(cdbc_pool_t *pool);
+
+/* Takes a connection, waiting for one to be returned if all are in use. */
+cdbc_conn_t *cdbc_pool_acquire(cdbc_pool_t *pool);
+
+/*
+ * Gives a connection back. One with unread responses is disconnected, and
+ * reconnects when next used.
+ */
+void cdbc_pool_release(cdbc_pool_t *pool, cdbc_conn_t *conn);
+
+//------------------------------------------------------------------------------------------------
+// Clusters
+
+/*
+ * A cluster spreads keys over several servers by consistent hashing, with
+ * no help from the servers: each key lives on one of them, chosen on a ring
+ * of virtual nodes, so adding or removing a server moves only the keys that
+ * it gains or loses. Calls are thread-safe and go through a pool of
+ * connections per server; topology changes wait for calls in progress.
+ */
+typedef struct cdbc_cluster cdbc_cluster_t;
+
+/*
+ * A cluster of the servers in a comma-separated list of host:port, with up
+ * to pool_size connections to each. Returns NULL if the list is malformed.
+ */
+cdbc_cluster_t *cdbc_cluster_create(const char *servers, int pool_size,
+                                    const cdbc_options_t *opts);
+
+void cdbc_cluster_destroy(cdbc_cluster_t *cluster);
+
+/* Adds or removes one host:port; returns CDBC_OK or CDBC_ERR_ARG. */
+int cdbc_cluster_add_server(cdbc_cluster_t *cluster, const char *server);
+int cdbc_cluster_remove_server(cdbc_cluster_t *cluster, const char *server);
+
+int cdbc_cluster_size(cdbc_cluster_t *cluster);
+
+/* Copies the host:port that key belongs to into server (cap bytes). */
+int cdbc_cluster_locate(cdbc_cluster_t *cluster, const char *key,
+                        char *server, size_t cap);
+
+/* As the calls on single connections, on the server that key belongs to. */
+int cdbc_cluster_get(cdbc_cluster_t *cluster, const char *key, char *value,
+                     size_t cap);
+int cdbc_cluster_add(cdbc_cluster_t *cluster, const char *key,
+                     const char *value);
+int cdbc_cluster_update(cdbc_cluster_t *cluster, const char *key,
+                        const char *value);
+int cdbc_cluster_put(cdbc_cluster_t *cluster, const char *key,
+                     const char *value);
+int cdbc_cluster_delete(cdbc_cluster_t *cluster, const char *key);
+
+/*
+ * Scans every server from start and calls fn on the first count pairs of
+ * them all, in key order. A server may answer with fewer pairs than count
+ * when they fill its response, so this stops before any key one of them may
+ * not have sent; scanning on from the last key passed to fn misses none.
+ * Returns the number of pairs passed to fn.
+ */
+int cdbc_cluster_scan(cdbc_cluster_t *cluster, const char *start, int count,
+                      cdbc_scan_fn fn, void *arg);
+
+/*
+ * Splits the batch by server, runs each part pipelined on a connection to
+ * its server, and gathers the results into the batch. Operations on a
+ * server that fails get its error; the first such error is returned.
+ */
+int cdbc_cluster_batch_exec(cdbc_cluster_t *cluster, cdbc_batch_t *batch);
+
+//------------------------------------------------------------------------------------------------
+// Asynchronous requests
+
+/*
+ * An asynchronous client spreads requests over a few non-blocking
+ * connections and completes them from an event loop. Any thread may submit;
+ * requests submitted between two turns of the loop go out together, one
+ * write per connection. The loop is turned by cdbc_async_run, either in a
+ * thread of its own or from an application's loop, which polls
+ * cdbc_async_fd for readability and then runs one turn without waiting.
+ * Callbacks are called from cdbc_async_run.
+ *
+ * Timeouts are only noticed when the loop turns: nothing makes cdbc_async_fd
+ * readable when a connect or a request runs out of time. An application's
+ * loop must therefore poll it with a timeout (a fraction of the shortest of
+ * connect_timeout_ms and io_timeout_ms, say) and turn the loop either way.
+ */
+typedef struct cdbc_async cdbc_async_t;
+
+/*
+ * Called once per request with its status: for gets the value, for raw
+ * commands the response line, and NULL otherwise or on errors. The string
+ * is only valid during the call.
+ */
+typedef void (*cdbc_async_fn)(int status, const char *response, void *arg);
+
+/*
+ * An asynchronous client with the given number of connections to host:port.
+ * The address is resolved here, and NULL returned if it cannot be;
+ * connections are made without blocking the loop, within connect_timeout_ms,
+ * trying each of its addresses in turn until one accepts.
+ */
+cdbc_async_t *cdbc_async_create(const char *host, const char *port,
+                                int connections, const cdbc_options_t *opts);
+
+/* Closes the connections; outstanding requests fail with CDBC_ERR_IO. */
+void cdbc_async_destroy(cdbc_async_t *async);
+
+/* A file descriptor that is readable whenever the loop has work to do. */
+int cdbc_async_fd(const cdbc_async_t *async);
+
+/*
+ * Turns the loop: sends what was submitted, waits up to timeout_ms (0: not
+ * at all, -1: forever) for responses and completes them. Returns the number
+ * of requests completed.
+ */
+int cdbc_async_run(cdbc_async_t *async, int timeout_ms);
+
+/* Requests submitted and not yet completed. */
+int cdbc_async_outstanding(const cdbc_async_t *async);
+
+/* Submit requests; they return CDBC_OK, or CDBC_ERR_ARG without calling fn. */
+int cdbc_async_get(cdbc_async_t *async, const char *key, cdbc_async_fn fn,
+                   void *arg);
+int cdbc_async_add(cdbc_async_t *async, const char *key, const char *value,
+                   cdbc_async_fn fn, void *arg);
+int cdbc_async_update(cdbc_async_t *async, const char *key,
+                      const char *value, cdbc_async_fn fn, void *arg);
+int cdbc_async_delete(cdbc_async_t *async, const char *key, cdbc_async_fn fn,
+                      void *arg);
+int cdbc_async_command(cdbc_async_t *async, const char *command,
+                       cdbc_async_fn fn, void *arg);
+
+#endif  // CDBC_H_
@@ -0,0 +1,544 @@
+#include <errno.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "./cdbc.h"
+#include "./cdbc_internal.h"
+
+#define ASYNC_RBUF (2 * CDBC_MAX_RESPONSE)
+#define ASYNC_EVENTS 64
+
+enum req_type { r_get, r_add, r_update, r_delete, r_command };
+
+/* A request, from submission until its callback. */
+typedef struct async_req {
+    enum req_type type;
+    cdbc_async_fn fn;
+    void *arg;
+    uint64_t sent_ms;  // when it was queued on a connection
+    struct async_req *next;
+    size_t len;
+    char line[];  // the command, newline included
+} async_req_t;
+
+typedef struct async_conn {
+    int fd;          // -1 while disconnected
+    int writing;     // whether EPOLLOUT is on
+    int connecting;  // until EPOLLOUT says whether connect worked
+    struct addrinfo *addr;  // the address it is connecting or connected to
+    uint64_t connect_ms;
+    async_req_t *oldest;  // sent or queued, awaiting responses in order
+    async_req_t *newest;
+    int inflight;
+    char *wbuf;
+    size_t wlen, wcap;
+    size_t rstart, rend;
+    char rbuf[ASYNC_RBUF];
+} async_conn_t;
+
+struct cdbc_async {
+    char *host;
+    char *port;
+    struct addrinfo *addrs;  // resolved once, so the loop never waits on it
+    cdbc_options_t opts;
+    int epfd;
+    int evfd;  // written when the submission queue stops being empty
+    int nconns;
+    async_conn_t *conns;
+    int outstanding;
+
+    pthread_mutex_t mutex;  // protects the submission queue
+    async_req_t *queue_head;
+    async_req_t *queue_tail;
+};
+
+static uint64_t now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + (uint64_t)ts.tv_nsec / 1000000;
+}
+
+//------------------------------------------------------------------------------------------------
+// Completions
+
+/* Calls a request's callback with the outcome of its response, and frees it. */
+static void complete(cdbc_async_t *a, async_req_t *req, int status,
+                     const char *response) {
+    if (response != NULL) {
+        switch (req->type) {
+            case r_get:
+                if ((status = cdbc_read_status(response)) != CDBC_OK)
+                    response = NULL;
+                break;
+            case r_add:
+                status = cdbc_write_status(response, "added");
+                response = NULL;
+                break;
+            case r_update:
+                status = cdbc_write_status(response, "updated");
+                response = NULL;
+                break;
+            case r_delete:
+                status = cdbc_write_status(response, "removed");
+                response = NULL;
+                break;
+            default:
+                status = CDBC_OK;
+                break;
+        }
+    }
+    if (req->fn != NULL)
+        req->fn(status, response, req->arg);
+    free(req);
+    __atomic_sub_fetch(&a->outstanding, 1, __ATOMIC_RELAXED);
+}
+
+/* Drops a connection, failing everything in flight on it with status. */
+static int conn_down(cdbc_async_t *a, async_conn_t *c, int status) {
+    int completed = 0;
+    if (c->fd >= 0) {
+        epoll_ctl(a->epfd, EPOLL_CTL_DEL, c->fd, NULL);
+        close(c->fd);
+        c->fd = -1;
+    }
+    c->writing = 0;
+    c->connecting = 0;
+    c->wlen = 0;
+    c->rstart = c->rend = 0;
+    while (c->oldest != NULL) {
+        async_req_t *req = c->oldest;
+        c->oldest = req->next;
+        complete(a, req, status, NULL);
+        completed++;
+    }
+    c->newest = NULL;
+    c->inflight = 0;
+    return completed;
+}
+
+/* Starts connecting c to the first of the addresses from ai on that it can. */
+static int conn_start(cdbc_async_t *a, async_conn_t *c, struct addrinfo *ai) {
+    struct epoll_event ev;
+    for (; ai != NULL && c->fd < 0; ai = ai->ai_next) {
+        c->fd = socket(ai->ai_family,
+                       ai->ai_socktype | SOCK_NONBLOCK | SOCK_CLOEXEC,
+                       ai->ai_protocol);
+        if (c->fd < 0)
+            continue;
+        if (connect(c->fd, ai->ai_addr, ai->ai_addrlen) < 0 &&
+            errno != EINPROGRESS) {
+            close(c->fd);
+            c->fd = -1;
+        } else {
+            c->addr = ai;
+        }
+    }
+    if (c->fd < 0)
+        return -1;
+    int one = 1;
+    setsockopt(c->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    ev.events = EPOLLIN | EPOLLOUT;
+    ev.data.ptr = c;
+    if (epoll_ctl(a->epfd, EPOLL_CTL_ADD, c->fd, &ev) < 0) {
+        close(c->fd);
+        c->fd = -1;
+        return -1;
+    }
+    c->writing = 1;  // nothing is written before it connects
+    c->connecting = 1;
+    return 0;
+}
+
+/*
+ * Starts connecting c without waiting for it: requests queue up meanwhile,
+ * and go out once EPOLLOUT shows the connection made. The connect timeout
+ * covers every address tried.
+ */
+static int conn_up(cdbc_async_t *a, async_conn_t *c) {
+    if (conn_start(a, c, a->addrs) < 0)
+        return -1;
+    c->connect_ms = now_ms();
+    return 0;
+}
+
+/*
+ * Finishes connecting c once it is writable or has failed; the queue then
+ * goes out. A connect that failed moves on to the next address, keeping the
+ * queue, and fails c only once there is none left.
+ */
+static int conn_connected(cdbc_async_t *a, async_conn_t *c) {
+    int err = 0;
+    socklen_t len = sizeof(err);
+    if (getsockopt(c->fd, SOL_SOCKET, SO_ERROR, &err, &len) < 0 || err != 0) {
+        epoll_ctl(a->epfd, EPOLL_CTL_DEL, c->fd, NULL);
+        close(c->fd);
+        c->fd = -1;
+        if (conn_start(a, c, c->addr->ai_next) == 0)
+            return 0;
+        return conn_down(a, c, CDBC_ERR_IO);
+    }
+    c->connecting = 0;
+    return 0;
+}
+
+//------------------------------------------------------------------------------------------------
+// Connections
+
+/* Writes what is queued on c, watching for writability if it does not fit. */
+static int conn_flush(cdbc_async_t *a, async_conn_t *c) {
+    size_t off = 0;
+    while (off < c->wlen) {
+        ssize_t n = send(c->fd, c->wbuf + off, c->wlen - off, MSG_NOSIGNAL);
+        if (n > 0) {
+            off += n;
+        } else if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            break;
+        } else if (n < 0 && errno == EINTR) {
+            continue;
+        } else {
+            return conn_down(a, c, CDBC_ERR_IO);
+        }
+    }
+    memmove(c->wbuf, c->wbuf + off, c->wlen - off);
+    c->wlen -= off;
+
+    int want = c->wlen > 0;
+    if (want != c->writing) {
+        struct epoll_event ev;
+        ev.events = EPOLLIN | (want ? EPOLLOUT : 0);
+        ev.data.ptr = c;
+        epoll_ctl(a->epfd, EPOLL_CTL_MOD, c->fd, &ev);
+        c->writing = want;
+    }
+    return 0;
+}
+
+/* Reads what has arrived on c and completes the requests it answers. */
+static int conn_read(cdbc_async_t *a, async_conn_t *c) {
+    int completed = 0;
+    while (c->fd >= 0) {
+        if (c->rend == ASYNC_RBUF) {
+            return completed + conn_down(a, c, CDBC_ERR_PROTOCOL);
+        }
+        ssize_t n = recv(c->fd, c->rbuf + c->rend, ASYNC_RBUF - c->rend, 0);
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            break;
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return completed + conn_down(a, c, CDBC_ERR_IO);
+        c->rend += n;
+
+        char *nl;
+        while ((nl = memchr(c->rbuf + c->rstart, '\n',
+                            c->rend - c->rstart)) != NULL) {
+            async_req_t *req = c->oldest;
+            if (req == NULL)
+                return completed + conn_down(a, c, CDBC_ERR_PROTOCOL);
+            *nl = '\0';
+            if ((c->oldest = req->next) == NULL)
+                c->newest = NULL;
+            c->inflight--;
+            complete(a, req, CDBC_OK, c->rbuf + c->rstart);
+            completed++;
+            c->rstart = nl + 1 - c->rbuf;
+        }
+        memmove(c->rbuf, c->rbuf + c->rstart, c->rend - c->rstart);
+        c->rend -= c->rstart;
+        c->rstart = 0;
+    }
+    return completed;
+}
+
+/* Queues req on the connection with the fewest requests in flight. */
+static int assign(cdbc_async_t *a, async_req_t *req) {
+    async_conn_t *c = NULL;
+    for (int i = 0; i < a->nconns; i++) {
+        async_conn_t *candidate = &a->conns[i];
+        if (c == NULL || (candidate->fd >= 0 && c->fd < 0) ||
+            ((candidate->fd >= 0) == (c->fd >= 0) &&
+             candidate->inflight < c->inflight)) {
+            c = candidate;
+        }
+    }
+    if (c->fd < 0 && conn_up(a, c) < 0) {
+        complete(a, req, CDBC_ERR_IO, NULL);
+        return 1;
+    }
+    if (c->wlen + req->len > c->wcap) {
+        size_t cap = c->wcap > 0 ? c->wcap : CDBC_MAX_LINE;
+        while (cap < c->wlen + req->len)
+            cap *= 2;
+        char *wbuf = realloc(c->wbuf, cap);
+        if (wbuf == NULL) {
+            complete(a, req, CDBC_ERR_IO, NULL);
+            return 1;
+        }
+        c->wbuf = wbuf;
+        c->wcap = cap;
+    }
+    memcpy(c->wbuf + c->wlen, req->line, req->len);
+    c->wlen += req->len;
+    req->sent_ms = now_ms();
+    req->next = NULL;
+    if (c->newest != NULL)
+        c->newest->next = req;
+    else
+        c->oldest = req;
+    c->newest = req;
+    c->inflight++;
+    return 0;
+}
+
+/*
+ * Moves everything submitted onto the connections and writes it out, one
+ * write per connection for the whole lot.
+ */
+static int drain(cdbc_async_t *a) {
+    uint64_t count;
+    int completed = 0;
+
+    // Reset the eventfd before taking the queue, so a submission racing
+    // with this one writes it again and is not missed
+    if (read(a->evfd, &count, sizeof(count)) < 0 && errno != EAGAIN)
+        perror("read");
+    pthread_mutex_lock(&a->mutex);
+    async_req_t *req = a->queue_head;
+    a->queue_head = a->queue_tail = NULL;
+    pthread_mutex_unlock(&a->mutex);
+
+    while (req != NULL) {
+        async_req_t *next = req->next;
+        completed += assign(a, req);
+        req = next;
+    }
+    for (int i = 0; i < a->nconns; i++) {
+        async_conn_t *c = &a->conns[i];
+        if (c->fd >= 0 && c->wlen > 0 && !c->writing)
+            completed += conn_flush(a, c);
+    }
+    return completed;
+}
+
+/*
+ * Fails the connections that have taken too long to connect, or whose
+ * oldest request has waited too long.
+ */
+static int expire(cdbc_async_t *a) {
+    int completed = 0;
+    uint64_t now = now_ms();
+    for (int i = 0; i < a->nconns; i++) {
+        async_conn_t *c = &a->conns[i];
+        if (c->connecting && a->opts.connect_timeout_ms > 0 &&
+            now - c->connect_ms > (uint64_t)a->opts.connect_timeout_ms) {
+            completed += conn_down(a, c, CDBC_ERR_TIMEOUT);
+        } else if (!c->connecting && c->oldest != NULL &&
+                   a->opts.io_timeout_ms > 0 &&
+                   now - c->oldest->sent_ms >
+                       (uint64_t)a->opts.io_timeout_ms) {
+            completed += conn_down(a, c, CDBC_ERR_TIMEOUT);
+        }
+    }
+    return completed;
+}
+
+//------------------------------------------------------------------------------------------------
+// Interface
+
+cdbc_async_t *cdbc_async_create(const char *host, const char *port,
+                                int connections, const cdbc_options_t *opts) {
+    cdbc_async_t *a;
+    struct epoll_event ev;
+    if (connections < 1 || (a = calloc(1, sizeof(cdbc_async_t))) == NULL)
+        return NULL;
+    struct addrinfo hints;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    a->epfd = a->evfd = -1;
+    if (getaddrinfo(host, port, &hints, &a->addrs) != 0)
+        a->addrs = NULL;
+    if (a->addrs == NULL || (a->host = strdup(host)) == NULL ||
+        (a->port = strdup(port)) == NULL ||
+        (a->conns = calloc(connections, sizeof(async_conn_t))) == NULL ||
+        (a->epfd = epoll_create1(EPOLL_CLOEXEC)) < 0 ||
+        (a->evfd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0) {
+        goto fail;
+    }
+    ev.events = EPOLLIN;
+    ev.data.ptr = NULL;  // the eventfd; connections have their own
+    if (epoll_ctl(a->epfd, EPOLL_CTL_ADD, a->evfd, &ev) < 0)
+        goto fail;
+
+    if (opts != NULL)
+        a->opts = *opts;
+    else
+        cdbc_options_default(&a->opts);
+    a->nconns = connections;
+    for (int i = 0; i < connections; i++) {
+        a->conns[i].fd = -1;
+        conn_up(a, &a->conns[i]);  // or on first use
+    }
+    pthread_mutex_init(&a->mutex, NULL);
+    return a;
+
+fail:
+    if (a->epfd >= 0)
+        close(a->epfd);
+    if (a->evfd >= 0)
+        close(a->evfd);
+    if (a->addrs != NULL)
+        freeaddrinfo(a->addrs);
+    free(a->conns);
+    free(a->host);
+    free(a->port);
+    free(a);
+    return NULL;
+}
+
+void cdbc_async_destroy(cdbc_async_t *a) {
+    if (a == NULL)
+        return;
+    pthread_mutex_lock(&a->mutex);
+    async_req_t *req = a->queue_head;
+    a->queue_head = a->queue_tail = NULL;
+    pthread_mutex_unlock(&a->mutex);
+    while (req != NULL) {
+        async_req_t *next = req->next;
+        complete(a, req, CDBC_ERR_IO, NULL);
+        req = next;
+    }
+    for (int i = 0; i < a->nconns; i++) {
+        conn_down(a, &a->conns[i], CDBC_ERR_IO);
+        free(a->conns[i].wbuf);
+    }
+    pthread_mutex_destroy(&a->mutex);
+    close(a->epfd);
+    close(a->evfd);
+    freeaddrinfo(a->addrs);
+    free(a->conns);
+    free(a->host);
+    free(a->port);
+    free(a);
+}
+
+int cdbc_async_fd(const cdbc_async_t *a) { return a->epfd; }
+
+int cdbc_async_outstanding(const cdbc_async_t *a) {
+    return __atomic_load_n(&a->outstanding, __ATOMIC_RELAXED);
+}
+
+int cdbc_async_run(cdbc_async_t *a, int timeout_ms) {
+    struct epoll_event events[ASYNC_EVENTS];
+    int completed = drain(a);
+
+    int n = epoll_wait(a->epfd, events, ASYNC_EVENTS, timeout_ms);
+    for (int i = 0; i < n; i++) {
+        async_conn_t *c = events[i].data.ptr;
+        if (c == NULL) {
+            completed += drain(a);
+            continue;
+        }
+        if (c->fd < 0)
+            continue;
+        // A failed connect shows as an error, not as something to read
+        if (c->connecting &&
+            (events[i].events & (EPOLLOUT | EPOLLERR | EPOLLHUP)))
+            completed += conn_connected(a, c);
+        if (c->fd >= 0 && !c->connecting &&
+            (events[i].events & (EPOLLIN | EPOLLERR | EPOLLHUP)))
+            completed += conn_read(a, c);
+        if (c->fd >= 0 && !c->connecting && (events[i].events & EPOLLOUT))
+            completed += conn_flush(a, c);
+    }
+    return completed + expire(a);
+}
+
+/* Queues a request for the loop, waking it if it may be waiting. */
+static int submit(cdbc_async_t *a, enum req_type type, const char *line,
+                  cdbc_async_fn fn, void *arg) {
+    size_t len = strlen(line);
+    if (len + 1 > CDBC_MAX_LINE - 1 || memchr(line, '\n', len) != NULL)
+        return CDBC_ERR_ARG;
+    async_req_t *req = malloc(sizeof(async_req_t) + len + 1);
+    if (req == NULL)
+        return CDBC_ERR_IO;
+    req->type = type;
+    req->fn = fn;
+    req->arg = arg;
+    req->next = NULL;
+    req->len = len + 1;
+    memcpy(req->line, line, len);
+    req->line[len] = '\n';
+    __atomic_add_fetch(&a->outstanding, 1, __ATOMIC_RELAXED);
+
+    pthread_mutex_lock(&a->mutex);
+    int was_empty = a->queue_head == NULL;
+    if (a->queue_tail != NULL)
+        a->queue_tail->next = req;
+    else
+        a->queue_head = req;
+    a->queue_tail = req;
+    pthread_mutex_unlock(&a->mutex);
+
+    // One wake-up covers everything submitted until the loop drains
+    if (was_empty) {
+        uint64_t one = 1;
+        if (write(a->evfd, &one, sizeof(one)) < 0)
+            perror("write");
+    }
+    return CDBC_OK;
+}
+
+int cdbc_async_get(cdbc_async_t *a, const char *key, cdbc_async_fn fn,
+                   void *arg) {
+    char line[CDBC_MAX_LINE];
+    if (!cdbc_valid_word(key))
+        return CDBC_ERR_ARG;
+    snprintf(line, sizeof(line), "q %s", key);
+    return submit(a, r_get, line, fn, arg);
+}
+
+static int submit_write(cdbc_async_t *a, enum req_type type, char cmd,
+                        const char *key, const char *value, cdbc_async_fn fn,
+                        void *arg) {
+    char line[CDBC_MAX_LINE];
+    if (!cdbc_valid_word(key) || (value != NULL && !cdbc_valid_word(value)))
+        return CDBC_ERR_ARG;
+    if (value != NULL)
+        snprintf(line, sizeof(line), "%c %s %s", cmd, key, value);
+    else
+        snprintf(line, sizeof(line), "%c %s", cmd, key);
+    return submit(a, type, line, fn, arg);
+}
+
+int cdbc_async_add(cdbc_async_t *a, const char *key, const char *value,
+                   cdbc_async_fn fn, void *arg) {
+    return submit_write(a, r_add, 'a', key, value, fn, arg);
+}
+
+int cdbc_async_update(cdbc_async_t *a, const char *key, const char *value,
+                      cdbc_async_fn fn, void *arg) {
+    return submit_write(a, r_update, 'u', key, value, fn, arg);
+}
+
+int cdbc_async_delete(cdbc_async_t *a, const char *key, cdbc_async_fn fn,
+                      void *arg) {
+    return submit_write(a, r_delete, 'd', key, NULL, fn, arg);
+}
+
+int cdbc_async_command(cdbc_async_t *a, const char *command, cdbc_async_fn fn,
+                       void *arg) {
+    return submit(a, r_command, command, fn, arg);
+}
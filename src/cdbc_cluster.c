@@ -0,0 +1,396 @@
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "./cdbc.h"
+#include "./cdbc_internal.h"
+#include "./ring.h"
+#include "./scan_merge.h"
+
+typedef struct cluster_server {
+    char *name;  // host:port, which places it on the ring
+    char *host;
+    char *port;
+    cdbc_pool_t *pool;
+} cluster_server_t;
+
+struct cdbc_cluster {
+    pthread_rwlock_t lock;  // read by calls, written by topology changes
+    cluster_server_t *servers;
+    int nservers;
+    ring_t ring;
+    int pool_size;
+    cdbc_options_t opts;
+};
+
+/* The pairs returned by the servers' scans, kept for merging. */
+typedef struct scan_pairs {
+    scan_pair_t *pairs;
+    int count;
+    int cap;
+} scan_pairs_t;
+
+//------------------------------------------------------------------------------------------------
+// Topology
+
+static void server_free(cluster_server_t *s) {
+    cdbc_pool_destroy(s->pool);
+    free(s->name);
+    free(s->host);
+    free(s->port);
+}
+
+/* Rebuilds the ring after the servers change. Called with the lock held. */
+static int rebuild(cdbc_cluster_t *cl) {
+    const char *names[cl->nservers > 0 ? cl->nservers : 1];
+    ring_t ring;
+    for (int i = 0; i < cl->nservers; i++) {
+        names[i] = cl->servers[i].name;
+    }
+    if (ring_build(&ring, names, cl->nservers) < 0)
+        return CDBC_ERR_IO;
+    ring_free(&cl->ring);
+    cl->ring = ring;
+    return CDBC_OK;
+}
+
+static int find_server(const cdbc_cluster_t *cl, const char *name) {
+    for (int i = 0; i < cl->nservers; i++) {
+        if (strcmp(cl->servers[i].name, name) == 0)
+            return i;
+    }
+    return -1;
+}
+
+/* Appends host:port to the servers, without touching the ring. */
+static int push_server(cdbc_cluster_t *cl, const char *server) {
+    const char *colon = strrchr(server, ':');
+    if (colon == NULL || colon == server || colon[1] == '\0' ||
+        find_server(cl, server) >= 0) {
+        return CDBC_ERR_ARG;
+    }
+    cluster_server_t *servers =
+        realloc(cl->servers, (cl->nservers + 1) * sizeof(cluster_server_t));
+    if (servers == NULL)
+        return CDBC_ERR_IO;
+    cl->servers = servers;
+
+    cluster_server_t *s = &cl->servers[cl->nservers];
+    memset(s, 0, sizeof(*s));
+    if ((s->name = strdup(server)) == NULL ||
+        (s->host = strndup(server, colon - server)) == NULL ||
+        (s->port = strdup(colon + 1)) == NULL ||
+        (s->pool = cdbc_pool_create(s->host, s->port, cl->pool_size,
+                                    &cl->opts)) == NULL) {
+        server_free(s);
+        return CDBC_ERR_IO;
+    }
+    cl->nservers++;
+    return CDBC_OK;
+}
+
+cdbc_cluster_t *cdbc_cluster_create(const char *servers, int pool_size,
+                                    const cdbc_options_t *opts) {
+    cdbc_cluster_t *cl;
+    char *list, *save, *server;
+    if (pool_size < 1 || (cl = calloc(1, sizeof(cdbc_cluster_t))) == NULL)
+        return NULL;
+    if (opts != NULL)
+        cl->opts = *opts;
+    else
+        cdbc_options_default(&cl->opts);
+    cl->pool_size = pool_size;
+    pthread_rwlock_init(&cl->lock, NULL);
+
+    if ((list = strdup(servers)) == NULL) {
+        cdbc_cluster_destroy(cl);
+        return NULL;
+    }
+    for (server = strtok_r(list, ",", &save); server != NULL;
+         server = strtok_r(NULL, ",", &save)) {
+        if (push_server(cl, server) != CDBC_OK) {
+            free(list);
+            cdbc_cluster_destroy(cl);
+            return NULL;
+        }
+    }
+    free(list);
+    if (cl->nservers == 0 || rebuild(cl) != CDBC_OK) {
+        cdbc_cluster_destroy(cl);
+        return NULL;
+    }
+    return cl;
+}
+
+void cdbc_cluster_destroy(cdbc_cluster_t *cl) {
+    if (cl == NULL)
+        return;
+    for (int i = 0; i < cl->nservers; i++) {
+        server_free(&cl->servers[i]);
+    }
+    free(cl->servers);
+    ring_free(&cl->ring);
+    pthread_rwlock_destroy(&cl->lock);
+    free(cl);
+}
+
+int cdbc_cluster_add_server(cdbc_cluster_t *cl, const char *server) {
+    int err;
+    pthread_rwlock_wrlock(&cl->lock);
+    if ((err = push_server(cl, server)) == CDBC_OK &&
+        (err = rebuild(cl)) != CDBC_OK) {
+        server_free(&cl->servers[--cl->nservers]);
+    }
+    pthread_rwlock_unlock(&cl->lock);
+    return err;
+}
+
+int cdbc_cluster_remove_server(cdbc_cluster_t *cl, const char *server) {
+    int i, err = CDBC_ERR_ARG;
+    pthread_rwlock_wrlock(&cl->lock);
+    if ((i = find_server(cl, server)) >= 0) {
+        // No call holds one of its connections while the lock is ours
+        server_free(&cl->servers[i]);
+        memmove(&cl->servers[i], &cl->servers[i + 1],
+                (cl->nservers - i - 1) * sizeof(cluster_server_t));
+        cl->nservers--;
+        err = rebuild(cl);
+    }
+    pthread_rwlock_unlock(&cl->lock);
+    return err;
+}
+
+int cdbc_cluster_size(cdbc_cluster_t *cl) {
+    pthread_rwlock_rdlock(&cl->lock);
+    int n = cl->nservers;
+    pthread_rwlock_unlock(&cl->lock);
+    return n;
+}
+
+//------------------------------------------------------------------------------------------------
+// Single-key calls
+
+/*
+ * Takes the read lock and a connection to the server key belongs to; NULL
+ * (and the lock released) if there is none.
+ */
+static cdbc_conn_t *acquire(cdbc_cluster_t *cl, const char *key,
+                            cdbc_pool_t **pool) {
+    cdbc_conn_t *conn = NULL;
+    pthread_rwlock_rdlock(&cl->lock);
+    if (cl->nservers > 0) {
+        int i = ring_lookup(&cl->ring, key, strlen(key));
+        *pool = cl->servers[i].pool;
+        conn = cdbc_pool_acquire(*pool);
+    }
+    if (conn == NULL)
+        pthread_rwlock_unlock(&cl->lock);
+    return conn;
+}
+
+static void release(cdbc_cluster_t *cl, cdbc_pool_t *pool,
+                    cdbc_conn_t *conn) {
+    cdbc_pool_release(pool, conn);
+    pthread_rwlock_unlock(&cl->lock);
+}
+
+int cdbc_cluster_locate(cdbc_cluster_t *cl, const char *key, char *server,
+                        size_t cap) {
+    int err = CDBC_ERR_IO;
+    if (!cdbc_valid_word(key) || cap == 0)
+        return CDBC_ERR_ARG;
+    pthread_rwlock_rdlock(&cl->lock);
+    if (cl->nservers > 0) {
+        int i = ring_lookup(&cl->ring, key, strlen(key));
+        strncpy(server, cl->servers[i].name, cap - 1);
+        server[cap - 1] = '\0';
+        err = CDBC_OK;
+    }
+    pthread_rwlock_unlock(&cl->lock);
+    return err;
+}
+
+int cdbc_cluster_get(cdbc_cluster_t *cl, const char *key, char *value,
+                     size_t cap) {
+    cdbc_pool_t *pool;
+    cdbc_conn_t *conn;
+    if (!cdbc_valid_word(key))
+        return CDBC_ERR_ARG;
+    if ((conn = acquire(cl, key, &pool)) == NULL)
+        return CDBC_ERR_IO;
+    int err = cdbc_get(conn, key, value, cap);
+    release(cl, pool, conn);
+    return err;
+}
+
+int cdbc_cluster_add(cdbc_cluster_t *cl, const char *key, const char *value) {
+    cdbc_pool_t *pool;
+    cdbc_conn_t *conn;
+    if (!cdbc_valid_word(key))
+        return CDBC_ERR_ARG;
+    if ((conn = acquire(cl, key, &pool)) == NULL)
+        return CDBC_ERR_IO;
+    int err = cdbc_add(conn, key, value);
+    release(cl, pool, conn);
+    return err;
+}
+
+int cdbc_cluster_update(cdbc_cluster_t *cl, const char *key,
+                        const char *value) {
+    cdbc_pool_t *pool;
+    cdbc_conn_t *conn;
+    if (!cdbc_valid_word(key))
+        return CDBC_ERR_ARG;
+    if ((conn = acquire(cl, key, &pool)) == NULL)
+        return CDBC_ERR_IO;
+    int err = cdbc_update(conn, key, value);
+    release(cl, pool, conn);
+    return err;
+}
+
+int cdbc_cluster_put(cdbc_cluster_t *cl, const char *key, const char *value) {
+    cdbc_pool_t *pool;
+    cdbc_conn_t *conn;
+    if (!cdbc_valid_word(key))
+        return CDBC_ERR_ARG;
+    if ((conn = acquire(cl, key, &pool)) == NULL)
+        return CDBC_ERR_IO;
+    int err = cdbc_put(conn, key, value);
+    release(cl, pool, conn);
+    return err;
+}
+
+int cdbc_cluster_delete(cdbc_cluster_t *cl, const char *key) {
+    cdbc_pool_t *pool;
+    cdbc_conn_t *conn;
+    if (!cdbc_valid_word(key))
+        return CDBC_ERR_ARG;
+    if ((conn = acquire(cl, key, &pool)) == NULL)
+        return CDBC_ERR_IO;
+    int err = cdbc_delete(conn, key);
+    release(cl, pool, conn);
+    return err;
+}
+
+//------------------------------------------------------------------------------------------------
+// Scans and batches
+
+static int collect_pair(const char *key, const char *value, void *arg) {
+    scan_pairs_t *p = (scan_pairs_t *)arg;
+    if (p->count == p->cap) {
+        int cap = p->cap > 0 ? 2 * p->cap : 64;
+        scan_pair_t *pairs = realloc(p->pairs, cap * sizeof(scan_pair_t));
+        if (pairs == NULL)
+            return 1;
+        p->pairs = pairs;
+        p->cap = cap;
+    }
+    scan_pair_t *pair = &p->pairs[p->count];
+    if ((pair->key = strdup(key)) == NULL)
+        return 1;
+    if ((pair->value = strdup(value)) == NULL) {
+        free(pair->key);
+        return 1;
+    }
+    p->count++;
+    return 0;
+}
+
+int cdbc_cluster_scan(cdbc_cluster_t *cl, const char *start, int count,
+                      cdbc_scan_fn fn, void *arg) {
+    scan_pairs_t p = {NULL, 0, 0};
+    int err = CDBC_OK, delivered = 0;
+    const char *cutoff = NULL;
+    if (!cdbc_valid_word(start) || count < 0)
+        return CDBC_ERR_ARG;
+
+    // Every server may hold any of the first count keys from start
+    pthread_rwlock_rdlock(&cl->lock);
+    for (int i = 0; i < cl->nservers && err >= 0; i++) {
+        cdbc_conn_t *conn = cdbc_pool_acquire(cl->servers[i].pool);
+        if (conn == NULL) {
+            err = CDBC_ERR_IO;
+            break;
+        }
+        int first = p.count;
+        err = cdbc_scan(conn, start, count, collect_pair, &p);
+        cdbc_pool_release(cl->servers[i].pool, conn);
+        if (err > p.count - first)
+            err = CDBC_ERR_IO;  // out of memory for its pairs
+        if (err > 0)
+            scan_merge_bound(&cutoff, &p.pairs[first], p.count - first,
+                             count);
+    }
+    pthread_rwlock_unlock(&cl->lock);
+
+    if (err >= 0) {
+        int merged = scan_merge(p.pairs, p.count, cutoff, count);
+        while (delivered < merged) {
+            scan_pair_t *pair = &p.pairs[delivered++];
+            if (fn != NULL && fn(pair->key, pair->value, arg))
+                break;
+        }
+    }
+    for (int i = 0; i < p.count; i++) {
+        free(p.pairs[i].key);
+        free(p.pairs[i].value);
+    }
+    free(p.pairs);
+    return err >= 0 ? delivered : err;
+}
+
+int cdbc_cluster_batch_exec(cdbc_cluster_t *cl, cdbc_batch_t *batch) {
+    int n = cdbc_batch_size(batch);
+    int result = CDBC_OK;
+    if (n == 0)
+        return CDBC_OK;
+    pthread_rwlock_rdlock(&cl->lock);
+    int nservers = cl->nservers;
+    cdbc_batch_t **parts = calloc(nservers, sizeof(cdbc_batch_t *));
+    int *server = malloc(n * sizeof(int));
+    int *index = malloc(n * sizeof(int));  // in its server's part
+    if (nservers == 0 || parts == NULL || server == NULL || index == NULL) {
+        result = CDBC_ERR_IO;
+        goto done;
+    }
+
+    for (int i = 0; i < n; i++) {
+        const char *key = cdbc_batch_key(batch, i);
+        int s = server[i] = ring_lookup(&cl->ring, key, strlen(key));
+        if (parts[s] == NULL && (parts[s] = cdbc_batch_create()) == NULL) {
+            result = CDBC_ERR_IO;
+            goto done;
+        }
+        if ((index[i] = cdbc_batch_take(parts[s], batch, i)) < 0) {
+            result = index[i];
+            goto done;
+        }
+    }
+
+    // Each server's part is pipelined on one of its connections
+    for (int s = 0; s < nservers; s++) {
+        if (parts[s] == NULL)
+            continue;
+        cdbc_conn_t *conn = cdbc_pool_acquire(cl->servers[s].pool);
+        int err = conn != NULL ? cdbc_batch_exec(conn, parts[s]) : CDBC_ERR_IO;
+        if (conn != NULL)
+            cdbc_pool_release(cl->servers[s].pool, conn);
+        if (err != CDBC_OK && result == CDBC_OK)
+            result = err;
+        for (int i = 0; i < n; i++) {
+            if (server[i] == s)
+                cdbc_batch_settle(batch, i, err == CDBC_OK ? parts[s] : NULL,
+                                  index[i], err);
+        }
+    }
+
+done:
+    pthread_rwlock_unlock(&cl->lock);
+    for (int s = 0; parts != NULL && s < nservers; s++) {
+        cdbc_batch_free(parts[s]);
+    }
+    free(parts);
+    free(server);
+    free(index);
+    return result;
+}
@@ -0,0 +1,40 @@
+#ifndef CDBC_INTERNAL_H_
+#define CDBC_INTERNAL_H_
+
+#include "./cdbc.h"
+
+/*
+ * Helpers shared by the parts of the client library: blocking calls
+ * (cdbc.c), asynchronous ones (cdbc_async.c) and clusters (cdbc_cluster.c).
+ * Not part of its interface.
+ */
+
+/*
+ * Connects to host:port within timeout_ms (0: as long as connect takes).
+ * Returns a non-blocking socket with TCP_NODELAY set, or -1.
+ */
+int cdbc_dial(const char *host, const char *port, int timeout_ms);
+
+/* Keys and values are single words that fit in the server's buffers. */
+int cdbc_valid_word(const char *s);
+
+/* Maps a query's response onto CDBC_OK (a value) or a status. */
+int cdbc_read_status(const char *response);
+
+/* Maps a write's response onto a status; ok is its success response. */
+int cdbc_write_status(const char *response, const char *ok);
+
+/* The key of operation i of a batch. */
+const char *cdbc_batch_key(const cdbc_batch_t *batch, int i);
+
+/* Appends a copy of operation i of src to dst; returns its index in dst. */
+int cdbc_batch_take(cdbc_batch_t *dst, const cdbc_batch_t *src, int i);
+
+/*
+ * Sets the outcome of operation i of dst: that of operation j of src, which
+ * was taken from it, or status if src is NULL.
+ */
+void cdbc_batch_settle(cdbc_batch_t *dst, int i, const cdbc_batch_t *src,
+                       int j, int status);
+
+#endif  // CDBC_INTERNAL_H_
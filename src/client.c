@@ -1,61 +1,11 @@
-#include <arpa/inet.h>
-#include <fcntl.h>
-#include <netdb.h>
-#include <netinet/in.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <sys/socket.h>
-#include <sys/stat.h>
 #include <sys/types.h>
-#include <sys/uio.h>
 #include <sys/wait.h>
 #include <unistd.h>
 
-#define BUFSIZE 1024
-
-/*
- * Helper that opens a TCP socket representing the server.
- * Returns the file descriptor on success, -1 on failure.
- */
-int get_socket(const char *server, const char *port) {
-    // setup for getaddrinfo
-    int sock;
-    struct addrinfo hints;
-    struct addrinfo *result;
-
-    memset(&hints, 0, sizeof(hints));
-    hints.ai_family = AF_UNSPEC;
-    hints.ai_socktype = SOCK_STREAM;
-
-    int err;
-    if ((err = getaddrinfo(server, port, &hints, &result)) != 0) {
-        fprintf(stderr, "Error in getaddrinfo: %s\n", gai_strerror(err));
-        return -1;
-    }
-
-    // find the right interface
-    struct addrinfo *res;
-    for (res = result; res != NULL; res = res->ai_next) {
-        if ((sock = socket(res->ai_family, res->ai_socktype,
-                           res->ai_protocol)) < 0) {
-            continue;
-        }
-        if (connect(sock, res->ai_addr, res->ai_addrlen) >= 0) {
-            break;
-        }
-        close(sock);
-    }
-
-    freeaddrinfo(result);
-
-    if (res == NULL) {
-        fprintf(stderr, "Failed to connect to '%s'!\n", server);
-        return -1;
-    }
-
-    return sock;
-}
+#include "./cdbc.h"
 
 /*
  * Forks off a process that attempts to connect to the server, and then run the
@@ -80,41 +30,47 @@ pid_t create_occurence(const char *server, const char *port,
         }
 
         // Step 3: set up a new connection to the server
-        int sock;
-        if ((sock = get_socket(server, port)) == -1) {
+        cdbc_conn_t *conn;
+        if ((conn = cdbc_connect(server, port, NULL)) == NULL) {
+            perror("cdbc_connect");
+            exit(1);
+        }
+        if (!cdbc_connected(conn)) {
+            fprintf(stderr, "Failed to connect to '%s'!\n", server);
             exit(1);
         }
 
         // Step 4: loop, sending queries and printing responses
-        FILE *cxn = fdopen(sock, "w+");
-        char rbuf[BUFSIZE], qbuf[BUFSIZE];
-        rbuf[0] = '\0';
+        char qbuf[CDBC_MAX_LINE];
+        char *rbuf = malloc(CDBC_MAX_RESPONSE);
+        if (rbuf == NULL) {
+            perror("malloc");
+            exit(1);
+        }
 
         while (1) {
             // if there are no more commands, so we can clean up and exit
             if (fgets(qbuf, sizeof(qbuf), infile) == NULL) {
-                qbuf[0] = EOF;
-                fputs(qbuf, cxn);
-                fflush(cxn);
-                fclose(cxn);
+                cdbc_close(conn);
                 fclose(infile);
+                free(rbuf);
                 printf("Client terminated cleanly.\n");
                 exit(0);
-            } else {
-                // otherwise, send the command
-                if (fputs(qbuf, cxn) == EOF) {
-                    fprintf(stderr, "No connection!\n");
-                    exit(1);
-                }
-                fflush(cxn);
             }
 
-            // wait for the response and print it
-            if (fgets(rbuf, BUFSIZE, cxn) == NULL) {
-                fprintf(stderr, "Connection terminated.\n");
+            // otherwise, send the command and print the response
+            qbuf[strcspn(qbuf, "\n")] = '\0';
+            int err = cdbc_command(conn, qbuf, rbuf, CDBC_MAX_RESPONSE);
+            if (err == CDBC_ERR_ARG) {
+                fprintf(stderr, "Command too long: %.40s...\n", qbuf);
+                continue;
+            }
+            if (err != CDBC_OK) {
+                fprintf(stderr, "Connection terminated: %s.\n",
+                        cdbc_strerror(err));
                 exit(1);
             }
-            printf("%s", rbuf);
+            printf("%s\n", rbuf);
         }
     }
 
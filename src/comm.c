@@ -1,5 +1,6 @@
 #include "./comm.h"
 #include <arpa/inet.h>
+#include <errno.h>
 #include <netinet/in.h>
 #include <pthread.h>
 #include <stdio.h>
@@ -10,6 +11,10 @@
 #include <sys/uio.h>
 #include <unistd.h>
 
+#include "./probes.h"
+#include "./trace.h"
+#include "./tracking.h"
+
 /* Serverside I/O functions */
 
 int lsock;
@@ -38,6 +43,11 @@ void *listener(void (*server)(FILE *)) {
         perror("socket");
         exit(1);
     }
+    // A restarted server can take its port back while old connections wait
+    // out TIME_WAIT, so reconnecting clients find it again
+    int one = 1;
+    if (setsockopt(lsock, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one)) < 0)
+        perror("setsockopt");
 
     struct sockaddr_in addr;
     memset(&addr, 0, sizeof(addr));
@@ -74,6 +84,7 @@ void *listener(void (*server)(FILE *)) {
 
         fprintf(stderr, "received connection from %s#%hu\n",
                 inet_ntoa(client_addr.sin_addr), client_addr.sin_port);
+        PROBE2(conn__accept, csock, inet_ntoa(client_addr.sin_addr));
 
         FILE *cxstr;
         if (!(cxstr = fdopen(csock, "w+"))) {
@@ -90,18 +101,59 @@ void *listener(void (*server)(FILE *)) {
 }
 
 void comm_shutdown(FILE *cxstr) {
+    PROBE1(conn__close, fileno(cxstr));
     if (fclose(cxstr) < 0)
         perror("fclose");
 }
 
+/*
+ * Writes a response line straight to the socket. Responses bypass stdio
+ * because a stdio stream cannot switch from reading to writing while it holds
+ * buffered input, which is exactly the state a pipelining client leaves it in.
+ */
+static int comm_write_line(FILE *cxstr, const char *response, size_t len) {
+    struct iovec iov[2];
+    iov[0].iov_base = (void *)response;
+    iov[0].iov_len = len;
+    iov[1].iov_base = "\n";
+    iov[1].iov_len = 1;
+
+    int iovcnt = 2;
+    struct iovec *cur = iov;
+    while (iovcnt > 0) {
+        ssize_t n = writev(fileno(cxstr), cur, iovcnt);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0)
+            return -1;
+        while (iovcnt > 0 && (size_t)n >= cur->iov_len) {
+            n -= cur->iov_len;
+            cur++;
+            iovcnt--;
+        }
+        if (iovcnt > 0) {
+            cur->iov_base = (char *)cur->iov_base + n;
+            cur->iov_len -= n;
+        }
+    }
+    return 0;
+}
+
 int comm_serve(FILE *cxstr, char *response, char *command) {
-    if (strlen(response) > 0) {
-        if (fputs(response, cxstr) == EOF || fputc('\n', cxstr) == EOF ||
-            fflush(cxstr) == EOF) {
+    size_t len = strlen(response);
+    if (len > 0) {
+        uint64_t span = TRACE_BEGIN();
+        tracking_write_begin();
+        int err = comm_write_line(cxstr, response, len);
+        tracking_write_end();
+        if (err < 0) {
             fprintf(stderr, "client connection terminated\n");
             return -1;
         }
+        TRACE_END("flush", span);
     }
+    // The request ends once its response is on the wire
+    trace_request_end();
 
     if (fgets(command, BUFLEN, cxstr) == NULL) {
         fprintf(stderr, "client connection terminated\n");
@@ -5,7 +5,7 @@
 #include <pthread.h>
 #include <stdio.h>
 
-#define BUFLEN 256
+#define BUFLEN 1024  // longest command line a client may send
 #define handle_error_en(en, msg) \
     do {                         \
         errno = en;              \
@@ -0,0 +1,475 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "./comm.h"
+#include "./hist.h"
+
+/*
+ * Connection-storm benchmark for the server's accept path. Worker threads
+ * open connections on an open-loop schedule at the target rate, optionally
+ * send one command on each and wait for its response, then close them. The
+ * connect latency and the time from starting to connect until the first
+ * response line (through listener, client_constructor and run_client) are
+ * recorded per connection.
+ *
+ * With -p, the server process's thread count and resident memory are
+ * sampled from /proc during the storm. With -s, the rate doubles from -b up
+ * to -r, one step per -d seconds, and the highest rate that was sustained
+ * (95% achieved, no failures) is reported.
+ *
+ * Connections are closed with an RST by default, so that the client does
+ * not run out of ports to TIME_WAIT at high rates; -g closes them normally.
+ */
+
+#define CONNECT_TIMEOUT_NS 5000000000ull
+#define SAMPLE_INTERVAL_US 50000
+#define SUSTAINED_FRACTION 0.95
+
+typedef struct storm_config {
+    const char *server;
+    const char *port;
+    int threads;
+    double rate;       // connections per second, all threads
+    double duration;   // seconds per step
+    const char *command;  // sent on every connection, if set
+    int graceful;
+    pid_t server_pid;
+    struct sockaddr_storage addr;
+    socklen_t addrlen;
+} storm_config_t;
+
+enum conn_state { cs_connecting, cs_waiting };
+
+typedef struct storm_conn {
+    int fd;
+    enum conn_state state;
+    uint64_t start;
+    struct storm_conn *prev;  // in order of start, for timeouts
+    struct storm_conn *next;
+} storm_conn_t;
+
+typedef struct storm_thread {
+    pthread_t thread;
+    const storm_config_t *config;
+    double rate;
+    storm_conn_t *oldest;
+    storm_conn_t *newest;
+    hist_t connect;
+    hist_t first_response;
+    uint64_t started;
+    uint64_t completed;
+    uint64_t failed;
+} storm_thread_t;
+
+/* Server process statistics, sampled during a step. */
+typedef struct server_stats {
+    pthread_t thread;
+    pid_t pid;
+    volatile int running;
+    long threads_max;
+    long threads_last;
+    long rss_kb_max;
+    long rss_kb_last;
+} server_stats_t;
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+//------------------------------------------------------------------------------------------------
+// Connections
+
+static void list_remove(storm_thread_t *t, storm_conn_t *c) {
+    if (c->prev != NULL)
+        c->prev->next = c->next;
+    else
+        t->oldest = c->next;
+    if (c->next != NULL)
+        c->next->prev = c->prev;
+    else
+        t->newest = c->prev;
+}
+
+/* Closes and forgets a connection; failed ones count as failures. */
+static void conn_finish(storm_thread_t *t, storm_conn_t *c, int failed) {
+    if (!t->config->graceful) {
+        struct linger lg = {1, 0};
+        setsockopt(c->fd, SOL_SOCKET, SO_LINGER, &lg, sizeof(lg));
+    }
+    close(c->fd);
+    list_remove(t, c);
+    if (failed)
+        t->failed++;
+    else
+        t->completed++;
+    free(c);
+}
+
+/* Starts a non-blocking connect and adds the connection to the epoll set. */
+static void conn_start(storm_thread_t *t, int epfd, uint64_t now) {
+    const storm_config_t *cfg = t->config;
+    storm_conn_t *c = calloc(1, sizeof(storm_conn_t));
+    if (c == NULL) {
+        perror("calloc");
+        exit(1);
+    }
+    t->started++;
+    c->start = now;
+    c->state = cs_connecting;
+    if ((c->fd = socket(cfg->addr.ss_family, SOCK_STREAM | SOCK_NONBLOCK,
+                        0)) < 0) {
+        t->failed++;
+        free(c);
+        return;
+    }
+    int one = 1;
+    setsockopt(c->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+    c->prev = t->newest;
+    if (t->newest != NULL)
+        t->newest->next = c;
+    else
+        t->oldest = c;
+    t->newest = c;
+
+    if (connect(c->fd, (struct sockaddr *)&cfg->addr, cfg->addrlen) < 0 &&
+        errno != EINPROGRESS) {
+        conn_finish(t, c, 1);
+        return;
+    }
+    struct epoll_event ev;
+    ev.events = EPOLLOUT;
+    ev.data.ptr = c;
+    if (epoll_ctl(epfd, EPOLL_CTL_ADD, c->fd, &ev) < 0) {
+        conn_finish(t, c, 1);
+    }
+}
+
+/* Moves a connection along when epoll reports it ready. */
+static void conn_event(storm_thread_t *t, int epfd, storm_conn_t *c,
+                       uint32_t events) {
+    const storm_config_t *cfg = t->config;
+    uint64_t now = now_ns();
+
+    if (c->state == cs_connecting) {
+        int err = 0;
+        socklen_t len = sizeof(err);
+        getsockopt(c->fd, SOL_SOCKET, SO_ERROR, &err, &len);
+        if (err != 0 || (events & EPOLLERR)) {
+            conn_finish(t, c, 1);
+            return;
+        }
+        hist_record(&t->connect, now - c->start);
+        if (cfg->command == NULL) {
+            conn_finish(t, c, 0);
+            return;
+        }
+        size_t clen = strlen(cfg->command);
+        if (send(c->fd, cfg->command, clen, MSG_NOSIGNAL) != (ssize_t)clen) {
+            conn_finish(t, c, 1);
+            return;
+        }
+        c->state = cs_waiting;
+        struct epoll_event ev;
+        ev.events = EPOLLIN;
+        ev.data.ptr = c;
+        epoll_ctl(epfd, EPOLL_CTL_MOD, c->fd, &ev);
+        return;
+    }
+
+    // Waiting for the response: one line, which is short
+    char buf[256];
+    ssize_t n = recv(c->fd, buf, sizeof(buf), 0);
+    if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+        return;
+    if (n <= 0) {
+        conn_finish(t, c, 1);
+        return;
+    }
+    if (memchr(buf, '\n', n) != NULL) {
+        hist_record(&t->first_response, now - c->start);
+        conn_finish(t, c, 0);
+    }
+}
+
+static void *storm_worker(void *arg) {
+    storm_thread_t *t = (storm_thread_t *)arg;
+    const storm_config_t *cfg = t->config;
+    struct epoll_event events[256];
+    int epfd;
+
+    if ((epfd = epoll_create1(0)) < 0) {
+        perror("epoll_create1");
+        exit(1);
+    }
+    uint64_t start = now_ns();
+    uint64_t end = start + (uint64_t)(cfg->duration * 1e9);
+    uint64_t interval = (uint64_t)(1e9 / t->rate);
+    uint64_t due = start;
+
+    while (1) {
+        uint64_t now = now_ns();
+        if (now >= end && t->oldest == NULL)
+            break;
+        while (due <= now && due < end) {
+            conn_start(t, epfd, now);
+            due += interval;
+        }
+        // Connections are started in order, so the oldest times out first
+        while (t->oldest != NULL &&
+               now - t->oldest->start > CONNECT_TIMEOUT_NS) {
+            conn_finish(t, t->oldest, 1);
+        }
+
+        int timeout = due < end && due > now ? (int)((due - now) / 1000000)
+                                             : (due >= end ? 10 : 0);
+        int n = epoll_wait(epfd, events, 256, timeout);
+        for (int i = 0; i < n; i++) {
+            conn_event(t, epfd, (storm_conn_t *)events[i].data.ptr,
+                       events[i].events);
+        }
+    }
+    close(epfd);
+    return NULL;
+}
+
+//------------------------------------------------------------------------------------------------
+// Server statistics
+
+/* Reads the thread count and resident size of a process. */
+static int read_proc_status(pid_t pid, long *threads, long *rss_kb) {
+    char path[64], line[256];
+    FILE *f;
+    snprintf(path, sizeof(path), "/proc/%d/status", (int)pid);
+    if ((f = fopen(path, "r")) == NULL)
+        return -1;
+    while (fgets(line, sizeof(line), f) != NULL) {
+        sscanf(line, "Threads: %ld", threads);
+        sscanf(line, "VmRSS: %ld", rss_kb);
+    }
+    fclose(f);
+    return 0;
+}
+
+static void *stats_sampler(void *arg) {
+    server_stats_t *s = (server_stats_t *)arg;
+    while (s->running) {
+        long threads = 0, rss_kb = 0;
+        if (read_proc_status(s->pid, &threads, &rss_kb) == 0) {
+            s->threads_last = threads;
+            s->rss_kb_last = rss_kb;
+            if (threads > s->threads_max)
+                s->threads_max = threads;
+            if (rss_kb > s->rss_kb_max)
+                s->rss_kb_max = rss_kb;
+        }
+        usleep(SAMPLE_INTERVAL_US);
+    }
+    return NULL;
+}
+
+//------------------------------------------------------------------------------------------------
+// Steps and reporting
+
+typedef struct step_result {
+    double rate;
+    double seconds;
+    uint64_t started;
+    uint64_t completed;
+    uint64_t failed;
+    hist_t connect;
+    hist_t first_response;
+    server_stats_t stats;
+} step_result_t;
+
+/* Runs the storm at one rate for the configured duration. */
+static void run_step(storm_config_t *cfg, double rate, step_result_t *r) {
+    storm_thread_t *threads = calloc(cfg->threads, sizeof(storm_thread_t));
+    int err;
+    if (threads == NULL) {
+        perror("calloc");
+        exit(1);
+    }
+    memset(r, 0, sizeof(*r));
+    r->rate = rate;
+    hist_init(&r->connect);
+    hist_init(&r->first_response);
+
+    if (cfg->server_pid > 0) {
+        r->stats.pid = cfg->server_pid;
+        r->stats.running = 1;
+        if ((err = pthread_create(&r->stats.thread, 0, stats_sampler,
+                                  &r->stats))) {
+            handle_error_en(err, "pthread_create");
+        }
+    }
+
+    uint64_t start = now_ns();
+    for (int i = 0; i < cfg->threads; i++) {
+        threads[i].config = cfg;
+        threads[i].rate = rate / cfg->threads;
+        hist_init(&threads[i].connect);
+        hist_init(&threads[i].first_response);
+        if ((err = pthread_create(&threads[i].thread, 0, storm_worker,
+                                  &threads[i]))) {
+            handle_error_en(err, "pthread_create");
+        }
+    }
+    for (int i = 0; i < cfg->threads; i++) {
+        if ((err = pthread_join(threads[i].thread, 0))) {
+            handle_error_en(err, "pthread_join");
+        }
+        hist_merge(&r->connect, &threads[i].connect);
+        hist_merge(&r->first_response, &threads[i].first_response);
+        r->started += threads[i].started;
+        r->completed += threads[i].completed;
+        r->failed += threads[i].failed;
+    }
+    r->seconds = (now_ns() - start) / 1e9;
+    free(threads);
+
+    if (cfg->server_pid > 0) {
+        r->stats.running = 0;
+        pthread_join(r->stats.thread, 0);
+    }
+}
+
+static int sustained(const step_result_t *r) {
+    return r->failed == 0 &&
+           r->completed >= SUSTAINED_FRACTION * r->rate * r->seconds;
+}
+
+static void print_header(const storm_config_t *cfg) {
+    printf("%10s %10s %9s %8s %10s %10s", "target/s", "conn/s", "done",
+           "failed", "conn p50", "conn p99");
+    if (cfg->command != NULL)
+        printf(" %10s %10s", "resp p50", "resp p99");
+    if (cfg->server_pid > 0)
+        printf(" %8s %8s %10s %10s", "threads", "max thr", "rss MB",
+               "max rss MB");
+    printf("\n");
+}
+
+static void print_step(const storm_config_t *cfg, const step_result_t *r) {
+    printf("%10.0f %10.0f %9lu %8lu %10.1f %10.1f", r->rate,
+           r->completed / r->seconds, r->completed, r->failed,
+           hist_percentile(&r->connect, 50) / 1e3,
+           hist_percentile(&r->connect, 99) / 1e3);
+    if (cfg->command != NULL)
+        printf(" %10.1f %10.1f", hist_percentile(&r->first_response, 50) / 1e3,
+               hist_percentile(&r->first_response, 99) / 1e3);
+    if (cfg->server_pid > 0)
+        printf(" %8ld %8ld %10.1f %10.1f", r->stats.threads_last,
+               r->stats.threads_max, r->stats.rss_kb_last / 1024.0,
+               r->stats.rss_kb_max / 1024.0);
+    printf("\n");
+    fflush(stdout);
+}
+
+static void usage(const char *cmd) {
+    fprintf(stderr,
+            "Usage: %s [-t threads] [-r conns/sec] [-d seconds] "
+            "[-c command] [-g]\n"
+            "       [-p server pid] [-s [-b start rate]] <server> <port>\n",
+            cmd);
+}
+
+int main(int argc, char *argv[]) {
+    storm_config_t cfg;
+    memset(&cfg, 0, sizeof(cfg));
+    cfg.threads = 2;
+    cfg.rate = 1000;
+    cfg.duration = 5;
+    int sweep = 0;
+    double base_rate = 100;
+    char command[BUFLEN];
+    int opt;
+
+    while ((opt = getopt(argc, argv, "t:r:d:c:gp:sb:")) != -1) {
+        switch (opt) {
+            case 't':
+                cfg.threads = atoi(optarg);
+                break;
+            case 'r':
+                cfg.rate = atof(optarg);
+                break;
+            case 'd':
+                cfg.duration = atof(optarg);
+                break;
+            case 'c':
+                snprintf(command, sizeof(command), "%s\n", optarg);
+                cfg.command = command;
+                break;
+            case 'g':
+                cfg.graceful = 1;
+                break;
+            case 'p':
+                cfg.server_pid = atoi(optarg);
+                break;
+            case 's':
+                sweep = 1;
+                break;
+            case 'b':
+                base_rate = atof(optarg);
+                break;
+            default:
+                usage(argv[0]);
+                return 1;
+        }
+    }
+    if (optind != argc - 2 || cfg.threads < 1 || cfg.rate <= 0 ||
+        cfg.duration <= 0 || base_rate <= 0) {
+        usage(argv[0]);
+        return 1;
+    }
+    cfg.server = argv[optind];
+    cfg.port = argv[optind + 1];
+
+    // Resolve once, so the storm measures connects and not DNS
+    struct addrinfo hints, *res;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    int err;
+    if ((err = getaddrinfo(cfg.server, cfg.port, &hints, &res)) != 0) {
+        fprintf(stderr, "Error in getaddrinfo: %s\n", gai_strerror(err));
+        return 1;
+    }
+    memcpy(&cfg.addr, res->ai_addr, res->ai_addrlen);
+    cfg.addrlen = res->ai_addrlen;
+    freeaddrinfo(res);
+
+    step_result_t r;
+    double best = 0;
+    print_header(&cfg);
+    for (double rate = sweep ? base_rate : cfg.rate;; rate *= 2) {
+        if (rate > cfg.rate)
+            rate = cfg.rate;
+        run_step(&cfg, rate, &r);
+        print_step(&cfg, &r);
+        if (sustained(&r) && rate > best)
+            best = rate;
+        if (rate >= cfg.rate || (sweep && !sustained(&r)))
+            break;
+    }
+    if (sweep) {
+        printf("max sustained rate: %.0f conn/s\n", best);
+    }
+    return 0;
+}
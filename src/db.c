@@ -1,23 +1,45 @@
 #include <assert.h>
 #include <ctype.h>
 #include <errno.h>
+#include <malloc.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
 #include "./db.h"
 #include "./comm.h"
+#include "./hotkeys.h"
+#include "./probes.h"
+#include "./tracking.h"
 
 #define MAXLEN 256
-
-// The root node of the binary tree is never freed (it's allocated in the data region).
-node_t head = {"", "", 0, 0, PTHREAD_RWLOCK_INITIALIZER};
+#define DUMP_BATCH 1024
 
 //------------------------------------------------------------------------------------------------
 // Constructor, destructor, and cleanup methods
 
+/* Counts a key or value string as allocated (count 1) or freed (count -1). */
+static void string_account(int cat, char *str, int count) {
+    if (str != NULL) {
+        metrics_mem(cat, count, strlen(str) + 1,
+                    malloc_usable_size(str) + MALLOC_CHUNK_OVERHEAD);
+    }
+}
+
+/* Counts a node and its strings as allocated (count 1) or freed (count -1). */
+static void node_account(node_t *node, int count) {
+    size_t lock_size = sizeof(pthread_rwlock_t);
+    size_t node_size = malloc_usable_size(node) + MALLOC_CHUNK_OVERHEAD;
+    metrics_mem(mem_node, count, sizeof(node_t) - lock_size,
+                node_size - lock_size);
+    metrics_mem(mem_lock, count, lock_size, lock_size);
+    string_account(mem_key, node->key, count);
+    string_account(mem_value, node->value, count);
+}
+
 /* Constructs a new node */
-node_t *node_constructor(char *arg_key, char *arg_value, node_t *arg_left,
+node_t *node_constructor(const char *arg_key, const char *arg_value,
+                         node_t *arg_left,
                          node_t *arg_right) {
     size_t key_len = strlen(arg_key);
     size_t val_len = strlen(arg_value);
@@ -25,6 +47,7 @@ node_t *node_constructor(char *arg_key, char *arg_value, node_t *arg_left,
     if (key_len > MAXLEN || val_len > MAXLEN)
         return 0;
 
+    uint64_t span = TRACE_BEGIN();
     node_t *new_node = (node_t *)malloc(sizeof(node_t));
 
     if (new_node == NULL)
@@ -60,12 +83,18 @@ node_t *node_constructor(char *arg_key, char *arg_value, node_t *arg_left,
     if ((err = pthread_rwlock_init(&new_node->lock, NULL))) {
         handle_error_en(err, "pthread_rwlock_init");
     }
+    TRACE_END("alloc", span);
+    node_account(new_node, 1);
+    PROBE2(node__alloc, new_node, new_node->key);
 
     return new_node;
 }
 
 /* Destroys a node and frees up its allocated memory */
 void node_destructor(node_t *node) {
+    PROBE1(node__free, node);
+    node_account(node, -1);
+
     // Destroy the rwlock
     pthread_rwlock_destroy(&node->lock);
 
@@ -89,15 +118,55 @@ void db_cleanup_recurs(node_t *node) {
     node_destructor(node);
 }
 
-void db_cleanup() {
-    db_cleanup_recurs(head.lchild);
-    db_cleanup_recurs(head.rchild);
+void db_cleanup(db_t *db) {
+    db_cleanup_recurs(db->head.lchild);
+    db_cleanup_recurs(db->head.rchild);
+    db->head.lchild = NULL;
+    db->head.rchild = NULL;
+}
+
+db_t *db_create(void) {
+    db_t *db = calloc(1, sizeof(db_t));
+    if (db == NULL)
+        return NULL;
+    // The root holds no pair and sorts before every key
+    db->head.key = "";
+    db->head.value = "";
+    int err;
+    if ((err = pthread_rwlock_init(&db->head.lock, NULL))) {
+        handle_error_en(err, "pthread_rwlock_init");
+    }
+    return db;
+}
+
+void db_set_change_fn(db_t *db, db_change_fn fn, void *arg) {
+    db->on_change = fn;
+    db->change_arg = arg;
+}
+
+void db_destroy(db_t *db) {
+    if (db == NULL)
+        return;
+    db_cleanup(db);
+    pthread_rwlock_destroy(&db->head.lock);
+    free(db);
 }
 
 //------------------------------------------------------------------------------------------------
 // Database modifiers and accessors
 
-node_t *search(char *key, node_t *parent, node_t **parentpp, enum locktype lt) {
+int db_lock_slow(enum locktype lt, pthread_rwlock_t *lk) {
+    uint64_t start = metrics_now_ns();
+    int err = (lt == l_read) ? pthread_rwlock_rdlock(lk)
+                             : pthread_rwlock_wrlock(lk);
+    metrics_cell_t *cell = metrics_thread_cell();
+    METRIC_ADD(cell->lock_acquires[lt], 1);
+    metrics_lock_wait(lt, metrics_now_ns() - start);
+    return err;
+}
+
+node_t *search(const char *key, node_t *parent, node_t **parentpp,
+               enum locktype lt) {
     // parent is locked on entry
     node_t *next;
     if (strcmp(key, parent->key) < 0) {
@@ -110,11 +179,11 @@ node_t *search(char *key, node_t *parent, node_t **parentpp, enum locktype lt) {
     if (next == NULL) {
         result = NULL;
     } else {
-        lock(lt, &next->lock);
+        lock(lt, next);
         if (strcmp(key, next->key) == 0) {
             result = next;
         } else {
-            pthread_rwlock_unlock(&parent->lock);
+            unlock(lt, parent);
             return search(key, next, parentpp, lt);
         }
     }
@@ -125,40 +194,42 @@ node_t *search(char *key, node_t *parent, node_t **parentpp, enum locktype lt) {
         *parentpp = parent;
     } else {
         // unlock the parent if the function doesn't care about it
-        pthread_rwlock_unlock(&parent->lock);
+        unlock(lt, parent);
     }
 
     return result;
 }
 
-void db_query(char *key, char *result, int len) {
+int db_query(db_t *db, const char *key, char *result, int len) {
     /*
      * Part 2: Make this thread safe!
      */
-    lock(l_read, &head.lock);
-    node_t *target = search(key, &head, NULL, l_read);
-    if (target == NULL) {
-        snprintf(result, len, "not found");
-    } else {
-        snprintf(result, len, "%s", target->value);
-        pthread_rwlock_unlock(&target->lock);
-    }
+    hotkeys_record(key);
+    tracking_read(key);
+    lock(l_read, &db->head);
+    node_t *target = search(key, &db->head, NULL, l_read);
+    if (target == NULL)
+        return -1;
+    int n = snprintf(result, len, "%s", target->value);
+    unlock(l_read, target);
+    return n;
 }
 
-int db_add(char *key, char *value) {
+int db_add(db_t *db, const char *key, const char *value) {
     /*
      * Part 2: Make this thread safe!
      */
     node_t *parent;
     node_t *target;
 
-    lock(l_write, &head.lock);
+    hotkeys_record(key);
+    lock(l_write, &db->head);
 
     // First, find the key in the bst. If it already exists, return 0.
     // The parent is saved to the parent ptr.
-    if ((target = search(key, &head, &parent, l_write)) != NULL) {
-        pthread_rwlock_unlock(&target->lock);
-        pthread_rwlock_unlock(&parent->lock);
+    if ((target = search(key, &db->head, &parent, l_write)) != NULL) {
+        unlock(l_write, target);
+        unlock(l_write, parent);
         return 0;
     }
     // Else, create a new node and attach it to the left/right of the parent.
@@ -168,25 +239,61 @@ int db_add(char *key, char *value) {
         parent->lchild = newnode;
     else
         parent->rchild = newnode;
-    pthread_rwlock_unlock(&parent->lock);
+    if (db->on_change != NULL)
+        db->on_change(key, value, db->change_arg);
+    unlock(l_write, parent);
+    tracking_invalidate(key);
 
     return 1;
 }
 
-int db_remove(char *key) {
+int db_update(db_t *db, const char *key, const char *value) {
+    node_t *target;
+
+    if (strlen(value) > MAXLEN)
+        return 0;
+
+    hotkeys_record(key);
+    lock(l_write, &db->head);
+    if ((target = search(key, &db->head, NULL, l_write)) == NULL) {
+        return 0;
+    }
+
+    // Only the node itself is locked; swap its value in place
+    char *new_value = strdup(value);
+    if (new_value == NULL) {
+        unlock(l_write, target);
+        return 0;
+    }
+    string_account(mem_value, target->value, -1);
+    free(target->value);
+    target->value = new_value;
+    string_account(mem_value, target->value, 1);
+    if (db->on_change != NULL)
+        db->on_change(key, value, db->change_arg);
+    unlock(l_write, target);
+    tracking_invalidate(key);
+
+    return 1;
+}
+
+int db_remove(db_t *db, const char *key) {
     /*
      * Part 2: Make this thread safe!
      */
     node_t *parent;  // parent of the node to delete
     node_t *dnode;   // node to delete
 
-    lock(l_write, &head.lock);
+    lock(l_write, &db->head);
     // first, find the node to be removed
-    if ((dnode = search(key, &head, &parent, l_write)) == NULL) {
+    if ((dnode = search(key, &db->head, &parent, l_write)) == NULL) {
         // it's not there
-        pthread_rwlock_unlock(&parent->lock);
+        unlock(l_write, parent);
         return 0;
     }
+    // dnode stays locked until it is gone, so this keeps the order too
+    if (db->on_change != NULL)
+        db->on_change(key, NULL, db->change_arg);
 
     // We found it. If the target has no right child, then we can simply replace
     // its parent's pointer to the target with the target's own left child.
@@ -198,8 +305,8 @@ int db_remove(char *key) {
             parent->rchild = dnode->lchild;
 
         // unlock mutexes
-        pthread_rwlock_unlock(&dnode->lock);
-        pthread_rwlock_unlock(&parent->lock);
+        unlock(l_write, dnode);
+        unlock(l_write, parent);
         // done with dnode
         node_destructor(dnode);
     } else if (dnode->lchild == NULL) {
@@ -210,8 +317,8 @@ int db_remove(char *key) {
             parent->rchild = dnode->rchild;
 
         // unlock mutexes
-        pthread_rwlock_unlock(&dnode->lock);
-        pthread_rwlock_unlock(&parent->lock);
+        unlock(l_write, dnode);
+        unlock(l_write, parent);
         // done with dnode
         node_destructor(dnode);
     } else {
@@ -221,15 +328,15 @@ int db_remove(char *key) {
         // greater than all nodes in its left subtree
         node_t *next = dnode->rchild;
         node_t **pnext = &dnode->rchild;
-        lock(l_write, &next->lock);            // Lock the right child
-        pthread_rwlock_unlock(&parent->lock);  // Unlock the parent of dnode
+        lock(l_write, next);      // Lock the right child
+        unlock(l_write, parent);  // Unlock the parent of dnode
 
         while (next->lchild != NULL) {
             // work our way down the lchild chain, finding the smallest node
             // in the subtree.
             node_t *nextl = next->lchild;
-            lock(l_write, &nextl->lock);  // Lock the left child
-            pthread_rwlock_unlock(&next->lock);
+            lock(l_write, nextl);  // Lock the left child
+            unlock(l_write, next);
             pnext = &next->lchild;
             next = nextl;
         }
@@ -238,18 +345,75 @@ int db_remove(char *key) {
         *pnext = next->rchild;
 
         // replace dnode with the contents of next
+        string_account(mem_key, dnode->key, -1);
+        string_account(mem_value, dnode->value, -1);
         dnode->key = realloc(dnode->key, strlen(next->key) + 1);
         dnode->value = realloc(dnode->value, strlen(next->value) + 1);
 
         snprintf(dnode->key, MAXLEN, "%s", next->key);
         snprintf(dnode->value, MAXLEN, "%s", next->value);
-        pthread_rwlock_unlock(&next->lock);
-        pthread_rwlock_unlock(&dnode->lock);
+        string_account(mem_key, dnode->key, 1);
+        string_account(mem_value, dnode->value, 1);
+        unlock(l_write, next);
+        unlock(l_write, dnode);
         node_destructor(next);
     }
+    tracking_invalidate(key);
     return 1;
 }
 
+/* Scan state shared by the recursion of db_scan. */
+typedef struct scan {
+    node_t *root;
+    const char *start;
+    int inclusive;  // whether start itself is in range
+    int limit;
+    int count;
+    int stopped;  // the callback asked to stop
+    db_scan_fn fn;
+    void *arg;
+} scan_t;
+
+#define SCAN_MORE(scan) (!(scan)->stopped && (scan)->count < (scan)->limit)
+
+/*
+ * In-order walk of the subtree rooted at node, which is read-locked on entry
+ * and unlocked on return. A node stays locked while its left subtree is
+ * walked; the right spine is followed hand over hand.
+ */
+static void db_scan_recurs(node_t *node, scan_t *scan) {
+    while (node != NULL) {
+        // Everything on the left is smaller than node, so it can only be in
+        // range if node is
+        int in_range = node != scan->root &&
+                       strcmp(node->key, scan->start) >= 1 - scan->inclusive;
+        if (in_range && node->lchild != NULL && SCAN_MORE(scan)) {
+            node_t *left = node->lchild;
+            lock(l_read, left);
+            db_scan_recurs(left, scan);
+        }
+        if (in_range && SCAN_MORE(scan)) {
+            scan->stopped = scan->fn(node->key, node->value, scan->arg);
+            scan->count++;
+        }
+
+        node_t *right = NULL;
+        if (SCAN_MORE(scan) && (right = node->rchild) != NULL) {
+            lock(l_read, right);
+        }
+        unlock(l_read, node);
+        node = right;
+    }
+}
+
+int db_scan(db_t *db, const char *start, int inclusive, int limit,
+            db_scan_fn fn, void *arg) {
+    scan_t scan = {&db->head, start, inclusive, limit, 0, 0, fn, arg};
+    lock(l_read, &db->head);
+    db_scan_recurs(&db->head, &scan);
+    return scan.count;
+}
+
 //------------------------------------------------------------------------------------------------
 // Printing methods and their helpers
 
@@ -259,82 +423,249 @@ static inline void print_spaces(int lvl, FILE *out) {
     }
 }
 
-/* helper function for db_print */
-void db_print_recurs(node_t *node, int lvl, FILE *out) {
-    print_spaces(lvl, out);  // print spaces to differentiate levels
+/*
+ * Where a tree dump stopped: the way from the root down to the next line to
+ * write, as 'l' and 'r' for each level, so that the next batch can walk back
+ * down to it with none of the previous batch's locks held.
+ */
+typedef struct tree_cursor {
+    FILE *buf;
+    char *path;
+    int depth;     // levels of path to follow, or 0 to write from the root
+    int capacity;  // of path
+    int budget;    // lines this batch may still write
+} tree_cursor_t;
 
-    // print node's key/value, or (root) if it's the root
-    if (node == NULL) {
-        fprintf(out, "(null)\n");
-        return;
-    }
-    lock(l_read, &node->lock);  // Lock the passed-in node
-    if (node == &head) {
-        fprintf(out, "(root)\n");
-    } else {
-        fprintf(out, "%s %s\n", node->key, node->value);
-    }
-    // Traverse the left child
-    node_t *left = node->lchild;
-    if (left != NULL) {
-        lock(l_read, &left->lock);  // Lock the left child
+/*
+ * Writes the tree under node, read-locked by the caller unless NULL, from
+ * where the cursor stopped until the batch is full. Returns 1 then, 0 once the
+ * subtree is written, and -1 if the path cannot grow. The tree may change
+ * between batches, so that a later batch resumes wherever the path now leads.
+ */
+static int tree_batch(node_t *node, int lvl, tree_cursor_t *c) {
+    char resume = lvl < c->depth ? c->path[lvl] : '\0';
+
+    if (resume == '\0' || node == NULL) {
+        c->depth = 0;  // at the next line: write from here on
+        resume = '\0';
+        if (c->budget-- == 0) {
+            c->depth = lvl;
+            return 1;
+        }
+        print_spaces(lvl, c->buf);  // print spaces to differentiate levels
+        if (node == NULL) {
+            fprintf(c->buf, "(null)\n");
+            return 0;
+        }
+        // print node's key/value, or (root) if it's the root
+        if (lvl == 0) {
+            fprintf(c->buf, "(root)\n");
+        } else {
+            fprintf(c->buf, "%s %s\n", node->key, node->value);
+        }
     }
-    pthread_rwlock_unlock(&node->lock);  // Unlock the passed-in node
-    db_print_recurs(left, lvl + 1, out);
 
-    // Traverse the right child
-    if (left != NULL) {
-        pthread_rwlock_unlock(&left->lock);  // Unlock the left child
-    }
-    node_t *right = node->rchild;
-    if (right != NULL) {
-        lock(l_read, &right->lock);  // Lock the right child
+    if (lvl >= c->capacity) {
+        int capacity = c->capacity == 0 ? 64 : 2 * c->capacity;
+        char *path = realloc(c->path, capacity);
+        if (path == NULL) {
+            return -1;
+        }
+        c->path = path;
+        c->capacity = capacity;
     }
-    db_print_recurs(right, lvl + 1, out);
-    if (right != NULL) {
-        pthread_rwlock_unlock(&right->lock);  // Unlock the right child
+    // Traverse the left child, unless it was written already, then the right
+    for (int right = resume == 'r'; right < 2; right++) {
+        node_t *child = right ? node->rchild : node->lchild;
+        if (child != NULL) {
+            lock(l_read, child);
+        }
+        c->path[lvl] = right ? 'r' : 'l';
+        int stop = tree_batch(child, lvl + 1, c);
+        if (child != NULL) {
+            unlock(l_read, child);
+        }
+        if (stop != 0) {
+            return stop;
+        }
     }
+    return 0;
 }
 
-int db_print(char *filename) {
+/* A dump handed over to a background writer thread. */
+typedef struct dump {
+    db_t *db;
     FILE *out;
-    if (filename == NULL) {
-        db_print_recurs(&head, 0, stdout);
-        return 0;
+    int sorted;
+} dump_t;
+
+/* Collects one batch of a sorted dump. */
+typedef struct dump_batch {
+    FILE *buf;
+    char last[MAXLEN + 1];  // where the next batch starts
+} dump_batch_t;
+
+// Writer threads still running, so that the database outlives them
+static int dumps_running = 0;
+static pthread_mutex_t dumps_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t dumps_done = PTHREAD_COND_INITIALIZER;
+
+static int dump_batch_add(const char *key, const char *value, void *arg) {
+    dump_batch_t *batch = (dump_batch_t *)arg;
+    fprintf(batch->buf, "%s\t%s\n", key, value);
+    snprintf(batch->last, sizeof(batch->last), "%s", key);
+    return 0;
+}
+
+/*
+ * Writes a dump without holding any node lock while doing I/O. Both formats
+ * are streamed in batches, of DUMP_BATCH lines of the tree or DUMP_BATCH keys
+ * in order, and each batch's locks are dropped before the batch is written.
+ */
+static void *dump_writer(void *arg) {
+    dump_t *dump = (dump_t *)arg;
+
+    if (!dump->sorted) {
+        tree_cursor_t cursor = {NULL, NULL, 0, 0, 0};
+        int stop;
+        do {
+            char *buf = NULL;
+            size_t buf_len = 0;
+            if ((cursor.buf = open_memstream(&buf, &buf_len)) == NULL) {
+                perror("open_memstream");
+                break;
+            }
+            cursor.budget = DUMP_BATCH;
+            lock(l_read, &dump->db->head);
+            stop = tree_batch(&dump->db->head, 0, &cursor);
+            unlock(l_read, &dump->db->head);
+            fclose(cursor.buf);
+            fwrite(buf, 1, buf_len, dump->out);
+            free(buf);
+            if (stop < 0) {
+                perror("dump");
+            }
+        } while (stop > 0);
+        free(cursor.path);
+    } else {
+        dump_batch_t batch;
+        batch.last[0] = '\0';
+        int n;
+        do {
+            char *buf = NULL;
+            size_t buf_len = 0;
+            if ((batch.buf = open_memstream(&buf, &buf_len)) == NULL) {
+                perror("open_memstream");
+                break;
+            }
+            n = db_scan(dump->db, batch.last, 0, DUMP_BATCH, dump_batch_add,
+                        &batch);
+            fclose(batch.buf);
+            fwrite(buf, 1, buf_len, dump->out);
+            free(buf);
+        } while (n == DUMP_BATCH);
     }
 
-    // skip over leading whitespace
-    while (isspace(*filename)) {
-        filename++;
+    if (dump->out == stdout) {
+        fflush(stdout);
+    } else {
+        fclose(dump->out);
     }
+    free(dump);
 
-    if (*filename == '\0') {
-        db_print_recurs(&head, 0, stdout);
-        return 0;
+    pthread_mutex_lock(&dumps_mutex);
+    if (--dumps_running == 0) {
+        pthread_cond_broadcast(&dumps_done);
+    }
+    pthread_mutex_unlock(&dumps_mutex);
+    return NULL;
+}
+
+int db_print(db_t *db, char *filename, int sorted) {
+    FILE *out = stdout;
+    dump_t *dump;
+    pthread_t tid;
+    int err;
+
+    if (filename != NULL) {
+        // skip over leading whitespace
+        while (isspace(*filename)) {
+            filename++;
+        }
+        if (*filename != '\0' && (out = fopen(filename, "w+")) == NULL) {
+            return -1;
+        }
     }
 
-    if ((out = fopen(filename, "w+")) == NULL) {
+    if ((dump = malloc(sizeof(dump_t))) == NULL) {
+        if (out != stdout)
+            fclose(out);
         return -1;
     }
+    dump->db = db;
+    dump->out = out;
+    dump->sorted = sorted;
+
+    pthread_mutex_lock(&dumps_mutex);
+    dumps_running++;
+    pthread_mutex_unlock(&dumps_mutex);
 
-    db_print_recurs(&head, 0, out);
-    fclose(out);
+    if ((err = pthread_create(&tid, 0, dump_writer, dump))) {
+        handle_error_en(err, "dump pthread_create");
+    }
+    if ((err = pthread_detach(tid))) {
+        handle_error_en(err, "dump pthread_detach");
+    }
 
     return 0;
 }
 
+void db_print_wait(void) {
+    pthread_mutex_lock(&dumps_mutex);
+    while (dumps_running > 0) {
+        pthread_cond_wait(&dumps_done, &dumps_mutex);
+    }
+    pthread_mutex_unlock(&dumps_mutex);
+}
+
 //------------------------------------------------------------------------------------------------
 // Command interpreting
 
+#define SCAN_PREFIX 11  // room for the pair count of a scan response
+
+/* Appends scanned pairs to a response line while they fit. */
+typedef struct scan_response {
+    char *buf;
+    int len;  // buffer size
+    int used;
+    int count;
+} scan_response_t;
+
+static int scan_response_add(const char *key, const char *value, void *arg) {
+    scan_response_t *r = (scan_response_t *)arg;
+    int n = snprintf(r->buf + r->used, r->len - r->used, " %s %s", key, value);
+    if (n >= r->len - r->used) {
+        // Doesn't fit: cut the line back and stop
+        r->buf[r->used] = '\0';
+        return 1;
+    }
+    r->used += n;
+    r->count++;
+    return 0;
+}
+
 /*
- * Interprets the given command string and writes up to len bytes into response,
+ * Executes the given command string and writes up to len bytes into response,
  * where len is the buffer size.
  */
-void interpret_command(char *command, char *response, int len) {
+static void execute_command(db_t *db, char *command, char *response,
+                            int len) {
     char value[MAXLEN];
-    char ibuf[MAXLEN];
+    char ibuf[BUFLEN];
     char name[MAXLEN];
     int sscanf_ret;
+    int count;
+    uint64_t span;
 
     if (strlen(command) <= 1) {
         snprintf(response, len, "ill-formed command");
@@ -345,25 +676,28 @@ void interpret_command(char *command, char *response, int len) {
     switch (command[0]) {
         case 'q':
             // Query
+            span = TRACE_BEGIN();
             sscanf_ret = sscanf(&command[1], "%255s", name);
+            TRACE_END("parse", span);
             if (sscanf_ret < 1) {
                 snprintf(response, len, "ill-formed command");
                 return;
             }
-            db_query(name, response, len);
-            if (strlen(response) == 0) {
+            if (db_query(db, name, response, len) < 0) {
                 snprintf(response, len, "not found");
             }
             return;
 
         case 'a':
             // Add to the database
+            span = TRACE_BEGIN();
             sscanf_ret = sscanf(&command[1], "%255s %255s", name, value);
+            TRACE_END("parse", span);
             if (sscanf_ret < 2) {
                 snprintf(response, len, "ill-formed command");
                 return;
             }
-            if (db_add(name, value)) {
+            if (db_add(db, name, value)) {
                 snprintf(response, len, "added");
             } else {
                 snprintf(response, len, "already in database");
@@ -372,18 +706,74 @@ void interpret_command(char *command, char *response, int len) {
 
         case 'd':
             // Delete from the database
+            span = TRACE_BEGIN();
             sscanf_ret = sscanf(&command[1], "%255s", name);
+            TRACE_END("parse", span);
             if (sscanf_ret < 1) {
                 snprintf(response, len, "ill-formed command");
                 return;
             }
-            if (db_remove(name)) {
+            if (db_remove(db, name)) {
                 snprintf(response, len, "removed");
             } else {
                 snprintf(response, len, "not in database");
             }
             return;
 
+        case 'u':
+            // Update a key that is already in the database
+            span = TRACE_BEGIN();
+            sscanf_ret = sscanf(&command[1], "%255s %255s", name, value);
+            TRACE_END("parse", span);
+            if (sscanf_ret < 2) {
+                snprintf(response, len, "ill-formed command");
+                return;
+            }
+            if (db_update(db, name, value)) {
+                snprintf(response, len, "updated");
+            } else {
+                snprintf(response, len, "not in database");
+            }
+            return;
+
+        case 's':
+            // Scan up to count keys from name onwards. The response is the
+            // number of pairs found followed by the pairs, on one line, and
+            // holds as many pairs as fit in it.
+            span = TRACE_BEGIN();
+            sscanf_ret = sscanf(&command[1], "%255s %d", name, &count);
+            TRACE_END("parse", span);
+            if (sscanf_ret < 2 || count < 0) {
+                snprintf(response, len, "ill-formed command");
+                return;
+            }
+            if (len <= SCAN_PREFIX) {
+                snprintf(response, len, "0");
+                return;
+            }
+            // Pairs go after room for the count, which is then moved up
+            scan_response_t scan = {response + SCAN_PREFIX, len - SCAN_PREFIX,
+                                    0, 0};
+            scan.buf[0] = '\0';
+            db_scan(db, name, 1, count, scan_response_add, &scan);
+            char prefix[SCAN_PREFIX + 1];
+            int plen = snprintf(prefix, sizeof(prefix), "%d", scan.count);
+            memmove(response + plen, scan.buf, scan.used + 1);
+            memcpy(response, prefix, plen);
+            return;
+
+        case 't':
+            // Turn invalidations for this connection's reads on or off
+            sscanf_ret = sscanf(&command[1], "%255s", name);
+            if (sscanf_ret < 1 ||
+                (strcmp(name, "on") != 0 && strcmp(name, "off") != 0) ||
+                tracking_enable(name[1] == 'n') < 0) {
+                snprintf(response, len, "ill-formed command");
+                return;
+            }
+            snprintf(response, len, "tracking %s", name);
+            return;
+
         case 'f':
             // process the commands in a file (silently)
             sscanf_ret = sscanf(&command[1], "%255s", name);
@@ -399,7 +789,7 @@ void interpret_command(char *command, char *response, int len) {
             }
             while (fgets(ibuf, sizeof(ibuf), finput) != 0) {
                 pthread_testcancel();  // fgets is not a cancellation point
-                interpret_command(ibuf, response, len);
+                interpret_command(db, ibuf, response, len);
             }
             fclose(finput);
             snprintf(response, len, "file processed");
@@ -410,3 +800,13 @@ void interpret_command(char *command, char *response, int len) {
             return;
     }
 }
+
+/*
+ * Interprets the given command string and writes up to len bytes into response,
+ * where len is the buffer size.
+ */
+void interpret_command(db_t *db, char *command, char *response, int len) {
+    PROBE1(command__start, command);
+    execute_command(db, command, response, len);
+    PROBE2(command__end, command, response);
+}
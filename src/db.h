@@ -1,8 +1,13 @@
 #ifndef DB_H_
 #define DB_H_
 
+#include <errno.h>
 #include <pthread.h>
 
+#include "./metrics.h"
+#include "./probes.h"
+#include "./trace.h"
+
 // Represent database as a binary tree
 typedef struct node {
     char *key;
@@ -12,47 +17,143 @@ typedef struct node {
     pthread_rwlock_t lock;
 } node_t;
 
-extern node_t head;
+/*
+ * Called for each change to a database while the changed node is locked, so
+ * that changes to one key are seen in the order they were made. value is
+ * NULL for removals.
+ */
+typedef void (*db_change_fn)(const char *key, const char *value, void *arg);
+
+/*
+ * A database. Its tree hangs off a root node that holds no pair; there may
+ * be any number of databases, each used by any number of threads.
+ */
+typedef struct db {
+    node_t head;
+    db_change_fn on_change;
+    void *change_arg;
+} db_t;
 
 enum locktype { l_read, l_write };
 
-#define lock(lt, lk) \
-    ((lt) == l_read) ? pthread_rwlock_rdlock(lk) : pthread_rwlock_wrlock(lk)
+/* Blocks for a node lock, recording how long the wait took. */
+int db_lock_slow(enum locktype lt, pthread_rwlock_t *lk);
+
+/*
+ * Acquires a node's lock. The uncontended case costs a trylock; only a lock
+ * that would block is timed and counted as a wait. Every node lock is taken
+ * here and released in db_unlock, so lock__acquire and lock__release pair up.
+ */
+static inline int db_lock(enum locktype lt, node_t *node) {
+    pthread_rwlock_t *lk = &node->lock;
+    uint64_t span = TRACE_BEGIN();
+    int err = (lt == l_read) ? pthread_rwlock_tryrdlock(lk)
+                             : pthread_rwlock_trywrlock(lk);
+    if (err == EBUSY) {
+        err = db_lock_slow(lt, lk);
+    } else {
+        METRIC_ADD(metrics_thread_cell()->lock_acquires[lt], 1);
+    }
+    TRACE_END(lt == l_read ? "rdlock" : "wrlock", span);
+    PROBE3(lock__acquire, node, node->key, lt);
+    return err;
+}
+
+/* Releases a node's lock, taken as lt. */
+static inline void db_unlock(enum locktype lt, node_t *node) {
+    (void)lt;  // only the probe needs it
+    PROBE2(lock__release, node, lt);
+    pthread_rwlock_unlock(&node->lock);
+}
+
+#define lock(lt, node) db_lock((lt), (node))
+#define unlock(lt, node) db_unlock((lt), (node))
+
+/** Makes an empty database. Returns NULL if out of memory. */
+db_t *db_create(void);
+
+/**
+ * Frees a database and all its nodes. No other thread may be using it, and
+ * its prints must have finished.
+ */
+void db_destroy(db_t *db);
+
+/**
+ * Has fn called on every change from now on. Must be set before other
+ * threads use the database.
+ */
+void db_set_change_fn(db_t *db, db_change_fn fn, void *arg);
 
 /**
  * Searches the database tree for a node containing the given key. 
  * Returns that node if it's found, otherwise NULL.
  */
-node_t *search(char *key, node_t *parent, node_t **parentp, enum locktype lt);
+node_t *search(const char *key, node_t *parent, node_t **parentp,
+               enum locktype lt);
 
 /**
  * Retrieves the value of the node associated with the given key. 
- * If found, returns the value stored in that node in the given result buffer 
- * of the given size. Otherwise, result is filled with "not found".
+ * If found, copies the value stored in that node into the given result buffer
+ * of the given size and returns its length, as snprintf would. Otherwise,
+ * returns -1.
  */
-void db_query(char *key, char *result, int len);
+int db_query(db_t *db, const char *key, char *result, int len);
 
 /**
  * Adds a new node with the given key and value to the database if it hasn't
  * existed. Returns 1 on success and 0 on failure.
  */
-int db_add(char *key, char *value);
+int db_add(db_t *db, const char *key, const char *value);
+
+/**
+ * Replaces the value of the node with the given key if it exists. Returns 1 on
+ * success and 0 if the key is not in the database.
+ */
+int db_update(db_t *db, const char *key, const char *value);
 
 /**
  * Retrieves and deletes the node with the given key.
  */
-int db_remove(char *key);
+int db_remove(db_t *db, const char *key);
+
+/**
+ * Called for each key/value pair visited by db_scan, with the pair's node
+ * read-locked. The pair must be copied if it is needed afterwards. Returning
+ * nonzero stops the scan after this pair.
+ */
+typedef int (*db_scan_fn)(const char *key, const char *value, void *arg);
+
+/**
+ * Visits up to limit keys greater than start (or equal to it, if inclusive),
+ * in ascending order. Locks are only held for the duration of the call, so a
+ * long scan can be done in batches by passing the last key of one batch as
+ * the exclusive start of the next. Returns the number of keys visited.
+ */
+int db_scan(db_t *db, const char *start, int inclusive, int limit,
+            db_scan_fn fn, void *arg);
 
 /**
  * Gets called by the server to interpret a command from a client, 
  * call database functions, and store the response.
  */
-void interpret_command(char *command, char *response, int resp_capacity);
+void interpret_command(db_t *db, char *command, char *response,
+                       int resp_capacity);
 
-/** Print the tree to a file. */
-int db_print(char *filename);
+/**
+ * Prints the database to a file, or to stdout if filename is NULL or blank,
+ * from a background thread. Either format, the tree or "key<TAB>value" lines
+ * in key order, is streamed in batches with the locks released in between.
+ * Returns -1 if the file cannot be opened.
+ */
+int db_print(db_t *db, char *filename, int sorted);
 
-/** Frees all dynamically-allocated nodes in the database before exiting. */
-void db_cleanup(void);
+/** Waits until every background print has finished. */
+void db_print_wait(void);
+
+/**
+ * Frees all dynamically-allocated nodes in the database, leaving it empty.
+ * No other thread may be using the database.
+ */
+void db_cleanup(db_t *db);
 
 #endif  // DB_H_
@@ -0,0 +1,617 @@
+#include <arpa/inet.h>
+#include <getopt.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "./comm.h"
+#include "./db.h"
+#include "./hist.h"
+#include "./keygen.h"
+#include "./metrics.h"
+#include "./rand.h"
+
+/*
+ * Standalone microbenchmark of the database engine. It links db.o directly,
+ * so the numbers are the cost of search, db_query, db_add and db_remove
+ * without the network in the way. In net mode the same operations go over
+ * loopback TCP instead, one connection per thread, to a listener started
+ * through comm.c and served by one thread per connection as in the server;
+ * comparing the two modes separates the network layer from the engine.
+ *
+ * A sweep (-T) repeats the run at 1, 2, 4, ... threads (and connections),
+ * recording throughput, latency and the CPU time used at each step.
+ *
+ * Each configuration can be run several times (-R); -O then saves every
+ * repetition's throughput and latency as JSON keyed by configuration, which
+ * scripts/bench_compare.py diffs against a baseline.
+ *
+ * The dataset is preloaded with every other key of a key space twice its size;
+ * writes then add or remove keys of the whole space with equal odds, so the
+ * tree stays around the dataset size and about half the reads hit. Keys are
+ * drawn from a keygen distribution (-d); with the sequential one keys are
+ * named in index order, so both the preload and the run follow key order.
+ */
+
+#define MAX_KEY 255
+#define MAX_VALUE 255
+#define CONNECT_TRIES 500  // 10ms apart, while the listener starts
+#define MAX_REPS 64
+
+// The database under test, emptied after every run
+static db_t *db;
+
+enum bench_op { op_query, op_add, op_remove, NUM_OPS };
+static const char *op_names[NUM_OPS] = {"query", "add", "remove"};
+
+enum bench_format { fmt_csv, fmt_json };
+
+enum bench_mode { mode_inproc, mode_net, NUM_MODES };
+static const char *mode_names[NUM_MODES] = {"inproc", "net"};
+
+typedef struct bench_config {
+    int threads;
+    double read_ratio;
+    int key_size;
+    int value_size;
+    uint64_t dataset;
+    uint64_t ops;  // per thread
+    uint64_t seed;
+    keygen_t *keygen;  // over the whole key space
+    enum bench_mode mode;
+    int port;  // of the listener, in net mode
+} bench_config_t;
+
+typedef struct bench_result {
+    double seconds;
+    double cpu_seconds;  // user and system time of the whole process
+    hist_t hist[NUM_OPS];
+} bench_result_t;
+
+/* One configuration's results over its repetitions; index 0 is "all". */
+typedef struct bench_samples {
+    int reps;
+    uint64_t ops[NUM_OPS + 1];
+    double ops_per_sec[NUM_OPS + 1][MAX_REPS];
+    uint64_t p50_ns[NUM_OPS + 1][MAX_REPS];
+    uint64_t p99_ns[NUM_OPS + 1][MAX_REPS];
+} bench_samples_t;
+
+typedef struct worker {
+    pthread_t thread;
+    int id;
+    const bench_config_t *config;
+    pthread_barrier_t *barrier;
+    hist_t hist[NUM_OPS];
+} worker_t;
+
+//------------------------------------------------------------------------------------------------
+// Keys, values and randomness
+
+/*
+ * Writes the key for index idx, key_size characters long. Keys are hashed so
+ * that the binary tree sees them in random order whatever order they are
+ * generated in, unless the distribution is sequential.
+ */
+static void make_key(char *buf, const bench_config_t *c, uint64_t idx) {
+    int key_size = c->key_size;
+    char hex[17];
+    int skip = 0;  // leading digits left out
+    if (c->keygen->dist != kg_sequential) {
+        idx = rand_mix64(idx);
+    } else if (key_size < 16) {
+        skip = 16 - key_size;  // the low digits are the ones that vary
+    }
+    snprintf(hex, sizeof(hex), "%016lx", idx);
+    for (int i = 0; i < key_size; i++) {
+        buf[i] = i + skip < 16 ? hex[i + skip] : 'k';
+    }
+    buf[key_size] = '\0';
+}
+
+//------------------------------------------------------------------------------------------------
+// Network mode
+
+/* Serves one connection the way server.c's client threads do. */
+static void *net_serve(void *arg) {
+    FILE *cxstr = (FILE *)arg;
+    char command[BUFLEN], response[BUFLEN];
+    response[0] = '\0';
+
+    while (comm_serve(cxstr, response, command) == 0) {
+        interpret_command(db, command, response, sizeof(response));
+    }
+    comm_shutdown(cxstr);
+    return NULL;
+}
+
+static void net_accept(FILE *cxstr) {
+    pthread_t thread;
+    pthread_attr_t attr;
+    int err;
+
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    if ((err = pthread_create(&thread, &attr, net_serve, cxstr))) {
+        handle_error_en(err, "pthread_create");
+    }
+    pthread_attr_destroy(&attr);
+}
+
+/* Connects to the local listener, waiting for it to come up if need be. */
+static int net_connect(int port) {
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    for (int i = 0; i < CONNECT_TRIES; i++) {
+        int sock;
+        if ((sock = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
+            perror("socket");
+            exit(1);
+        }
+        if (connect(sock, (struct sockaddr *)&addr, sizeof(addr)) == 0) {
+            int one = 1;
+            setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+            return sock;
+        }
+        close(sock);
+        usleep(10000);
+    }
+    fprintf(stderr, "Failed to connect to port %d!\n", port);
+    exit(1);
+}
+
+/* Sends one command and reads its response line. */
+static void net_request(int sock, FILE *in, const char *command, char *result,
+                        size_t cap) {
+    size_t len = strlen(command);
+    for (size_t off = 0; off < len;) {
+        ssize_t n = send(sock, command + off, len - off, MSG_NOSIGNAL);
+        if (n < 0) {
+            perror("send");
+            exit(1);
+        }
+        off += n;
+    }
+    if (fgets(result, cap, in) == NULL) {
+        fprintf(stderr, "Connection terminated.\n");
+        exit(1);
+    }
+}
+
+//------------------------------------------------------------------------------------------------
+// Running a workload
+
+static void *preload_worker(void *arg) {
+    worker_t *w = (worker_t *)arg;
+    const bench_config_t *c = w->config;
+    char key[MAX_KEY + 1], value[MAX_VALUE + 1];
+    memset(value, 'v', c->value_size);
+    value[c->value_size] = '\0';
+
+    for (uint64_t i = w->id; i < c->dataset; i += c->threads) {
+        make_key(key, c, 2 * i);
+        db_add(db, key, value);
+    }
+    return NULL;
+}
+
+static void *bench_worker(void *arg) {
+    worker_t *w = (worker_t *)arg;
+    const bench_config_t *c = w->config;
+    uint64_t rng = rand_seed(c->seed + w->id);
+    char key[MAX_KEY + 1], value[MAX_VALUE + 1], result[MAX_VALUE + 1];
+    char command[BUFLEN];
+    int sock = -1;
+    FILE *in = NULL;
+    memset(value, 'v', c->value_size);
+    value[c->value_size] = '\0';
+
+    for (int o = 0; o < NUM_OPS; o++) {
+        hist_init(&w->hist[o]);
+    }
+    if (c->mode == mode_net) {
+        sock = net_connect(c->port);
+        if ((in = fdopen(sock, "r")) == NULL) {
+            perror("fdopen");
+            exit(1);
+        }
+    }
+    pthread_barrier_wait(w->barrier);
+
+    for (uint64_t i = 0; i < c->ops; i++) {
+        make_key(key, c, keygen_next(c->keygen, &rng, 2 * c->dataset));
+        enum bench_op op;
+        if (rand_unit(&rng) < c->read_ratio) {
+            op = op_query;
+        } else {
+            op = (rand_next(&rng) & 1) ? op_add : op_remove;
+        }
+
+        if (c->mode == mode_net) {
+            if (op == op_query) {
+                snprintf(command, sizeof(command), "q %s\n", key);
+            } else if (op == op_add) {
+                snprintf(command, sizeof(command), "a %s %s\n", key, value);
+            } else {
+                snprintf(command, sizeof(command), "d %s\n", key);
+            }
+        }
+
+        uint64_t start = metrics_now_ns();
+        if (c->mode == mode_net) {
+            net_request(sock, in, command, result, sizeof(result));
+        } else {
+            switch (op) {
+                case op_query:
+                    db_query(db, key, result, sizeof(result));
+                    break;
+                case op_add:
+                    db_add(db, key, value);
+                    break;
+                default:
+                    db_remove(db, key);
+                    break;
+            }
+        }
+        hist_record(&w->hist[op], metrics_now_ns() - start);
+    }
+
+    if (in != NULL) {
+        fclose(in);  // the server thread sees EOF and exits
+    }
+    return NULL;
+}
+
+/* Starts config->threads threads running fn and waits for them. */
+static void run_workers(const bench_config_t *config, worker_t *workers,
+                        void *(*fn)(void *), pthread_barrier_t *barrier) {
+    int err;
+    for (int t = 0; t < config->threads; t++) {
+        workers[t].id = t;
+        workers[t].config = config;
+        workers[t].barrier = barrier;
+        if ((err = pthread_create(&workers[t].thread, 0, fn, &workers[t]))) {
+            handle_error_en(err, "pthread_create");
+        }
+    }
+    if (barrier != NULL) {
+        pthread_barrier_wait(barrier);
+    }
+}
+
+static void join_workers(const bench_config_t *config, worker_t *workers) {
+    int err;
+    for (int t = 0; t < config->threads; t++) {
+        if ((err = pthread_join(workers[t].thread, 0))) {
+            handle_error_en(err, "pthread_join");
+        }
+    }
+}
+
+static double cpu_seconds(void) {
+    struct rusage ru;
+    getrusage(RUSAGE_SELF, &ru);
+    return ru.ru_utime.tv_sec + ru.ru_stime.tv_sec +
+           (ru.ru_utime.tv_usec + ru.ru_stime.tv_usec) / 1e6;
+}
+
+/* Loads the dataset, runs the workload and empties the database again. */
+static void run_bench(const bench_config_t *config, bench_result_t *result) {
+    worker_t *workers;
+    pthread_barrier_t barrier;
+
+    if ((workers = calloc(config->threads, sizeof(worker_t))) == NULL) {
+        perror("calloc");
+        exit(1);
+    }
+
+    run_workers(config, workers, preload_worker, NULL);
+    join_workers(config, workers);
+
+    // The barrier includes this thread so the clock starts with the workers
+    pthread_barrier_init(&barrier, NULL, config->threads + 1);
+    run_workers(config, workers, bench_worker, &barrier);
+    uint64_t start = metrics_now_ns();
+    double cpu_start = cpu_seconds();
+    join_workers(config, workers);
+    result->seconds = (double)(metrics_now_ns() - start) / 1e9;
+    result->cpu_seconds = cpu_seconds() - cpu_start;
+    pthread_barrier_destroy(&barrier);
+
+    for (int o = 0; o < NUM_OPS; o++) {
+        hist_init(&result->hist[o]);
+        for (int t = 0; t < config->threads; t++) {
+            hist_merge(&result->hist[o], &workers[t].hist[o]);
+        }
+    }
+    free(workers);
+    db_cleanup(db);
+}
+
+//------------------------------------------------------------------------------------------------
+// Reporting
+
+static void print_header(enum bench_format format) {
+    if (format == fmt_csv) {
+        printf("engine,mode,threads,read_ratio,key_size,value_size,dataset,"
+               "distribution,op,ops,seconds,ops_per_sec,mean_ns,p50_ns,"
+               "p90_ns,p99_ns,p999_ns,max_ns,cpu_cores,cpu_util\n");
+    }
+}
+
+/* Sums the per-operation histograms of a run. */
+static void merge_all(const bench_result_t *r, hist_t *all) {
+    hist_init(all);
+    for (int o = 0; o < NUM_OPS; o++) {
+        hist_merge(all, &r->hist[o]);
+    }
+}
+
+/*
+ * Prints one row for the whole run ("all") and one per operation type. CPU
+ * use is in cores busy on average (cpu_cores) and as a fraction of all the
+ * machine's cores (cpu_util); in net mode it includes the client side.
+ */
+static void print_result(enum bench_format format, const bench_config_t *c,
+                         const bench_result_t *r) {
+    double cores = r->cpu_seconds / r->seconds;
+    double util = cores / sysconf(_SC_NPROCESSORS_ONLN);
+    hist_t all;
+    merge_all(r, &all);
+
+    for (int o = -1; o < NUM_OPS; o++) {
+        const hist_t *h = o < 0 ? &all : &r->hist[o];
+        const char *name = o < 0 ? "all" : op_names[o];
+        if (h->total == 0)
+            continue;
+        double ops_per_sec = h->total / r->seconds;
+        if (format == fmt_csv) {
+            printf("bst,%s,%d,%.2f,%d,%d,%lu,%s,%s,%lu,%.3f,%.0f,%.0f,%lu,"
+                   "%lu,%lu,%lu,%lu,%.2f,%.3f\n",
+                   mode_names[c->mode], c->threads, c->read_ratio,
+                   c->key_size, c->value_size, c->dataset,
+                   keygen_name(c->keygen), name, h->total, r->seconds,
+                   ops_per_sec, hist_mean(h), hist_percentile(h, 50),
+                   hist_percentile(h, 90), hist_percentile(h, 99),
+                   hist_percentile(h, 99.9), h->max, cores, util);
+        } else {
+            printf("{\"engine\":\"bst\",\"mode\":\"%s\",\"threads\":%d,"
+                   "\"read_ratio\":%.2f,\"key_size\":%d,\"value_size\":%d,"
+                   "\"dataset\":%lu,\"distribution\":\"%s\",\"op\":\"%s\","
+                   "\"ops\":%lu,\"seconds\":%.3f,\"ops_per_sec\":%.0f,"
+                   "\"mean_ns\":%.0f,\"p50_ns\":%lu,\"p90_ns\":%lu,"
+                   "\"p99_ns\":%lu,\"p999_ns\":%lu,\"max_ns\":%lu,"
+                   "\"cpu_cores\":%.2f,\"cpu_util\":%.3f}\n",
+                   mode_names[c->mode], c->threads, c->read_ratio,
+                   c->key_size, c->value_size, c->dataset,
+                   keygen_name(c->keygen), name, h->total, r->seconds,
+                   ops_per_sec, hist_mean(h), hist_percentile(h, 50),
+                   hist_percentile(h, 90), hist_percentile(h, 99),
+                   hist_percentile(h, 99.9), h->max, cores, util);
+        }
+    }
+    fflush(stdout);
+}
+
+/* Adds a run to the samples of its configuration. */
+static void add_sample(bench_samples_t *s, const bench_result_t *r) {
+    hist_t all;
+    merge_all(r, &all);
+    for (int o = 0; o <= NUM_OPS; o++) {
+        const hist_t *h = o == 0 ? &all : &r->hist[o - 1];
+        s->ops[o] += h->total;
+        s->ops_per_sec[o][s->reps] = h->total / r->seconds;
+        s->p50_ns[o][s->reps] = hist_percentile(h, 50);
+        s->p99_ns[o][s->reps] = hist_percentile(h, 99);
+    }
+    s->reps++;
+}
+
+/*
+ * Writes a configuration's samples as members of the "results" object of the
+ * -O file, one per operation, keyed by everything that defines the run.
+ */
+static void write_samples(FILE *out, int *first, const bench_config_t *c,
+                          const bench_samples_t *s) {
+    for (int o = 0; o <= NUM_OPS; o++) {
+        const char *name = o == 0 ? "all" : op_names[o - 1];
+        if (s->ops[o] == 0)
+            continue;
+        fprintf(out,
+                "%s\n    \"%s/t%d/r%.2f/k%d/v%d/n%lu/%s/%s\": {"
+                "\"mode\": \"%s\", \"threads\": %d, \"read_ratio\": %.2f, "
+                "\"key_size\": %d, \"value_size\": %d, \"dataset\": %lu, "
+                "\"distribution\": \"%s\", \"op\": \"%s\", \"reps\": %d",
+                *first ? "" : ",", mode_names[c->mode], c->threads,
+                c->read_ratio, c->key_size, c->value_size, c->dataset,
+                keygen_name(c->keygen), name, mode_names[c->mode], c->threads,
+                c->read_ratio, c->key_size, c->value_size, c->dataset,
+                keygen_name(c->keygen), name, s->reps);
+        fprintf(out, ", \"ops_per_sec\": [");
+        for (int i = 0; i < s->reps; i++) {
+            fprintf(out, "%s%.0f", i ? ", " : "", s->ops_per_sec[o][i]);
+        }
+        fprintf(out, "], \"p50_ns\": [");
+        for (int i = 0; i < s->reps; i++) {
+            fprintf(out, "%s%lu", i ? ", " : "", s->p50_ns[o][i]);
+        }
+        fprintf(out, "], \"p99_ns\": [");
+        for (int i = 0; i < s->reps; i++) {
+            fprintf(out, "%s%lu", i ? ", " : "", s->p99_ns[o][i]);
+        }
+        fprintf(out, "]}");
+        *first = 0;
+    }
+}
+
+//------------------------------------------------------------------------------------------------
+// Main function
+
+static void usage(const char *cmd) {
+    fprintf(stderr,
+            "Usage: %s [-t threads] [-r read ratio] [-k key size] "
+            "[-v value size]\n"
+            "       [-n dataset keys] [-o ops per thread] [-s seed] "
+            "[-f csv|json]\n"
+            "       [-d uniform|zipfian|sequential|latest|hotspot] "
+            "[-z distribution parameter]\n"
+            "       [-m inproc|net|both] [-p port] [-T sweep up to threads]\n"
+            "       [-R repetitions] [-O results.json]\n",
+            cmd);
+}
+
+int main(int argc, char *argv[]) {
+    bench_config_t config = {4, 0.9, 16, 32, 100000, 100000, 1, NULL,
+                             mode_inproc, 9300};
+    enum bench_format format = fmt_csv;
+    int modes[NUM_MODES] = {1, 0};  // which modes to run
+    int sweep = 0;
+    int reps = 1;
+    const char *results_path = NULL;
+    FILE *results = NULL;
+    const char *dist = "uniform";
+    double dist_param = 0;
+    keygen_t keygen;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "t:r:k:v:n:o:s:f:d:z:m:p:T:R:O:")) != -1) {
+        switch (opt) {
+            case 't':
+                config.threads = atoi(optarg);
+                break;
+            case 'r':
+                config.read_ratio = atof(optarg);
+                break;
+            case 'k':
+                config.key_size = atoi(optarg);
+                break;
+            case 'v':
+                config.value_size = atoi(optarg);
+                break;
+            case 'n':
+                config.dataset = strtoull(optarg, NULL, 10);
+                break;
+            case 'o':
+                config.ops = strtoull(optarg, NULL, 10);
+                break;
+            case 's':
+                config.seed = strtoull(optarg, NULL, 10);
+                break;
+            case 'd':
+                dist = optarg;
+                break;
+            case 'm':
+                if (strcmp(optarg, "inproc") != 0 &&
+                    strcmp(optarg, "net") != 0 && strcmp(optarg, "both") != 0) {
+                    usage(argv[0]);
+                    return 1;
+                }
+                modes[mode_inproc] = strcmp(optarg, "net") != 0;
+                modes[mode_net] = strcmp(optarg, "inproc") != 0;
+                break;
+            case 'p':
+                config.port = atoi(optarg);
+                break;
+            case 'T':
+                sweep = atoi(optarg);
+                break;
+            case 'R':
+                reps = atoi(optarg);
+                break;
+            case 'O':
+                results_path = optarg;
+                break;
+            case 'z':
+                dist_param = atof(optarg);
+                break;
+            case 'f':
+                if (strcmp(optarg, "csv") == 0) {
+                    format = fmt_csv;
+                } else if (strcmp(optarg, "json") == 0) {
+                    format = fmt_json;
+                } else {
+                    usage(argv[0]);
+                    return 1;
+                }
+                break;
+            default:
+                usage(argv[0]);
+                return 1;
+        }
+    }
+    if (config.threads < 1 || config.key_size < 1 ||
+        config.key_size > MAX_KEY || config.value_size < 1 ||
+        config.value_size > MAX_VALUE || config.dataset < 1 ||
+        config.read_ratio < 0 || config.read_ratio > 1 || reps < 1 ||
+        reps > MAX_REPS ||
+        keygen_init(&keygen, dist, 2 * config.dataset, dist_param) < 0) {
+        usage(argv[0]);
+        return 1;
+    }
+    config.keygen = &keygen;
+    if ((db = db_create()) == NULL) {
+        perror("db_create");
+        return 1;
+    }
+
+    if (results_path != NULL) {
+        if ((results = fopen(results_path, "w")) == NULL) {
+            perror("Error opening results file");
+            return 1;
+        }
+        fprintf(results, "{\"engine\": \"bst\", \"results\": {");
+    }
+    if (modes[mode_net]) {
+        start_listener(config.port, net_accept);
+    }
+
+    // A sweep doubles the thread count up to its limit, which is always run
+    int from = sweep > 0 ? 1 : config.threads;
+    int to = sweep > 0 ? sweep : config.threads;
+    bench_result_t result;
+    bench_samples_t *samples;
+    int first = 1;
+    if ((samples = malloc(sizeof(bench_samples_t))) == NULL) {
+        perror("malloc");
+        return 1;
+    }
+    print_header(format);
+    for (int threads = from;; threads *= 2) {
+        config.threads = threads < to ? threads : to;
+        for (int m = 0; m < NUM_MODES; m++) {
+            if (!modes[m])
+                continue;
+            config.mode = m;
+            memset(samples, 0, sizeof(*samples));
+            for (int rep = 0; rep < reps; rep++) {
+                run_bench(&config, &result);
+                print_result(format, &config, &result);
+                add_sample(samples, &result);
+            }
+            if (results != NULL) {
+                write_samples(results, &first, &config, samples);
+            }
+        }
+        if (config.threads == to)
+            break;
+    }
+    free(samples);
+
+    if (results != NULL) {
+        fprintf(results, "\n}}\n");
+        fclose(results);
+    }
+    return 0;
+}
@@ -0,0 +1,73 @@
+#include <string.h>
+
+#include "./hist.h"
+
+#define SUB_COUNT (1u << HIST_SUB_BITS)
+
+/* Maps a value to its bucket. Values below SUB_COUNT get a bucket each. */
+static int bucket_of(uint64_t value) {
+    if (value < SUB_COUNT)
+        return (int)value;
+    int msb = 63 - __builtin_clzll(value);
+    int shift = msb - HIST_SUB_BITS;
+    int sub = (int)((value >> shift) - SUB_COUNT);
+    return ((shift + 1) << HIST_SUB_BITS) | sub;
+}
+
+/* Returns the largest value that maps to bucket b. */
+static uint64_t bucket_top(int b) {
+    int group = b >> HIST_SUB_BITS;
+    uint64_t sub = b & (SUB_COUNT - 1);
+    if (group == 0)
+        return sub;
+    int shift = group - 1;
+    return ((SUB_COUNT + sub) << shift) + ((1ull << shift) - 1);
+}
+
+void hist_init(hist_t *h) {
+    memset(h, 0, sizeof(*h));
+    h->min = UINT64_MAX;
+}
+
+void hist_record_n(hist_t *h, uint64_t value, uint64_t count) {
+    h->counts[bucket_of(value)] += count;
+    h->total += count;
+    h->sum += (double)value * count;
+    if (value < h->min)
+        h->min = value;
+    if (value > h->max)
+        h->max = value;
+}
+
+void hist_merge(hist_t *dst, const hist_t *src) {
+    for (int b = 0; b < HIST_BUCKETS; b++) {
+        dst->counts[b] += src->counts[b];
+    }
+    dst->total += src->total;
+    dst->sum += src->sum;
+    if (src->min < dst->min)
+        dst->min = src->min;
+    if (src->max > dst->max)
+        dst->max = src->max;
+}
+
+uint64_t hist_percentile(const hist_t *h, double p) {
+    if (h->total == 0)
+        return 0;
+    uint64_t rank = (uint64_t)(p / 100.0 * h->total + 0.5);
+    if (rank < 1)
+        rank = 1;
+    uint64_t seen = 0;
+    for (int b = 0; b < HIST_BUCKETS; b++) {
+        seen += h->counts[b];
+        if (seen >= rank) {
+            uint64_t top = bucket_top(b);
+            return top < h->max ? top : h->max;
+        }
+    }
+    return h->max;
+}
+
+double hist_mean(const hist_t *h) {
+    return h->total > 0 ? h->sum / h->total : 0.0;
+}
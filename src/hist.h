@@ -0,0 +1,41 @@
+#ifndef HIST_H_
+#define HIST_H_
+
+#include <stdint.h>
+
+/*
+ * Log-linear latency histogram in the style of HdrHistogram: every power of
+ * two is split into 2^HIST_SUB_BITS equal buckets, so any recorded value is
+ * reported within about 3% of its true value. Not thread-safe; give each
+ * thread its own and merge them.
+ */
+
+#define HIST_SUB_BITS 5
+#define HIST_BUCKETS ((64 - HIST_SUB_BITS + 1) << HIST_SUB_BITS)
+
+typedef struct hist {
+    uint64_t counts[HIST_BUCKETS];
+    uint64_t total;
+    uint64_t min;
+    uint64_t max;
+    double sum;
+} hist_t;
+
+void hist_init(hist_t *h);
+
+/* Records count occurrences of value. */
+void hist_record_n(hist_t *h, uint64_t value, uint64_t count);
+
+static inline void hist_record(hist_t *h, uint64_t value) {
+    hist_record_n(h, value, 1);
+}
+
+/* Adds every recorded value of src to dst. */
+void hist_merge(hist_t *dst, const hist_t *src);
+
+/* Returns the value at or below which p percent of recorded values fall. */
+uint64_t hist_percentile(const hist_t *h, double p);
+
+double hist_mean(const hist_t *h);
+
+#endif  // HIST_H_
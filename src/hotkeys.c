@@ -0,0 +1,289 @@
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "./hotkeys.h"
+#include "./comm.h"
+
+#define HOTKEYS_SLOTS 64  // counters per summary
+#define HOTKEY_LEN 256
+#define HOTKEYS_DEFAULT_TOP 20
+
+typedef struct hotkey {
+    char key[HOTKEY_LEN];
+    uint64_t count;  // overestimates the true count by at most err
+    uint64_t err;
+} hotkey_t;
+
+/*
+ * A SpaceSaving summary. The mutex is only contended while a report merges
+ * the summaries, and is only taken on sampled accesses.
+ */
+typedef struct summary {
+    pthread_mutex_t mutex;
+    int used;
+    hotkey_t slots[HOTKEYS_SLOTS];
+
+    struct summary *prev;
+    struct summary *next;
+} summary_t;
+
+int hotkeys_sample_every = 64;
+
+static __thread int countdown = 0;
+static __thread summary_t *thread_summary = NULL;
+
+// Live summaries, plus one holding the merged summaries of exited threads
+static summary_t *summary_list_head = NULL;
+static summary_t retired = {PTHREAD_MUTEX_INITIALIZER, 0, {{{0}, 0, 0}},
+                            NULL, NULL};
+static pthread_mutex_t summary_list_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static pthread_key_t summary_key;
+static pthread_once_t summary_key_once = PTHREAD_ONCE_INIT;
+
+//------------------------------------------------------------------------------------------------
+// SpaceSaving
+
+/*
+ * Adds weight accesses of key (with the given error) to a summary whose
+ * mutex is held. When the summary is full the least-counted key is evicted
+ * and its count becomes the newcomer's error.
+ */
+static void summary_add(summary_t *s, const char *key, uint64_t weight,
+                        uint64_t err) {
+    int min = 0;
+    for (int i = 0; i < s->used; i++) {
+        if (strcmp(s->slots[i].key, key) == 0) {
+            s->slots[i].count += weight;
+            s->slots[i].err += err;
+            return;
+        }
+        if (s->slots[i].count < s->slots[min].count) {
+            min = i;
+        }
+    }
+
+    hotkey_t *slot;
+    if (s->used < HOTKEYS_SLOTS) {
+        slot = &s->slots[s->used++];
+        slot->count = 0;
+        slot->err = 0;
+    } else {
+        slot = &s->slots[min];
+        slot->err = slot->count;
+    }
+    snprintf(slot->key, HOTKEY_LEN, "%s", key);
+    slot->count += weight;
+    slot->err += err;
+}
+
+/*
+ * What a key the summary does not hold may have been counted: nothing until
+ * it fills up, since no key has been evicted.
+ */
+static uint64_t summary_min(const summary_t *s) {
+    uint64_t min = UINT64_MAX;
+    if (s->used < HOTKEYS_SLOTS)
+        return 0;
+    for (int i = 0; i < s->used; i++) {
+        if (s->slots[i].count < min)
+            min = s->slots[i].count;
+    }
+    return min;
+}
+
+static int summary_find(const summary_t *s, const char *key) {
+    for (int i = 0; i < s->used; i++) {
+        if (strcmp(s->slots[i].key, key) == 0)
+            return i;
+    }
+    return -1;
+}
+
+/*
+ * Merges src into dst, both locked. A key only dst holds may have been
+ * counted up to src's minimum in src, which goes into its count and error.
+ */
+static void summary_merge(summary_t *dst, const summary_t *src) {
+    uint64_t min = summary_min(src);
+    for (int i = 0; min > 0 && i < dst->used; i++) {
+        if (summary_find(src, dst->slots[i].key) < 0) {
+            dst->slots[i].count += min;
+            dst->slots[i].err += min;
+        }
+    }
+    for (int i = 0; i < src->used; i++) {
+        summary_add(dst, src->slots[i].key, src->slots[i].count,
+                    src->slots[i].err);
+    }
+}
+
+//------------------------------------------------------------------------------------------------
+// Summary lifecycle
+
+/* Thread-exit destructor: merges the summary into the retired one. */
+static void summary_retire(void *arg) {
+    summary_t *s = (summary_t *)arg;
+
+    pthread_mutex_lock(&summary_list_mutex);
+    if (s->next != NULL) {
+        s->next->prev = s->prev;
+    }
+    if (s->prev != NULL) {
+        s->prev->next = s->next;
+    }
+    if (s == summary_list_head) {
+        summary_list_head = s->next;
+    }
+    pthread_mutex_lock(&retired.mutex);
+    summary_merge(&retired, s);
+    pthread_mutex_unlock(&retired.mutex);
+    pthread_mutex_unlock(&summary_list_mutex);
+
+    thread_summary = NULL;
+    pthread_mutex_destroy(&s->mutex);
+    free(s);
+}
+
+static void summary_key_create(void) {
+    int err;
+    if ((err = pthread_key_create(&summary_key, summary_retire))) {
+        handle_error_en(err, "pthread_key_create");
+    }
+}
+
+static summary_t *summary_create(void) {
+    summary_t *s;
+    int err;
+
+    pthread_once(&summary_key_once, summary_key_create);
+    if ((s = calloc(1, sizeof(summary_t))) == NULL) {
+        perror("Unable to malloc space for a hot key summary");
+        exit(1);
+    }
+    pthread_mutex_init(&s->mutex, NULL);
+    if ((err = pthread_setspecific(summary_key, s))) {
+        handle_error_en(err, "pthread_setspecific");
+    }
+
+    pthread_mutex_lock(&summary_list_mutex);
+    s->next = summary_list_head;
+    if (summary_list_head != NULL) {
+        summary_list_head->prev = s;
+    }
+    summary_list_head = s;
+    pthread_mutex_unlock(&summary_list_mutex);
+
+    thread_summary = s;
+    return s;
+}
+
+//------------------------------------------------------------------------------------------------
+// Recording and reporting
+
+void hotkeys_record(const char *key) {
+    int every = __atomic_load_n(&hotkeys_sample_every, __ATOMIC_RELAXED);
+    if (every <= 0 || --countdown > 0)
+        return;
+    countdown = every;
+
+    summary_t *s = thread_summary;
+    if (s == NULL) {
+        s = summary_create();
+    }
+    // Counted in accesses at the rate it was sampled at, so changing the
+    // rate leaves what is already counted as it was
+    pthread_mutex_lock(&s->mutex);
+    summary_add(s, key, every, 0);
+    pthread_mutex_unlock(&s->mutex);
+}
+
+/* A key of the merged summaries. */
+typedef struct merged {
+    hotkey_t hotkey;   // summed over the summaries that hold it
+    uint64_t held_min; // the minimums of those summaries
+} merged_t;
+
+static int compare_count_desc(const void *a, const void *b) {
+    const hotkey_t *x = &((const merged_t *)a)->hotkey;
+    const hotkey_t *y = &((const merged_t *)b)->hotkey;
+    if (x->count != y->count)
+        return x->count < y->count ? 1 : -1;
+    return strcmp(x->key, y->key);
+}
+
+void hotkeys_write_top(FILE *out, int n) {
+    // Merge into one summary large enough to hold every candidate
+    size_t cap = HOTKEYS_SLOTS, used = 0;
+    uint64_t min_sum = 0;  // every summary's minimum
+    merged_t *all = malloc(cap * sizeof(merged_t));
+    if (all == NULL) {
+        perror("malloc");
+        return;
+    }
+
+    pthread_mutex_lock(&summary_list_mutex);
+    for (summary_t *s = &retired; s != NULL;
+         s = (s == &retired) ? summary_list_head : s->next) {
+        pthread_mutex_lock(&s->mutex);
+        uint64_t min = summary_min(s);
+        min_sum += min;
+        for (int i = 0; i < s->used; i++) {
+            size_t j;
+            for (j = 0; j < used; j++) {
+                if (strcmp(all[j].hotkey.key, s->slots[i].key) == 0)
+                    break;
+            }
+            if (j == used) {
+                if (used == cap) {
+                    merged_t *grown = realloc(all, 2 * cap * sizeof(merged_t));
+                    if (grown == NULL)
+                        break;
+                    all = grown;
+                    cap *= 2;
+                }
+                all[used].hotkey = s->slots[i];
+                all[used++].held_min = min;
+            } else {
+                all[j].hotkey.count += s->slots[i].count;
+                all[j].hotkey.err += s->slots[i].err;
+                all[j].held_min += min;
+            }
+        }
+        pthread_mutex_unlock(&s->mutex);
+    }
+    pthread_mutex_unlock(&summary_list_mutex);
+
+    // A summary that does not hold a key may have counted it up to its
+    // minimum, so that goes into the key's count and error
+    for (size_t i = 0; i < used; i++) {
+        all[i].hotkey.count += min_sum - all[i].held_min;
+        all[i].hotkey.err += min_sum - all[i].held_min;
+    }
+    qsort(all, used, sizeof(merged_t), compare_count_desc);
+
+    fprintf(out, "%-4s %14s %14s  %s\n", "rank", "accesses", "error", "key");
+    for (size_t i = 0; i < used && (int)i < n; i++) {
+        fprintf(out, "%-4zu %14lu %14lu  %s\n", i + 1, all[i].hotkey.count,
+                all[i].hotkey.err, all[i].hotkey.key);
+    }
+    free(all);
+}
+
+void hotkeys_write(FILE *out) {
+    hotkeys_write_top(out, HOTKEYS_DEFAULT_TOP);
+}
+
+void hotkeys_reset(void) {
+    pthread_mutex_lock(&summary_list_mutex);
+    for (summary_t *s = &retired; s != NULL;
+         s = (s == &retired) ? summary_list_head : s->next) {
+        pthread_mutex_lock(&s->mutex);
+        s->used = 0;
+        pthread_mutex_unlock(&s->mutex);
+    }
+    pthread_mutex_unlock(&summary_list_mutex);
+}
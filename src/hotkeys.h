@@ -0,0 +1,27 @@
+#ifndef HOTKEYS_H_
+#define HOTKEYS_H_
+
+#include <stdio.h>
+
+/*
+ * Approximate top-k of accessed keys. Every thread keeps its own SpaceSaving
+ * summary, fed with one access in every `hotkeys_sample_every`; the summaries
+ * are only merged when a report is asked for. Each sampled access counts as
+ * the accesses the rate then in force stands for.
+ */
+
+extern int hotkeys_sample_every;  // 0 turns sampling off
+
+/* Counts an access to key, subject to sampling. */
+void hotkeys_record(const char *key);
+
+/* Writes the n hottest keys with their estimated access counts. */
+void hotkeys_write_top(FILE *out, int n);
+
+/* Writes the default-sized report, for the admin page. */
+void hotkeys_write(FILE *out);
+
+/* Forgets every access counted so far. */
+void hotkeys_reset(void);
+
+#endif  // HOTKEYS_H_
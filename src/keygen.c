@@ -0,0 +1,92 @@
+#include <math.h>
+#include <string.h>
+
+#include "./keygen.h"
+#include "./rand.h"
+
+#define DEFAULT_THETA 0.99
+#define DEFAULT_HOT_FRACTION 0.2
+#define DEFAULT_HOT_OP_FRACTION 0.8
+
+static const char *dist_names[] = {"uniform", "zipfian", "sequential",
+                                   "latest", "hotspot"};
+
+static double zeta(uint64_t n, double theta) {
+    double sum = 0;
+    for (uint64_t i = 1; i <= n; i++) {
+        sum += 1.0 / pow((double)i, theta);
+    }
+    return sum;
+}
+
+int keygen_init(keygen_t *g, const char *name, uint64_t items, double param) {
+    memset(g, 0, sizeof(*g));
+    int dist;
+    for (dist = 0; dist <= kg_hotspot; dist++) {
+        if (strcmp(name, dist_names[dist]) == 0)
+            break;
+    }
+    if (dist > kg_hotspot || items < 1)
+        return -1;
+    g->dist = dist;
+    g->items = items;
+
+    if (dist == kg_zipfian || dist == kg_latest) {
+        // Gray et al., "Quickly generating billion-record synthetic
+        // databases", as YCSB does it; theta must stay below 1
+        g->theta = param > 0 ? param : DEFAULT_THETA;
+        if (g->theta >= 1)
+            return -1;
+        g->zeta_n = zeta(items, g->theta);
+        g->alpha = 1.0 / (1.0 - g->theta);
+        g->eta = (1.0 - pow(2.0 / items, 1.0 - g->theta)) /
+                 (1.0 - zeta(2, g->theta) / g->zeta_n);
+    } else if (dist == kg_hotspot) {
+        g->hot_fraction = param > 0 ? param : DEFAULT_HOT_FRACTION;
+        g->hot_op_fraction = DEFAULT_HOT_OP_FRACTION;
+        if (g->hot_fraction >= 1)
+            return -1;
+    }
+    return 0;
+}
+
+/* A zipfian rank in [0, items): 0 is the most popular. */
+static uint64_t zipf_rank(const keygen_t *g, uint64_t *rng) {
+    double u = rand_unit(rng);
+    double uz = u * g->zeta_n;
+    if (uz < 1.0)
+        return 0;
+    if (uz < 1.0 + pow(0.5, g->theta))
+        return 1;
+    uint64_t rank =
+        (uint64_t)(g->items * pow(g->eta * u - g->eta + 1, g->alpha));
+    return rank < g->items ? rank : g->items - 1;
+}
+
+uint64_t keygen_next(keygen_t *g, uint64_t *rng, uint64_t n) {
+    uint64_t rank, hot;
+
+    switch (g->dist) {
+        case kg_zipfian:
+            // Scatter the popular ranks so they are not neighbours in the tree
+            return rand_mix64(zipf_rank(g, rng)) % n;
+        case kg_sequential:
+            return __atomic_fetch_add(&g->next, 1, __ATOMIC_RELAXED) % n;
+        case kg_latest:
+            rank = zipf_rank(g, rng);
+            return rank < n ? n - 1 - rank : 0;
+        case kg_hotspot:
+            hot = (uint64_t)(n * g->hot_fraction);
+            if (hot == 0)
+                hot = 1;
+            if (hot == n || rand_unit(rng) < g->hot_op_fraction)
+                return rand_next(rng) % hot;
+            return hot + rand_next(rng) % (n - hot);
+        default:
+            return rand_next(rng) % n;
+    }
+}
+
+const char *keygen_name(const keygen_t *g) {
+    return dist_names[g->dist];
+}
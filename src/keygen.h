@@ -0,0 +1,57 @@
+#ifndef KEYGEN_H_
+#define KEYGEN_H_
+
+#include <stdint.h>
+
+/*
+ * Key-index generators for the benchmark tools, after YCSB's request
+ * distributions. A generator picks indices in [0, n) for a key space of n
+ * items, where n may grow as a run inserts keys:
+ *
+ *   uniform     every index equally likely
+ *   zipfian     skewed by theta (0.99 by default) towards a few indices,
+ *               which are scattered over the key space by hashing
+ *   sequential  0, 1, 2, ... shared by all threads, wrapping at n
+ *   latest      zipfian towards the most recently inserted indices
+ *   hotspot     a fraction of the ops (0.8) go to a fraction of the
+ *               indices (0.2), the rest to the remainder
+ *
+ * Randomness comes from the caller's rand.h state, so runs with the same
+ * seed draw the same keys.
+ */
+
+enum keygen_dist {
+    kg_uniform,
+    kg_zipfian,
+    kg_sequential,
+    kg_latest,
+    kg_hotspot
+};
+
+typedef struct keygen {
+    enum keygen_dist dist;
+    uint64_t items;  // size of the key space the zipfian constants are for
+    double theta;
+    double alpha;
+    double eta;
+    double zeta_n;
+    double hot_fraction;
+    double hot_op_fraction;
+    uint64_t next;  // sequential position, shared
+} keygen_t;
+
+/*
+ * Sets up a generator of the named distribution over items indices. param is
+ * theta for zipfian and latest, the hot data fraction for hotspot, and is
+ * ignored otherwise; 0 picks the default. Returns 0, or -1 if the name or
+ * parameter is not valid.
+ */
+int keygen_init(keygen_t *g, const char *name, uint64_t items, double param);
+
+/* Returns the next index, below n. */
+uint64_t keygen_next(keygen_t *g, uint64_t *rng, uint64_t n);
+
+/* The distribution's name, as keygen_init takes it. */
+const char *keygen_name(const keygen_t *g);
+
+#endif  // KEYGEN_H_
@@ -0,0 +1,1018 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <math.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "./capture.h"
+#include "./comm.h"
+#include "./hist.h"
+#include "./keygen.h"
+#include "./rand.h"
+#include "./ring.h"
+#include "./workload.h"
+
+/*
+ * Open-loop load generator. A few threads each run an epoll loop over their
+ * share of the connections and issue requests on a fixed schedule (or a
+ * Poisson one) at the target rate, whether or not earlier requests have been
+ * answered; requests are pipelined on each connection.
+ *
+ * Latency is measured from the time a request was scheduled to be sent, not
+ * from when it actually went out, so a stalled server or a backed-up socket
+ * shows up in the percentiles instead of silently lowering the offered load
+ * (coordinated omission). The uncorrected service time is reported too.
+ *
+ * Requests come from a script, from a YCSB core workload (-w), or are plain
+ * queries of keys drawn from a keygen distribution (-k). With -l the
+ * workload's records are first inserted as fast as the server takes them.
+ *
+ * With -C, a capture recorded by the server's `capture` command is replayed
+ * instead: one connection per captured connection, each command sent at its
+ * original time (divided by the -x speed-up), again whether or not earlier
+ * ones have been answered.
+ *
+ * With -H, the load is spread over several servers by consistent hashing,
+ * as the client library's clusters do: every connection becomes one to each
+ * server, and each request goes to the server its key belongs to.
+ */
+
+#define LINE_MAX_LEN 1024
+#define READ_CHUNK 65536
+#define DRAIN_NS 5000000000ull  // wait for stragglers after the run
+#define LOAD_BATCH 256           // inserts in flight per load connection
+#define MAX_SERVERS 64
+
+typedef struct command_pool {
+    char **lines;  // newline-terminated
+    size_t *lens;
+    size_t count;
+} command_pool_t;
+
+typedef struct lg_config {
+    const char *hosts[MAX_SERVERS];
+    const char *ports[MAX_SERVERS];
+    int nservers;
+    ring_t ring;  // with more than one server
+    int threads;
+    int connections;
+    double qps;
+    double duration;
+    int poisson;
+    uint64_t keys;
+    uint64_t seed;
+    command_pool_t pool;
+    keygen_t *keygen;      // for plain queries
+    workload_t *workload;  // NULL unless -w
+} lg_config_t;
+
+/* An outstanding request. */
+typedef struct request {
+    uint64_t sched;
+    uint64_t sent;
+    int op;     // workload_op, or -1 outside a workload
+    int lines;  // responses still to come
+} request_t;
+
+/* A growable FIFO of outstanding requests. */
+typedef struct pending {
+    request_t *reqs;
+    size_t head;
+    size_t count;
+    size_t cap;
+} pending_t;
+
+/* A captured command to replay. */
+typedef struct replay_event {
+    uint64_t ts_ns;  // since the start of the replay, speed-up applied
+    int conn;        // index into the replaying thread's connections
+    uint32_t len;
+    char *command;
+} replay_event_t;
+
+typedef struct conn {
+    int fd;
+    char *wbuf;
+    size_t wlen;
+    size_t wcap;
+    int want_write;  // registered for EPOLLOUT
+    char rbuf[READ_CHUNK];
+    size_t rlen;
+    pending_t pending;
+} conn_t;
+
+typedef struct lg_thread {
+    pthread_t thread;
+    int id;
+    const lg_config_t *config;
+    int ngroups;  // connections, as counted by -c
+    int nconns;   // sockets: one per group and server, by group
+    conn_t *conns;
+    double rate;  // requests per second from this thread
+    uint64_t rng;
+    conn_t **dirty;  // connections with unflushed requests
+    int ndirty;
+    replay_event_t *events;  // this thread's share of a capture, in order
+    size_t nevents;
+    size_t next_event;
+    hist_t corrected;
+    hist_t service;
+    hist_t op_hist[WL_NOPS];  // corrected latency per workload operation
+    uint64_t sent;
+    uint64_t completed;
+    uint64_t errors;
+} lg_thread_t;
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+//------------------------------------------------------------------------------------------------
+// Connections
+
+/*
+ * Opens a TCP connection to the server.
+ * Returns the file descriptor on success, -1 on failure.
+ */
+static int get_socket(const char *server, const char *port) {
+    int sock = -1;
+    struct addrinfo hints;
+    struct addrinfo *result;
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+
+    int err;
+    if ((err = getaddrinfo(server, port, &hints, &result)) != 0) {
+        fprintf(stderr, "Error in getaddrinfo: %s\n", gai_strerror(err));
+        return -1;
+    }
+
+    struct addrinfo *res;
+    for (res = result; res != NULL; res = res->ai_next) {
+        if ((sock = socket(res->ai_family, res->ai_socktype,
+                           res->ai_protocol)) < 0) {
+            continue;
+        }
+        if (connect(sock, res->ai_addr, res->ai_addrlen) >= 0) {
+            break;
+        }
+        close(sock);
+    }
+    freeaddrinfo(result);
+
+    if (res == NULL) {
+        fprintf(stderr, "Failed to connect to '%s'!\n", server);
+        return -1;
+    }
+    return sock;
+}
+
+static void pending_push(pending_t *p, const request_t *req) {
+    if (p->count == p->cap) {
+        size_t cap = p->cap ? 2 * p->cap : 64;
+        request_t *reqs = malloc(cap * sizeof(request_t));
+        if (reqs == NULL) {
+            perror("malloc");
+            exit(1);
+        }
+        for (size_t i = 0; i < p->count; i++) {
+            reqs[i] = p->reqs[(p->head + i) % p->cap];
+        }
+        free(p->reqs);
+        p->reqs = reqs;
+        p->head = 0;
+        p->cap = cap;
+    }
+    p->reqs[(p->head + p->count) % p->cap] = *req;
+    p->count++;
+}
+
+static void pending_pop(pending_t *p) {
+    p->head = (p->head + 1) % p->cap;
+    p->count--;
+}
+
+static void conn_append(conn_t *c, const char *line, size_t len) {
+    if (c->wlen + len > c->wcap) {
+        size_t cap = c->wcap ? c->wcap : 4096;
+        while (cap < c->wlen + len)
+            cap *= 2;
+        if ((c->wbuf = realloc(c->wbuf, cap)) == NULL) {
+            perror("realloc");
+            exit(1);
+        }
+        c->wcap = cap;
+    }
+    memcpy(c->wbuf + c->wlen, line, len);
+    c->wlen += len;
+}
+
+/* Writes what the socket takes; returns -1 if the connection failed. */
+static int conn_flush(int epfd, conn_t *c) {
+    size_t off = 0;
+    while (off < c->wlen) {
+        ssize_t n = send(c->fd, c->wbuf + off, c->wlen - off, MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                break;
+            return -1;
+        }
+        off += n;
+    }
+    memmove(c->wbuf, c->wbuf + off, c->wlen - off);
+    c->wlen -= off;
+
+    // Only ask for EPOLLOUT while there is something left to write
+    int want = c->wlen > 0;
+    if (want != c->want_write) {
+        struct epoll_event ev;
+        ev.events = EPOLLIN | (want ? EPOLLOUT : 0);
+        ev.data.ptr = c;
+        epoll_ctl(epfd, EPOLL_CTL_MOD, c->fd, &ev);
+        c->want_write = want;
+    }
+    return 0;
+}
+
+/*
+ * Reads responses and matches each line with the oldest request, which is
+ * complete once all of its lines are in.
+ */
+static int conn_read(lg_thread_t *t, conn_t *c) {
+    while (1) {
+        ssize_t n = recv(c->fd, c->rbuf + c->rlen, sizeof(c->rbuf) - c->rlen,
+                         0);
+        if (n < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                return 0;
+            return -1;
+        }
+        if (n == 0)
+            return -1;
+        c->rlen += n;
+
+        uint64_t now = now_ns();
+        char *start = c->rbuf;
+        char *nl;
+        while ((nl = memchr(start, '\n', c->rbuf + c->rlen - start)) != NULL) {
+            request_t *req = c->pending.count > 0
+                                 ? &c->pending.reqs[c->pending.head]
+                                 : NULL;
+            if (req != NULL && --req->lines == 0) {
+                hist_record(&t->corrected, now - req->sched);
+                hist_record(&t->service, now - req->sent);
+                if (req->op >= 0)
+                    hist_record(&t->op_hist[req->op], now - req->sched);
+                pending_pop(&c->pending);
+                t->completed++;
+            }
+            start = nl + 1;
+        }
+        c->rlen = c->rbuf + c->rlen - start;
+        memmove(c->rbuf, start, c->rlen);
+        if (c->rlen == sizeof(c->rbuf)) {
+            // A response longer than the buffer; drop it
+            c->rlen = 0;
+        }
+    }
+}
+
+//------------------------------------------------------------------------------------------------
+// Requests
+
+/*
+ * Writes the next command into buf and returns its length. The request's
+ * operation and number of response lines are filled in.
+ */
+static size_t next_command(lg_thread_t *t, char *buf, size_t cap,
+                           request_t *req) {
+    const lg_config_t *c = t->config;
+    req->op = -1;
+    req->lines = 1;
+    if (c->workload != NULL) {
+        req->op = workload_next_op(c->workload, &t->rng);
+        return workload_command(c->workload, req->op, &t->rng, buf, cap,
+                                &req->lines);
+    }
+    if (c->pool.count > 0) {
+        size_t i = rand_next(&t->rng) % c->pool.count;
+        size_t len = c->pool.lens[i] < cap ? c->pool.lens[i] : cap - 1;
+        memcpy(buf, c->pool.lines[i], len);
+        return len;
+    }
+    return snprintf(buf, cap, "q key%lu\n",
+                    keygen_next(c->keygen, &t->rng, c->keys));
+}
+
+/* The connection of a group to the server that line's key belongs to. */
+static conn_t *route(lg_thread_t *t, int group, const char *line, size_t len) {
+    const lg_config_t *c = t->config;
+    int server = 0;
+    if (c->nservers > 1) {
+        // "<op> <key> ...": the key is the first word after the command
+        size_t start = 1, end;
+        while (start < len && line[start] == ' ')
+            start++;
+        for (end = start; end < len && line[end] != ' ' && line[end] != '\n';)
+            end++;
+        server = ring_lookup(&c->ring, line + start, end - start);
+    }
+    return &t->conns[group * c->nservers + server];
+}
+
+/*
+ * Queues a request on conn, to go out with the next flush. One for a closed
+ * connection fails at once, so that it counts as sent and as an error.
+ */
+static void queue_request(lg_thread_t *t, conn_t *conn, const char *line,
+                          size_t len, const request_t *req) {
+    if (conn->fd < 0) {
+        t->sent++;
+        t->errors++;
+        return;
+    }
+    if (conn->wlen == 0 && !conn->want_write)
+        t->dirty[t->ndirty++] = conn;
+    conn_append(conn, line, len);
+    pending_push(&conn->pending, req);
+    t->sent++;
+}
+
+/* Time until the next request, in nanoseconds. */
+static uint64_t next_interval(lg_thread_t *t) {
+    double mean = 1e9 / t->rate;
+    if (t->config->poisson)
+        return (uint64_t)(-log(1.0 - rand_unit(&t->rng)) * mean);
+    return (uint64_t)mean;
+}
+
+static void *lg_worker(void *arg) {
+    lg_thread_t *t = (lg_thread_t *)arg;
+    const lg_config_t *c = t->config;
+    int epfd;
+    char line[LINE_MAX_LEN];
+
+    if ((epfd = epoll_create1(0)) < 0) {
+        perror("epoll_create1");
+        exit(1);
+    }
+    for (int i = 0; i < t->nconns; i++) {
+        conn_t *conn = &t->conns[i];
+        int one = 1;
+        setsockopt(conn->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        fcntl(conn->fd, F_SETFL, fcntl(conn->fd, F_GETFL) | O_NONBLOCK);
+        struct epoll_event ev;
+        ev.events = EPOLLIN;
+        ev.data.ptr = conn;
+        if (epoll_ctl(epfd, EPOLL_CTL_ADD, conn->fd, &ev) < 0) {
+            perror("epoll_ctl");
+            exit(1);
+        }
+    }
+
+    uint64_t start = now_ns();
+    uint64_t end = start + (uint64_t)(c->duration * 1e9) + 1;
+    uint64_t due = start;
+    size_t rr = 0;
+    struct epoll_event events[64];
+
+    while (1) {
+        uint64_t now = now_ns();
+        uint64_t outstanding = t->sent - t->completed - t->errors;
+        // A replay ends once its last event has gone out, however late
+        int queued = t->events == NULL || t->next_event == t->nevents;
+        if (now >= end && queued &&
+            (outstanding == 0 || now >= end + DRAIN_NS))
+            break;
+
+        // Queue every request whose time has come. Each goes out on the next
+        // connection in turn (or on its own one, when replaying), even if
+        // that one has not answered yet.
+        if (t->events != NULL) {
+            while (t->next_event < t->nevents &&
+                   (due = start + t->events[t->next_event].ts_ns) <= now) {
+                replay_event_t *ev = &t->events[t->next_event++];
+                conn_t *conn = route(t, ev->conn, ev->command, ev->len);
+                request_t req = {due, now, -1, 1};
+                queue_request(t, conn, ev->command, ev->len, &req);
+            }
+            if (t->next_event == t->nevents)
+                due = end;
+        }
+        while (t->events == NULL && due <= now && due < end) {
+            request_t req = {due, now, -1, 1};
+            size_t len = next_command(t, line, sizeof(line), &req);
+            conn_t *conn = route(t, rr++ % t->ngroups, line, len);
+            queue_request(t, conn, line, len, &req);
+            due += next_interval(t);
+        }
+        for (int i = 0; i < t->ndirty; i++) {
+            conn_t *conn = t->dirty[i];
+            if (conn->fd >= 0 && conn_flush(epfd, conn) < 0) {
+                t->errors += conn->pending.count;
+                close(conn->fd);
+                conn->fd = -1;
+            }
+        }
+        t->ndirty = 0;
+
+        // Sleep until the next request is due, or until there is I/O
+        now = now_ns();
+        int timeout = 0;
+        if (due < end && due > now) {
+            timeout = (int)((due - now) / 1000000);
+        } else if (due >= end) {
+            timeout = 10;
+        }
+        int n = epoll_wait(epfd, events, 64, timeout);
+        for (int i = 0; i < n; i++) {
+            conn_t *conn = (conn_t *)events[i].data.ptr;
+            if (conn->fd < 0)
+                continue;
+            int failed = 0;
+            if (events[i].events & (EPOLLIN | EPOLLERR | EPOLLHUP))
+                failed = conn_read(t, conn) < 0;
+            if (!failed && (events[i].events & EPOLLOUT))
+                failed = conn_flush(epfd, conn) < 0;
+            if (failed) {
+                t->errors += conn->pending.count;
+                close(conn->fd);
+                conn->fd = -1;
+            }
+        }
+    }
+
+    for (int i = 0; i < t->nconns; i++) {
+        if (t->conns[i].fd >= 0)
+            close(t->conns[i].fd);
+        free(t->conns[i].wbuf);
+        free(t->conns[i].pending.reqs);
+    }
+    close(epfd);
+    return NULL;
+}
+
+/* Sends count inserts on fd and waits for all their responses. */
+static void load_batch(lg_thread_t *t, int fd, const char *batch, size_t len,
+                       int count) {
+    char line[LINE_MAX_LEN];
+    for (size_t off = 0; off < len;) {
+        ssize_t n = send(fd, batch + off, len - off, MSG_NOSIGNAL);
+        if (n < 0) {
+            perror("send");
+            exit(1);
+        }
+        off += n;
+    }
+
+    size_t rlen = 0;
+    while (count > 0) {
+        ssize_t n = recv(fd, line + rlen, sizeof(line) - rlen, 0);
+        if (n <= 0) {
+            fprintf(stderr, "Connection terminated during load.\n");
+            exit(1);
+        }
+        rlen += n;
+        char *start = line, *nl;
+        while ((nl = memchr(start, '\n', line + rlen - start)) != NULL) {
+            if (strncmp(start, "added", 5) == 0) {
+                t->completed++;
+            } else {
+                t->errors++;  // already in the database, most likely
+            }
+            count--;
+            start = nl + 1;
+        }
+        rlen = line + rlen - start;
+        memmove(line, start, rlen);
+    }
+}
+
+/*
+ * Load phase: inserts this thread's share of the workload's records over its
+ * first connection (to each server), LOAD_BATCH at a time, with blocking I/O.
+ */
+static void *load_worker(void *arg) {
+    lg_thread_t *t = (lg_thread_t *)arg;
+    const lg_config_t *c = t->config;
+    char line[LINE_MAX_LEN];
+    char *batch[MAX_SERVERS];
+    size_t len[MAX_SERVERS];
+    int count[MAX_SERVERS];
+    for (int s = 0; s < c->nservers; s++) {
+        if ((batch[s] = malloc(LOAD_BATCH * LINE_MAX_LEN)) == NULL) {
+            perror("malloc");
+            exit(1);
+        }
+    }
+
+    uint64_t next = t->id;
+    while (next < c->workload->records) {
+        memset(len, 0, sizeof(len));
+        memset(count, 0, sizeof(count));
+        for (int i = 0; i < LOAD_BATCH && next < c->workload->records; i++) {
+            size_t n = workload_load_command(c->workload, next, &t->rng, line,
+                                             sizeof(line));
+            int s = route(t, 0, line, n) - t->conns;
+            memcpy(batch[s] + len[s], line, n);
+            len[s] += n;
+            count[s]++;
+            next += c->threads;
+        }
+        for (int s = 0; s < c->nservers; s++) {
+            if (count[s] > 0)
+                load_batch(t, t->conns[s].fd, batch[s], len[s], count[s]);
+        }
+    }
+    for (int s = 0; s < c->nservers; s++) {
+        free(batch[s]);
+    }
+    return NULL;
+}
+
+//------------------------------------------------------------------------------------------------
+// Setup and reporting
+
+static int compare_ids(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+/*
+ * Loads a capture file and deals its commands out to the threads: captured
+ * connection i (in order of id) is replayed by thread i % threads as its
+ * connection i / threads. Sets the number of connections and the duration.
+ */
+static int load_capture(const char *path, double speedup, lg_config_t *config,
+                        lg_thread_t *threads) {
+    FILE *f;
+    capture_header_t header;
+    capture_record_t rec;
+    replay_event_t *events = NULL;
+    uint64_t *conn_ids = NULL;
+    size_t count = 0, cap = 0;
+
+    if ((f = fopen(path, "rb")) == NULL) {
+        perror("Error opening capture file");
+        return -1;
+    }
+    if (fread(&header, sizeof(header), 1, f) != 1 ||
+        memcmp(header.magic, CAPTURE_MAGIC, sizeof(CAPTURE_MAGIC)) != 0) {
+        fprintf(stderr, "%s is not a capture file\n", path);
+        fclose(f);
+        return -1;
+    }
+    while (fread(&rec, sizeof(rec), 1, f) == 1) {
+        if (count == cap) {
+            cap = cap ? 2 * cap : 1024;
+            events = realloc(events, cap * sizeof(replay_event_t));
+            conn_ids = realloc(conn_ids, cap * sizeof(uint64_t));
+            if (events == NULL || conn_ids == NULL) {
+                perror("realloc");
+                exit(1);
+            }
+        }
+        replay_event_t *ev = &events[count];
+        ev->ts_ns = (uint64_t)(rec.ts_ns / speedup);
+        ev->len = rec.len;
+        if ((ev->command = malloc(rec.len)) == NULL) {
+            perror("malloc");
+            exit(1);
+        }
+        if (fread(ev->command, 1, rec.len, f) != rec.len) {
+            free(ev->command);
+            break;  // truncated by a server that did not stop the capture
+        }
+        conn_ids[count++] = rec.conn_id;
+    }
+    fclose(f);
+    if (count == 0) {
+        fprintf(stderr, "%s holds no commands\n", path);
+        return -1;
+    }
+
+    // Number the connections densely, in order of id
+    uint64_t *ids = malloc(count * sizeof(uint64_t));
+    if (ids == NULL) {
+        perror("malloc");
+        exit(1);
+    }
+    memcpy(ids, conn_ids, count * sizeof(uint64_t));
+    qsort(ids, count, sizeof(uint64_t), compare_ids);
+    size_t nconns = 0;
+    for (size_t i = 0; i < count; i++) {
+        if (nconns == 0 || ids[nconns - 1] != ids[i])
+            ids[nconns++] = ids[i];
+    }
+    config->connections = nconns;
+    if (config->threads > (int)nconns)
+        config->threads = nconns;
+    config->duration = events[count - 1].ts_ns / 1e9;
+
+    // Each thread gets the events of its own connections, sized to them
+    size_t *share = calloc(config->threads, sizeof(size_t));
+    if (share == NULL) {
+        perror("calloc");
+        exit(1);
+    }
+    for (size_t i = 0; i < count; i++) {
+        uint64_t *id = bsearch(&conn_ids[i], ids, nconns, sizeof(uint64_t),
+                               compare_ids);
+        conn_ids[i] = id - ids;
+        share[conn_ids[i] % config->threads]++;
+    }
+    for (int i = 0; i < config->threads; i++) {
+        if ((threads[i].events = calloc(share[i] > 0 ? share[i] : 1,
+                                        sizeof(replay_event_t))) == NULL) {
+            perror("calloc");
+            exit(1);
+        }
+    }
+    free(share);
+    for (size_t i = 0; i < count; i++) {
+        size_t conn = conn_ids[i];
+        lg_thread_t *t = &threads[conn % config->threads];
+        events[i].conn = conn / config->threads;
+        t->events[t->nevents++] = events[i];
+    }
+    free(ids);
+    free(conn_ids);
+    free(events);
+    return 0;
+}
+
+/* Loads a script of commands to pick from, one per line. */
+static int load_pool(const char *path, command_pool_t *pool) {
+    FILE *f;
+    char line[LINE_MAX_LEN];
+    size_t cap = 0;
+
+    if ((f = fopen(path, "r")) == NULL) {
+        perror("Error opening script file");
+        return -1;
+    }
+    while (fgets(line, sizeof(line), f) != NULL) {
+        size_t len = strcspn(line, "\n");
+        if (len == 0)
+            continue;
+        line[len++] = '\n';
+        line[len] = '\0';
+        if (pool->count == cap) {
+            cap = cap ? 2 * cap : 256;
+            pool->lines = realloc(pool->lines, cap * sizeof(char *));
+            pool->lens = realloc(pool->lens, cap * sizeof(size_t));
+            if (pool->lines == NULL || pool->lens == NULL) {
+                perror("realloc");
+                exit(1);
+            }
+        }
+        pool->lines[pool->count] = strdup(line);
+        pool->lens[pool->count] = len;
+        pool->count++;
+    }
+    fclose(f);
+    return 0;
+}
+
+/* Prints the latency spectrum in HdrHistogram's percentile-distribution form. */
+static void print_distribution(const char *title, const hist_t *h) {
+    static const double pcts[] = {0,    10,   25,    50,    75,     90,
+                                  95,   99,   99.5,  99.9,  99.95,  99.99,
+                                  99.995, 99.999, 100};
+    printf("%s\n%14s %12s %12s %14s\n", title, "Value(us)", "Percentile",
+           "TotalCount", "1/(1-Percentile)");
+    for (size_t i = 0; i < sizeof(pcts) / sizeof(pcts[0]); i++) {
+        double p = pcts[i];
+        uint64_t v = p == 0 ? h->min : hist_percentile(h, p);
+        printf("%14.3f %12.6f %12lu %14.2f\n", v / 1e3, p / 100,
+               (uint64_t)(p / 100 * h->total + 0.5),
+               p < 100 ? 1 / (1 - p / 100) : INFINITY);
+    }
+}
+
+/* Prints the per-operation summary in YCSB's own report format. */
+static void print_ycsb(const workload_t *w, double seconds, uint64_t completed,
+                       const hist_t *op_hist) {
+    printf("[OVERALL], RunTime(ms), %.0f\n", seconds * 1e3);
+    printf("[OVERALL], Throughput(ops/sec), %.2f\n", completed / seconds);
+    for (int op = 0; op < WL_NOPS; op++) {
+        const hist_t *h = &op_hist[op];
+        if (w->proportion[op] == 0)
+            continue;
+        const char *name = workload_op_names[op];
+        printf("[%s], Operations, %lu\n", name, h->total);
+        printf("[%s], AverageLatency(us), %.3f\n", name, hist_mean(h) / 1e3);
+        printf("[%s], MinLatency(us), %.0f\n", name,
+               h->total ? h->min / 1e3 : 0.0);
+        printf("[%s], MaxLatency(us), %.0f\n", name, h->max / 1e3);
+        printf("[%s], 95thPercentileLatency(us), %.0f\n", name,
+               hist_percentile(h, 95) / 1e3);
+        printf("[%s], 99thPercentileLatency(us), %.0f\n", name,
+               hist_percentile(h, 99) / 1e3);
+    }
+}
+
+static void usage(const char *cmd) {
+    fprintf(stderr,
+            "Usage: %s [-c connections] [-t threads] [-q target qps] "
+            "[-d seconds] [-P]\n"
+            "       [-s script | -w a-f [-l] [-F fields] [-L field length] "
+            "[-m max scan]]\n"
+            "       [-n keys or records] [-k uniform|zipfian|sequential|"
+            "latest|hotspot [-z param]]\n"
+            "       [-S seed] <server> <port> | -H host:port,...\n"
+            "       %s [-t threads] -C capture [-x speed-up] <server> <port> | "
+            "-H host:port,...\n",
+            cmd, cmd);
+}
+
+int main(int argc, char *argv[]) {
+    lg_config_t config;
+    memset(&config, 0, sizeof(config));
+    config.threads = 2;
+    config.connections = 16;
+    config.qps = 10000;
+    config.duration = 10;
+    config.keys = 1000;
+    config.seed = 1;
+    char workload_name = 0;
+    int load = 0, field_count = 1, field_length = 100, max_scan = 100;
+    workload_t workload;
+    const char *dist = NULL;
+    double dist_param = 0;
+    keygen_t keygen;
+    const char *capture_path = NULL;
+    double speedup = 1;
+    char *servers = NULL;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "c:t:q:d:Ps:w:lF:L:m:n:k:z:S:C:x:H:")) != -1) {
+        switch (opt) {
+            case 'c':
+                config.connections = atoi(optarg);
+                break;
+            case 't':
+                config.threads = atoi(optarg);
+                break;
+            case 'q':
+                config.qps = atof(optarg);
+                break;
+            case 'd':
+                config.duration = atof(optarg);
+                break;
+            case 'P':
+                config.poisson = 1;
+                break;
+            case 's':
+                if (load_pool(optarg, &config.pool) < 0)
+                    return 1;
+                break;
+            case 'w':
+                workload_name = optarg[0];
+                break;
+            case 'l':
+                load = 1;
+                break;
+            case 'F':
+                field_count = atoi(optarg);
+                break;
+            case 'L':
+                field_length = atoi(optarg);
+                break;
+            case 'm':
+                max_scan = atoi(optarg);
+                break;
+            case 'n':
+                config.keys = strtoull(optarg, NULL, 10);
+                break;
+            case 'k':
+                dist = optarg;
+                break;
+            case 'z':
+                dist_param = atof(optarg);
+                break;
+            case 'S':
+                config.seed = strtoull(optarg, NULL, 10);
+                break;
+            case 'C':
+                capture_path = optarg;
+                break;
+            case 'x':
+                speedup = atof(optarg);
+                break;
+            case 'H':
+                servers = optarg;
+                break;
+            default:
+                usage(argv[0]);
+                return 1;
+        }
+    }
+    if (servers != NULL && optind == argc) {
+        // host:port,host:port,...
+        char *save, *server, *colon;
+        for (server = strtok_r(servers, ",", &save); server != NULL;
+             server = strtok_r(NULL, ",", &save)) {
+            if (config.nservers == MAX_SERVERS ||
+                (colon = strrchr(server, ':')) == NULL) {
+                usage(argv[0]);
+                return 1;
+            }
+            *colon = '\0';
+            config.hosts[config.nservers] = server;
+            config.ports[config.nservers++] = colon + 1;
+        }
+    } else if (servers == NULL && optind == argc - 2) {
+        config.hosts[0] = argv[optind];
+        config.ports[0] = argv[optind + 1];
+        config.nservers = 1;
+    }
+    if (config.nservers == 0 || config.threads < 1 || config.qps <= 0 ||
+        config.connections < config.threads || config.keys < 1) {
+        usage(argv[0]);
+        return 1;
+    }
+    if (workload_name != 0) {
+        if (workload_init(&workload, workload_name, config.keys, field_count,
+                          field_length, max_scan, dist, dist_param) < 0) {
+            usage(argv[0]);
+            return 1;
+        }
+        config.workload = &workload;
+    } else if (load || keygen_init(&keygen, dist ? dist : "uniform",
+                                   config.keys, dist_param) < 0) {
+        usage(argv[0]);
+        return 1;
+    }
+    config.keygen = &keygen;
+    if (config.nservers > 1) {
+        char names[MAX_SERVERS][300];
+        const char *name_ptrs[MAX_SERVERS];
+        for (int i = 0; i < config.nservers; i++) {
+            snprintf(names[i], sizeof(names[i]), "%s:%s", config.hosts[i],
+                     config.ports[i]);
+            name_ptrs[i] = names[i];
+        }
+        if (ring_build(&config.ring, name_ptrs, config.nservers) < 0) {
+            perror("ring_build");
+            return 1;
+        }
+    }
+
+    lg_thread_t *threads = calloc(config.threads, sizeof(lg_thread_t));
+    if (threads == NULL) {
+        perror("calloc");
+        return 1;
+    }
+    if (capture_path != NULL) {
+        if (speedup <= 0 || config.workload != NULL || load) {
+            usage(argv[0]);
+            return 1;
+        }
+        if (load_capture(capture_path, speedup, &config, threads) < 0)
+            return 1;
+    }
+
+    // Connect everything up front so the run measures requests only
+    for (int i = 0; i < config.threads; i++) {
+        lg_thread_t *t = &threads[i];
+        t->id = i;
+        t->config = &config;
+        t->ngroups = config.connections / config.threads +
+                     (i < config.connections % config.threads);
+        t->nconns = t->ngroups * config.nservers;
+        t->rate = config.qps / config.threads;
+        t->rng = rand_seed(config.seed + i);
+        hist_init(&t->corrected);
+        hist_init(&t->service);
+        for (int op = 0; op < WL_NOPS; op++) {
+            hist_init(&t->op_hist[op]);
+        }
+        if ((t->conns = calloc(t->nconns, sizeof(conn_t))) == NULL ||
+            (t->dirty = calloc(t->nconns, sizeof(conn_t *))) == NULL) {
+            perror("calloc");
+            return 1;
+        }
+        for (int j = 0; j < t->nconns; j++) {
+            int s = j % config.nservers;
+            if ((t->conns[j].fd = get_socket(config.hosts[s],
+                                             config.ports[s])) < 0)
+                return 1;
+        }
+    }
+
+    int err;
+    if (load) {
+        uint64_t load_start = now_ns();
+        for (int i = 0; i < config.threads; i++) {
+            if ((err = pthread_create(&threads[i].thread, 0, load_worker,
+                                      &threads[i]))) {
+                handle_error_en(err, "pthread_create");
+            }
+        }
+        uint64_t added = 0, existing = 0;
+        for (int i = 0; i < config.threads; i++) {
+            if ((err = pthread_join(threads[i].thread, 0))) {
+                handle_error_en(err, "pthread_join");
+            }
+            added += threads[i].completed;
+            existing += threads[i].errors;
+            threads[i].completed = threads[i].errors = 0;
+        }
+        double load_seconds = (now_ns() - load_start) / 1e9;
+        printf("loaded %lu records (%lu already present) in %.2fs, "
+               "%.0f inserts/s\n\n",
+               added, existing, load_seconds,
+               (added + existing) / load_seconds);
+    }
+
+    hist_t op_hist[WL_NOPS];
+    for (int op = 0; op < WL_NOPS; op++) {
+        hist_init(&op_hist[op]);
+    }
+    uint64_t start = now_ns();
+    for (int i = 0; i < config.threads; i++) {
+        if ((err = pthread_create(&threads[i].thread, 0, lg_worker,
+                                  &threads[i]))) {
+            handle_error_en(err, "pthread_create");
+        }
+    }
+
+    hist_t corrected, service;
+    hist_init(&corrected);
+    hist_init(&service);
+    uint64_t sent = 0, completed = 0, errors = 0;
+    for (int i = 0; i < config.threads; i++) {
+        if ((err = pthread_join(threads[i].thread, 0))) {
+            handle_error_en(err, "pthread_join");
+        }
+        hist_merge(&corrected, &threads[i].corrected);
+        hist_merge(&service, &threads[i].service);
+        for (int op = 0; op < WL_NOPS; op++) {
+            hist_merge(&op_hist[op], &threads[i].op_hist[op]);
+        }
+        sent += threads[i].sent;
+        completed += threads[i].completed;
+        errors += threads[i].errors;
+        free(threads[i].conns);
+        free(threads[i].dirty);
+        for (size_t e = 0; e < threads[i].nevents; e++) {
+            free(threads[i].events[e].command);
+        }
+        free(threads[i].events);
+    }
+    double seconds = (now_ns() - start) / 1e9;
+    free(threads);
+
+    if (capture_path != NULL) {
+        printf("replayed %s at %.2fx, achieved %.0f req/s over %.2fs "
+               "(%d connections, %d threads)\n",
+               capture_path, speedup, completed / seconds, seconds,
+               config.connections, config.threads);
+    } else {
+        printf("target %.0f req/s, achieved %.0f req/s over %.2fs "
+               "(%d connections, %d threads)\n",
+               config.qps, completed / seconds, seconds, config.connections,
+               config.threads);
+    }
+    if (capture_path == NULL && config.pool.count == 0) {
+        const keygen_t *g = config.workload ? &config.workload->keys
+                                            : config.keygen;
+        printf("%s keys over %lu\n", keygen_name(g), config.keys);
+    }
+    printf("sent %lu, completed %lu, errors %lu, unanswered %lu\n", sent,
+           completed, errors, sent - completed - errors);
+    printf("latency (us)  p50 %.1f  p90 %.1f  p99 %.1f  p99.9 %.1f  max %.1f\n",
+           hist_percentile(&corrected, 50) / 1e3,
+           hist_percentile(&corrected, 90) / 1e3,
+           hist_percentile(&corrected, 99) / 1e3,
+           hist_percentile(&corrected, 99.9) / 1e3, corrected.max / 1e3);
+    printf("service (us)  p50 %.1f  p90 %.1f  p99 %.1f  p99.9 %.1f  max %.1f\n\n",
+           hist_percentile(&service, 50) / 1e3,
+           hist_percentile(&service, 90) / 1e3,
+           hist_percentile(&service, 99) / 1e3,
+           hist_percentile(&service, 99.9) / 1e3, service.max / 1e3);
+    print_distribution("Latency from scheduled send (corrected):", &corrected);
+    if (config.workload != NULL) {
+        printf("\n");
+        print_ycsb(config.workload, seconds, completed, op_hist);
+    }
+
+    return 0;
+}
@@ -0,0 +1,344 @@
+#include <getopt.h>
+#include <inttypes.h>
+#include <malloc.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "./db.h"
+#include "./metrics.h"
+#include "./rand.h"
+
+/*
+ * Memory-footprint benchmark. For each dataset size it loads that many keys
+ * into the engine, with key and value lengths drawn uniformly from the given
+ * ranges, and compares what the data is worth (the payload: key and value
+ * bytes) with what it costs: the bytes db.c accounts to nodes, locks, keys
+ * and values, the growth of the allocator's heap, and the growth of the
+ * resident set. It then deletes a fraction of the keys and measures again,
+ * which shows the memory the allocator keeps but cannot hand back.
+ *
+ * Every size is measured in a child process of its own, so each starts from
+ * a fresh heap and RSS.
+ */
+
+#define MAX_KEY 255
+#define MAX_VALUE 255
+#define MAX_SIZES 32
+#define KEY_DIGITS_MAX 10  // base-62 digits that fit in 64 bits with room
+
+enum bench_format { fmt_csv, fmt_json };
+
+typedef struct mem_config {
+    int key_min, key_max;
+    int value_min, value_max;
+    double delete_fraction;
+    uint64_t seed;
+    enum bench_format format;
+} mem_config_t;
+
+/* A snapshot of everything that is measured. */
+typedef struct mem_sample {
+    int64_t keys;     // live nodes, as db.c counts them
+    int64_t tracked;  // bytes db.c accounts to nodes, locks, keys and values
+    uint64_t heap_in_use;
+    uint64_t heap_free;
+    uint64_t heap_total;
+    uint64_t rss;
+} mem_sample_t;
+
+//------------------------------------------------------------------------------------------------
+// Keys and measurements
+
+/* Draws a length in [min, max] that is fixed for index idx. */
+static int length_of(uint64_t idx, uint64_t salt, int min, int max) {
+    return min + (int)(rand_mix64(idx * 2 + salt) % (uint64_t)(max - min + 1));
+}
+
+/* The number of base-62 digits every key starts with, and how many keys they
+ * can tell apart. */
+static int key_digits(const mem_config_t *c) {
+    return c->key_min < KEY_DIGITS_MAX ? c->key_min : KEY_DIGITS_MAX;
+}
+
+static uint64_t key_space(const mem_config_t *c) {
+    uint64_t space = 1;
+    for (int i = 0; i < key_digits(c); i++) {
+        space *= 62;
+    }
+    return space;
+}
+
+/*
+ * Writes the key for idx. It starts with idx in base 62, scrambled by an
+ * odd multiplier prime to 62 so that keys are not inserted in order, which
+ * keeps keys distinct for every idx below key_space; the rest of the key is
+ * its hash in hex, repeated to the key's length.
+ */
+static int make_key(char *buf, const mem_config_t *c, uint64_t idx) {
+    static const char digits[] =
+        "0123456789ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz";
+    int len = length_of(idx, c->seed, c->key_min, c->key_max);
+    int ndigits = key_digits(c);
+    uint64_t space = key_space(c);
+    uint64_t x = (uint64_t)((unsigned __int128)(idx % space) *
+                            (0x9e3779b97f4a7c15ull % space) % space);
+    char hex[17];
+    for (int i = ndigits - 1; i >= 0; i--, x /= 62) {
+        buf[i] = digits[x % 62];
+    }
+    snprintf(hex, sizeof(hex), "%016" PRIx64, rand_mix64(idx + c->seed));
+    for (int i = ndigits; i < len; i++) {
+        buf[i] = hex[i % 16];
+    }
+    buf[len] = '\0';
+    return len;
+}
+
+static int make_value(char *buf, const mem_config_t *c, uint64_t idx) {
+    int len = length_of(idx, c->seed + 1, c->value_min, c->value_max);
+    memset(buf, 'v', len);
+    buf[len] = '\0';
+    return len;
+}
+
+static int is_deleted(const mem_config_t *c, uint64_t idx) {
+    uint64_t h = rand_mix64(idx ^ (c->seed * 0x9e3779b97f4a7c15ull));
+    return (h >> 11) * (1.0 / 9007199254740992.0) < c->delete_fraction;
+}
+
+static uint64_t read_rss(void) {
+    FILE *f;
+    unsigned long pages_v, pages_r;
+    if ((f = fopen("/proc/self/statm", "r")) == NULL) {
+        return 0;
+    }
+    int n = fscanf(f, "%lu %lu", &pages_v, &pages_r);
+    fclose(f);
+    return n == 2 ? (uint64_t)pages_r * sysconf(_SC_PAGESIZE) : 0;
+}
+
+static void measure(mem_sample_t *s) {
+    metrics_cell_t m;
+    metrics_collect(&m);
+    s->keys = m.mem_objects[mem_node];
+    s->tracked = m.mem_allocated[mem_node] + m.mem_allocated[mem_lock] +
+                 m.mem_allocated[mem_key] + m.mem_allocated[mem_value];
+#if defined(__GLIBC__) && __GLIBC_PREREQ(2, 33)
+    struct mallinfo2 mi = mallinfo2();
+    s->heap_in_use = mi.uordblks + mi.hblkhd;
+    s->heap_free = mi.fordblks;
+    s->heap_total = mi.arena + mi.hblkhd;
+#else
+    // Without allocator statistics only the tracked bytes and RSS are known
+    s->heap_in_use = s->tracked;
+    s->heap_free = 0;
+    s->heap_total = s->tracked;
+#endif
+    s->rss = read_rss();
+}
+
+//------------------------------------------------------------------------------------------------
+// Reporting
+
+static void print_header(const mem_config_t *c) {
+    if (c->format == fmt_csv) {
+        printf("engine,phase,requested_keys,keys,key_size,value_size,payload_bytes,"
+               "payload_per_key,tracked_per_key,heap_per_key,rss_per_key,"
+               "overhead_ratio,heap_free_bytes,fragmentation\n");
+    }
+}
+
+/*
+ * Prints one phase: the keys it should hold next to the keys the engine
+ * holds. Heap and RSS are taken relative to the empty engine, so they
+ * include everything the keys cost; the overhead ratio is the heap growth
+ * over the payload.
+ */
+static void print_phase(const mem_config_t *c, const char *phase,
+                        uint64_t requested, const mem_sample_t *base,
+                        const mem_sample_t *s, uint64_t payload) {
+    double keys = s->keys > 0 ? (double)s->keys : 1;
+    double heap = (double)s->heap_in_use - (double)base->heap_in_use;
+    double rss = (double)s->rss - (double)base->rss;
+    double frag = s->heap_total > 0 ? (double)s->heap_free / s->heap_total : 0;
+    char ksize[16], vsize[16];
+    snprintf(ksize, sizeof(ksize), "%d:%d", c->key_min, c->key_max);
+    snprintf(vsize, sizeof(vsize), "%d:%d", c->value_min, c->value_max);
+
+    if (c->format == fmt_csv) {
+        printf("bst,%s,%" PRIu64 ",%ld,%s,%s,%lu,%.1f,%.1f,%.1f,%.1f,%.2f,%lu,"
+               "%.3f\n",
+               phase, requested, s->keys, ksize, vsize, payload, payload / keys,
+               s->tracked / keys, heap / keys, rss / keys,
+               payload > 0 ? heap / payload : 0, s->heap_free, frag);
+    } else {
+        printf("{\"engine\":\"bst\",\"phase\":\"%s\","
+               "\"requested_keys\":%" PRIu64 ",\"keys\":%ld,"
+               "\"key_size\":\"%s\",\"value_size\":\"%s\","
+               "\"payload_bytes\":%lu,\"payload_per_key\":%.1f,"
+               "\"tracked_per_key\":%.1f,\"heap_per_key\":%.1f,"
+               "\"rss_per_key\":%.1f,\"overhead_ratio\":%.2f,"
+               "\"heap_free_bytes\":%lu,\"fragmentation\":%.3f}\n",
+               phase, requested, s->keys, ksize, vsize, payload, payload / keys,
+               s->tracked / keys, heap / keys, rss / keys,
+               payload > 0 ? heap / payload : 0, s->heap_free, frag);
+    }
+    fflush(stdout);
+}
+
+//------------------------------------------------------------------------------------------------
+// Running
+
+/* Loads size keys, measures, deletes some of them and measures again. */
+static void run_size(const mem_config_t *c, uint64_t size) {
+    char key[MAX_KEY + 1], value[MAX_VALUE + 1];
+    mem_sample_t base, s;
+    uint64_t payload = 0;
+    db_t *db;
+
+    if ((db = db_create()) == NULL) {
+        perror("db_create");
+        exit(1);
+    }
+    measure(&base);
+    for (uint64_t i = 0; i < size; i++) {
+        int klen = make_key(key, c, i);
+        int vlen = make_value(value, c, i);
+        if (db_add(db, key, value)) {
+            payload += klen + vlen;
+        }
+    }
+    measure(&s);
+    print_phase(c, "loaded", size, &base, &s, payload);
+
+    if (c->delete_fraction > 0) {
+        uint64_t kept = size;
+        for (uint64_t i = 0; i < size; i++) {
+            if (!is_deleted(c, i))
+                continue;
+            kept--;
+            int klen = make_key(key, c, i);
+            int vlen = make_value(value, c, i);
+            if (db_remove(db, key)) {
+                payload -= klen + vlen;
+            }
+        }
+        measure(&s);
+        print_phase(c, "after_delete", kept, &base, &s, payload);
+    }
+    db_destroy(db);
+}
+
+/* Parses "n" or "min:max" into a length range. */
+static int parse_range(const char *arg, int *min, int *max) {
+    char *end;
+    *min = *max = (int)strtol(arg, &end, 10);
+    if (*end == ':') {
+        *max = (int)strtol(end + 1, &end, 10);
+    }
+    return *end == '\0' && *min >= 1 && *min <= *max ? 0 : -1;
+}
+
+static void usage(const char *cmd) {
+    fprintf(stderr,
+            "Usage: %s [-n sizes, comma separated] [-k key size[:max]] "
+            "[-v value size[:max]]\n"
+            "       [-D delete fraction] [-s seed] [-f csv|json]\n",
+            cmd);
+}
+
+int main(int argc, char *argv[]) {
+    mem_config_t config = {16, 16, 32, 32, 0.5, 1, fmt_csv};
+    uint64_t sizes[MAX_SIZES] = {10000, 100000, 1000000};
+    int nsizes = 3;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "n:k:v:D:s:f:")) != -1) {
+        switch (opt) {
+            case 'n':
+                nsizes = 0;
+                for (char *tok = strtok(optarg, ","); tok != NULL;
+                     tok = strtok(NULL, ",")) {
+                    if (nsizes == MAX_SIZES ||
+                        (sizes[nsizes] = strtoull(tok, NULL, 10)) == 0) {
+                        usage(argv[0]);
+                        return 1;
+                    }
+                    nsizes++;
+                }
+                break;
+            case 'k':
+                if (parse_range(optarg, &config.key_min, &config.key_max) < 0) {
+                    usage(argv[0]);
+                    return 1;
+                }
+                break;
+            case 'v':
+                if (parse_range(optarg, &config.value_min, &config.value_max) <
+                    0) {
+                    usage(argv[0]);
+                    return 1;
+                }
+                break;
+            case 'D':
+                config.delete_fraction = atof(optarg);
+                break;
+            case 's':
+                config.seed = strtoull(optarg, NULL, 10);
+                break;
+            case 'f':
+                if (strcmp(optarg, "csv") == 0) {
+                    config.format = fmt_csv;
+                } else if (strcmp(optarg, "json") == 0) {
+                    config.format = fmt_json;
+                } else {
+                    usage(argv[0]);
+                    return 1;
+                }
+                break;
+            default:
+                usage(argv[0]);
+                return 1;
+        }
+    }
+    if (nsizes == 0 || config.key_max > MAX_KEY ||
+        config.value_max > MAX_VALUE || config.delete_fraction < 0 ||
+        config.delete_fraction > 1) {
+        usage(argv[0]);
+        return 1;
+    }
+    for (int i = 0; i < nsizes; i++) {
+        if (sizes[i] > key_space(&config)) {
+            fprintf(stderr,
+                    "%" PRIu64 " keys do not fit in keys of %d characters\n",
+                    sizes[i], config.key_min);
+            return 1;
+        }
+    }
+
+    print_header(&config);
+    fflush(stdout);  // or every child would print it again
+    for (int i = 0; i < nsizes; i++) {
+        pid_t pid = fork();
+        if (pid < 0) {
+            perror("fork");
+            return 1;
+        }
+        if (pid == 0) {
+            run_size(&config, sizes[i]);
+            exit(0);
+        }
+        int status;
+        if (waitpid(pid, &status, 0) < 0 || !WIFEXITED(status) ||
+            WEXITSTATUS(status) != 0) {
+            fprintf(stderr, "run of %" PRIu64 " keys failed\n", sizes[i]);
+            return 1;
+        }
+    }
+    return 0;
+}
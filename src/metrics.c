@@ -0,0 +1,376 @@
+#include <malloc.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "./metrics.h"
+#include "./comm.h"
+
+__thread metrics_cell_t *metrics_cell = NULL;
+
+// Live cells, plus the sum of the cells of threads that have exited
+static metrics_cell_t *cell_list_head = NULL;
+static metrics_cell_t retired;
+static pthread_mutex_t cell_list_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static pthread_key_t cell_key;
+static pthread_once_t cell_key_once = PTHREAD_ONCE_INIT;
+
+static uint64_t conn_total = 0;
+static int64_t conn_active = 0;
+
+static const char *cmd_names[M_NCMDS] = {"query", "add",  "update",
+                                         "delete", "scan", "file",
+                                         "track", "invalid"};
+static const char *lock_names[2] = {"read", "write"};
+static const char *mem_names[M_NMEM] = {"node", "key",        "value",
+                                        "lock", "connection", "stack"};
+
+//------------------------------------------------------------------------------------------------
+// Cell lifecycle
+
+/* Adds every counter of src into dst. */
+static void cell_accumulate(metrics_cell_t *dst, metrics_cell_t *src) {
+    for (int c = 0; c < M_NCMDS; c++) {
+        dst->cmd_count[c] += METRIC_READ(src->cmd_count[c]);
+        dst->cmd_ns[c] += METRIC_READ(src->cmd_ns[c]);
+        for (int b = 0; b < METRICS_LAT_BUCKETS; b++) {
+            dst->cmd_hist[c][b] += METRIC_READ(src->cmd_hist[c][b]);
+        }
+    }
+    for (int l = 0; l < 2; l++) {
+        dst->lock_acquires[l] += METRIC_READ(src->lock_acquires[l]);
+        dst->lock_waits[l] += METRIC_READ(src->lock_waits[l]);
+        dst->lock_wait_ns[l] += METRIC_READ(src->lock_wait_ns[l]);
+    }
+    for (int m = 0; m < M_NMEM; m++) {
+        dst->mem_objects[m] += METRIC_READ(src->mem_objects[m]);
+        dst->mem_requested[m] += METRIC_READ(src->mem_requested[m]);
+        dst->mem_allocated[m] += METRIC_READ(src->mem_allocated[m]);
+    }
+}
+
+/* Thread-exit destructor: folds the cell into the retired totals. */
+static void cell_retire(void *arg) {
+    metrics_cell_t *cell = (metrics_cell_t *)arg;
+
+    pthread_mutex_lock(&cell_list_mutex);
+    if (cell->next != NULL) {
+        cell->next->prev = cell->prev;
+    }
+    if (cell->prev != NULL) {
+        cell->prev->next = cell->next;
+    }
+    if (cell == cell_list_head) {
+        cell_list_head = cell->next;
+    }
+    cell_accumulate(&retired, cell);
+    pthread_mutex_unlock(&cell_list_mutex);
+
+    metrics_cell = NULL;
+    free(cell);
+}
+
+static void cell_key_create(void) {
+    int err;
+    if ((err = pthread_key_create(&cell_key, cell_retire))) {
+        handle_error_en(err, "pthread_key_create");
+    }
+}
+
+metrics_cell_t *metrics_cell_create(void) {
+    metrics_cell_t *cell;
+    int err;
+
+    pthread_once(&cell_key_once, cell_key_create);
+    if ((cell = calloc(1, sizeof(metrics_cell_t))) == NULL) {
+        perror("Unable to malloc space for a metrics cell");
+        exit(1);
+    }
+    if ((err = pthread_setspecific(cell_key, cell))) {
+        handle_error_en(err, "pthread_setspecific");
+    }
+
+    pthread_mutex_lock(&cell_list_mutex);
+    cell->next = cell_list_head;
+    if (cell_list_head != NULL) {
+        cell_list_head->prev = cell;
+    }
+    cell_list_head = cell;
+    pthread_mutex_unlock(&cell_list_mutex);
+
+    metrics_cell = cell;
+    return cell;
+}
+
+//------------------------------------------------------------------------------------------------
+// Recording
+
+void metrics_command(char op, uint64_t ns) {
+    metrics_cell_t *cell = metrics_thread_cell();
+    int c;
+    switch (op) {
+        case 'q':
+            c = m_query;
+            break;
+        case 'a':
+            c = m_add;
+            break;
+        case 'u':
+            c = m_update;
+            break;
+        case 'd':
+            c = m_delete;
+            break;
+        case 's':
+            c = m_scan;
+            break;
+        case 'f':
+            c = m_file;
+            break;
+        case 't':
+            c = m_track;
+            break;
+        default:
+            c = m_invalid;
+            break;
+    }
+
+    // Bucket i holds latencies up to 2^i microseconds
+    int b = 0;
+    uint64_t us = ns / 1000;
+    while (b < METRICS_LAT_BUCKETS - 1 && us > (1ull << b)) {
+        b++;
+    }
+
+    METRIC_ADD(cell->cmd_count[c], 1);
+    METRIC_ADD(cell->cmd_ns[c], ns);
+    METRIC_ADD(cell->cmd_hist[c][b], 1);
+}
+
+void metrics_lock_wait(int lt, uint64_t ns) {
+    metrics_cell_t *cell = metrics_thread_cell();
+    METRIC_ADD(cell->lock_waits[lt], 1);
+    METRIC_ADD(cell->lock_wait_ns[lt], ns);
+}
+
+void metrics_mem(int cat, int count, size_t requested, size_t allocated) {
+    metrics_cell_t *cell = metrics_thread_cell();
+    int64_t sign = count < 0 ? -1 : 1;
+    METRIC_ADD(cell->mem_objects[cat], count);
+    METRIC_ADD(cell->mem_requested[cat], sign * (int64_t)requested);
+    METRIC_ADD(cell->mem_allocated[cat], sign * (int64_t)allocated);
+}
+
+void metrics_conn_open(void) {
+    __atomic_add_fetch(&conn_total, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&conn_active, 1, __ATOMIC_RELAXED);
+}
+
+void metrics_conn_close(void) {
+    __atomic_sub_fetch(&conn_active, 1, __ATOMIC_RELAXED);
+}
+
+//------------------------------------------------------------------------------------------------
+// Reporting
+
+void metrics_collect(metrics_cell_t *out) {
+    memset(out, 0, sizeof(*out));
+    pthread_mutex_lock(&cell_list_mutex);
+    cell_accumulate(out, &retired);
+    for (metrics_cell_t *cell = cell_list_head; cell != NULL;
+         cell = cell->next) {
+        cell_accumulate(out, cell);
+    }
+    pthread_mutex_unlock(&cell_list_mutex);
+}
+
+/* Reads the process' virtual and resident size from /proc, in bytes. */
+static int read_statm(uint64_t *vsize, uint64_t *rss) {
+    FILE *f;
+    unsigned long pages_v, pages_r;
+    if ((f = fopen("/proc/self/statm", "r")) == NULL) {
+        return -1;
+    }
+    int n = fscanf(f, "%lu %lu", &pages_v, &pages_r);
+    fclose(f);
+    if (n != 2) {
+        return -1;
+    }
+    long page = sysconf(_SC_PAGESIZE);
+    *vsize = (uint64_t)pages_v * page;
+    *rss = (uint64_t)pages_r * page;
+    return 0;
+}
+
+void metrics_write(FILE *out) {
+    metrics_cell_t m;
+    metrics_collect(&m);
+
+    fprintf(out,
+            "# HELP concurrentdb_commands_total Client commands executed.\n"
+            "# TYPE concurrentdb_commands_total counter\n");
+    for (int c = 0; c < M_NCMDS; c++) {
+        fprintf(out, "concurrentdb_commands_total{cmd=\"%s\"} %lu\n",
+                cmd_names[c], m.cmd_count[c]);
+    }
+
+    fprintf(out,
+            "# HELP concurrentdb_command_duration_seconds Time spent executing "
+            "client commands.\n"
+            "# TYPE concurrentdb_command_duration_seconds histogram\n");
+    for (int c = 0; c < M_NCMDS; c++) {
+        uint64_t cumulative = 0;
+        for (int b = 0; b < METRICS_LAT_BUCKETS; b++) {
+            cumulative += m.cmd_hist[c][b];
+            if (b == METRICS_LAT_BUCKETS - 1) {
+                fprintf(out,
+                        "concurrentdb_command_duration_seconds_bucket{cmd=\"%s\","
+                        "le=\"+Inf\"} %lu\n",
+                        cmd_names[c], cumulative);
+            } else {
+                fprintf(out,
+                        "concurrentdb_command_duration_seconds_bucket{cmd=\"%s\","
+                        "le=\"%g\"} %lu\n",
+                        cmd_names[c], (double)(1ull << b) / 1e6, cumulative);
+            }
+        }
+        fprintf(out,
+                "concurrentdb_command_duration_seconds_sum{cmd=\"%s\"} %.9f\n"
+                "concurrentdb_command_duration_seconds_count{cmd=\"%s\"} %lu\n",
+                cmd_names[c], (double)m.cmd_ns[c] / 1e9, cmd_names[c],
+                m.cmd_count[c]);
+    }
+
+    fprintf(out,
+            "# HELP concurrentdb_connections_active Connected clients.\n"
+            "# TYPE concurrentdb_connections_active gauge\n"
+            "concurrentdb_connections_active %ld\n"
+            "# HELP concurrentdb_connections_total Clients accepted since "
+            "start.\n"
+            "# TYPE concurrentdb_connections_total counter\n"
+            "concurrentdb_connections_total %lu\n",
+            __atomic_load_n(&conn_active, __ATOMIC_RELAXED),
+            __atomic_load_n(&conn_total, __ATOMIC_RELAXED));
+
+    fprintf(out,
+            "# HELP concurrentdb_lock_acquisitions_total Tree node lock "
+            "acquisitions.\n"
+            "# TYPE concurrentdb_lock_acquisitions_total counter\n");
+    for (int l = 0; l < 2; l++) {
+        fprintf(out, "concurrentdb_lock_acquisitions_total{mode=\"%s\"} %lu\n",
+                lock_names[l], m.lock_acquires[l]);
+    }
+    fprintf(out,
+            "# HELP concurrentdb_lock_waits_total Tree node lock acquisitions "
+            "that had to block.\n"
+            "# TYPE concurrentdb_lock_waits_total counter\n");
+    for (int l = 0; l < 2; l++) {
+        fprintf(out, "concurrentdb_lock_waits_total{mode=\"%s\"} %lu\n",
+                lock_names[l], m.lock_waits[l]);
+    }
+    fprintf(out,
+            "# HELP concurrentdb_lock_wait_seconds_total Time spent blocked on "
+            "tree node locks.\n"
+            "# TYPE concurrentdb_lock_wait_seconds_total counter\n");
+    for (int l = 0; l < 2; l++) {
+        fprintf(out, "concurrentdb_lock_wait_seconds_total{mode=\"%s\"} %.9f\n",
+                lock_names[l], (double)m.lock_wait_ns[l] / 1e9);
+    }
+
+    fprintf(out,
+            "# HELP concurrentdb_memory_requested_bytes Bytes requested from "
+            "the allocator, by category.\n"
+            "# TYPE concurrentdb_memory_requested_bytes gauge\n");
+    for (int c = 0; c < M_NMEM; c++) {
+        fprintf(out,
+                "concurrentdb_memory_requested_bytes{category=\"%s\"} %ld\n",
+                mem_names[c], m.mem_requested[c]);
+    }
+    fprintf(out,
+            "# HELP concurrentdb_memory_allocated_bytes Bytes used by the "
+            "allocator, including slack and chunk headers, by category.\n"
+            "# TYPE concurrentdb_memory_allocated_bytes gauge\n");
+    for (int c = 0; c < M_NMEM; c++) {
+        fprintf(out,
+                "concurrentdb_memory_allocated_bytes{category=\"%s\"} %ld\n",
+                mem_names[c], m.mem_allocated[c]);
+    }
+    fprintf(out,
+            "# HELP concurrentdb_keys Keys stored in the database.\n"
+            "# TYPE concurrentdb_keys gauge\n"
+            "concurrentdb_keys %ld\n",
+            m.mem_objects[mem_node]);
+
+    uint64_t vsize, rss;
+    if (read_statm(&vsize, &rss) == 0) {
+        fprintf(out,
+                "# HELP process_resident_memory_bytes Resident memory size in "
+                "bytes.\n"
+                "# TYPE process_resident_memory_bytes gauge\n"
+                "process_resident_memory_bytes %lu\n"
+                "# HELP process_virtual_memory_bytes Virtual memory size in "
+                "bytes.\n"
+                "# TYPE process_virtual_memory_bytes gauge\n"
+                "process_virtual_memory_bytes %lu\n",
+                rss, vsize);
+    }
+}
+
+void metrics_memory_write(FILE *out) {
+    metrics_cell_t m;
+    metrics_collect(&m);
+
+    int64_t requested = 0, allocated = 0;
+    fprintf(out, "%-12s %12s %16s %16s\n", "category", "objects", "requested",
+            "allocated");
+    for (int c = 0; c < M_NMEM; c++) {
+        fprintf(out, "%-12s %12ld %16ld %16ld\n", mem_names[c],
+                m.mem_objects[c], m.mem_requested[c], m.mem_allocated[c]);
+        requested += m.mem_requested[c];
+        allocated += m.mem_allocated[c];
+    }
+    fprintf(out, "%-12s %12s %16ld %16ld\n", "total", "", requested,
+            allocated);
+
+    // Everything a key costs: its node, lock, key and value strings
+    int64_t keys = m.mem_objects[mem_node];
+    if (keys > 0) {
+        int64_t per_key_req = m.mem_requested[mem_node] +
+                              m.mem_requested[mem_lock] +
+                              m.mem_requested[mem_key] +
+                              m.mem_requested[mem_value];
+        int64_t per_key_alloc = m.mem_allocated[mem_node] +
+                                m.mem_allocated[mem_lock] +
+                                m.mem_allocated[mem_key] +
+                                m.mem_allocated[mem_value];
+        fprintf(out,
+                "keys %ld, bytes per key %.1f requested, %.1f allocated "
+                "(payload %.1f)\n",
+                keys, (double)per_key_req / keys, (double)per_key_alloc / keys,
+                (double)(m.mem_requested[mem_key] +
+                         m.mem_requested[mem_value]) /
+                    keys);
+    } else {
+        fprintf(out, "keys 0\n");
+    }
+
+    uint64_t vsize, rss;
+    if (read_statm(&vsize, &rss) == 0) {
+        fprintf(out, "process rss %lu, virtual %lu\n", rss, vsize);
+    }
+
+#if defined(__GLIBC__) && __GLIBC_PREREQ(2, 33)
+    // Free bytes held in the heap are memory the process pays for but cannot
+    // use for anything but future allocations of a fitting size
+    struct mallinfo2 mi = mallinfo2();
+    size_t heap = mi.arena + mi.hblkhd;
+    fprintf(out,
+            "allocator heap %zu (mmapped %zu), in use %zu, free %zu, "
+            "fragmentation %.1f%%\n",
+            heap, mi.hblkhd, mi.uordblks + mi.hblkhd, mi.fordblks,
+            heap > 0 ? 100.0 * mi.fordblks / heap : 0.0);
+#endif
+}
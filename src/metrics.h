@@ -0,0 +1,113 @@
+#ifndef METRICS_H_
+#define METRICS_H_
+
+#include <stdint.h>
+#include <stdio.h>
+#include <time.h>
+
+/*
+ * Server-wide counters. Every thread owns a private metrics cell that only it
+ * writes to, so the hot paths never touch a shared cache line; the cells are
+ * summed when someone asks for a report.
+ */
+
+// Command types, indexed by the first character of a client command
+enum metrics_cmd {
+    m_query,
+    m_add,
+    m_update,
+    m_delete,
+    m_scan,
+    m_file,
+    m_track,
+    m_invalid,
+    M_NCMDS
+};
+
+// Memory categories, counted where the memory is allocated and freed
+enum metrics_mem {
+    mem_node,   // node_t minus its lock
+    mem_key,
+    mem_value,
+    mem_lock,   // the rwlock embedded in each node
+    mem_conn,   // client_t and its socket stream
+    mem_stack,  // client thread stacks (reserved, not necessarily resident)
+    M_NMEM
+};
+
+// Per-allocation bookkeeping of the allocator, on top of the usable size
+#define MALLOC_CHUNK_OVERHEAD sizeof(size_t)
+
+// Latency histogram buckets: upper bounds of 1us * 2^i, the last one is +Inf
+#define METRICS_LAT_BUCKETS 24
+
+typedef struct metrics_cell {
+    uint64_t cmd_count[M_NCMDS];
+    uint64_t cmd_ns[M_NCMDS];
+    uint64_t cmd_hist[M_NCMDS][METRICS_LAT_BUCKETS];
+
+    // Indexed by enum locktype (read, write)
+    uint64_t lock_acquires[2];
+    uint64_t lock_waits[2];  // acquisitions that had to block
+    uint64_t lock_wait_ns[2];
+
+    // Indexed by enum metrics_mem. Memory may be freed by a different thread
+    // than the one that allocated it, so a single cell can go negative; only
+    // the sum over all cells is meaningful.
+    int64_t mem_objects[M_NMEM];
+    int64_t mem_requested[M_NMEM];  // bytes asked of the allocator
+    int64_t mem_allocated[M_NMEM];  // bytes it actually handed out
+
+    // For the list of live cells
+    struct metrics_cell *prev;
+    struct metrics_cell *next;
+} metrics_cell_t;
+
+// Single-writer increment; readers on other threads see whole values
+#define METRIC_ADD(field, n) \
+    __atomic_store_n(&(field), (field) + (n), __ATOMIC_RELAXED)
+#define METRIC_SET(field, v) __atomic_store_n(&(field), (v), __ATOMIC_RELAXED)
+#define METRIC_READ(field) __atomic_load_n(&(field), __ATOMIC_RELAXED)
+
+/* Returns the calling thread's cell, creating it on first use. */
+metrics_cell_t *metrics_cell_create(void);
+
+extern __thread metrics_cell_t *metrics_cell;
+
+static inline metrics_cell_t *metrics_thread_cell(void) {
+    metrics_cell_t *cell = metrics_cell;
+    return cell != NULL ? cell : metrics_cell_create();
+}
+
+static inline uint64_t metrics_now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+/* Records one executed command (identified by its first character). */
+void metrics_command(char op, uint64_t ns);
+
+/* Records a lock acquisition that had to block for ns nanoseconds. */
+void metrics_lock_wait(int lt, uint64_t ns);
+
+/*
+ * Records objects allocated (count > 0) or freed (count < 0) in a category,
+ * with the bytes requested and the bytes the allocator really used.
+ */
+void metrics_mem(int cat, int count, size_t requested, size_t allocated);
+
+/* Connection lifecycle, called by the server when clients come and go. */
+void metrics_conn_open(void);
+void metrics_conn_close(void);
+
+/* Sums every live and retired cell into out. */
+void metrics_collect(metrics_cell_t *out);
+
+/* Writes all metrics in Prometheus text exposition format. */
+void metrics_write(FILE *out);
+
+/* Writes the memory breakdown, bytes per key and allocator statistics. */
+void metrics_memory_write(FILE *out);
+
+#endif  // METRICS_H_
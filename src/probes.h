@@ -0,0 +1,35 @@
+#ifndef PROBES_H_
+#define PROBES_H_
+
+/*
+ * USDT static tracepoints under the `concurrentdb` provider. When
+ * <sys/sdt.h> (systemtap-sdt-dev) is available each probe compiles to a
+ * single nop plus an ELF note that bpftrace and perf can attach to; without
+ * it, or when built with -DNO_SDT, probes compile to nothing. See scripts/
+ * for bpftrace examples.
+ */
+
+#if defined(__has_include) && !defined(NO_SDT)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define HAVE_SDT 1
+#endif
+#endif
+
+#ifdef HAVE_SDT
+#define PROBE1(name, a) DTRACE_PROBE1(concurrentdb, name, a)
+#define PROBE2(name, a, b) DTRACE_PROBE2(concurrentdb, name, a, b)
+#define PROBE3(name, a, b, c) DTRACE_PROBE3(concurrentdb, name, a, b, c)
+#else
+#define PROBE1(name, a) \
+    do {                \
+    } while (0)
+#define PROBE2(name, a, b) \
+    do {                   \
+    } while (0)
+#define PROBE3(name, a, b, c) \
+    do {                      \
+    } while (0)
+#endif
+
+#endif  // PROBES_H_
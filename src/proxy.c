@@ -0,0 +1,818 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "./comm.h"
+#include "./ring.h"
+#include "./scan_merge.h"
+
+/*
+ * Key-routing proxy. Clients connect to it as to a server and speak the same
+ * line protocol; each command is sent to the server its key belongs to, by
+ * the same consistent hashing as cdbc_cluster (ring.c, over the "host:port"
+ * names as given), so the proxy and smart clients agree on where keys live.
+ *
+ * One thread runs an epoll loop over every socket. Each server is reached
+ * over a few connections shared by all clients, each client's commands always
+ * over the same one: requests are pipelined on them, and everything queued
+ * for a connection in one turn of the loop goes out in one write. Responses
+ * go back to each client in the order it sent its requests, whichever servers
+ * answer first.
+ *
+ * A scan is sent to every server, and their pairs are merged in key order
+ * into one response, as many as fit, as a server would answer. File commands
+ * (f), tracking (t) and replication (r) are refused, since they concern one
+ * server. A request whose server cannot be reached is answered
+ * "server unavailable".
+ */
+
+#define MAX_SERVERS 64
+#define PROXY_CONNS 2          // connections per server, by default
+#define PROXY_EVENTS 64
+#define PROXY_RETRY_MS 1000    // before connecting again to a failed server
+#define CONNECT_TIMEOUT_MS 1000
+#define RESLEN 16384           // longest response line, as server.c's
+#define KEY_LEN 256
+#define CLIENT_RBUF (4 * BUFLEN)
+#define SERVER_RBUF (2 * RESLEN)
+#define CLIENT_MAX_PENDING 1024  // requests in flight before reading stops
+#define CLIENT_MAX_OUT (1 << 20) // bytes of responses before reading stops
+
+enum handle_kind { h_listener, h_client, h_server };
+
+typedef struct buf {
+    char *data;
+    size_t len;
+    size_t cap;
+} buf_t;
+
+/* A client's request, until its response has been queued to the client. */
+typedef struct request {
+    struct client *client;  // NULL once the client has gone
+    int pending;            // server responses still to come
+    int failed;             // a server could not be reached
+    int count;              // the pairs a scan asked for, or -1
+    int lane;               // which connection to each server carries it
+    int nparts;
+    char **parts;           // the servers' responses
+    struct request *next;   // the client's next request
+} request_t;
+
+/* One server response a request is waiting for. */
+typedef struct part {
+    request_t *req;
+    int index;
+    struct part *next;
+} part_t;
+
+typedef struct server_conn {
+    enum handle_kind kind;
+    int server;
+    int fd;          // -1 while disconnected
+    int writing;     // whether EPOLLOUT is on
+    int connecting;  // until EPOLLOUT says whether connect worked
+    struct addrinfo *ai;  // the address being connected to
+    uint64_t connect_ms;
+    uint64_t retry_ms;
+    part_t *oldest;  // sent or queued, awaiting responses in order
+    part_t *newest;
+    buf_t out;
+    size_t rlen;
+    char rbuf[SERVER_RBUF];
+} server_conn_t;
+
+typedef struct client {
+    enum handle_kind kind;
+    int fd;      // -1 once closed
+    int events;  // what epoll is watching for
+    int dirty;   // on the dirty list
+    int lane;    // its connection to each server
+    int eof;     // sent everything; closed once its responses are out
+    request_t *oldest;
+    request_t *newest;
+    int pending;
+    buf_t out;
+    size_t rlen;
+    char rbuf[CLIENT_RBUF];
+    struct client *next_dirty;
+} client_t;
+
+static struct {
+    int epfd;
+    int nservers;
+    int conns_per_server;
+    char *hosts[MAX_SERVERS];
+    char *ports[MAX_SERVERS];
+    struct addrinfo *addrs[MAX_SERVERS];  // resolved once, before the loop
+    ring_t ring;
+    server_conn_t *conns;     // conns_per_server for each server in turn
+    client_t *dirty;          // clients with output to flush or to free
+    int next_lane;            // for the next client, round robin
+    enum handle_kind listener;
+} proxy;
+
+static uint64_t now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + (uint64_t)ts.tv_nsec / 1000000;
+}
+
+static int buf_append(buf_t *b, const char *data, size_t len) {
+    if (b->len + len > b->cap) {
+        size_t cap = b->cap > 0 ? b->cap : BUFLEN;
+        while (cap < b->len + len)
+            cap *= 2;
+        char *grown = realloc(b->data, cap);
+        if (grown == NULL)
+            return -1;
+        b->data = grown;
+        b->cap = cap;
+    }
+    memcpy(b->data + b->len, data, len);
+    b->len += len;
+    return 0;
+}
+
+/* Sends what it can of b; returns 1 if some is left, -1 on error. */
+static int buf_send(buf_t *b, int fd) {
+    size_t off = 0;
+    while (off < b->len) {
+        ssize_t n = send(fd, b->data + off, b->len - off, MSG_NOSIGNAL);
+        if (n > 0)
+            off += n;
+        else if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            break;
+        else if (n < 0 && errno == EINTR)
+            continue;
+        else
+            return -1;
+    }
+    memmove(b->data, b->data + off, b->len - off);
+    b->len -= off;
+    return b->len > 0;
+}
+
+static void watch(int fd, int events, void *handle, int op) {
+    struct epoll_event ev;
+    ev.events = events;
+    ev.data.ptr = handle;
+    if (epoll_ctl(proxy.epfd, op, fd, &ev) < 0)
+        perror("epoll_ctl");
+}
+
+static void request_free(request_t *req) {
+    for (int i = 0; i < req->nparts; i++)
+        free(req->parts[i]);
+    free(req->parts);
+    free(req);
+}
+
+//------------------------------------------------------------------------------------------------
+// Responses to clients
+
+static void client_dirty(client_t *c) {
+    if (!c->dirty) {
+        c->dirty = 1;
+        c->next_dirty = proxy.dirty;
+        proxy.dirty = c;
+    }
+}
+
+/* Merges the servers' scan responses into one, as scan_merge.h describes. */
+static void scan_respond(request_t *req, buf_t *out) {
+    int total = 0;
+    long n[MAX_SERVERS];
+    char *save[MAX_SERVERS];
+    const char *cutoff = NULL;
+
+    for (int i = 0; i < req->nparts; i++) {
+        char *end;
+        char *count = strtok_r(req->parts[i], " ", &save[i]);
+        n[i] = count != NULL ? strtol(count, &end, 10) : -1;
+        if (count == NULL || *end != '\0' || n[i] < 0) {
+            // Not a scan response; the error holds for every server
+            buf_append(out, req->parts[i], strlen(req->parts[i]));
+            buf_append(out, "\n", 1);
+            return;
+        }
+        total += n[i];
+    }
+
+    // The pairs point into the responses
+    scan_pair_t *pairs = malloc((total > 0 ? total : 1) * sizeof(scan_pair_t));
+    if (pairs == NULL) {
+        buf_append(out, "0\n", 2);
+        return;
+    }
+    int npairs = 0;
+    for (int i = 0; i < req->nparts; i++) {
+        int first = npairs;
+        for (long j = 0; j < n[i]; j++) {
+            scan_pair_t *p = &pairs[npairs];
+            p->key = strtok_r(NULL, " ", &save[i]);
+            p->value = strtok_r(NULL, " ", &save[i]);
+            if (p->key == NULL || p->value == NULL)
+                break;
+            npairs++;
+        }
+        scan_merge_bound(&cutoff, &pairs[first], npairs - first, req->count);
+    }
+    int merged = scan_merge(pairs, npairs, cutoff, req->count);
+
+    char body[SCAN_ROOM];
+    int used = 0, count = 0;
+    body[0] = '\0';
+    while (count < merged) {
+        int len = snprintf(body + used, SCAN_ROOM - used, " %s %s",
+                           pairs[count].key, pairs[count].value);
+        if (len >= SCAN_ROOM - used) {
+            body[used] = '\0';
+            break;
+        }
+        used += len;
+        count++;
+    }
+    free(pairs);
+
+    char prefix[16];
+    int plen = snprintf(prefix, sizeof(prefix), "%d", count);
+    buf_append(out, prefix, plen);
+    buf_append(out, body, used);
+    buf_append(out, "\n", 1);
+}
+
+/* Queues the responses of c's requests that are complete, in order. */
+static void client_deliver(client_t *c) {
+    while (c->oldest != NULL && c->oldest->pending == 0) {
+        request_t *req = c->oldest;
+        if (req->failed) {
+            buf_append(&c->out, "server unavailable\n", 19);
+        } else if (req->count >= 0) {
+            scan_respond(req, &c->out);
+        } else {
+            buf_append(&c->out, req->parts[0], strlen(req->parts[0]));
+            buf_append(&c->out, "\n", 1);
+        }
+        if ((c->oldest = req->next) == NULL)
+            c->newest = NULL;
+        c->pending--;
+        request_free(req);
+    }
+    client_dirty(c);
+}
+
+/* Records one server's response to req, or its failure if line is NULL. */
+static void part_done(request_t *req, int index, const char *line) {
+    if (line == NULL || (req->parts[index] = strdup(line)) == NULL)
+        req->failed = 1;
+    if (--req->pending > 0)
+        return;
+    if (req->client != NULL)
+        client_deliver(req->client);
+    else
+        request_free(req);
+}
+
+//------------------------------------------------------------------------------------------------
+// Server connections
+
+static void server_close(server_conn_t *s) {
+    epoll_ctl(proxy.epfd, EPOLL_CTL_DEL, s->fd, NULL);
+    close(s->fd);
+    s->fd = -1;
+}
+
+/* Drops s, failing everything queued on it; a failed connect waits a while. */
+static void server_down(server_conn_t *s) {
+    int was_up = s->fd >= 0 && !s->connecting;
+    if (s->fd >= 0)
+        server_close(s);
+    if (s->connecting) {
+        s->retry_ms = now_ms() + PROXY_RETRY_MS;
+        fprintf(stderr, "cannot reach %s:%s\n", proxy.hosts[s->server],
+                proxy.ports[s->server]);
+    } else if (was_up) {
+        fprintf(stderr, "lost %s:%s\n", proxy.hosts[s->server],
+                proxy.ports[s->server]);
+    }
+    s->writing = 0;
+    s->connecting = 0;
+    s->out.len = 0;
+    s->rlen = 0;
+    while (s->oldest != NULL) {
+        part_t *p = s->oldest;
+        s->oldest = p->next;
+        part_done(p->req, p->index, NULL);
+        free(p);
+    }
+    s->newest = NULL;
+}
+
+/*
+ * Starts connecting s to the first address from ai on that takes a
+ * non-blocking connect: requests queue up meanwhile, and go out once EPOLLOUT
+ * shows the connection made.
+ */
+static int server_dial(server_conn_t *s, struct addrinfo *ai) {
+    for (; ai != NULL; ai = ai->ai_next) {
+        s->fd = socket(ai->ai_family,
+                       ai->ai_socktype | SOCK_NONBLOCK | SOCK_CLOEXEC,
+                       ai->ai_protocol);
+        if (s->fd < 0)
+            continue;
+        if (connect(s->fd, ai->ai_addr, ai->ai_addrlen) == 0 ||
+            errno == EINPROGRESS)
+            break;
+        close(s->fd);
+        s->fd = -1;
+    }
+    if (s->fd < 0)
+        return -1;
+    int one = 1;
+    setsockopt(s->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    s->ai = ai;
+    s->writing = 1;  // nothing is written before it connects
+    s->connecting = 1;
+    s->connect_ms = now_ms();
+    watch(s->fd, EPOLLOUT, s, EPOLL_CTL_ADD);
+    return 0;
+}
+
+static int server_up(server_conn_t *s) {
+    uint64_t now = now_ms();
+    if (now < s->retry_ms)
+        return -1;
+    if (server_dial(s, proxy.addrs[s->server]) < 0) {
+        s->retry_ms = now + PROXY_RETRY_MS;
+        return -1;
+    }
+    return 0;
+}
+
+/* Moves on to s's next address, keeping its queue, or gives the server up. */
+static void server_redial(server_conn_t *s) {
+    server_close(s);
+    if (server_dial(s, s->ai->ai_next) < 0)
+        server_down(s);
+}
+
+/*
+ * Queues line for server, for req's part, on the connection that carries the
+ * client's commands to it: one per client, so that they run in the order it
+ * sent them, as they would over its own connection.
+ */
+static void server_send(int server, request_t *req, int index,
+                        const char *line, size_t len) {
+    server_conn_t *s = &proxy.conns[server * proxy.conns_per_server +
+                                     req->lane];
+    part_t *p = malloc(sizeof(part_t));
+    if (p == NULL || (s->fd < 0 && server_up(s) < 0) ||
+        buf_append(&s->out, line, len) < 0) {
+        free(p);
+        part_done(req, index, NULL);
+        return;
+    }
+    p->req = req;
+    p->index = index;
+    p->next = NULL;
+    if (s->newest != NULL)
+        s->newest->next = p;
+    else
+        s->oldest = p;
+    s->newest = p;
+}
+
+static void server_flush(server_conn_t *s) {
+    int left = buf_send(&s->out, s->fd);
+    if (left < 0) {
+        server_down(s);
+    } else if (left != s->writing) {
+        watch(s->fd, EPOLLIN | (left ? EPOLLOUT : 0), s, EPOLL_CTL_MOD);
+        s->writing = left;
+    }
+}
+
+/* Finishes connecting s once it is writable; the queue then goes out. */
+static void server_connected(server_conn_t *s) {
+    int err = 0;
+    socklen_t len = sizeof(err);
+    if (getsockopt(s->fd, SOL_SOCKET, SO_ERROR, &err, &len) < 0 || err != 0) {
+        server_redial(s);
+        return;
+    }
+    s->connecting = 0;
+    watch(s->fd, EPOLLIN | EPOLLOUT, s, EPOLL_CTL_MOD);
+    server_flush(s);
+}
+
+/* Reads what has arrived from a server and answers the parts it completes. */
+static void server_read(server_conn_t *s) {
+    while (s->fd >= 0) {
+        if (s->rlen == SERVER_RBUF) {
+            server_down(s);
+            return;
+        }
+        ssize_t n = recv(s->fd, s->rbuf + s->rlen, SERVER_RBUF - s->rlen, 0);
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            return;
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0) {
+            server_down(s);
+            return;
+        }
+        s->rlen += n;
+
+        char *line = s->rbuf, *nl;
+        while ((nl = memchr(line, '\n', s->rbuf + s->rlen - line)) != NULL) {
+            part_t *p = s->oldest;
+            if (p == NULL) {
+                server_down(s);
+                return;
+            }
+            *nl = '\0';
+            if ((s->oldest = p->next) == NULL)
+                s->newest = NULL;
+            part_done(p->req, p->index, line);
+            free(p);
+            line = nl + 1;
+        }
+        s->rlen -= line - s->rbuf;
+        memmove(s->rbuf, line, s->rlen);
+    }
+}
+
+/* Moves on from connects that have taken too long; returns the next deadline. */
+static int server_expire(void) {
+    uint64_t now = now_ms();
+    int wait = -1;
+    for (int i = 0; i < proxy.nservers * proxy.conns_per_server; i++) {
+        server_conn_t *s = &proxy.conns[i];
+        if (s->connecting && now - s->connect_ms >= CONNECT_TIMEOUT_MS)
+            server_redial(s);
+        if (s->connecting) {
+            int left = (int)(s->connect_ms + CONNECT_TIMEOUT_MS - now);
+            if (wait < 0 || left < wait)
+                wait = left;
+        }
+    }
+    return wait;
+}
+
+//------------------------------------------------------------------------------------------------
+// Client connections
+
+/* Answers req from the proxy itself. */
+static void request_answer(request_t *req, const char *response) {
+    req->pending = 1;
+    part_done(req, 0, response);
+}
+
+/* Starts on one command line from c, without its newline. */
+static void client_command(client_t *c, char *line, size_t len) {
+    char key[KEY_LEN];
+    int count;
+    request_t *req = calloc(1, sizeof(request_t));
+    if (req == NULL || (req->parts = calloc(proxy.nservers,
+                                            sizeof(char *))) == NULL) {
+        free(req);
+        return;
+    }
+    req->client = c;
+    req->lane = c->lane;
+    req->count = -1;
+    req->nparts = 1;
+    if (c->newest != NULL)
+        c->newest->next = req;
+    else
+        c->oldest = req;
+    c->newest = req;
+    c->pending++;
+
+    line[len] = '\0';
+    switch (line[0]) {
+        case 'q':
+        case 'a':
+        case 'd':
+        case 'u':
+            if (sscanf(&line[1], "%255s", key) < 1) {
+                request_answer(req, "ill-formed command");
+                return;
+            }
+            req->pending = 1;
+            line[len] = '\n';  // sent on as it came
+            server_send(ring_lookup(&proxy.ring, key, strlen(key)), req, 0,
+                        line, len + 1);
+            return;
+
+        case 's':
+            if (sscanf(&line[1], "%255s %d", key, &count) < 2 || count < 0) {
+                request_answer(req, "ill-formed command");
+                return;
+            }
+            // Any server may hold any of the first count keys from start
+            req->count = count;
+            req->nparts = req->pending = proxy.nservers;
+            line[len] = '\n';
+            for (int i = 0; i < proxy.nservers; i++)
+                server_send(i, req, i, line, len + 1);
+            return;
+
+        case 'f':
+        case 't':
+        case 'r':
+            request_answer(req, "not supported by proxy");
+            return;
+
+        default:
+            request_answer(req, "ill-formed command");
+            return;
+    }
+}
+
+/* Closes c; its requests still with servers are dropped when they finish. */
+static void client_close(client_t *c) {
+    epoll_ctl(proxy.epfd, EPOLL_CTL_DEL, c->fd, NULL);
+    close(c->fd);
+    c->fd = -1;
+    while (c->oldest != NULL) {
+        request_t *req = c->oldest;
+        c->oldest = req->next;
+        if (req->pending > 0)
+            req->client = NULL;
+        else
+            request_free(req);
+    }
+    c->newest = NULL;
+    client_dirty(c);  // freed once the loop is done with it
+}
+
+static void client_read(client_t *c) {
+    while (c->fd >= 0) {
+        if (c->rlen == CLIENT_RBUF) {
+            // No line is that long
+            client_close(c);
+            return;
+        }
+        ssize_t n = recv(c->fd, c->rbuf + c->rlen, CLIENT_RBUF - c->rlen, 0);
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            return;
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n == 0 && !c->eof) {
+            // Shut for writing: answer what it sent, then close
+            c->eof = 1;
+            client_dirty(c);
+            return;
+        }
+        if (n <= 0) {
+            client_close(c);
+            return;
+        }
+        c->rlen += n;
+
+        char *line = c->rbuf, *nl;
+        while ((nl = memchr(line, '\n', c->rbuf + c->rlen - line)) != NULL) {
+            client_command(c, line, nl - line);
+            line = nl + 1;
+        }
+        c->rlen -= line - c->rbuf;
+        memmove(c->rbuf, line, c->rlen);
+        if (c->pending >= CLIENT_MAX_PENDING)
+            return;
+    }
+}
+
+/*
+ * Writes c's responses, and reads more requests only while it is taking
+ * them, so a client that pipelines without reading cannot pile them up. A
+ * client that has shut its side is closed once it has all its responses.
+ */
+static void client_flush(client_t *c) {
+    int left = c->out.len > 0 ? buf_send(&c->out, c->fd) : 0;
+    if (left < 0 || (c->eof && !left && c->pending == 0)) {
+        client_close(c);
+        return;
+    }
+    int events = (left ? EPOLLOUT : 0) |
+                 (!c->eof && c->pending < CLIENT_MAX_PENDING &&
+                          c->out.len < CLIENT_MAX_OUT
+                      ? EPOLLIN
+                      : 0);
+    if (events != c->events) {
+        watch(c->fd, events, c, EPOLL_CTL_MOD);
+        c->events = events;
+    }
+}
+
+static void client_accept(int lsock) {
+    int fd;
+    while ((fd = accept(lsock, NULL, NULL)) >= 0) {
+        client_t *c = calloc(1, sizeof(client_t));
+        if (c == NULL) {
+            close(fd);
+            continue;
+        }
+        int one = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+        c->kind = h_client;
+        c->fd = fd;
+        c->events = EPOLLIN;
+        c->lane = proxy.next_lane++ % proxy.conns_per_server;
+        watch(fd, EPOLLIN, c, EPOLL_CTL_ADD);
+    }
+    if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+        perror("accept");
+}
+
+//------------------------------------------------------------------------------------------------
+// Main loop
+
+/* Writes what this turn of the loop queued: one write per connection. */
+static void flush_all(void) {
+    for (int i = 0; i < proxy.nservers * proxy.conns_per_server; i++) {
+        server_conn_t *s = &proxy.conns[i];
+        if (s->fd >= 0 && s->out.len > 0 && !s->writing)
+            server_flush(s);
+    }
+    while (proxy.dirty != NULL) {
+        client_t *c = proxy.dirty;
+        proxy.dirty = c->next_dirty;
+        c->dirty = 0;
+        if (c->fd >= 0)
+            client_flush(c);
+        // Closing while flushing puts it back on the list
+        if (c->fd < 0 && !c->dirty) {
+            free(c->out.data);
+            free(c);
+        }
+    }
+}
+
+static int listen_on(int port) {
+    int lsock = socket(AF_INET, SOCK_STREAM, 0);
+    if (lsock < 0)
+        return -1;
+    int yes = 1;
+    setsockopt(lsock, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes));
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    if (bind(lsock, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+        listen(lsock, 128) < 0) {
+        close(lsock);
+        return -1;
+    }
+    fcntl(lsock, F_SETFL, fcntl(lsock, F_GETFL) | O_NONBLOCK);
+    return lsock;
+}
+
+static void usage(const char *cmd) {
+    fprintf(stderr,
+            "Usage: %s [-c connections per server] <port> "
+            "host:port,host:port,...\n",
+            cmd);
+}
+
+int main(int argc, char *argv[]) {
+    int opt;
+    proxy.conns_per_server = PROXY_CONNS;
+    while ((opt = getopt(argc, argv, "c:")) != -1) {
+        switch (opt) {
+            case 'c':
+                proxy.conns_per_server = atoi(optarg);
+                break;
+            default:
+                usage(argv[0]);
+                return 1;
+        }
+    }
+    if (optind != argc - 2 || proxy.conns_per_server < 1) {
+        usage(argv[0]);
+        return 1;
+    }
+    int port = atoi(argv[optind]);
+
+    // host:port,host:port,... named on the ring as given
+    const char *names[MAX_SERVERS];
+    char *save, *server, *colon;
+    for (server = strtok_r(argv[optind + 1], ",", &save); server != NULL;
+         server = strtok_r(NULL, ",", &save)) {
+        if (proxy.nservers == MAX_SERVERS ||
+            (colon = strrchr(server, ':')) == NULL) {
+            usage(argv[0]);
+            return 1;
+        }
+        names[proxy.nservers] = strdup(server);
+        *colon = '\0';
+        proxy.hosts[proxy.nservers] = server;
+        proxy.ports[proxy.nservers++] = colon + 1;
+    }
+    if (proxy.nservers == 0) {
+        usage(argv[0]);
+        return 1;
+    }
+    if (ring_build(&proxy.ring, names, proxy.nservers) < 0) {
+        perror("ring_build");
+        return 1;
+    }
+    struct addrinfo hints;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    for (int i = 0; i < proxy.nservers; i++) {
+        int err = getaddrinfo(proxy.hosts[i], proxy.ports[i], &hints,
+                              &proxy.addrs[i]);
+        if (err != 0) {
+            fprintf(stderr, "%s:%s: %s\n", proxy.hosts[i], proxy.ports[i],
+                    gai_strerror(err));
+            return 1;
+        }
+    }
+
+    signal(SIGPIPE, SIG_IGN);
+    if ((proxy.epfd = epoll_create1(0)) < 0) {
+        perror("epoll_create1");
+        return 1;
+    }
+    int lsock = listen_on(port);
+    if (lsock < 0) {
+        perror("listen");
+        return 1;
+    }
+    proxy.listener = h_listener;
+    watch(lsock, EPOLLIN, &proxy.listener, EPOLL_CTL_ADD);
+
+    int nconns = proxy.nservers * proxy.conns_per_server;
+    if ((proxy.conns = calloc(nconns, sizeof(server_conn_t))) == NULL) {
+        perror("calloc");
+        return 1;
+    }
+    for (int i = 0; i < nconns; i++) {
+        server_conn_t *s = &proxy.conns[i];
+        s->kind = h_server;
+        s->server = i / proxy.conns_per_server;
+        s->fd = -1;
+        if (server_up(s) < 0 && i % proxy.conns_per_server == 0) {
+            fprintf(stderr, "cannot reach %s:%s yet\n", proxy.hosts[s->server],
+                    proxy.ports[s->server]);
+        }
+    }
+    printf("listening on port %d for %d servers\n", port, proxy.nservers);
+    fflush(stdout);
+
+    struct epoll_event events[PROXY_EVENTS];
+    int wait = server_expire();
+    while (1) {
+        int n = epoll_wait(proxy.epfd, events, PROXY_EVENTS, wait);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0) {
+            perror("epoll_wait");
+            return 1;
+        }
+        for (int i = 0; i < n; i++) {
+            enum handle_kind *kind = events[i].data.ptr;
+            uint32_t ev = events[i].events;
+            if (*kind == h_listener) {
+                client_accept(lsock);
+            } else if (*kind == h_server) {
+                server_conn_t *s = (server_conn_t *)kind;
+                if (s->fd >= 0 && s->connecting) {
+                    if (ev & (EPOLLOUT | EPOLLHUP | EPOLLERR))
+                        server_connected(s);
+                    continue;
+                }
+                if (s->fd >= 0 && (ev & EPOLLOUT))
+                    server_flush(s);
+                if (s->fd >= 0 && (ev & (EPOLLIN | EPOLLHUP | EPOLLERR)))
+                    server_read(s);
+            } else {
+                client_t *c = (client_t *)kind;
+                if (c->fd >= 0 && (ev & EPOLLOUT))
+                    client_dirty(c);
+                if (c->fd >= 0 && (ev & (EPOLLIN | EPOLLHUP | EPOLLERR)))
+                    client_read(c);
+            }
+        }
+        wait = server_expire();
+        flush_all();
+    }
+    return 0;
+}
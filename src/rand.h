@@ -0,0 +1,40 @@
+#ifndef RAND_H_
+#define RAND_H_
+
+#include <stdint.h>
+
+/*
+ * Small, fast pseudo-random numbers for the benchmark tools: xorshift64*,
+ * one state word per thread. Seed through rand_seed so that nearby seeds
+ * still give unrelated streams.
+ */
+
+/* A bijective 64-bit mix (splitmix64's finalizer). */
+static inline uint64_t rand_mix64(uint64_t x) {
+    x ^= x >> 30;
+    x *= 0xbf58476d1ce4e5b9ull;
+    x ^= x >> 27;
+    x *= 0x94d049bb133111ebull;
+    x ^= x >> 31;
+    return x;
+}
+
+static inline uint64_t rand_seed(uint64_t seed) {
+    return rand_mix64(seed + 0x9e3779b97f4a7c15ull) | 1;
+}
+
+static inline uint64_t rand_next(uint64_t *state) {
+    uint64_t x = *state;
+    x ^= x >> 12;
+    x ^= x << 25;
+    x ^= x >> 27;
+    *state = x;
+    return x * 0x2545f4914f6cdd1dull;
+}
+
+/* Uniform in [0, 1). */
+static inline double rand_unit(uint64_t *state) {
+    return (rand_next(state) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+#endif  // RAND_H_
@@ -0,0 +1,771 @@
+#include <errno.h>
+#include <inttypes.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "./repl.h"
+
+#define KEY_LEN 256       // as db.c's MAXLEN
+#define LINE_LEN 640      // the longest stream line, with room to spare
+#define CHUNK_LEN 65536   // bytes of stream sent or received at once
+#define SNAPSHOT_BATCH 1024
+#define CLEAR_BATCH 256
+#define NAME_LEN 64
+#define ID_LEN 17         // a replication id, 16 hex digits
+#define MARK_EVERY 256    // changes between marks in the log
+#define MIN_LINE 8        // "D 1 1 k\n", so the log holds no more lines
+
+/* A replica being served, as seen by the primary. */
+typedef struct replica {
+    char peer[NAME_LEN];
+    int syncing;          // still sending it the copy
+    uint64_t sent;        // stream offset of the next byte of the log to send
+    uint64_t acked_seq;   // the last change it applied, and when that was made
+    uint64_t acked_ms;
+    char *buf;            // what is being sent to it
+    struct replica *next;
+} replica_t;
+
+/* Where a change's line starts in the stream. */
+typedef struct mark {
+    uint64_t seq;
+    uint64_t off;
+} mark_t;
+
+static db_t *repl_db = NULL;
+static char repl_id[ID_LEN];  // this server's, new each time it starts
+
+// The change log. Bytes [log_start, log_end) of the stream are in log_buf;
+// the rest have been overwritten. Both are moved a whole line at a time.
+static int log_active = 0;  // read without the lock on every change
+static pthread_mutex_t log_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t log_grown;
+static size_t log_size;
+static char *log_buf = NULL;
+static uint64_t log_start = 0;
+static uint64_t log_end = 0;
+static uint64_t log_first = 1;  // the change at log_start
+static uint64_t log_seq = 0;    // the last change logged, and when it was made
+static uint64_t log_ms = 0;
+// The first change of every MARK_EVERY, so that a replica picking up where it
+// left off need not search the whole log
+static mark_t *log_marks = NULL;
+static size_t log_nmarks;
+static replica_t *replicas = NULL;
+static uint64_t served_syncs[2];  // full, partial
+
+// The primary this server follows, if it is a replica
+static int following = 0;
+static pthread_t follow_thread;
+static char follow_host[NAME_LEN];
+static char follow_port[NAME_LEN];
+static pthread_mutex_t follow_mutex = PTHREAD_MUTEX_INITIALIZER;
+static int link_up = 0;
+static int link_syncing = 0;
+// From a full sync's start until its copy is loaded, even if the link drops
+// in between: the database is part way through being replaced
+static int db_incomplete = 0;
+static uint64_t applied_seq = 0;  // the last change applied, and its time
+static uint64_t applied_ms = 0;
+static uint64_t primary_seq = 0;  // the primary's latest, as last heard
+static uint64_t primary_ms = 0;
+static char primary_id[ID_LEN];  // of the primary the database copies
+static uint64_t full_syncs = 0;
+static uint64_t partial_syncs = 0;
+
+static uint64_t now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + (uint64_t)ts.tv_nsec / 1000000;
+}
+
+static uint64_t monotonic_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + (uint64_t)ts.tv_nsec / 1000000;
+}
+
+static void unlock_mutex(void *mutex) {
+    pthread_mutex_unlock((pthread_mutex_t *)mutex);
+}
+
+static int send_all(int fd, const char *buf, size_t len) {
+    while (len > 0) {
+        ssize_t n = send(fd, buf, len, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return -1;
+        buf += n;
+        len -= n;
+    }
+    return 0;
+}
+
+//------------------------------------------------------------------------------------------------
+// The change log, written by client threads and read by replica threads
+
+/* Copies len bytes of the stream, from offset off, out of the log. */
+static void ring_read(uint64_t off, char *dst, size_t len) {
+    size_t at = off % log_size;
+    size_t first = log_size - at < len ? log_size - at : len;
+    memcpy(dst, log_buf + at, first);
+    memcpy(dst + first, log_buf, len - first);
+}
+
+/* The offset of the line after the one at off. */
+static uint64_t ring_next_line(uint64_t off) {
+    while (1) {
+        size_t at = off % log_size;
+        size_t span = log_size - at;
+        if (span > log_end - off)
+            span = log_end - off;
+        // A line can wrap round the end of the buffer
+        char *nl = memchr(log_buf + at, '\n', span);
+        if (nl != NULL)
+            return off + (nl - (log_buf + at)) + 1;
+        off += span;
+    }
+}
+
+/* Appends change seq's line, dropping the oldest lines to make room. */
+static void ring_append(uint64_t seq, const char *line, size_t len) {
+    while (log_end - log_start + len > log_size) {
+        log_start = ring_next_line(log_start);
+        log_first++;
+    }
+    if ((seq - 1) % MARK_EVERY == 0) {
+        mark_t *m = &log_marks[(seq - 1) / MARK_EVERY % log_nmarks];
+        m->seq = seq;
+        m->off = log_end;
+    }
+    size_t at = log_end % log_size;
+    size_t first = log_size - at < len ? log_size - at : len;
+    memcpy(log_buf + at, line, first);
+    memcpy(log_buf, line + first, len - first);
+    log_end += len;
+}
+
+/*
+ * Finds where change seq starts in the stream; one past the last change is
+ * where the next will. Returns -1 if the change is no longer in the log.
+ */
+static int ring_find(uint64_t seq, uint64_t *off) {
+    if (log_buf == NULL || seq < log_first || seq > log_seq + 1)
+        return -1;
+    uint64_t s = log_first, at = log_start;
+    mark_t *m = &log_marks[(seq - 1) / MARK_EVERY % log_nmarks];
+    if (m->seq >= log_first && m->seq <= seq && seq - m->seq < MARK_EVERY) {
+        s = m->seq;
+        at = m->off;
+    }
+    for (; s < seq; s++)
+        at = ring_next_line(at);
+    *off = at;
+    return 0;
+}
+
+/* db's change callback: logs the change while the key is still locked. */
+static void log_change(const char *key, const char *value, void *arg) {
+    (void)arg;
+    if (!__atomic_load_n(&log_active, __ATOMIC_ACQUIRE))
+        return;
+    char line[LINE_LEN];
+    uint64_t ms = now_ms();
+
+    pthread_mutex_lock(&log_mutex);
+    uint64_t seq = ++log_seq;
+    int len = value != NULL ? snprintf(line, LINE_LEN,
+                                       "P %" PRIu64 " %" PRIu64 " %s %s\n",
+                                       seq, ms, key, value)
+                            : snprintf(line, LINE_LEN,
+                                       "D %" PRIu64 " %" PRIu64 " %s\n", seq,
+                                       ms, key);
+    ring_append(seq, line, len);
+    log_ms = ms;
+    pthread_cond_broadcast(&log_grown);
+    pthread_mutex_unlock(&log_mutex);
+}
+
+void repl_init(db_t *db, size_t backlog) {
+    // Unique enough that a replica never takes one run of a primary for
+    // another
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    uint64_t id = (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+    id = (id ^ ((uint64_t)getpid() << 32)) * 0x9e3779b97f4a7c15ull;
+    snprintf(repl_id, ID_LEN, "%016" PRIx64, id);
+    log_size = backlog;
+    log_nmarks = backlog / (MIN_LINE * MARK_EVERY) + 1;
+
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&log_grown, &attr);
+    pthread_condattr_destroy(&attr);
+    repl_db = db;
+    db_set_change_fn(db, log_change, NULL);
+}
+
+//------------------------------------------------------------------------------------------------
+// The primary's side of a link
+
+/* A batch of the copy, formatted while the tree is being scanned. */
+typedef struct snapshot {
+    char *buf;
+    size_t len;
+    int count;
+    char last[KEY_LEN];
+} snapshot_t;
+
+static int snapshot_pair(const char *key, const char *value, void *arg) {
+    snapshot_t *s = (snapshot_t *)arg;
+    s->len += sprintf(s->buf + s->len, "S %s %s\n", key, value);
+    strcpy(s->last, key);
+    s->count++;
+    return 0;
+}
+
+/* Sends the copy of the database, a batch of pairs at a time. */
+static int send_snapshot(int fd, char *buf) {
+    snapshot_t s = {buf, 0, 0, ""};
+    int inclusive = 1;
+    do {
+        s.len = 0;
+        s.count = 0;
+        db_scan(repl_db, s.last, inclusive, SNAPSHOT_BATCH, snapshot_pair,
+                &s);
+        inclusive = 0;
+        if (s.len > 0 && send_all(fd, s.buf, s.len) < 0)
+            return -1;
+    } while (s.count == SNAPSHOT_BATCH);
+    return send_all(fd, "E\n", 2);
+}
+
+/* Reads what acks have arrived, without waiting. Returns -1 on EOF. */
+static int read_acks(int fd, replica_t *r, char *in, size_t *in_len,
+                     uint64_t *last_ack) {
+    ssize_t n;
+    while ((n = recv(fd, in + *in_len, LINE_LEN - *in_len, MSG_DONTWAIT)) >
+           0) {
+        *in_len += n;
+        char *line = in, *nl;
+        while ((nl = memchr(line, '\n', in + *in_len - line)) != NULL) {
+            uint64_t seq, ms;
+            if (sscanf(line, "ack %" SCNu64 " %" SCNu64, &seq, &ms) == 2) {
+                if (r->syncing) {
+                    // It has loaded the copy, and from now on is expected to
+                    // keep up; one that stops reading is dropped rather than
+                    // waited on forever
+                    struct timeval timeout = {REPL_TIMEOUT_MS / 1000, 0};
+                    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout,
+                               sizeof(timeout));
+                }
+                pthread_mutex_lock(&log_mutex);
+                r->syncing = 0;
+                r->acked_seq = seq;
+                r->acked_ms = ms;
+                pthread_mutex_unlock(&log_mutex);
+                *last_ack = monotonic_ms();
+            }
+            line = nl + 1;
+        }
+        *in_len -= line - in;
+        memmove(in, line, *in_len);
+        // A line that fills the buffer is not an ack
+        if (*in_len == LINE_LEN)
+            return -1;
+    }
+    if (n == 0 || (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR))
+        return -1;
+    return 0;
+}
+
+/* Forgets a replica once its thread is done with it, however it ends. */
+static void replica_forget(void *arg) {
+    replica_t *r = (replica_t *)arg;
+    pthread_mutex_lock(&log_mutex);
+    for (replica_t **p = &replicas; *p != NULL; p = &(*p)->next) {
+        if (*p == r) {
+            *p = r->next;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&log_mutex);
+    free(r->buf);
+    free(r);
+}
+
+/*
+ * Waits up to REPL_ACK_MS for changes r has not been sent, and copies the
+ * next chunk of them, whole lines only, into r->buf; *n is its length, and
+ * *seq and *ms where the log is up to. Returns -1 if r has fallen out of the
+ * log.
+ */
+static int next_chunk(replica_t *r, size_t *n, uint64_t *seq, uint64_t *ms) {
+    int lost, timed_out = 0;
+    struct timespec until;
+    clock_gettime(CLOCK_MONOTONIC, &until);
+    until.tv_nsec += REPL_ACK_MS * 1000000L;
+    if (until.tv_nsec >= 1000000000L) {
+        until.tv_sec++;
+        until.tv_nsec -= 1000000000L;
+    }
+    *n = 0;
+
+    pthread_mutex_lock(&log_mutex);
+    pthread_cleanup_push(unlock_mutex, &log_mutex);
+    while (r->sent == log_end && !timed_out) {
+        timed_out = pthread_cond_timedwait(&log_grown, &log_mutex, &until) ==
+                    ETIMEDOUT;
+    }
+    lost = r->sent < log_start;
+    if (!lost && r->sent < log_end) {
+        *n = log_end - r->sent < CHUNK_LEN ? log_end - r->sent : CHUNK_LEN;
+        ring_read(r->sent, r->buf, *n);
+        // So the heartbeat goes between two lines
+        while (r->buf[*n - 1] != '\n')
+            (*n)--;
+        r->sent += *n;
+    }
+    *seq = log_seq;
+    *ms = log_ms;
+    pthread_cleanup_pop(1);
+    return lost ? -1 : 0;
+}
+
+/*
+ * Streams the log to r from r->sent on, with a heartbeat after each chunk and
+ * at least every REPL_HEARTBEAT_MS, until the link breaks or r falls out of
+ * the log. Acks are read at least every REPL_ACK_MS, so that r's lag is as
+ * fresh when the log is idle. Kept apart from the cleanup handlers, whose
+ * setjmp would make its state unsafe across them.
+ */
+static void stream_changes(int fd, replica_t *r) {
+    char line[LINE_LEN], in[LINE_LEN];
+    size_t in_len = 0;
+    uint64_t last_ack = monotonic_ms(), last_beat = 0;
+    while (1) {
+        size_t n;
+        uint64_t seq, ms;
+        // The changes it needs next are gone; it has to start over
+        if (next_chunk(r, &n, &seq, &ms) < 0)
+            break;
+        // Each heartbeat tells the replica how far behind it is
+        uint64_t now = monotonic_ms();
+        if (n > 0 || now - last_beat >= REPL_HEARTBEAT_MS) {
+            int len = snprintf(line, LINE_LEN,
+                               "H %" PRIu64 " %" PRIu64 "\n", seq, ms);
+            if ((n > 0 && send_all(fd, r->buf, n) < 0) ||
+                send_all(fd, line, len) < 0)
+                break;
+            last_beat = now;
+        }
+        // Loading the copy takes the replica a while, unheard from
+        if (read_acks(fd, r, in, &in_len, &last_ack) < 0 ||
+            (!r->syncing && monotonic_ms() - last_ack > REPL_TIMEOUT_MS))
+            break;
+    }
+}
+
+int repl_serve(int fd, const char *peer, const char *request) {
+    replica_t *r = calloc(1, sizeof(replica_t));
+    if (r == NULL)
+        return -1;
+    if ((r->buf = malloc(SNAPSHOT_BATCH * LINE_LEN)) == NULL) {
+        free(r);
+        return -1;
+    }
+    snprintf(r->peer, NAME_LEN, "%s", peer);
+    r->syncing = 1;
+    char id[ID_LEN];
+    uint64_t from;
+    int partial = sscanf(request, "%16s %" SCNu64, id, &from) == 2 &&
+                  strcmp(id, repl_id) == 0;
+
+    // From here on every change is logged after the copy's starting point,
+    // and a change the copy might miss holds its key's lock until logged
+    pthread_mutex_lock(&log_mutex);
+    if (log_buf == NULL) {
+        log_buf = malloc(log_size);
+        log_marks = calloc(log_nmarks, sizeof(mark_t));
+        if (log_buf == NULL || log_marks == NULL) {
+            free(log_buf);
+            free(log_marks);
+            log_buf = NULL;
+            log_marks = NULL;
+            pthread_mutex_unlock(&log_mutex);
+            free(r->buf);
+            free(r);
+            return -1;
+        }
+    }
+    __atomic_store_n(&log_active, 1, __ATOMIC_RELEASE);
+    // A replica of this server that is back soon enough only needs the
+    // changes it missed
+    partial = partial && ring_find(from + 1, &r->sent) == 0;
+    if (!partial)
+        r->sent = log_end;
+    served_syncs[partial]++;
+    uint64_t seq = log_seq;
+    uint64_t ms = log_seq > 0 ? log_ms : now_ms();
+    r->next = replicas;
+    replicas = r;
+    pthread_mutex_unlock(&log_mutex);
+    pthread_cleanup_push(replica_forget, r);
+
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+    char line[LINE_LEN];
+    int len = partial ? snprintf(line, LINE_LEN, "continue %s %" PRIu64 "\n",
+                                 repl_id, from)
+                      : snprintf(line, LINE_LEN,
+                                 "sync %s %" PRIu64 " %" PRIu64 "\n", repl_id,
+                                 seq, ms);
+    if (send_all(fd, line, len) == 0 &&
+        (partial || send_snapshot(fd, r->buf) == 0))
+        stream_changes(fd, r);
+    pthread_cleanup_pop(1);
+    return -1;
+}
+
+//------------------------------------------------------------------------------------------------
+// The replica's side of a link
+
+static int dial(void) {
+    struct addrinfo hints, *res, *ai;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    if (getaddrinfo(follow_host, follow_port, &hints, &res) != 0)
+        return -1;
+    int fd = -1;
+    for (ai = res; ai != NULL && fd < 0; ai = ai->ai_next) {
+        if ((fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol)) < 0)
+            continue;
+        if (connect(fd, ai->ai_addr, ai->ai_addrlen) < 0) {
+            close(fd);
+            fd = -1;
+        }
+    }
+    freeaddrinfo(res);
+    if (fd >= 0) {
+        int one = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    }
+    return fd;
+}
+
+static void put(const char *key, const char *value) {
+    if (!db_add(repl_db, key, value))
+        db_update(repl_db, key, value);
+}
+
+/* Keys collected to be removed, since a scan cannot remove them itself. */
+typedef struct doomed {
+    int count;
+    char keys[CLEAR_BATCH][KEY_LEN];
+} doomed_t;
+
+static int doom_key(const char *key, const char *value, void *arg) {
+    (void)value;
+    doomed_t *d = (doomed_t *)arg;
+    strcpy(d->keys[d->count++], key);
+    return 0;
+}
+
+/* Empties the database before a copy replaces it. */
+static void clear_db(void) {
+    doomed_t d;
+    do {
+        d.count = 0;
+        db_scan(repl_db, "", 1, CLEAR_BATCH, doom_key, &d);
+        for (int i = 0; i < d.count; i++)
+            db_remove(repl_db, d.keys[i]);
+    } while (d.count > 0);
+}
+
+/*
+ * A link to the primary. The copy arrives in key order, which would make a
+ * list of the tree, so its pairs are kept until it is complete and then added
+ * middle first.
+ */
+typedef struct link {
+    int fd;
+    char id[ID_LEN];  // of the primary the copy is from
+    char **pairs;     // "key value"
+    size_t count;
+    size_t capacity;
+} link_t;
+
+static int copy_pair(link_t *link, const char *pair) {
+    if (link->count == link->capacity) {
+        size_t capacity = link->capacity > 0 ? 2 * link->capacity : 1024;
+        char **pairs = realloc(link->pairs, capacity * sizeof(char *));
+        if (pairs == NULL)
+            return -1;
+        link->pairs = pairs;
+        link->capacity = capacity;
+    }
+    if ((link->pairs[link->count] = strdup(pair)) == NULL)
+        return -1;
+    link->count++;
+    return 0;
+}
+
+/* Adds pairs [lo, hi) so that each subtree gets its middle pair first. */
+static void copy_apply(char **pairs, size_t lo, size_t hi) {
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        char *value = strchr(pairs[mid], ' ');
+        *value++ = '\0';
+        put(pairs[mid], value);
+        copy_apply(pairs, lo, mid);
+        lo = mid + 1;
+    }
+}
+
+static void copy_free(link_t *link) {
+    for (size_t i = 0; i < link->count; i++)
+        free(link->pairs[i]);
+    free(link->pairs);
+    link->pairs = NULL;
+    link->count = link->capacity = 0;
+}
+
+/* Applies one line of the primary's stream. Returns -1 if it is not one. */
+static int apply_line(link_t *link, char *line) {
+    char key[KEY_LEN], value[KEY_LEN];
+    uint64_t seq, ms;
+
+    if (sscanf(line, "P %" SCNu64 " %" SCNu64 " %255s %255s", &seq, &ms, key,
+               value) == 4) {
+        put(key, value);
+    } else if (sscanf(line, "D %" SCNu64 " %" SCNu64 " %255s", &seq, &ms,
+                      key) == 3) {
+        db_remove(repl_db, key);
+    } else if (sscanf(line, "H %" SCNu64 " %" SCNu64, &seq, &ms) == 2) {
+        pthread_mutex_lock(&follow_mutex);
+        primary_seq = seq;
+        primary_ms = ms;
+        pthread_mutex_unlock(&follow_mutex);
+        return 0;
+    } else if (sscanf(line, "S %255s %255s", key, value) == 2) {
+        return copy_pair(link, line + 2);
+    } else if (strcmp(line, "E") == 0) {
+        copy_apply(link->pairs, 0, link->count);
+        copy_free(link);
+        pthread_mutex_lock(&follow_mutex);
+        link_syncing = 0;
+        memcpy(primary_id, link->id, ID_LEN);
+        pthread_mutex_unlock(&follow_mutex);
+        __atomic_store_n(&db_incomplete, 0, __ATOMIC_RELEASE);
+        return 0;
+    } else if (sscanf(line, "sync %16s %" SCNu64 " %" SCNu64, link->id, &seq,
+                      &ms) == 3) {
+        // Reads are refused until the copy has replaced the database
+        __atomic_store_n(&db_incomplete, 1, __ATOMIC_RELEASE);
+        pthread_mutex_lock(&follow_mutex);
+        link_syncing = 1;
+        full_syncs++;
+        primary_id[0] = '\0';  // until the copy is complete
+        primary_seq = seq;
+        primary_ms = ms;
+        pthread_mutex_unlock(&follow_mutex);
+        copy_free(link);
+        clear_db();
+    } else if (sscanf(line, "continue %16s %" SCNu64, key, &seq) == 2) {
+        // The primary still had every change since the last one applied
+        pthread_mutex_lock(&follow_mutex);
+        partial_syncs++;
+        ms = applied_ms;
+        pthread_mutex_unlock(&follow_mutex);
+    } else {
+        return -1;
+    }
+    // A change, or the point the copy starts from
+    pthread_mutex_lock(&follow_mutex);
+    applied_seq = seq;
+    applied_ms = ms;
+    if (seq > primary_seq) {
+        primary_seq = seq;
+        primary_ms = ms;
+    }
+    pthread_mutex_unlock(&follow_mutex);
+    return 0;
+}
+
+/* Polls for the primary's stream; only here can repl_stop cancel. */
+static int wait_readable(struct pollfd *pfd) {
+    int state;
+    pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, &state);
+    int n = poll(pfd, 1, REPL_TIMEOUT_MS);
+    pthread_setcancelstate(state, NULL);
+    return n;
+}
+
+static void close_link(void *arg) {
+    link_t *link = (link_t *)arg;
+    close(link->fd);
+    copy_free(link);
+}
+
+/* Follows the primary until the link fails. */
+static void follow_link(link_t *link) {
+    int fd = link->fd;
+    char buf[CHUNK_LEN];
+    size_t len = 0;
+    uint64_t last_ack = 0, acked = 0;
+
+    // Ask to carry on from the last change applied, if there was one
+    char request[LINE_LEN];
+    int request_len = primary_id[0] != '\0'
+                          ? snprintf(request, LINE_LEN, "r %s %" PRIu64 "\n",
+                                     primary_id, applied_seq)
+                          : snprintf(request, LINE_LEN, "r\n");
+    if (send_all(fd, request, request_len) < 0)
+        return;
+    pthread_mutex_lock(&follow_mutex);
+    link_up = 1;
+    pthread_mutex_unlock(&follow_mutex);
+
+    while (1) {
+        struct pollfd pfd = {fd, POLLIN, 0};
+        if (wait_readable(&pfd) <= 0)
+            return;
+        ssize_t n = recv(fd, buf + len, CHUNK_LEN - len, 0);
+        if (n <= 0)
+            return;
+        len += n;
+        char *line = buf, *nl;
+        while ((nl = memchr(line, '\n', buf + len - line)) != NULL) {
+            *nl = '\0';
+            if (apply_line(link, line) < 0)
+                return;
+            line = nl + 1;
+        }
+        len -= line - buf;
+        memmove(buf, line, len);
+        if (len == CHUNK_LEN)
+            return;
+
+        // Ack every so often while busy, and as soon as caught up; only
+        // this thread changes applied_seq, so it can read it unlocked
+        uint64_t now = monotonic_ms();
+        struct pollfd more = {fd, POLLIN, 0};
+        if (!link_syncing &&
+            (now - last_ack >= REPL_ACK_MS ||
+             (applied_seq != acked && poll(&more, 1, 0) == 0))) {
+            char ack[LINE_LEN];
+            int ack_len =
+                snprintf(ack, LINE_LEN, "ack %" PRIu64 " %" PRIu64 "\n",
+                         applied_seq, applied_ms);
+            if (send_all(fd, ack, ack_len) < 0)
+                return;
+            acked = applied_seq;
+            last_ack = now;
+        }
+    }
+}
+
+static void *follow_main(void *arg) {
+    (void)arg;
+    // Changes are applied with tree locks held, so hold cancellation off
+    pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+    while (1) {
+        pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
+        link_t link = {dial(), "", NULL, 0, 0};
+        pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+        if (link.fd >= 0) {
+            pthread_cleanup_push(close_link, &link);
+            follow_link(&link);
+            pthread_cleanup_pop(1);
+        }
+        pthread_mutex_lock(&follow_mutex);
+        link_up = 0;
+        link_syncing = 0;
+        pthread_mutex_unlock(&follow_mutex);
+        struct timespec pause = {REPL_RETRY_MS / 1000,
+                                 REPL_RETRY_MS % 1000 * 1000000L};
+        pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
+        nanosleep(&pause, NULL);
+        pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+    }
+    return NULL;
+}
+
+int repl_follow(const char *host, const char *port) {
+    int err;
+    snprintf(follow_host, NAME_LEN, "%s", host);
+    snprintf(follow_port, NAME_LEN, "%s", port);
+    if ((err = pthread_create(&follow_thread, 0, follow_main, NULL)) != 0)
+        return err;
+    __atomic_store_n(&following, 1, __ATOMIC_RELEASE);
+    return 0;
+}
+
+void repl_stop(void) {
+    if (!repl_read_only())
+        return;
+    pthread_cancel(follow_thread);
+    pthread_join(follow_thread, NULL);
+}
+
+int repl_read_only(void) {
+    return __atomic_load_n(&following, __ATOMIC_ACQUIRE);
+}
+
+int repl_incomplete(void) {
+    return __atomic_load_n(&db_incomplete, __ATOMIC_ACQUIRE);
+}
+
+//------------------------------------------------------------------------------------------------
+// Status
+
+void repl_write(FILE *out) {
+    pthread_mutex_lock(&log_mutex);
+    fprintf(out,
+            "log: id %s, changes %" PRIu64 " to %" PRIu64 " in %" PRIu64
+            " of %zu bytes, %" PRIu64 " full and %" PRIu64
+            " partial syncs served\n",
+            repl_id, log_first, log_seq, log_end - log_start, log_size,
+            served_syncs[0], served_syncs[1]);
+    fprintf(out, "%-21s %-9s %12s %10s %10s\n", "replica", "state", "acked",
+            "lag(ops)", "lag(ms)");
+    for (replica_t *r = replicas; r != NULL; r = r->next) {
+        uint64_t lag = log_seq - r->acked_seq;
+        uint64_t lag_ms =
+            lag > 0 && log_ms > r->acked_ms ? log_ms - r->acked_ms : 0;
+        fprintf(out, "%-21s %-9s %12" PRIu64 " %10" PRIu64 " %10" PRIu64 "\n",
+                r->peer, r->syncing ? "syncing" : "streaming", r->acked_seq,
+                lag, lag_ms);
+    }
+    pthread_mutex_unlock(&log_mutex);
+
+    if (!repl_read_only())
+        return;
+    pthread_mutex_lock(&follow_mutex);
+    uint64_t lag = primary_seq > applied_seq ? primary_seq - applied_seq : 0;
+    uint64_t lag_ms =
+        lag > 0 && primary_ms > applied_ms ? primary_ms - applied_ms : 0;
+    fprintf(out,
+            "primary %s:%s, link %s, applied %" PRIu64 ", lag %" PRIu64
+            " ops %" PRIu64 " ms, %" PRIu64 " full and %" PRIu64
+            " partial syncs\n",
+            follow_host, follow_port,
+            !link_up ? "down" : link_syncing ? "syncing" : "up", applied_seq,
+            lag, lag_ms, full_syncs, partial_syncs);
+    pthread_mutex_unlock(&follow_mutex);
+}
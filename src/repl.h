@@ -0,0 +1,79 @@
+#ifndef REPL_H_
+#define REPL_H_
+
+#include <stdio.h>
+
+#include "./db.h"
+
+/*
+ * Asynchronous primary-to-replica replication. Every server keeps a change
+ * log, a ring of the last few megabytes of changes (the backlog), once a
+ * replica has asked for one. A replica connects like a client and sends "r";
+ * from then on the connection carries the primary's stream, one line per
+ * entry:
+ *
+ *   sync <id> <seq> <ms>         a full copy follows, as of change seq
+ *   S <key> <value>              a pair of the copy
+ *   E                            end of the copy
+ *   continue <id> <seq>          no copy: the changes after seq follow
+ *   P <seq> <ms> <key> <value>   key was added or updated
+ *   D <seq> <ms> <key>           key was removed
+ *   H <seq> <ms>                 the primary is at change seq
+ *
+ * seq numbers changes from 1, and is the offset replicas keep their place in
+ * the stream by; ms is the primary's wall clock when it made them. id names
+ * one run of the primary, whose numbering starts over when it restarts. The
+ * replica answers "ack <seq> <ms>" with the last change it applied. Both sides
+ * report its lag as the changes it has yet to apply, and as how much earlier
+ * its last change was made than the primary's.
+ *
+ * A replica that falls further behind than the log reaches is disconnected.
+ * One that reconnects sends "r <id> <seq>" with the last change it applied,
+ * and is sent only the changes after that if they are all still in the log;
+ * otherwise it copies the whole database again.
+ *
+ * Changes are logged in the order they were made to each key, but a replica
+ * applies them some time later; it is only ever behind, never inconsistent
+ * with an earlier state of the primary's keys. Clients of a replica may read
+ * but not write, and not read while it loads a copy.
+ */
+
+#define REPL_LOG_SIZE (16 << 20)  // default bytes of changes kept
+#define REPL_HEARTBEAT_MS 1000    // when there are no changes to send
+#define REPL_ACK_MS 100           // how often a replica reports progress
+#define REPL_TIMEOUT_MS 5000      // silence after which a link is dropped
+#define REPL_RETRY_MS 1000        // between a replica's connection attempts
+
+/* Logs db's changes, backlog bytes of them, for replicas of this server. */
+void repl_init(db_t *db, size_t backlog);
+
+/*
+ * Serves the replica that sent "r" and then request over fd, until it
+ * disconnects or falls too far behind. Returns -1 then, and the caller
+ * closes the connection.
+ */
+int repl_serve(int fd, const char *peer, const char *request);
+
+/*
+ * Makes this server a replica of the primary at host:port, following it in a
+ * thread of its own and reconnecting whenever the link drops. Returns 0, or
+ * an error number if the thread cannot be started.
+ */
+int repl_follow(const char *host, const char *port);
+
+/* Stops following the primary, before the database goes away. */
+void repl_stop(void);
+
+/* Whether this server is a replica, whose clients must not write. */
+int repl_read_only(void);
+
+/*
+ * Whether this replica is part way through replacing its database with a
+ * copy of the primary's, so that its clients must not read either.
+ */
+int repl_incomplete(void);
+
+/* Writes the state of replication: this server's log and its links. */
+void repl_write(FILE *out);
+
+#endif  // REPL_H_
@@ -0,0 +1,62 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "./rand.h"
+#include "./ring.h"
+
+uint64_t ring_hash(const char *s, size_t len) {
+    uint64_t h = 0xcbf29ce484222325ull;
+    for (size_t i = 0; i < len; i++) {
+        h ^= (unsigned char)s[i];
+        h *= 0x100000001b3ull;
+    }
+    // FNV alone leaves similar keys ("key1", "key2") close together
+    return rand_mix64(h);
+}
+
+static int compare_points(const void *a, const void *b) {
+    const ring_point_t *x = a, *y = b;
+    if (x->hash != y->hash)
+        return x->hash < y->hash ? -1 : 1;
+    return x->node - y->node;
+}
+
+int ring_build(ring_t *r, const char *const *names, int n) {
+    char point[300];
+    r->nnodes = n;
+    r->npoints = n * RING_VNODES;
+    if ((r->points = malloc(r->npoints * sizeof(ring_point_t))) == NULL) {
+        r->npoints = r->nnodes = 0;
+        return -1;
+    }
+    for (int i = 0; i < n; i++) {
+        for (int v = 0; v < RING_VNODES; v++) {
+            int len = snprintf(point, sizeof(point), "%s#%d", names[i], v);
+            r->points[i * RING_VNODES + v].hash = ring_hash(point, len);
+            r->points[i * RING_VNODES + v].node = i;
+        }
+    }
+    qsort(r->points, r->npoints, sizeof(ring_point_t), compare_points);
+    return 0;
+}
+
+void ring_free(ring_t *r) {
+    free(r->points);
+    r->points = NULL;
+    r->npoints = r->nnodes = 0;
+}
+
+int ring_lookup(const ring_t *r, const char *key, size_t len) {
+    uint64_t h = ring_hash(key, len);
+    int lo = 0, hi = r->npoints;
+    // First point at or after h, wrapping round to the first of all
+    while (lo < hi) {
+        int mid = lo + (hi - lo) / 2;
+        if (r->points[mid].hash < h)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return r->points[lo == r->npoints ? 0 : lo].node;
+}
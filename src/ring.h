@@ -0,0 +1,40 @@
+#ifndef RING_H_
+#define RING_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Consistent hashing over a set of named nodes (servers, as "host:port"),
+ * in the style of ketama: every node is placed on a 64-bit ring at
+ * RING_VNODES points hashed from its name, and a key belongs to the node at
+ * the first point at or after the key's hash. Points depend only on names,
+ * so adding or removing one of n nodes moves about 1/n of the keys, all of
+ * them to or from that node.
+ */
+
+#define RING_VNODES 160
+
+typedef struct ring_point {
+    uint64_t hash;
+    int node;  // index into the names the ring was built from
+} ring_point_t;
+
+typedef struct ring {
+    ring_point_t *points;  // sorted by hash
+    int npoints;
+    int nnodes;
+} ring_t;
+
+/* 64-bit hash of a key or node name (FNV-1a, then mixed). */
+uint64_t ring_hash(const char *s, size_t len);
+
+/* Builds the ring for n nodes; returns 0, or -1 if out of memory. */
+int ring_build(ring_t *r, const char *const *names, int n);
+
+void ring_free(ring_t *r);
+
+/* The index of the node that key belongs to; the ring must not be empty. */
+int ring_lookup(const ring_t *r, const char *key, size_t len);
+
+#endif  // RING_H_
@@ -0,0 +1,32 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "./scan_merge.h"
+
+void scan_merge_bound(const char **cutoff, const scan_pair_t *pairs, int n,
+                      int count) {
+    size_t used = 0;
+    if (n <= 0)
+        return;
+    for (int i = 0; i < n; i++)
+        used += strlen(pairs[i].key) + strlen(pairs[i].value) + 2;
+    const char *last = pairs[n - 1].key;
+    if ((n == count || used + SCAN_PAIR_MAX >= SCAN_ROOM) &&
+        (*cutoff == NULL || strcmp(last, *cutoff) < 0))
+        *cutoff = last;
+}
+
+static int compare_pairs(const void *a, const void *b) {
+    return strcmp(((const scan_pair_t *)a)->key,
+                  ((const scan_pair_t *)b)->key);
+}
+
+int scan_merge(scan_pair_t *pairs, int n, const char *cutoff, int count) {
+    int merged = 0;
+    if (n > 0)
+        qsort(pairs, n, sizeof(scan_pair_t), compare_pairs);
+    while (merged < count && merged < n &&
+           (cutoff == NULL || strcmp(pairs[merged].key, cutoff) <= 0))
+        merged++;
+    return merged;
+}
@@ -0,0 +1,35 @@
+#ifndef SCAN_MERGE_H_
+#define SCAN_MERGE_H_
+
+/*
+ * Merging one scan's answers from several servers (cdbc_cluster_scan and the
+ * proxy). Each server answers with the first pairs from start that it holds,
+ * as many as were asked for or as fit in one response, so a server that
+ * stopped there may hold keys after its last that the others' pairs must not
+ * be delivered past: the merge ends at the least such last key, and a scan
+ * going on from the last key delivered misses none.
+ */
+
+#define SCAN_RESPONSE 16384                 // as server.c's RESLEN
+#define SCAN_ROOM (SCAN_RESPONSE - 11)      // what db.c leaves for the pairs
+#define SCAN_PAIR_MAX (2 * 255 + 2)         // " key value" at its longest
+
+typedef struct scan_pair {
+    char *key;
+    char *value;
+} scan_pair_t;
+
+/*
+ * Takes in the n pairs one server answered a scan for count with: if it may
+ * have stopped short of its keys, lowers *cutoff (NULL: none yet) to its last.
+ */
+void scan_merge_bound(const char **cutoff, const scan_pair_t *pairs, int n,
+                      int count);
+
+/*
+ * Sorts the pairs of every server by key and returns how many of the first
+ * are the merged answer: at most count, and none past cutoff.
+ */
+int scan_merge(scan_pair_t *pairs, int n, const char *cutoff, int count);
+
+#endif  // SCAN_MERGE_H_
@@ -1,11 +1,15 @@
+#include <arpa/inet.h>
 #include <assert.h>
+#include <ctype.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <inttypes.h>
 #include <pthread.h>
 #include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/socket.h>
 #include <sys/stat.h>
 #include <sys/time.h>
 #include <sys/types.h>
@@ -13,12 +17,22 @@
 #include <unistd.h>
 
 #include "./server.h"
+#include "./admin.h"
+#include "./capture.h"
 #include "./comm.h"
 #include "./db.h"
+#include "./hotkeys.h"
+#include "./metrics.h"
+#include "./repl.h"
+#include "./trace.h"
+#include "./tracking.h"
 
-#define RESLEN 256
+#define RESLEN 16384  // room for scan results
 #define COMMAND_LEN 64
 #define MAX_TOKENS 32
+#define USAGE                                                               \
+    "Usage: %s [-a <admin port>] [-r <primary host:port>] [-b <backlog MB>] " \
+    "<port> \n"
 
 // Initialize global variables
 client_t *thread_list_head = NULL;
@@ -33,6 +47,41 @@ typedef struct server_accept {
     pthread_mutex_t mutex;
 } server_accept_t;
 server_accept_t server_accept = {1, PTHREAD_MUTEX_INITIALIZER};
+// Source of client ids, only touched by the listener thread
+uint64_t next_client_id = 1;
+// The database every client works on
+db_t *db = NULL;
+
+/*
+ * Counts a client's struct and socket stream as allocated (count 1) or freed
+ * (count -1). The stream buffer is sized by the socket's block size.
+ */
+static void client_account(client_t *client, int count) {
+    struct stat st;
+    size_t buf_size = BUFSIZ;
+    if (fstat(fileno(client->cxstr), &st) == 0) {
+        buf_size = st.st_blksize;
+    }
+    size_t size = sizeof(client_t) + sizeof(FILE) + buf_size;
+    metrics_mem(mem_conn, count, size,
+                size + 3 * MALLOC_CHUNK_OVERHEAD);  // three allocations
+}
+
+/*
+ * Counts a client thread's stack as allocated (count 1) or freed (-1). Client
+ * threads are created with default attributes, so they get the default size.
+ */
+static void stack_account(int count) {
+    pthread_attr_t attr;
+    size_t size;
+    if (pthread_attr_init(&attr) != 0) {
+        return;
+    }
+    if (pthread_attr_getstacksize(&attr, &size) == 0) {
+        metrics_mem(mem_stack, count, size, size);
+    }
+    pthread_attr_destroy(&attr);
+}
 
 // A wrapper around pthread_mutex_unlock for pthread_cleanup_push
 void cleanup_unlock_mutex(void *mutex) {
@@ -57,9 +106,27 @@ void client_constructor(FILE *cxstr) {
         exit(1);
     }
     // Initialize client's fields
+    memset(client, 0, sizeof(client_t));
     client->cxstr = cxstr;
     client->next = NULL;
     client->prev = NULL;
+    client->id = next_client_id++;
+    client->connected_ns = metrics_now_ns();
+    client->last_active_ns = client->connected_ns;
+    pthread_mutex_init(&client->stats_mutex, NULL);
+
+    // Remember who is on the other end for the clients command
+    struct sockaddr_in peer;
+    socklen_t peer_len = sizeof(peer);
+    if (getpeername(fileno(cxstr), (struct sockaddr *)&peer, &peer_len) == 0 &&
+        peer.sin_family == AF_INET) {
+        char ip[INET_ADDRSTRLEN];
+        inet_ntop(AF_INET, &peer.sin_addr, ip, sizeof(ip));
+        snprintf(client->peer, PEER_LEN, "%s:%hu", ip, ntohs(peer.sin_port));
+    } else {
+        snprintf(client->peer, PEER_LEN, "unknown");
+    }
+    client_account(client, 1);
 
     // Create a new client thread that runs `run_client`
     if ((err = pthread_create(&tid, 0, run_client, client))) {
@@ -92,11 +159,14 @@ void *run_client(void *arg) {
     }
     pthread_mutex_unlock(&server_accept.mutex);
 
+    client->cell = metrics_thread_cell();
+    tracking_thread_start(fileno(client->cxstr));
+
     // Initialize buffers for server's response and client's command
     char response[RESLEN];
-    char command[COMMAND_LEN];
+    char command[BUFLEN];
     memset(&response, 0, RESLEN);
-    memset(&command, 0, COMMAND_LEN);
+    memset(&command, 0, BUFLEN);
 
     // Safely add client to the beginning of the client list
     pthread_mutex_lock(&thread_list_mutex);
@@ -113,16 +183,58 @@ void *run_client(void *arg) {
     pthread_mutex_lock(&server_control.server_mutex);
     server_control.num_client_threads++;
     pthread_mutex_unlock(&server_control.server_mutex);
+    metrics_conn_open();
+    stack_account(1);
 
     // Push `thread_cleanup` as a cleanup_handler
     pthread_cleanup_push(thread_cleanup, client);
     // Loop to output the previous response and read in the client's next
     // command, until the client disconnects
     while (comm_serve(client->cxstr, response, command) != -1) {
+        trace_request_begin();
+        // comm_serve has just sent the previous response, if there was one
+        size_t sent = strlen(response);
+        METRIC_ADD(client->bytes_out, sent > 0 ? sent + 1 : 0);
+        size_t command_len = strlen(command);
+        METRIC_ADD(client->bytes_in, command_len);
+        capture_write(client->id, command, command_len);
+        pthread_mutex_lock(&client->stats_mutex);
+        snprintf(client->current, CURRENT_CMD_LEN, "%.*s",
+                 (int)strcspn(command, "\r\n"), command);
+        pthread_mutex_unlock(&client->stats_mutex);
+
         // Stop the client thread while the server is stopped
+        uint64_t wait_start = metrics_now_ns();
         client_control_wait();
         // Execute the command
-        interpret_command(command, response, COMMAND_LEN);
+        uint64_t start = metrics_now_ns();
+        METRIC_ADD(client->control_wait_ns, start - wait_start);
+        if (trace_sampled)
+            trace_span("control_wait", wait_start);
+        uint64_t span = TRACE_BEGIN();
+        if (command[0] == 'r' && isspace((unsigned char)command[1])) {
+            // A replica: the connection carries its stream from here on
+            repl_serve(fileno(client->cxstr), client->peer, &command[1]);
+            break;
+        }
+        if (repl_read_only() && command[0] != '\0' &&
+            strchr("aduf", command[0]) != NULL) {
+            snprintf(response, RESLEN, "read-only replica");
+        } else if (repl_incomplete() && command[0] != '\0' &&
+                   strchr("qs", command[0]) != NULL) {
+            snprintf(response, RESLEN, "replica syncing");
+        } else {
+            interpret_command(db, command, response, RESLEN);
+        }
+        TRACE_END("execute", span);
+        uint64_t end = metrics_now_ns();
+        metrics_command(command[0], end - start);
+
+        METRIC_ADD(client->commands, 1);
+        METRIC_SET(client->last_active_ns, end);
+        pthread_mutex_lock(&client->stats_mutex);
+        client->current[0] = '\0';
+        pthread_mutex_unlock(&client->stats_mutex);
     }
     pthread_cleanup_pop(1);  // Pop `thread_cleanup` when the user disconnects
 
@@ -140,7 +252,9 @@ void *run_client(void *arg) {
  */
 void client_destructor(client_t *client) {
     // Close the client's file stream
+    client_account(client, -1);
     comm_shutdown(client->cxstr);
+    pthread_mutex_destroy(&client->stats_mutex);
     // Free the client struct
     free(client);
 }
@@ -166,6 +280,7 @@ void thread_cleanup(void *arg) {
         thread_list_head = client->next;
     }
     pthread_mutex_unlock(&thread_list_mutex);
+    tracking_thread_stop();
 
     // Decrement the number of active threads
     pthread_mutex_lock(&server_control.server_mutex);
@@ -176,6 +291,8 @@ void thread_cleanup(void *arg) {
         pthread_cond_broadcast(&server_control.server_cond);
     }
     pthread_mutex_unlock(&server_control.server_mutex);
+    metrics_conn_close();
+    stack_account(-1);
 
     // Destroy the passed-in client
     client_destructor(client);
@@ -198,6 +315,63 @@ void delete_all() {
     pthread_mutex_unlock(&thread_list_mutex);
 }
 
+/**
+ * Writes one line per connected client with its live statistics
+ * Param: out, the stream to write the table to
+ * Return: void
+ */
+void clients_write(FILE *out) {
+    uint64_t now = metrics_now_ns();
+    fprintf(out, "%-6s %-21s %9s %9s %10s %10s %10s %10s  %s\n", "id", "peer",
+            "age(s)", "idle(s)", "cmds", "in", "out", "blocked(ms)",
+            "current");
+
+    pthread_mutex_lock(&thread_list_mutex);
+    for (client_t *c = thread_list_head; c != NULL; c = c->next) {
+        // Time blocked is time stopped by `s` plus time waiting on tree locks
+        uint64_t blocked = METRIC_READ(c->control_wait_ns) +
+                           METRIC_READ(c->cell->lock_wait_ns[l_read]) +
+                           METRIC_READ(c->cell->lock_wait_ns[l_write]);
+        char current[CURRENT_CMD_LEN];
+        pthread_mutex_lock(&c->stats_mutex);
+        snprintf(current, CURRENT_CMD_LEN, "%s", c->current);
+        pthread_mutex_unlock(&c->stats_mutex);
+
+        uint64_t last_active = METRIC_READ(c->last_active_ns);
+        uint64_t idle = now > last_active ? now - last_active : 0;
+
+        fprintf(out, "%-6lu %-21s %9.1f %9.1f %10lu %10lu %10lu %10.3f  %s\n",
+                c->id, c->peer, (double)(now - c->connected_ns) / 1e9,
+                (double)idle / 1e9,
+                METRIC_READ(c->commands), METRIC_READ(c->bytes_in),
+                METRIC_READ(c->bytes_out), (double)blocked / 1e6,
+                current[0] != '\0' ? current : "-");
+    }
+    pthread_mutex_unlock(&thread_list_mutex);
+}
+
+/**
+ * Cancels the client thread with the given id
+ * Param: id, the id shown by the clients command
+ * Return: 0 on success, -1 if no such client is connected
+ */
+int client_kill(uint64_t id) {
+    int err;
+    int found = -1;
+    pthread_mutex_lock(&thread_list_mutex);
+    for (client_t *c = thread_list_head; c != NULL; c = c->next) {
+        if (c->id == id) {
+            if ((err = pthread_cancel(c->thread))) {
+                handle_error_en(err, "pthread_cancel");
+            }
+            found = 0;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&thread_list_mutex);
+    return found;
+}
+
 //------------------------------------------------------------------------------------------------
 /**
  * Parses command line input
@@ -336,17 +510,128 @@ void sig_handler_destructor(sig_handler_t *sighandler) {
     free(sighandler);
 }
 
+//------------------------------------------------------------------------------------------------
+// Tracing
+
+/**
+ * Handles the trace REPL command: `trace <N>` samples one request in N per
+ * client thread (0 turns it off), `trace dump [file]` writes the spans as
+ * Chrome trace-event JSON, and `trace clear` drops them.
+ * Param: tokens, the parsed command line
+ * Return: void
+ */
+void trace_command(char *tokens[]) {
+    if (tokens[1] == NULL) {
+        printf("tracing 1 in %d requests\n",
+               __atomic_load_n(&trace_sample_every, __ATOMIC_RELAXED));
+    } else if (strcmp("dump", tokens[1]) == 0) {
+        FILE *out = stdout;
+        if (tokens[2] != NULL && (out = fopen(tokens[2], "w")) == NULL) {
+            perror("fopen");
+            return;
+        }
+        trace_write(out);
+        if (out != stdout) {
+            fclose(out);
+        }
+    } else if (strcmp("clear", tokens[1]) == 0) {
+        trace_clear();
+    } else {
+        __atomic_store_n(&trace_sample_every, atoi(tokens[1]),
+                         __ATOMIC_RELAXED);
+    }
+    fflush(stdout);
+}
+
+//------------------------------------------------------------------------------------------------
+// Hot keys
+
+/**
+ * Handles the hotkeys REPL command: `hotkeys [n]` lists the n hottest keys,
+ * `hotkeys sample <N>` counts one access in N per thread (0 turns sampling
+ * off), and `hotkeys reset` forgets all counts.
+ * Param: tokens, the parsed command line
+ * Return: void
+ */
+void hotkeys_command(char *tokens[]) {
+    if (tokens[1] == NULL) {
+        hotkeys_write(stdout);
+    } else if (strcmp("sample", tokens[1]) == 0 && tokens[2] != NULL) {
+        __atomic_store_n(&hotkeys_sample_every, atoi(tokens[2]),
+                         __ATOMIC_RELAXED);
+    } else if (strcmp("reset", tokens[1]) == 0) {
+        hotkeys_reset();
+    } else {
+        hotkeys_write_top(stdout, atoi(tokens[1]));
+    }
+    fflush(stdout);
+}
+
+//------------------------------------------------------------------------------------------------
+// Traffic capture
+
+/**
+ * Handles the capture REPL command: `capture start <file> [sample <N>]`
+ * records the commands of one connection in N (all by default) to file for
+ * replaying with loadgen, and `capture stop` finishes the file.
+ * Param: tokens, the parsed command line
+ * Return: void
+ */
+void capture_command(char *tokens[]) {
+    if (tokens[1] != NULL && strcmp("start", tokens[1]) == 0 &&
+        tokens[2] != NULL) {
+        int sample_every = 1;
+        if (tokens[3] != NULL && strcmp("sample", tokens[3]) == 0 &&
+            tokens[4] != NULL) {
+            sample_every = atoi(tokens[4]);
+        }
+        if (capture_start(tokens[2], sample_every) < 0) {
+            perror("capture");
+        }
+    } else if (tokens[1] != NULL && strcmp("stop", tokens[1]) == 0) {
+        printf("captured %" PRIu64 " commands\n", capture_stop());
+    } else {
+        fprintf(stderr, "usage: capture start <file> [sample <N>] | stop\n");
+    }
+    fflush(stdout);
+}
+
 //------------------------------------------------------------------------------------------------
 // Main function
 
-// The arguments to the server should be the port number.
+// The arguments to the server should be the port number, optionally preceded
+// by -a <admin port> to serve metrics over HTTP, -r <host:port> to run as a
+// replica of the primary there, and -b <MB> to keep that much of the change
+// log for replicas of this server.
 int main(int argc, char *argv[]) {
     // Parse args
-    if (argc != 2) {
-        fprintf(stderr, "Usage: %s <port> \n", argv[0]);
+    int admin_port = 0;
+    char *primary = NULL;
+    size_t backlog = REPL_LOG_SIZE;
+    int opt;
+    while ((opt = getopt(argc, argv, "a:r:b:")) != -1) {
+        switch (opt) {
+            case 'a':
+                admin_port = atoi(optarg);
+                break;
+            case 'r':
+                primary = optarg;
+                break;
+            case 'b':
+                backlog = (size_t)atoi(optarg) << 20;
+                break;
+            default:
+                fprintf(stderr, USAGE, argv[0]);
+                return 1;
+        }
+    }
+    char *primary_port = primary != NULL ? strrchr(primary, ':') : NULL;
+    if (optind != argc - 1 || (primary != NULL && primary_port == NULL) ||
+        backlog == 0) {
+        fprintf(stderr, USAGE, argv[0]);
         return 1;
     }
-    int port = atoi(argv[1]);
+    int port = atoi(argv[optind]);
     int err;
 
     // Block SIGPIPE signal so that the server does not abort when a client
@@ -360,19 +645,45 @@ int main(int argc, char *argv[]) {
         handle_error_en(err, "pthread_sigmask");
     }
 
+    if ((db = db_create()) == NULL) {
+        perror("db_create");
+        return 1;
+    }
+    repl_init(db, backlog);
+
     // Create a SIGINT signal handler
     sig_handler_t *sig_handler = sig_handler_constructor();
 
     // Start a listener thread for clients
     pthread_t listener_thread = start_listener(port, client_constructor);
 
+    // Follow the primary, if this is a replica
+    if (primary != NULL) {
+        *primary_port++ = '\0';
+        if ((err = repl_follow(primary, primary_port))) {
+            handle_error_en(err, "repl_follow");
+        }
+    }
+
+    // Start the admin thread for monitoring, if requested
+    pthread_t admin_thread = 0;  // started only with an admin port
+    if (admin_port > 0) {
+        admin_register("/metrics", metrics_write);
+        admin_register("/clients", clients_write);
+        admin_register("/trace", trace_write);
+        admin_register("/memory", metrics_memory_write);
+        admin_register("/hotkeys", hotkeys_write);
+        admin_register("/replication", repl_write);
+        admin_thread = start_admin(admin_port);
+    }
+
     // Loop for command line input ("p", "s", "g" commands)
     char buf[COMMAND_LEN];
     char *tokens[MAX_TOKENS] = {NULL};
     memset(&buf, 0, COMMAND_LEN);
     while (1) {
         ssize_t n = 0;
-        if ((n = read(0, buf, COMMAND_LEN)) == 1)
+        if ((n = read(0, buf, COMMAND_LEN - 1)) == 1)
             continue;  // Ignore single '\n'
         else if (n == 0) {
             break;  // Break when user hits "Ctrl-D" (EOF)
@@ -390,7 +701,11 @@ int main(int argc, char *argv[]) {
             continue;
         }
         if (strcmp("p", tokens[0]) == 0) {
-            db_print(tokens[1]);
+            // `p [-s] [file]`, where -s selects the sorted format
+            int sorted = tokens[1] != NULL && strcmp("-s", tokens[1]) == 0;
+            if (db_print(db, tokens[1 + sorted], sorted) < 0) {
+                perror("p");
+            }
         } else if (strcmp("s", tokens[0]) == 0) {
             if (printf("stopping all clients\n") < 0) {
                 fprintf(stderr, "unable to print stop message\n");
@@ -401,6 +716,26 @@ int main(int argc, char *argv[]) {
                 fprintf(stderr, "unable to print go message\n");
             }
             client_control_release();
+        } else if (strcmp("clients", tokens[0]) == 0) {
+            clients_write(stdout);
+            fflush(stdout);
+        } else if (strcmp("replication", tokens[0]) == 0) {
+            repl_write(stdout);
+            fflush(stdout);
+        } else if (strcmp("memory", tokens[0]) == 0) {
+            metrics_memory_write(stdout);
+            fflush(stdout);
+        } else if (strcmp("hotkeys", tokens[0]) == 0) {
+            hotkeys_command(tokens);
+        } else if (strcmp("trace", tokens[0]) == 0) {
+            trace_command(tokens);
+        } else if (strcmp("capture", tokens[0]) == 0) {
+            capture_command(tokens);
+        } else if (strcmp("kill", tokens[0]) == 0) {
+            if (tokens[1] == NULL ||
+                client_kill(strtoull(tokens[1], NULL, 10)) != 0) {
+                fprintf(stderr, "no such client\n");
+            }
         }
     }
     // Destroy the SIGINT handling thread
@@ -411,7 +746,8 @@ int main(int argc, char *argv[]) {
     server_accept.state = 0;
     pthread_mutex_unlock(&server_accept.mutex);
 
-    // Cancel all client threads
+    // Stop applying the primary's changes, then cancel all client threads
+    repl_stop();
     delete_all();
 
     // Stop the listener thread until there are no active clients left
@@ -426,8 +762,12 @@ int main(int argc, char *argv[]) {
     assert(thread_list_head == NULL);
     assert(server_control.num_client_threads == 0);
 
-    // Clean up the database
-    db_cleanup();
+    // Finish a capture left running
+    capture_stop();
+
+    // Clean up the database once background prints are done with it
+    db_print_wait();
+    db_destroy(db);
 
     // Cancel the listener thread
     if ((err = pthread_cancel(listener_thread))) {
@@ -438,6 +778,16 @@ int main(int argc, char *argv[]) {
     if ((err = pthread_join(listener_thread, 0))) {
         handle_error_en(err, "pthread_join");
     }
+
+    // Likewise for the admin thread
+    if (admin_port > 0) {
+        if ((err = pthread_cancel(admin_thread))) {
+            handle_error_en(err, "pthread_cancel");
+        }
+        if ((err = pthread_join(admin_thread, 0))) {
+            handle_error_en(err, "pthread_join");
+        }
+    }
     // Exit
     pthread_exit(0);
 
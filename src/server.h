@@ -1,4 +1,11 @@
 #include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include "./metrics.h"
+
+#define PEER_LEN 64
+#define CURRENT_CMD_LEN 64
 
 /*
  * Use the variables in this struct to synchronize your main thread with client
@@ -29,6 +36,20 @@ typedef struct client {
     pthread_t thread;
     FILE *cxstr;  // File stream for input and output
 
+    // Live statistics. Counters are written only by the client's own thread;
+    // stats_mutex guards `current`, which is copied as a whole.
+    uint64_t id;
+    char peer[PEER_LEN];
+    uint64_t connected_ns;
+    uint64_t last_active_ns;
+    uint64_t commands;
+    uint64_t bytes_in;
+    uint64_t bytes_out;
+    uint64_t control_wait_ns;  // time spent stopped by the `s` command
+    metrics_cell_t *cell;      // the thread's cell, for its lock waits
+    char current[CURRENT_CMD_LEN];
+    pthread_mutex_t stats_mutex;
+
     // For client list
     struct client *prev;
     struct client *next;
@@ -52,11 +73,24 @@ void client_destructor(client_t *client);
 void thread_cleanup(void *arg);
 void delete_all();
 
+// Methods for the clients and kill server commands
+void clients_write(FILE *out);
+int client_kill(uint64_t id);
+
 // Methods for stop/go server commands
 void client_control_wait();
 void client_control_stop();
 void client_control_release();
 
+// Sampled request tracing REPL command
+void trace_command(char *tokens[]);
+
+// Hot key REPL command
+void hotkeys_command(char *tokens[]);
+
+// Traffic capture REPL command
+void capture_command(char *tokens[]);
+
 // SIGINT signal handling
 sig_handler_t *sig_handler_constructor();
 void *monitor_signal(void *arg);
@@ -0,0 +1,219 @@
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "./trace.h"
+#include "./comm.h"
+
+#define TRACE_BUF_EVENTS 8192
+#define TRACE_MAX_EXITED 32
+
+typedef struct trace_event {
+    const char *name;
+    uint64_t start_ns;
+    uint64_t dur_ns;
+    uint64_t req;
+} trace_event_t;
+
+/*
+ * A thread's ring of spans. Buffers of exited threads stay in the list so
+ * their spans can still be dumped, up to TRACE_MAX_EXITED of them.
+ */
+typedef struct trace_buf {
+    pthread_mutex_t mutex;  // between the owner appending and a dump
+    long tid;
+    int exited;
+    uint64_t count;  // events ever appended; the ring holds the last ones
+    trace_event_t events[TRACE_BUF_EVENTS];
+
+    struct trace_buf *prev;
+    struct trace_buf *next;
+} trace_buf_t;
+
+int trace_sample_every = 0;
+__thread int trace_sampled = 0;
+
+static __thread int countdown = 0;
+static __thread uint64_t request_id;
+static __thread uint64_t request_start;
+static __thread trace_buf_t *thread_buf = NULL;
+
+static trace_buf_t *buf_list_head = NULL;
+static int num_exited = 0;
+static pthread_mutex_t buf_list_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static pthread_key_t buf_key;
+static pthread_once_t buf_key_once = PTHREAD_ONCE_INIT;
+
+static uint64_t next_request_id = 1;
+
+//------------------------------------------------------------------------------------------------
+// Buffer lifecycle
+
+/* Unlinks and frees a buffer; buf_list_mutex must be held. */
+static void buf_free(trace_buf_t *buf) {
+    if (buf->next != NULL) {
+        buf->next->prev = buf->prev;
+    }
+    if (buf->prev != NULL) {
+        buf->prev->next = buf->next;
+    }
+    if (buf == buf_list_head) {
+        buf_list_head = buf->next;
+    }
+    pthread_mutex_destroy(&buf->mutex);
+    free(buf);
+}
+
+/* Thread-exit destructor: keeps the buffer around for dumping. */
+static void buf_exit(void *arg) {
+    trace_buf_t *buf = (trace_buf_t *)arg;
+
+    pthread_mutex_lock(&buf_list_mutex);
+    buf->exited = 1;
+    num_exited++;
+    if (num_exited > TRACE_MAX_EXITED) {
+        // Buffers are added at the head, so the oldest exited is the last one
+        trace_buf_t *oldest = NULL;
+        for (trace_buf_t *b = buf_list_head; b != NULL; b = b->next) {
+            if (b->exited)
+                oldest = b;
+        }
+        buf_free(oldest);
+        num_exited--;
+    }
+    pthread_mutex_unlock(&buf_list_mutex);
+
+    thread_buf = NULL;
+}
+
+static void buf_key_create(void) {
+    int err;
+    if ((err = pthread_key_create(&buf_key, buf_exit))) {
+        handle_error_en(err, "pthread_key_create");
+    }
+}
+
+/* Allocates the calling thread's buffer the first time it samples. */
+static trace_buf_t *buf_create(void) {
+    trace_buf_t *buf;
+    int err;
+
+    pthread_once(&buf_key_once, buf_key_create);
+    if ((buf = calloc(1, sizeof(trace_buf_t))) == NULL) {
+        perror("Unable to malloc space for a trace buffer");
+        exit(1);
+    }
+    pthread_mutex_init(&buf->mutex, NULL);
+    buf->tid = syscall(SYS_gettid);
+    if ((err = pthread_setspecific(buf_key, buf))) {
+        handle_error_en(err, "pthread_setspecific");
+    }
+
+    pthread_mutex_lock(&buf_list_mutex);
+    buf->next = buf_list_head;
+    if (buf_list_head != NULL) {
+        buf_list_head->prev = buf;
+    }
+    buf_list_head = buf;
+    pthread_mutex_unlock(&buf_list_mutex);
+
+    thread_buf = buf;
+    return buf;
+}
+
+//------------------------------------------------------------------------------------------------
+// Recording
+
+void trace_request_begin(void) {
+    int every = __atomic_load_n(&trace_sample_every, __ATOMIC_RELAXED);
+    if (every <= 0) {
+        trace_sampled = 0;
+        return;
+    }
+    if (--countdown > 0) {
+        trace_sampled = 0;
+        return;
+    }
+    countdown = every;
+
+    if (thread_buf == NULL) {
+        buf_create();
+    }
+    trace_sampled = 1;
+    request_id = __atomic_fetch_add(&next_request_id, 1, __ATOMIC_RELAXED);
+    request_start = metrics_now_ns();
+}
+
+void trace_request_end(void) {
+    if (!trace_sampled)
+        return;
+    trace_span("request", request_start);
+    trace_sampled = 0;
+}
+
+void trace_span(const char *name, uint64_t start) {
+    trace_buf_t *buf = thread_buf;
+    if (buf == NULL)
+        return;
+    uint64_t end = metrics_now_ns();
+
+    pthread_mutex_lock(&buf->mutex);
+    trace_event_t *ev = &buf->events[buf->count % TRACE_BUF_EVENTS];
+    ev->name = name;
+    ev->start_ns = start;
+    ev->dur_ns = end - start;
+    ev->req = request_id;
+    buf->count++;
+    pthread_mutex_unlock(&buf->mutex);
+}
+
+//------------------------------------------------------------------------------------------------
+// Dumping
+
+void trace_write(FILE *out) {
+    int first = 1;
+    fprintf(out, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n");
+
+    pthread_mutex_lock(&buf_list_mutex);
+    for (trace_buf_t *buf = buf_list_head; buf != NULL; buf = buf->next) {
+        pthread_mutex_lock(&buf->mutex);
+        uint64_t n = buf->count < TRACE_BUF_EVENTS ? buf->count
+                                                   : TRACE_BUF_EVENTS;
+        for (uint64_t i = buf->count - n; i < buf->count; i++) {
+            trace_event_t *ev = &buf->events[i % TRACE_BUF_EVENTS];
+            fprintf(out,
+                    "%s{\"name\":\"%s\",\"cat\":\"concurrentdb\",\"ph\":\"X\","
+                    "\"ts\":%.3f,\"dur\":%.3f,\"pid\":1,\"tid\":%ld,"
+                    "\"args\":{\"req\":%lu}}",
+                    first ? "" : ",\n", ev->name, (double)ev->start_ns / 1e3,
+                    (double)ev->dur_ns / 1e3, buf->tid, ev->req);
+            first = 0;
+        }
+        pthread_mutex_unlock(&buf->mutex);
+    }
+    pthread_mutex_unlock(&buf_list_mutex);
+
+    fprintf(out, "\n]}\n");
+}
+
+void trace_clear(void) {
+    pthread_mutex_lock(&buf_list_mutex);
+    trace_buf_t *buf = buf_list_head;
+    while (buf != NULL) {
+        trace_buf_t *next = buf->next;
+        if (buf->exited) {
+            buf_free(buf);
+        } else {
+            pthread_mutex_lock(&buf->mutex);
+            buf->count = 0;
+            pthread_mutex_unlock(&buf->mutex);
+        }
+        buf = next;
+    }
+    num_exited = 0;
+    pthread_mutex_unlock(&buf_list_mutex);
+}
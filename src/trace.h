@@ -0,0 +1,44 @@
+#ifndef TRACE_H_
+#define TRACE_H_
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include "./metrics.h"
+
+/*
+ * Sampled per-request tracing. One request in every `trace_sample_every` on
+ * each thread records timestamped spans into that thread's ring buffer, and
+ * trace_write dumps all buffers as Chrome trace-event JSON (loadable in
+ * Perfetto or chrome://tracing). With sampling off a span costs one
+ * thread-local load and a branch.
+ */
+
+extern int trace_sample_every;    // 0 turns tracing off
+extern __thread int trace_sampled;  // is this thread's request sampled?
+
+// Spans are opened with TRACE_BEGIN and closed with TRACE_END; names must be
+// string literals since only the pointer is stored.
+#define TRACE_BEGIN() (trace_sampled ? metrics_now_ns() : 0)
+#define TRACE_END(name, start)          \
+    do {                                \
+        if (start)                      \
+            trace_span((name), (start)); \
+    } while (0)
+
+/* Decides whether the request that is about to run gets sampled. */
+void trace_request_begin(void);
+
+/* Closes the current request's span, if it was sampled. */
+void trace_request_end(void);
+
+/* Records a span from start until now on the calling thread. */
+void trace_span(const char *name, uint64_t start);
+
+/* Writes every buffered span as Chrome trace-event JSON. */
+void trace_write(FILE *out);
+
+/* Drops all buffered spans. */
+void trace_clear(void);
+
+#endif  // TRACE_H_
@@ -0,0 +1,280 @@
+#include <errno.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+
+#include "./tracking.h"
+
+#define TRACKING_STRIPES 256
+#define BUCKET_WORDS (TRACKING_BUCKETS / 64)
+#define PUSH_LEN 32
+
+/*
+ * A tracking connection. Its membership bits are guarded by the stripes of
+ * their buckets, and a word of them shares one stripe, so setting and
+ * clearing bits of different buckets never race.
+ */
+typedef struct tracking_client {
+    int fd;
+    int closed;  // fd is not to be written to; set under shut_mutex
+    int refs;    // the thread's own, plus one per push under way
+    pthread_mutex_t write_mutex;
+    pthread_mutex_t shut_mutex;  // never held while blocked
+    uint64_t member[BUCKET_WORDS];
+} tracking_client_t;
+
+/* The connections tracking a bucket, each at most once. */
+typedef struct bucket {
+    tracking_client_t **clients;
+    int count;
+    int capacity;
+} bucket_t;
+
+static bucket_t buckets[TRACKING_BUCKETS];
+static pthread_mutex_t stripes[TRACKING_STRIPES];
+static pthread_once_t stripes_once = PTHREAD_ONCE_INIT;
+static int trackers = 0;  // connections with tracking on
+
+static __thread int thread_fd = -1;
+static __thread tracking_client_t *self = NULL;
+static __thread tracking_client_t *writing = NULL;
+static __thread int write_cancel_state;
+
+static void stripes_init(void) {
+    for (int i = 0; i < TRACKING_STRIPES; i++)
+        pthread_mutex_init(&stripes[i], NULL);
+}
+
+static pthread_mutex_t *stripe(uint32_t b) {
+    return &stripes[(b / 64) % TRACKING_STRIPES];
+}
+
+uint32_t tracking_bucket(const char *key) {
+    uint32_t h = 2166136261u;
+    for (; *key != '\0'; key++) {
+        h ^= (unsigned char)*key;
+        h *= 16777619u;
+    }
+    return h & (TRACKING_BUCKETS - 1);
+}
+
+static void client_release(tracking_client_t *c) {
+    if (__atomic_sub_fetch(&c->refs, 1, __ATOMIC_ACQ_REL) == 0) {
+        pthread_mutex_destroy(&c->write_mutex);
+        pthread_mutex_destroy(&c->shut_mutex);
+        free(c);
+    }
+}
+
+/*
+ * Shuts the connection down after a push was lost, so its client finds out
+ * and drops its cache. A write blocked on it fails at once.
+ */
+static void client_abandon(tracking_client_t *c) {
+    pthread_mutex_lock(&c->shut_mutex);
+    if (!c->closed) {
+        shutdown(c->fd, SHUT_RDWR);
+        __atomic_store_n(&c->closed, 1, __ATOMIC_RELEASE);
+    }
+    pthread_mutex_unlock(&c->shut_mutex);
+}
+
+/* Sends a whole line, or gives up on the connection. */
+static void client_push(tracking_client_t *c, const char *line, size_t len) {
+    struct timespec start, now;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    size_t off = 0;
+
+    // The connection's own thread holds write_mutex while it writes a
+    // response, which blocks for as long as the client is not reading
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_nsec += TRACKING_SEND_MS * 1000000L;
+    deadline.tv_sec += deadline.tv_nsec / 1000000000L;
+    deadline.tv_nsec %= 1000000000L;
+    if (__atomic_load_n(&c->closed, __ATOMIC_ACQUIRE))
+        return;
+    if (pthread_mutex_timedlock(&c->write_mutex, &deadline) != 0) {
+        client_abandon(c);
+        return;
+    }
+    while (!__atomic_load_n(&c->closed, __ATOMIC_ACQUIRE) && off < len) {
+        ssize_t n = send(c->fd, line + off, len - off,
+                         MSG_DONTWAIT | MSG_NOSIGNAL);
+        if (n >= 0) {
+            off += n;
+            continue;
+        }
+        if (errno == EINTR)
+            continue;
+        if (errno != EAGAIN && errno != EWOULDBLOCK) {
+            client_abandon(c);
+            break;
+        }
+        // The client is not reading: wait out what is left of the deadline
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        long waited = (now.tv_sec - start.tv_sec) * 1000 +
+                      (now.tv_nsec - start.tv_nsec) / 1000000;
+        struct pollfd pfd = {c->fd, POLLOUT, 0};
+        if (waited >= TRACKING_SEND_MS ||
+            poll(&pfd, 1, TRACKING_SEND_MS - waited) <= 0) {
+            client_abandon(c);
+        }
+    }
+    pthread_mutex_unlock(&c->write_mutex);
+}
+
+/* Takes c out of every bucket it is in. */
+static void client_untrack(tracking_client_t *c) {
+    for (uint32_t w = 0; w < BUCKET_WORDS; w++) {
+        // Only c's own thread sets bits, so a clear word stays clear
+        if (__atomic_load_n(&c->member[w], __ATOMIC_RELAXED) == 0)
+            continue;
+        pthread_mutex_lock(stripe(w * 64));
+        uint64_t bits = c->member[w];
+        while (bits != 0) {
+            bucket_t *b = &buckets[w * 64 + __builtin_ctzll(bits)];
+            bits &= bits - 1;
+            for (int i = 0; i < b->count; i++) {
+                if (b->clients[i] == c) {
+                    b->clients[i] = b->clients[--b->count];
+                    break;
+                }
+            }
+        }
+        c->member[w] = 0;
+        pthread_mutex_unlock(stripe(w * 64));
+    }
+}
+
+void tracking_thread_start(int fd) {
+    pthread_once(&stripes_once, stripes_init);
+    thread_fd = fd;
+}
+
+void tracking_thread_stop(void) {
+    tracking_enable(0);
+    thread_fd = -1;
+}
+
+int tracking_enable(int on) {
+    if (thread_fd < 0)
+        return -1;
+    if (on && self == NULL) {
+        tracking_client_t *c = calloc(1, sizeof(tracking_client_t));
+        if (c == NULL)
+            return -1;
+        c->fd = thread_fd;
+        c->refs = 1;
+        pthread_mutex_init(&c->write_mutex, NULL);
+        pthread_mutex_init(&c->shut_mutex, NULL);
+        // A push follows no request, so Nagle would hold it back until the
+        // client gets round to acknowledging the last response
+        int one = 1;
+        setsockopt(c->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        self = c;
+        __atomic_add_fetch(&trackers, 1, __ATOMIC_SEQ_CST);
+    } else if (!on && self != NULL) {
+        tracking_client_t *c = self;
+        self = NULL;
+        client_untrack(c);
+        // Pushes still under way must not reach the fd once it is closed,
+        // nor shut it down
+        pthread_mutex_lock(&c->write_mutex);
+        pthread_mutex_lock(&c->shut_mutex);
+        __atomic_store_n(&c->closed, 1, __ATOMIC_RELEASE);
+        pthread_mutex_unlock(&c->shut_mutex);
+        pthread_mutex_unlock(&c->write_mutex);
+        __atomic_sub_fetch(&trackers, 1, __ATOMIC_SEQ_CST);
+        client_release(c);
+    }
+    return 0;
+}
+
+void tracking_write_begin(void) {
+    if ((writing = self) == NULL)
+        return;
+    pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &write_cancel_state);
+    pthread_mutex_lock(&writing->write_mutex);
+}
+
+void tracking_write_end(void) {
+    if (writing == NULL)
+        return;
+    pthread_mutex_unlock(&writing->write_mutex);
+    pthread_setcancelstate(write_cancel_state, NULL);
+    writing = NULL;
+}
+
+void tracking_read(const char *key) {
+    tracking_client_t *c = self;
+    if (c == NULL)
+        return;
+    uint32_t i = tracking_bucket(key);
+    uint64_t bit = 1ULL << (i % 64);
+    bucket_t *b = &buckets[i];
+
+    // Recorded before the read, so a write that the read misses is pushed
+    pthread_mutex_lock(stripe(i));
+    if ((c->member[i / 64] & bit) == 0) {
+        if (b->count == b->capacity) {
+            int capacity = b->capacity > 0 ? 2 * b->capacity : 4;
+            tracking_client_t **clients =
+                realloc(b->clients, capacity * sizeof(*clients));
+            if (clients == NULL) {
+                // Untracked reads cannot be cached; make the client start over
+                pthread_mutex_unlock(stripe(i));
+                client_abandon(c);
+                return;
+            }
+            b->clients = clients;
+            b->capacity = capacity;
+        }
+        b->clients[b->count++] = c;
+        __atomic_store_n(&c->member[i / 64], c->member[i / 64] | bit,
+                         __ATOMIC_RELAXED);
+    }
+    pthread_mutex_unlock(stripe(i));
+}
+
+void tracking_invalidate(const char *key) {
+    if (__atomic_load_n(&trackers, __ATOMIC_SEQ_CST) == 0)
+        return;
+    uint32_t i = tracking_bucket(key);
+    uint64_t bit = 1ULL << (i % 64);
+    bucket_t *b = &buckets[i];
+
+    // Take the bucket's connections; they are tracked again on their next
+    // read from it
+    pthread_mutex_lock(stripe(i));
+    tracking_client_t **clients = b->clients;
+    int count = b->count;
+    b->clients = NULL;
+    b->count = b->capacity = 0;
+    for (int j = 0; j < count; j++) {
+        __atomic_store_n(&clients[j]->member[i / 64],
+                         clients[j]->member[i / 64] & ~bit, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&clients[j]->refs, 1, __ATOMIC_RELAXED);
+    }
+    pthread_mutex_unlock(stripe(i));
+
+    if (count > 0) {
+        char line[PUSH_LEN];
+        int len = snprintf(line, sizeof(line), "!inv %u\n", i);
+        int state;
+        pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &state);
+        for (int j = 0; j < count; j++) {
+            client_push(clients[j], line, len);
+            client_release(clients[j]);
+        }
+        pthread_setcancelstate(state, NULL);
+    }
+    free(clients);
+}
@@ -0,0 +1,55 @@
+#ifndef TRACKING_H_
+#define TRACKING_H_
+
+#include <stdint.h>
+
+/*
+ * Invalidations for client-side caches. A connection that turns tracking on
+ * is remembered against the hash bucket of every key it reads; when a key
+ * in that bucket is added, updated or removed, the connection is sent the
+ * line "!inv <bucket>" and forgotten until it reads from the bucket again.
+ * Clients are expected to drop every key they cached from that bucket. The
+ * bucket of a key is the FNV-1a hash of it modulo TRACKING_BUCKETS, which
+ * makes both part of the protocol.
+ *
+ * A connection whose pushes cannot be sent within TRACKING_SEND_MS is shut
+ * down, so that its client loses its cache rather than keeping stale values.
+ */
+
+#define TRACKING_BUCKETS 65536  // a power of two
+#define TRACKING_SEND_MS 100
+
+/* The bucket key falls in. */
+uint32_t tracking_bucket(const char *key);
+
+/*
+ * Makes fd the calling thread's connection, whose responses it writes
+ * between tracking_write_begin and tracking_write_end. Only such threads
+ * can turn tracking on.
+ */
+void tracking_thread_start(int fd);
+
+/* Turns tracking off for the calling thread's connection and forgets it. */
+void tracking_thread_stop(void);
+
+/* Turns tracking on or off for the calling thread's connection. */
+int tracking_enable(int on);
+
+/*
+ * Brackets a response written by the calling thread, so that it cannot
+ * interleave with a push from another thread. Cancellation is held off in
+ * between.
+ */
+void tracking_write_begin(void);
+void tracking_write_end(void);
+
+/* Records a read of key, if the calling thread's connection is tracking. */
+void tracking_read(const char *key);
+
+/*
+ * Notifies the connections tracking key's bucket. Called once a write to key
+ * has been applied, with no locks held.
+ */
+void tracking_invalidate(const char *key);
+
+#endif  // TRACKING_H_
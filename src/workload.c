@@ -0,0 +1,142 @@
+#include <stdio.h>
+#include <string.h>
+
+#include "./rand.h"
+#include "./workload.h"
+
+const char *workload_op_names[WL_NOPS] = {"READ", "UPDATE", "INSERT", "SCAN",
+                                          "READ-MODIFY-WRITE"};
+
+/* The operation mix of each core workload, in workload_op order. */
+static const double mixes[6][WL_NOPS] = {
+    {0.50, 0.50, 0, 0, 0},     // a
+    {0.95, 0.05, 0, 0, 0},     // b
+    {1.00, 0, 0, 0, 0},        // c
+    {0.95, 0, 0.05, 0, 0},     // d
+    {0, 0, 0.05, 0.95, 0},     // e
+    {0.50, 0, 0, 0, 0.50},     // f
+};
+
+int workload_init(workload_t *w, char name, uint64_t records, int field_count,
+                  int field_length, int max_scan_length, const char *dist,
+                  double dist_param) {
+    if (name < 'a' || name > 'f' || records < 1 || field_count < 1 ||
+        field_length < 1 || max_scan_length < 1 ||
+        field_count * field_length > WORKLOAD_MAX_VALUE) {
+        return -1;
+    }
+    memset(w, 0, sizeof(*w));
+    w->name = name;
+    memcpy(w->proportion, mixes[name - 'a'], sizeof(w->proportion));
+    w->records = records;
+    w->field_count = field_count;
+    w->field_length = field_length;
+    w->max_scan_length = max_scan_length;
+    if (dist == NULL)
+        dist = name == 'd' ? "latest" : "zipfian";
+    if (keygen_init(&w->keys, dist, records, dist_param) < 0)
+        return -1;
+    w->ordered = w->keys.dist == kg_sequential;
+    return 0;
+}
+
+enum workload_op workload_next_op(const workload_t *w, uint64_t *rng) {
+    double u = rand_unit(rng);
+    for (int op = 0; op < WL_NOPS - 1; op++) {
+        if (u < w->proportion[op])
+            return op;
+        u -= w->proportion[op];
+    }
+    return WL_NOPS - 1;
+}
+
+/*
+ * YCSB's key name: "user" and the FNV-1a hash of the record number, or the
+ * number itself, padded to sort in order, if the workload is ordered.
+ */
+static int record_key(const workload_t *w, char *buf, size_t cap,
+                      uint64_t keynum) {
+    if (w->ordered)
+        return snprintf(buf, cap, "user%020lu", keynum);
+    uint64_t h = 0xcbf29ce484222325ull;
+    for (int i = 0; i < 8; i++) {
+        h ^= keynum & 0xff;
+        keynum >>= 8;
+        h *= 1099511628211ull;
+    }
+    int64_t signed_h = (int64_t)h;
+    return snprintf(buf, cap, "user%lu",
+                    (uint64_t)(signed_h < 0 ? -signed_h : signed_h));
+}
+
+/* Writes a random alphanumeric value of field_count * field_length bytes. */
+static int record_value(const workload_t *w, uint64_t *rng, char *buf) {
+    static const char chars[] =
+        "0123456789abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ";
+    int len = w->field_count * w->field_length;
+    uint64_t bits = 0;
+    for (int i = 0; i < len; i++) {
+        if (i % 10 == 0)
+            bits = rand_next(rng);
+        buf[i] = chars[bits % 62];
+        bits /= 62;
+    }
+    buf[len] = '\0';
+    return len;
+}
+
+/* Picks an existing record from the workload's distribution. */
+static uint64_t next_keynum(workload_t *w, uint64_t *rng) {
+    uint64_t n = w->records + __atomic_load_n(&w->inserted, __ATOMIC_RELAXED);
+    return keygen_next(&w->keys, rng, n);
+}
+
+size_t workload_command(workload_t *w, enum workload_op op, uint64_t *rng,
+                        char *buf, size_t cap, int *responses) {
+    char key[32];
+    char value[WORKLOAD_MAX_VALUE + 1];
+    int n;
+
+    *responses = 1;
+    switch (op) {
+        case wl_read:
+            record_key(w, key, sizeof(key), next_keynum(w, rng));
+            n = snprintf(buf, cap, "q %s\n", key);
+            break;
+        case wl_update:
+            record_key(w, key, sizeof(key), next_keynum(w, rng));
+            record_value(w, rng, value);
+            n = snprintf(buf, cap, "u %s %s\n", key, value);
+            break;
+        case wl_insert:
+            record_key(w, key, sizeof(key),
+                       w->records + __atomic_fetch_add(&w->inserted, 1,
+                                                       __ATOMIC_RELAXED));
+            record_value(w, rng, value);
+            n = snprintf(buf, cap, "a %s %s\n", key, value);
+            break;
+        case wl_scan:
+            record_key(w, key, sizeof(key), next_keynum(w, rng));
+            n = snprintf(buf, cap, "s %s %lu\n", key,
+                         1 + rand_next(rng) % w->max_scan_length);
+            break;
+        default:
+            record_key(w, key, sizeof(key), next_keynum(w, rng));
+            record_value(w, rng, value);
+            n = snprintf(buf, cap, "q %s\nu %s %s\n", key, key, value);
+            *responses = 2;
+            break;
+    }
+    return (size_t)n < cap ? (size_t)n : cap - 1;
+}
+
+size_t workload_load_command(const workload_t *w, uint64_t keynum,
+                             uint64_t *rng, char *buf, size_t cap) {
+    char key[32];
+    char value[WORKLOAD_MAX_VALUE + 1];
+
+    record_key(w, key, sizeof(key), keynum);
+    record_value(w, rng, value);
+    int n = snprintf(buf, cap, "a %s %s\n", key, value);
+    return (size_t)n < cap ? (size_t)n : cap - 1;
+}
@@ -0,0 +1,76 @@
+#ifndef WORKLOAD_H_
+#define WORKLOAD_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "./keygen.h"
+
+/*
+ * The YCSB core workloads, A to F, expressed in the server's commands:
+ *
+ *   A  update heavy       50% read, 50% update
+ *   B  read mostly        95% read, 5% update
+ *   C  read only          100% read
+ *   D  read latest        95% read, 5% insert
+ *   E  short ranges       95% scan, 5% insert
+ *   F  read-modify-write  50% read, 50% read-modify-write
+ *
+ * Reads are `q`, updates `u`, inserts `a`, scans `s <start> <count>` and a
+ * read-modify-write is a `q` followed by a `u` of the same key. Records are
+ * named as YCSB names them ("user" and a hash of the record number), so the
+ * load phase inserts them in effectively random order; with the sequential
+ * distribution they are named in order instead ("user" and the zero-padded
+ * record number), so both the load and the run walk the key order.
+ *
+ * Keys are requested from the workload's own distribution (zipfian, or
+ * latest for D) unless another one is given.
+ */
+
+#define WORKLOAD_MAX_VALUE 255  // the server's longest value
+#define WORKLOAD_MAX_COMMAND 600
+
+enum workload_op { wl_read, wl_update, wl_insert, wl_scan, wl_rmw, WL_NOPS };
+
+/* YCSB's names for the operations, as they appear in its reports. */
+extern const char *workload_op_names[WL_NOPS];
+
+typedef struct workload {
+    char name;  // 'a' to 'f'
+    double proportion[WL_NOPS];
+    uint64_t records;  // loaded before the run
+    int field_count;
+    int field_length;
+    int max_scan_length;
+    int ordered;        // record names sort in record order
+    keygen_t keys;      // picks the records to operate on
+    uint64_t inserted;  // records inserted during the run, shared
+} workload_t;
+
+/*
+ * Sets up workload name ('a' to 'f') over the given number of records.
+ * Values are field_count fields of field_length characters, concatenated.
+ * dist names a keygen distribution to use instead of the workload's, with
+ * its parameter; NULL keeps the default. Returns 0, or -1 if the name is
+ * unknown, the values would be too long or the distribution is not valid.
+ */
+int workload_init(workload_t *w, char name, uint64_t records, int field_count,
+                  int field_length, int max_scan_length, const char *dist,
+                  double dist_param);
+
+/* Picks the next operation. */
+enum workload_op workload_next_op(const workload_t *w, uint64_t *rng);
+
+/*
+ * Writes the command(s) for the next operation of type op into buf and
+ * returns their length. *responses is set to the number of response lines
+ * the server will send back.
+ */
+size_t workload_command(workload_t *w, enum workload_op op, uint64_t *rng,
+                        char *buf, size_t cap, int *responses);
+
+/* Writes the insert command for record keynum, for the load phase. */
+size_t workload_load_command(const workload_t *w, uint64_t keynum,
+                             uint64_t *rng, char *buf, size_t cap);
+
+#endif  // WORKLOAD_H_
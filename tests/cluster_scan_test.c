@@ -0,0 +1,189 @@
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "../src/cdbc.h"
+
+/*
+ * cdbc_cluster_scan against two fake servers that answer scans as db.c does,
+ * with as many pairs as fit in one response. The even keys have long values,
+ * so their server's answers are cut short well before count; the merge must
+ * not hand out odd keys past the last even key it was sent.
+ */
+
+#define NKEYS 200
+#define RESLEN 16384
+#define SCAN_PREFIX 11
+#define LONG_VALUE 250
+
+typedef struct fake_server {
+    int lsock;
+    int port;
+    int parity;  // holds the keys whose number has this parity
+    const char *value;
+} fake_server_t;
+
+static void key_name(int i, char *buf, size_t cap) {
+    snprintf(buf, cap, "k%03d", i);
+}
+
+/* Answers one scan line as db.c would, from server's keys. */
+static void answer_scan(fake_server_t *server, const char *line, char *out) {
+    char start[256], key[16];
+    int count, n = 0, used = 0;
+    char *pairs = out + SCAN_PREFIX;
+    int room = RESLEN - SCAN_PREFIX;
+    if (sscanf(line, "s %255s %d", start, &count) < 2) {
+        snprintf(out, RESLEN, "ill-formed command");
+        return;
+    }
+    pairs[0] = '\0';
+    for (int i = server->parity; i < NKEYS && n < count; i += 2) {
+        key_name(i, key, sizeof(key));
+        if (strcmp(key, start) < 0)
+            continue;
+        int len = snprintf(pairs + used, room - used, " %s %s", key,
+                           server->value);
+        if (len >= room - used) {
+            pairs[used] = '\0';
+            break;
+        }
+        used += len;
+        n++;
+    }
+    char prefix[SCAN_PREFIX + 1];
+    int plen = snprintf(prefix, sizeof(prefix), "%d", n);
+    memmove(out + plen, pairs, used + 1);
+    memcpy(out, prefix, plen);
+}
+
+static void *serve(void *arg) {
+    fake_server_t *server = (fake_server_t *)arg;
+    char *out = malloc(RESLEN);
+    int fd;
+    while (out != NULL && (fd = accept(server->lsock, NULL, NULL)) >= 0) {
+        FILE *in = fdopen(fd, "r");
+        char line[1024];
+        while (fgets(line, sizeof(line), in) != NULL) {
+            answer_scan(server, line, out);
+            size_t len = strlen(out);
+            out[len] = '\n';
+            if (write(fd, out, len + 1) != (ssize_t)(len + 1))
+                break;
+        }
+        fclose(in);
+    }
+    free(out);
+    return NULL;
+}
+
+static int fake_server_start(fake_server_t *server) {
+    struct sockaddr_in addr;
+    socklen_t addrlen = sizeof(addr);
+    pthread_t thread;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if ((server->lsock = socket(AF_INET, SOCK_STREAM, 0)) < 0 ||
+        bind(server->lsock, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+        listen(server->lsock, 16) < 0 ||
+        getsockname(server->lsock, (struct sockaddr *)&addr, &addrlen) < 0)
+        return -1;
+    server->port = ntohs(addr.sin_port);
+    if (pthread_create(&thread, NULL, serve, server) != 0)
+        return -1;
+    pthread_detach(thread);
+    return 0;
+}
+
+typedef struct collected {
+    char keys[NKEYS][16];
+    int count;
+} collected_t;
+
+static int collect(const char *key, const char *value, void *arg) {
+    collected_t *c = (collected_t *)arg;
+    (void)value;
+    if (c->count < NKEYS)
+        snprintf(c->keys[c->count++], sizeof(c->keys[0]), "%s", key);
+    return 0;
+}
+
+int main(void) {
+    char long_value[LONG_VALUE + 1];
+    memset(long_value, 'x', LONG_VALUE);
+    long_value[LONG_VALUE] = '\0';
+    fake_server_t servers[2] = {{-1, 0, 0, long_value}, {-1, 0, 1, "v"}};
+    char list[64];
+    int failures = 0;
+
+    for (int i = 0; i < 2; i++) {
+        if (fake_server_start(&servers[i]) < 0) {
+            perror("fake server");
+            return 1;
+        }
+    }
+    snprintf(list, sizeof(list), "127.0.0.1:%d,127.0.0.1:%d", servers[0].port,
+             servers[1].port);
+    cdbc_cluster_t *cl = cdbc_cluster_create(list, 1, NULL);
+    if (cl == NULL) {
+        fprintf(stderr, "cdbc_cluster_create failed\n");
+        return 1;
+    }
+
+    // One scan for more than the long-valued server can send at once
+    collected_t *c = calloc(1, sizeof(collected_t));
+    int n = cdbc_cluster_scan(cl, "k", 150, collect, c);
+    if (n <= 0 || n >= 150) {
+        fprintf(stderr, "FAIL: scan of 150 passed %d pairs\n", n);
+        failures++;
+    }
+    for (int i = 0; i < c->count; i++) {
+        char key[16];
+        key_name(i, key, sizeof(key));
+        if (strcmp(c->keys[i], key) != 0) {
+            fprintf(stderr, "FAIL: pair %d is %s, not %s\n", i, c->keys[i],
+                    key);
+            failures++;
+            break;
+        }
+    }
+
+    // Scanning on from the last key gets every key exactly once
+    int total = c->count;
+    char start[16];
+    while (n > 0 && total < NKEYS) {
+        snprintf(start, sizeof(start), "%s", c->keys[c->count - 1]);
+        c->count = 0;
+        n = cdbc_cluster_scan(cl, start, 150, collect, c);
+        for (int i = 1; i < c->count; i++) {  // the first is start again
+            char key[16];
+            key_name(total, key, sizeof(key));
+            if (strcmp(c->keys[i], key) != 0) {
+                fprintf(stderr, "FAIL: key %d is %s, not %s\n", total,
+                        c->keys[i], key);
+                failures++;
+                n = 0;
+                break;
+            }
+            total++;
+        }
+        if (c->count <= 1)
+            break;
+    }
+    if (total != NKEYS) {
+        fprintf(stderr, "FAIL: paged scan found %d of %d keys\n", total,
+                NKEYS);
+        failures++;
+    }
+
+    free(c);
+    cdbc_cluster_destroy(cl);
+    printf("cluster_scan_test: %s\n", failures == 0 ? "ok" : "FAILED");
+    return failures == 0 ? 0 : 1;
+}
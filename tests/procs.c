@@ -0,0 +1,161 @@
+#include <arpa/inet.h>
+#include <errno.h>
+#include <netinet/in.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "./procs.h"
+
+#define START_WAIT_MS 5000
+#define STOP_WAIT_MS 5000
+
+static void sleep_ms(int ms) {
+    struct timespec ts = {ms / 1000, (long)(ms % 1000) * 1000000};
+    nanosleep(&ts, NULL);
+}
+
+static int dial(int port) {
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd >= 0 && connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        close(fd);
+        fd = -1;
+    }
+    return fd;
+}
+
+int free_port(void) {
+    struct sockaddr_in addr;
+    socklen_t len = sizeof(addr);
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    int fd = socket(AF_INET, SOCK_STREAM, 0), port = -1;
+    if (fd >= 0 && bind(fd, (struct sockaddr *)&addr, sizeof(addr)) == 0 &&
+        getsockname(fd, (struct sockaddr *)&addr, &len) == 0)
+        port = ntohs(addr.sin_port);
+    if (fd >= 0)
+        close(fd);
+    return port;
+}
+
+int proc_start(proc_t *p, char *const argv[], int port) {
+    int fds[2];
+    if (pipe(fds) < 0)
+        return -1;
+    if ((p->pid = fork()) < 0) {
+        close(fds[0]);
+        close(fds[1]);
+        return -1;
+    }
+    if (p->pid == 0) {
+        dup2(fds[0], 0);
+        close(fds[0]);
+        close(fds[1]);
+        execv(argv[0], argv);
+        perror(argv[0]);
+        _exit(127);
+    }
+    close(fds[0]);
+    p->in = fds[1];
+    p->port = port;
+    for (int waited = 0; waited < START_WAIT_MS; waited += 10) {
+        int fd = dial(port);
+        if (fd >= 0) {
+            close(fd);
+            return 0;
+        }
+        if (waitpid(p->pid, NULL, WNOHANG) == p->pid) {
+            p->pid = -1;
+            break;
+        }
+        sleep_ms(10);
+    }
+    fprintf(stderr, "%s did not come up on port %d\n", argv[0], port);
+    proc_stop(p);
+    return -1;
+}
+
+int proc_command(proc_t *p, const char *line) {
+    size_t len = strlen(line);
+    return write(p->in, line, len) == (ssize_t)len ? 0 : -1;
+}
+
+void proc_stop(proc_t *p) {
+    if (p->in >= 0)
+        close(p->in);
+    p->in = -1;
+    if (p->pid <= 0)
+        return;
+    for (int waited = 0; waited < STOP_WAIT_MS; waited += 10) {
+        if (waitpid(p->pid, NULL, WNOHANG) == p->pid) {
+            p->pid = -1;
+            return;
+        }
+        sleep_ms(10);
+    }
+    kill(p->pid, SIGKILL);
+    waitpid(p->pid, NULL, 0);
+    p->pid = -1;
+}
+
+void proc_kill(proc_t *p) {
+    if (p->pid > 0) {
+        kill(p->pid, SIGTERM);
+        waitpid(p->pid, NULL, 0);
+        p->pid = -1;
+    }
+    proc_stop(p);
+}
+
+int conn_open(conn_t *c, int port) {
+    c->in = NULL;
+    if ((c->fd = dial(port)) < 0)
+        return -1;
+    int fd = dup(c->fd);
+    if (fd < 0 || (c->in = fdopen(fd, "r")) == NULL) {
+        if (fd >= 0)
+            close(fd);
+        close(c->fd);
+        return -1;
+    }
+    return 0;
+}
+
+void conn_close(conn_t *c) {
+    if (c->in != NULL)
+        fclose(c->in);
+    if (c->fd >= 0)
+        close(c->fd);
+    c->in = NULL;
+    c->fd = -1;
+}
+
+int conn_send(conn_t *c, const char *text) {
+    size_t len = strlen(text), off = 0;
+    while (off < len) {
+        ssize_t n = send(c->fd, text + off, len - off, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return -1;
+        off += n;
+    }
+    return 0;
+}
+
+char *conn_line(conn_t *c, char *buf, int cap) {
+    if (fgets(buf, cap, c->in) == NULL)
+        return NULL;
+    buf[strcspn(buf, "\n")] = '\0';
+    return buf;
+}
@@ -0,0 +1,47 @@
+#ifndef TESTS_PROCS_H_
+#define TESTS_PROCS_H_
+
+#include <stdio.h>
+#include <sys/types.h>
+
+/*
+ * Helpers for the tests that run the real binaries (./server, ./proxy) as
+ * processes on loopback ports, and talk to them one line at a time.
+ */
+
+typedef struct proc {
+    pid_t pid;
+    int in;  // its stdin, where the server reads its console commands
+    int port;
+} proc_t;
+
+typedef struct conn {
+    int fd;
+    FILE *in;
+} conn_t;
+
+/* A loopback port that nothing listens on at the moment. */
+int free_port(void);
+
+/* Runs argv with stdin on a pipe, and waits until port takes connections. */
+int proc_start(proc_t *p, char *const argv[], int port);
+
+/* Writes a console command to p's stdin. */
+int proc_command(proc_t *p, const char *line);
+
+/* Closes p's stdin, which stops a server, and kills p if it lingers. */
+void proc_stop(proc_t *p);
+
+/* Stops p at once, for the processes that do not read stdin. */
+void proc_kill(proc_t *p);
+
+int conn_open(conn_t *c, int port);
+void conn_close(conn_t *c);
+
+/* Sends text as it is: one or more lines, newlines included. */
+int conn_send(conn_t *c, const char *text);
+
+/* Reads one response line into buf, without its newline; NULL at the end. */
+char *conn_line(conn_t *c, char *buf, int cap);
+
+#endif  // TESTS_PROCS_H_
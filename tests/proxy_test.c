@@ -0,0 +1,220 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../src/ring.h"
+#include "./procs.h"
+
+/*
+ * The proxy in front of three servers, all run as processes: every key must
+ * land on the server the ring gives it, a client's pipelined commands must
+ * be answered in the order it sent them, and scans must page through keys
+ * with long values without skipping or repeating any.
+ */
+
+#define NSERVERS 3
+#define NKEYS 300
+#define NLONG 100  // keys with long values, all on one server
+#define NSHORT 100 // keys after those, on the others
+#define LONG_VALUE 250
+#define LINE_MAX 20000
+
+static int failures = 0;
+static ring_t ring;
+
+static void fail(const char *what, const char *got, const char *want) {
+    fprintf(stderr, "FAIL: %s: got \"%.60s\", want \"%.60s\"\n", what, got,
+            want);
+    failures++;
+}
+
+/* Sends one command and checks its response. */
+static void expect(conn_t *c, const char *command, const char *want) {
+    char line[LINE_MAX], sent[512];
+    snprintf(sent, sizeof(sent), "%s\n", command);
+    if (conn_send(c, sent) < 0 || conn_line(c, line, sizeof(line)) == NULL)
+        snprintf(line, sizeof(line), "(no response)");
+    if (strcmp(line, want) != 0)
+        fail(command, line, want);
+}
+
+static int owner(const char *key) {
+    return ring_lookup(&ring, key, strlen(key));
+}
+
+/* Keys go to the servers the ring gives them, and only there. */
+static void check_routing(conn_t *proxy, proc_t *servers) {
+    char command[64], key[16], value[16];
+    for (int i = 0; i < NKEYS; i++) {
+        snprintf(command, sizeof(command), "a key%03d val%03d", i, i);
+        expect(proxy, command, "added");
+    }
+    for (int s = 0; s < NSERVERS; s++) {
+        conn_t direct;
+        if (conn_open(&direct, servers[s].port) < 0) {
+            perror("connect to server");
+            exit(1);
+        }
+        for (int i = 0; i < NKEYS; i++) {
+            snprintf(key, sizeof(key), "key%03d", i);
+            snprintf(value, sizeof(value), "val%03d", i);
+            snprintf(command, sizeof(command), "q %s", key);
+            expect(&direct, command, owner(key) == s ? value : "not found");
+        }
+        conn_close(&direct);
+    }
+}
+
+/* Many commands in one write, across servers, come back in order. */
+static void check_pipelining(conn_t *proxy) {
+    size_t cap = NKEYS * 64, len = 0;
+    char *batch = malloc(cap), line[LINE_MAX], value[16];
+    for (int i = 0; i < NKEYS; i++) {
+        len += snprintf(batch + len, cap - len, "u key%03d new%03d\nq key%03d\n",
+                        i, i, i);
+        if (i % 50 == 0)
+            len += snprintf(batch + len, cap - len, "f anything\n");
+        else if (i % 2)
+            len += snprintf(batch + len, cap - len, "d key%03d\n", i);
+        else
+            len += snprintf(batch + len, cap - len, "q nokey\n");
+    }
+    if (conn_send(proxy, batch) < 0) {
+        perror("send");
+        exit(1);
+    }
+    free(batch);
+    for (int i = 0; i < NKEYS; i++) {
+        snprintf(value, sizeof(value), "new%03d", i);
+        const char *wants[3] = {"updated", value,
+                                i % 50 == 0 ? "not supported by proxy"
+                                : i % 2     ? "removed"
+                                            : "not found"};
+        for (int j = 0; j < 3; j++) {
+            if (conn_line(proxy, line, sizeof(line)) == NULL) {
+                fail("pipelined response", "(end of stream)", wants[j]);
+                return;
+            }
+            if (strcmp(line, wants[j]) != 0) {
+                fail("pipelined response", line, wants[j]);
+                return;
+            }
+        }
+    }
+}
+
+/*
+ * Scans for every key from the last one passed. The first keys are all on
+ * one server, with values so long that its answers are cut short, and the
+ * rest with short values on the others: the merge must stop at the last key
+ * of the first server rather than fill its response from the others, and the
+ * pages must pass each key once and in order.
+ */
+static void check_scan_paging(conn_t *proxy) {
+    char keys[NLONG + NSHORT][16], value[LONG_VALUE + 1];
+    char command[512], line[LINE_MAX], start[16] = "s";
+    int nkeys = 0, nlong = 0, next = 0, first_page = -1;
+    memset(value, 'x', LONG_VALUE);
+    value[LONG_VALUE] = '\0';
+    for (int i = 0; nkeys < NLONG + NSHORT; i++) {
+        char key[16];
+        snprintf(key, sizeof(key), "s%05d", i);
+        if (nlong < NLONG ? owner(key) != 0 : owner(key) == 0)
+            continue;
+        snprintf(keys[nkeys++], sizeof(keys[0]), "%s", key);
+        snprintf(command, sizeof(command), "a %s %s", key,
+                 nlong < NLONG ? value : "short");
+        expect(proxy, command, "added");
+        nlong += nlong < NLONG;
+    }
+
+    while (next < nkeys) {
+        snprintf(command, sizeof(command), "s %s %d\n", start, nkeys);
+        if (conn_send(proxy, command) < 0 ||
+            conn_line(proxy, line, sizeof(line)) == NULL) {
+            fail("scan", "(no response)", "pairs");
+            return;
+        }
+        char *save, *count = strtok_r(line, " ", &save);
+        int n = count != NULL ? atoi(count) : 0, fresh = 0;
+        if (first_page < 0)
+            first_page = n;
+        for (int j = 0; j < n; j++) {
+            char *key = strtok_r(NULL, " ", &save);
+            char *val = strtok_r(NULL, " ", &save);
+            if (key == NULL || val == NULL) {
+                fail("scan pairs", "(short)", "n pairs");
+                return;
+            }
+            if (strcmp(key, start) == 0)
+                continue;  // where the page started, passed before
+            if (strcmp(key, keys[next]) != 0 ||
+                strcmp(val, next < NLONG ? value : "short") != 0) {
+                fail("scan key", key, keys[next]);
+                return;
+            }
+            snprintf(start, sizeof(start), "%s", key);
+            next++;
+            fresh++;
+        }
+        if (fresh == 0)
+            break;
+    }
+    if (next != nkeys) {
+        fprintf(stderr, "FAIL: paged scans passed %d of %d keys\n", next,
+                nkeys);
+        failures++;
+    }
+    if (first_page <= 0 || first_page >= NLONG) {
+        fprintf(stderr, "FAIL: the first scan passed %d pairs, not fewer than "
+                        "%d for the long values\n", first_page, NLONG);
+        failures++;
+    }
+}
+
+int main(void) {
+    proc_t servers[NSERVERS], proxy;
+    char ports[NSERVERS][16], list[128] = "", proxy_port[16];
+    char *names[NSERVERS];
+    conn_t c;
+
+    for (int i = 0; i < NSERVERS; i++) {
+        int port = free_port();
+        snprintf(ports[i], sizeof(ports[i]), "%d", port);
+        char *argv[] = {"./server", ports[i], NULL};
+        if (port < 0 || proc_start(&servers[i], argv, port) < 0) {
+            fprintf(stderr, "cannot start a server\n");
+            return 1;
+        }
+        names[i] = malloc(32);
+        snprintf(names[i], 32, "127.0.0.1:%s", ports[i]);
+        snprintf(list + strlen(list), sizeof(list) - strlen(list), "%s%s",
+                 i > 0 ? "," : "", names[i]);
+    }
+    if (ring_build(&ring, (const char *const *)names, NSERVERS) < 0) {
+        perror("ring_build");
+        return 1;
+    }
+    int port = free_port();
+    snprintf(proxy_port, sizeof(proxy_port), "%d", port);
+    char *argv[] = {"./proxy", "-c", "2", proxy_port, list, NULL};
+    if (port < 0 || proc_start(&proxy, argv, port) < 0 ||
+        conn_open(&c, port) < 0) {
+        fprintf(stderr, "cannot start the proxy\n");
+        return 1;
+    }
+
+    check_routing(&c, servers);
+    check_pipelining(&c);
+    check_scan_paging(&c);
+
+    conn_close(&c);
+    proc_kill(&proxy);
+    ring_free(&ring);
+    for (int i = 0; i < NSERVERS; i++) {
+        proc_stop(&servers[i]);
+        free(names[i]);
+    }
+    printf("proxy_test: %s\n", failures == 0 ? "ok" : "FAILED");
+    return failures == 0 ? 0 : 1;
+}
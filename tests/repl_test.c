@@ -0,0 +1,244 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "./procs.h"
+
+/*
+ * A primary and a replica, run as processes. The replica must copy the
+ * primary's keys, refusing reads rather than answering from a partial copy
+ * while it loads them, then follow the primary's changes and refuse writes.
+ * Once it has caught up, the primary must report its lag as none within a
+ * few of the replica's acks, however idle the primary is.
+ */
+
+#define NKEYS 100000
+#define NCHANGES 3000  // updates, removals and additions each
+#define BATCH 1000
+#define LINE_MAX 1024
+#define WAIT_MS 30000
+#define LAG_SETTLE_MS 600  // a few acks (REPL_ACK_MS), short of a heartbeat
+
+/* Formats command i of a series, and the response it should get. */
+typedef void (*command_fn)(int i, char *command, char *want);
+
+static int failures = 0;
+static int changed = 0;  // whether the primary has had the changes yet
+
+static uint64_t now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + (uint64_t)ts.tv_nsec / 1000000;
+}
+
+static void sleep_ms(int ms) {
+    struct timespec ts = {ms / 1000, (long)(ms % 1000) * 1000000};
+    nanosleep(&ts, NULL);
+}
+
+static void fail(const char *what, const char *got, const char *want) {
+    fprintf(stderr, "FAIL: %s: got \"%s\", want \"%s\"\n", what, got, want);
+    failures++;
+}
+
+/* Runs commands [from, to) of fn, a batch per write; counts wrong answers. */
+static int pipeline(conn_t *c, int from, int to, command_fn fn) {
+    char *text = malloc(BATCH * 64), line[LINE_MAX];
+    char(*wants)[64] = malloc(BATCH * sizeof(*wants));
+    int wrong = 0;
+    for (int at = from; at < to; at += BATCH) {
+        int n = at + BATCH < to ? BATCH : to - at;
+        size_t len = 0;
+        for (int i = 0; i < n; i++) {
+            fn(at + i, text + len, wants[i]);
+            len += strlen(text + len);
+        }
+        if (conn_send(c, text) < 0) {
+            perror("send");
+            exit(1);
+        }
+        for (int i = 0; i < n; i++) {
+            if (conn_line(c, line, sizeof(line)) == NULL) {
+                fprintf(stderr, "connection lost\n");
+                exit(1);
+            }
+            if (strcmp(line, wants[i]) != 0 && wrong++ == 0)
+                fail("response", line, wants[i]);
+        }
+    }
+    free(wants);
+    free(text);
+    return wrong;
+}
+
+/* Keys are added out of order, since in order they would make a list. */
+static void load_key(int i, char *command, char *want) {
+    i = (int)((long)i * 7919 % NKEYS);  // a prime, so every key once
+    sprintf(command, "a key%06d v%d\n", i, i);
+    strcpy(want, "added");
+}
+
+/* The changes: updates of the first keys, removals of the last, additions. */
+static void change_key(int i, char *command, char *want) {
+    if (i < NCHANGES) {
+        sprintf(command, "u key%06d w%d\n", i, i);
+        strcpy(want, "updated");
+    } else if (i < 2 * NCHANGES) {
+        sprintf(command, "d key%06d\n", NKEYS - 1 - (i - NCHANGES));
+        strcpy(want, "removed");
+    } else {
+        sprintf(command, "a key%06d v%d\n", NKEYS + i - 2 * NCHANGES,
+                NKEYS + i - 2 * NCHANGES);
+        strcpy(want, "added");
+    }
+}
+
+static void query_key(int i, char *command, char *want) {
+    sprintf(command, "q key%06d\n", i);
+    if (changed && i < NCHANGES)
+        sprintf(want, "w%d", i);
+    else if (changed && i >= NKEYS - NCHANGES && i < NKEYS)
+        strcpy(want, "not found");
+    else if (!changed && i >= NKEYS)
+        strcpy(want, "not found");
+    else
+        sprintf(want, "v%d", i);
+}
+
+/* GETs path from an admin port into buf. */
+static int admin_get(int port, const char *path, char *buf, size_t cap) {
+    conn_t c;
+    char request[128];
+    size_t len = 0;
+    if (conn_open(&c, port) < 0)
+        return -1;
+    snprintf(request, sizeof(request), "GET %s HTTP/1.0\r\n\r\n", path);
+    conn_send(&c, request);
+    while (len + 1 < cap && fgets(buf + len, cap - len, c.in) != NULL)
+        len += strlen(buf + len);
+    buf[len] = '\0';
+    conn_close(&c);
+    return 0;
+}
+
+/* The full syncs a replica has had, from its link's status line. */
+static long full_syncs(int admin_port) {
+    char page[4096];
+    char *at;
+    long n;
+    if (admin_get(admin_port, "/replication", page, sizeof(page)) < 0 ||
+        (at = strstr(page, "\nprimary ")) == NULL ||
+        (at = strstr(at, " full and ")) == NULL)
+        return -1;
+    while (at > page && at[-1] != ' ')
+        at--;
+    return sscanf(at, "%ld", &n) == 1 ? n : -1;
+}
+
+/* The lag in changes the primary reports for its one replica, or -1. */
+static long primary_lag(int admin_port) {
+    char page[4096], peer[64], state[16];
+    unsigned long acked, lag, lag_ms;
+    if (admin_get(admin_port, "/replication", page, sizeof(page)) < 0)
+        return -1;
+    for (char *line = strtok(page, "\n"); line != NULL;
+         line = strtok(NULL, "\n")) {
+        if (sscanf(line, "%63s %15s %lu %lu %lu", peer, state, &acked, &lag,
+                   &lag_ms) == 5 &&
+            strcmp(state, "streaming") == 0)
+            return (long)lag;
+    }
+    return -1;
+}
+
+/* Asks the replica for the last key until it has it, as a copy or change. */
+static int wait_for(conn_t *replica, int i, int during_sync) {
+    char command[64], want[64], line[LINE_MAX];
+    uint64_t start = now_ms();
+    query_key(i, command, want);
+    while (now_ms() - start < WAIT_MS) {
+        if (conn_send(replica, command) < 0 ||
+            conn_line(replica, line, sizeof(line)) == NULL)
+            return -1;
+        if (strcmp(line, want) == 0)
+            return 0;
+        if (during_sync && strcmp(line, "replica syncing") != 0) {
+            // Neither the copy nor a refusal: read from a partial database
+            fail("read during sync", line, "replica syncing");
+            return -1;
+        }
+    }
+    fprintf(stderr, "FAIL: the replica never had key%06d\n", i);
+    failures++;
+    return -1;
+}
+
+int main(void) {
+    proc_t primary, replica;
+    conn_t p, r;
+    char ports[4][16], from[32];
+    int port[4];  // primary, its admin, replica, its admin
+
+    for (int i = 0; i < 4; i++) {
+        port[i] = free_port();
+        snprintf(ports[i], sizeof(ports[i]), "%d", port[i]);
+    }
+    char *primary_argv[] = {"./server", "-a", ports[1], ports[0], NULL};
+    if (proc_start(&primary, primary_argv, port[0]) < 0 ||
+        conn_open(&p, port[0]) < 0) {
+        fprintf(stderr, "cannot start the primary\n");
+        return 1;
+    }
+    pipeline(&p, 0, NKEYS, load_key);
+
+    // From its first full sync on, every read gets the copy or a refusal
+    snprintf(from, sizeof(from), "127.0.0.1:%s", ports[0]);
+    char *replica_argv[] = {"./server", "-r", from, "-a", ports[3], ports[2],
+                            NULL};
+    if (proc_start(&replica, replica_argv, port[2]) < 0 ||
+        conn_open(&r, port[2]) < 0) {
+        fprintf(stderr, "cannot start the replica\n");
+        return 1;
+    }
+    uint64_t start = now_ms();
+    while (full_syncs(port[3]) < 1 && now_ms() - start < WAIT_MS)
+        sleep_ms(1);
+    wait_for(&r, NKEYS - 1, 1);
+    pipeline(&r, 0, NKEYS, query_key);
+
+    // Changes follow, and the replica catches up with them
+    pipeline(&p, 0, 3 * NCHANGES, change_key);
+    changed = 1;
+    if (wait_for(&r, NKEYS + NCHANGES - 1, 0) == 0) {
+        uint64_t caught_up = now_ms();
+        long lag;
+        while ((lag = primary_lag(port[1])) != 0 &&
+               now_ms() - caught_up < WAIT_MS)
+            sleep_ms(10);
+        uint64_t settled = now_ms() - caught_up;
+        if (lag != 0 || settled > LAG_SETTLE_MS) {
+            fprintf(stderr,
+                    "FAIL: the primary reported lag %ld, %lu ms after the "
+                    "replica caught up\n",
+                    lag, (unsigned long)settled);
+            failures++;
+        }
+    }
+    pipeline(&r, 0, NKEYS + NCHANGES, query_key);
+
+    // Replicas may not write
+    char line[LINE_MAX];
+    if (conn_send(&r, "a key999999 v\n") < 0 ||
+        conn_line(&r, line, sizeof(line)) == NULL ||
+        strcmp(line, "read-only replica") != 0)
+        fail("write to a replica", line, "read-only replica");
+
+    conn_close(&r);
+    conn_close(&p);
+    proc_stop(&replica);
+    proc_stop(&primary);
+    printf("repl_test: %s\n", failures == 0 ? "ok" : "FAILED");
+    return failures == 0 ? 0 : 1;
+}